@@ -17,244 +17,274 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/stat.h>
+
 #include "block.h"
+#include "bmp.h"
+#include "cache.h"
+#include "extent.h"
 #include "inode.h"
+#include "journal.h"
 
 
 int ext2_block_read(ext2_t *fs, uint32_t bno, void *buff, uint32_t n)
 {
-	ssize_t size = n * fs->blocksz;
+	return ext2_cache_read(fs, bno, buff, n, 0);
+}
 
-	if (fs->read(fs->oid.id, bno * fs->blocksz, buff, size) != size)
-		return -EIO;
 
-	return EOK;
+int ext2_block_write(ext2_t *fs, uint32_t bno, const void *buff, uint32_t n)
+{
+	return ext2_cache_write(fs, bno, buff, n, 0);
 }
 
 
-int ext2_block_write(ext2_t *fs, uint32_t bno, const void *buff, uint32_t n)
+int ext2_block_readpart(ext2_t *fs, uint32_t bno, uint32_t offs, void *buff, uint32_t len)
 {
-	ssize_t size = n * fs->blocksz;
+	return ext2_cache_readpart(fs, bno, offs, buff, len, 0);
+}
 
-	if (fs->write(fs->oid.id, bno * fs->blocksz, buff, size) != size)
-		return -EIO;
 
-	return EOK;
+int ext2_block_writepart(ext2_t *fs, uint32_t bno, uint32_t offs, const void *buff, uint32_t len)
+{
+	return ext2_cache_writepart(fs, bno, offs, buff, len, 0);
 }
 
 
-int ext2_block_destroy(ext2_t *fs, uint32_t bno, uint32_t n)
+int ext2_block_writenew(ext2_t *fs, uint32_t bno, uint32_t offs, const void *buff, uint32_t len)
 {
-	uint32_t group = (bno - 1) / fs->sb->groupBlocks;
-	uint32_t i, j, offset, pgroup = group;
-	void *bmp;
-	int err;
+	return ext2_cache_writenew(fs, bno, offs, buff, len, 0);
+}
 
-	if ((bmp = malloc(fs->blocksz)) == NULL)
-		return -ENOMEM;
 
-	if ((err = ext2_block_read(fs, fs->gdt[group].blockBmp, bmp, 1)) < 0) {
-		free(bmp);
-		return err;
-	}
+/* Returns 1 if object blocks hold regular file data (file data isn't journalled, directories and symlinks are metadata) */
+static inline uint8_t ext2_block_data(ext2_obj_t *obj)
+{
+	return S_ISREG(obj->inode->mode) ? 1 : 0;
+}
 
-	for (i = 0, j = 0; i < n; i++, j++) {
-		group = (bno + i - 1) / fs->sb->groupBlocks;
-		offset = (bno + i - 1) % fs->sb->groupBlocks + 1;
 
-		if (group != pgroup) {
-			if ((err = ext2_block_write(fs, fs->gdt[pgroup].blockBmp, bmp, 1)) < 0) {
-				free(bmp);
-				return err;
-			}
+/* Allocates at least min and up to n consecutive blocks in a group, blocks following the first used ones are reserved in memory, returns number of allocated and reserved blocks */
+static int ext2_block_alloc(ext2_t *fs, uint32_t group, uint32_t goal, uint32_t min, uint32_t n, uint32_t used, uint32_t *res)
+{
+	uint32_t offs, blocks, inodes;
+	int ret;
 
-			fs->gdt[pgroup].freeBlocks += j;
+	/* Free blocks counter is only a hint, group bitmap is authoritative */
+	ext2_gdt_free(fs, group, &blocks, &inodes);
 
-			if ((err = ext2_gdt_syncone(fs, pgroup)) < 0) {
-				for (i = 0; i < j; i++)
-					ext2_togglebit(bmp, --offset);
+	if (blocks < min)
+		return 0;
 
-				if (!ext2_block_write(fs, fs->gdt[pgroup].blockBmp, bmp, 1))
-					fs->gdt[pgroup].freeBlocks -= j;
-				else
-					fs->sb->freeBlocks += j;
+	if ((ret = ext2_bmp_alloc(fs, BMP_BLOCK, group, goal, min, n, used, &offs)) <= 0)
+		return ret;
 
-				free(bmp);
-				return err;
-			}
+	ext2_gdt_update(fs, group, -(int32_t)(((uint32_t)ret < used) ? (uint32_t)ret : used), 0, 0);
 
-			fs->sb->freeBlocks += j;
-			pgroup = group;
-			j = 0;
+	*res = group * fs->sb->groupBlocks + offs - 1 + fs->sb->fstBlock;
 
-			if ((err = ext2_block_read(fs, fs->gdt[group].blockBmp, bmp, 1)) < 0) {
-				free(bmp);
-				return err;
-			}
-		}
+	return ret;
+}
 
-		ext2_togglebit(bmp, offset);
-	}
 
-	if ((err = ext2_block_write(fs, fs->gdt[group].blockBmp, bmp, 1)) < 0) {
-		free(bmp);
-		return err;
+/* Allocates up to n consecutive blocks (only first used blocks, the rest is reserved), prefers goal block and runs of n blocks, returns number of allocated and reserved blocks */
+static int ext2_block_allocrun(ext2_t *fs, uint32_t group, uint32_t goal, uint32_t n, uint32_t used, uint32_t *res)
+{
+	uint32_t i, min;
+	int ret;
+
+	for (min = n; min; min = (min > 1) ? 1 : 0) {
+		for (i = 0; i < fs->groups; i++) {
+			if ((ret = ext2_block_alloc(fs, (group + i) % fs->groups, i ? 0 : goal, min, n, used, res)))
+				return ret;
+		}
 	}
 
-	fs->gdt[group].freeBlocks += j;
+	return -ENOSPC;
+}
 
-	if ((err = ext2_gdt_syncone(fs, group)) < 0) {
-		for (i = 0; i < j; i++)
-			ext2_togglebit(bmp, offset--);
 
-		if (!ext2_block_write(fs, fs->gdt[group].blockBmp, bmp, 1))
-			fs->gdt[group].freeBlocks -= j;
-		else
-			fs->sb->freeBlocks += j;
+int ext2_block_destroy(ext2_t *fs, uint32_t bno, uint32_t n)
+{
+	uint32_t group, offs, k;
+	int ret;
 
-		free(bmp);
-		return err;
-	}
+	while (n) {
+		group = (bno - fs->sb->fstBlock) / fs->sb->groupBlocks;
+		offs = (bno - fs->sb->fstBlock) % fs->sb->groupBlocks + 1;
+
+		if ((k = fs->sb->groupBlocks - offs + 1) > n)
+			k = n;
 
-	fs->sb->freeBlocks += j;
-	free(bmp);
+		if ((ret = ext2_bmp_free(fs, BMP_BLOCK, group, offs, k)) < 0)
+			return ret;
+
+		if (ret)
+			ext2_gdt_update(fs, group, ret, 0, 0);
+
+		bno += k;
+		n -= k;
+	}
 
 	return EOK;
 }
 
 
-/* Allocates one new block */
-static int ext2_block_createone(ext2_t *fs, uint32_t bno, uint32_t *res)
+/* Makes room for n runs in a batch (full batch is applied) */
+static int ext2_block_batchroom(ext2_t *fs, ext2_bfree_t *batch, uint32_t n)
 {
-	uint32_t group = (bno - 1) / fs->sb->groupInodes;
-	uint32_t offset, pgroup = group;
-	void *bmp;
+	ext2_bmprun_t *runs;
+	uint32_t size;
 	int err;
 
-	if ((bmp = malloc(fs->blocksz)) == NULL)
-		return -ENOMEM;
+	if (batch->n + n <= batch->size)
+		return EOK;
 
-	do {
-		if ((err = ext2_block_read(fs, fs->gdt[group].blockBmp, bmp, 1)) < 0) {
-			free(bmp);
-			return err;
-		}
+	/* Full batch => apply it */
+	if ((batch->n + n > BFREE_SIZE) && ((err = ext2_block_freebatch(fs, batch)) < 0))
+		return err;
 
-		if (!(offset = ext2_findzerobit(bmp, fs->sb->groupBlocks, 0))) {
-			group = (group + 1) % fs->groups;
+	for (size = (batch->size) ? batch->size : BFREE_MINSIZE; size < batch->n + n; size *= 2);
 
-			if (group == pgroup) {
-				free(bmp);
-				return -ENOSPC;
-			}
-		}
-	} while (!offset);
+	if (size > BFREE_SIZE)
+		size = BFREE_SIZE;
 
-	ext2_togglebit(bmp, offset);
+	/* Out of memory => apply the batch through the deferred path and retry with an empty one */
+	if ((runs = (ext2_bmprun_t *)realloc(batch->runs, size * sizeof(ext2_bmprun_t))) == NULL) {
+		if (!batch->n)
+			return -ENOMEM;
 
-	if ((err = ext2_block_write(fs, fs->gdt[group].blockBmp, bmp, 1)) < 0) {
-		free(bmp);
-		return err;
+		if ((err = ext2_block_freebatch(fs, batch)) < 0)
+			return err;
+
+		size = BFREE_MINSIZE;
+		if ((runs = (ext2_bmprun_t *)malloc(size * sizeof(ext2_bmprun_t))) == NULL)
+			return -ENOMEM;
 	}
 
-	fs->gdt[group].freeBlocks--;
+	batch->runs = runs;
+	batch->size = size;
 
-	if ((err = ext2_gdt_syncone(fs, group)) < 0) {
-		ext2_togglebit(bmp, offset);
+	return EOK;
+}
 
-		if (!ext2_block_write(fs, fs->gdt[group].blockBmp, bmp, 1))
-			fs->gdt[group].freeBlocks++;
-		else
-			fs->sb->freeBlocks--;
 
-		free(bmp);
+int ext2_block_free(ext2_t *fs, ext2_bfree_t *batch, uint32_t bno, uint32_t n)
+{
+	uint32_t offs, k;
+	ext2_bmprun_t *run;
+	int err;
+
+	/* Blocks are either all queued or left to the caller, make room for a run in each group first */
+	offs = (bno - fs->sb->fstBlock) % fs->sb->groupBlocks;
+	if ((err = ext2_block_batchroom(fs, batch, (offs + n + fs->sb->groupBlocks - 1) / fs->sb->groupBlocks)) < 0)
 		return err;
-	}
 
-	fs->sb->freeBlocks--;
-	*res = group * fs->sb->groupBlocks + offset;
-	free(bmp);
+	while (n) {
+		offs = (bno - fs->sb->fstBlock) % fs->sb->groupBlocks;
+
+		if ((k = fs->sb->groupBlocks - offs) > n)
+			k = n;
+
+		/* Extend the last run (runs don't cross group boundaries) */
+		run = (batch->n) ? batch->runs + batch->n - 1 : NULL;
+		if ((run != NULL) && offs && (run->start + run->n == bno)) {
+			run->n += k;
+		}
+		else {
+			run = batch->runs + batch->n++;
+			run->start = bno;
+			run->n = k;
+		}
+
+		bno += k;
+		n -= k;
+	}
 
 	return EOK;
 }
 
 
-/* Tries to allocate n consecutive blocks */
-static int ext2_block_create(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t lbno, uint32_t n, uint32_t *res)
+static int ext2_block_runcmp(const void *r1, const void *r2)
 {
-	uint32_t *bno, group, pgroup, offset, i, j;
-	void *bmp;
-	int err;
+	const ext2_bmprun_t *run1 = (const ext2_bmprun_t *)r1;
+	const ext2_bmprun_t *run2 = (const ext2_bmprun_t *)r2;
 
-	if ((bmp = malloc(fs->blocksz)) == NULL)
-		return -ENOMEM;
+	if (run1->start > run2->start)
+		return 1;
+	else if (run1->start < run2->start)
+		return -1;
 
-	if (lbno) {
-		group = (lbno - 1) / fs->sb->groupBlocks;
-		offset = (lbno - 1) % fs->sb->groupBlocks + 1;
-	}
-	else {
-		group = ((uint32_t)obj->id - 1) / fs->sb->groupInodes;
-		offset = 0;
-	}
-	pgroup = group;
+	return 0;
+}
 
-	do {
-		if ((err = ext2_block_read(fs, fs->gdt[group].blockBmp, bmp, 1)) < 0) {
-			free(bmp);
-			return err;
-		}
 
-		if (!offset)
-			offset = ext2_findzerobit(bmp, fs->sb->groupBlocks, 0);
-		else if (!ext2_checkbit(bmp, offset))
-			break;
-		else
-			offset = ext2_findzerobit(bmp, fs->sb->groupBlocks, offset);
+int ext2_block_markbatch(ext2_t *fs, ext2_bfree_t *batch, uint8_t used)
+{
+	uint32_t i, j, group;
+	int ret, err = EOK;
 
-		if (!offset) {
-			group = (group + 1) % fs->groups;
+	if (batch->n)
+		qsort(batch->runs, batch->n, sizeof(ext2_bmprun_t), ext2_block_runcmp);
 
-			if (group == pgroup) {
-				free(bmp);
-				return -ENOSPC;
-			}
-		}
-	} while (!offset);
+	for (i = 0; i < batch->n; i = j) {
+		group = (batch->runs[i].start - fs->sb->fstBlock) / fs->sb->groupBlocks;
 
-	for (i = 0; (i < n) && (offset + i < fs->sb->groupBlocks) && !ext2_checkbit(bmp, offset + i); i++) {
-		if ((err = ext2_block_get(fs, obj, block + i, &bno)) < 0) {
-			free(bmp);
-			return err;
-		}
+		for (j = i + 1; (j < batch->n) && ((batch->runs[j].start - fs->sb->fstBlock) / fs->sb->groupBlocks == group); j++);
 
-		ext2_togglebit(bmp, offset + i);
-		*bno = group * fs->sb->groupBlocks + offset + i;
+		if ((ret = ext2_bmp_markruns(fs, BMP_BLOCK, group, batch->runs + i, j - i, used)) < 0)
+			err = ret;
+		else if (ret)
+			ext2_gdt_update(fs, group, (used) ? -ret : ret, 0, 0);
 	}
 
-	if ((err = ext2_block_write(fs, fs->gdt[group].blockBmp, bmp, 1)) < 0) {
-		free(bmp);
-		return err;
-	}
+	return err;
+}
 
-	fs->gdt[group].freeBlocks -= i;
 
-	if ((err = ext2_gdt_syncone(fs, group)) < 0) {
-		for (j = 0; j < i; j++)
-			ext2_togglebit(bmp, offset + j);
+int ext2_block_destroybatch(ext2_t *fs, ext2_bfree_t *batch)
+{
+	int err = ext2_block_markbatch(fs, batch, 0);
 
-		if (!ext2_block_write(fs, fs->gdt[group].blockBmp, bmp, 1))
-			fs->gdt[group].freeBlocks += i;
-		else
-			fs->sb->freeBlocks -= i;
+	free(batch->runs);
+	batch->runs = NULL;
+	batch->n = 0;
+	batch->size = 0;
 
-		free(bmp);
-		return err;
-	}
+	return err;
+}
+
+
+int ext2_block_freebatch(ext2_t *fs, ext2_bfree_t *batch)
+{
+	/* Blocks freed in the running transaction can't be reused before it's committed */
+	if (fs->journal != NULL)
+		return ext2_journal_free(fs, batch);
+
+	return ext2_block_destroybatch(fs, batch);
+}
+
+
+int ext2_block_createone(ext2_t *fs, uint32_t ino, uint32_t *res)
+{
+	int ret;
 
-	fs->sb->freeBlocks -= i;
-	*res = i;
-	free(bmp);
+	if ((ret = ext2_block_allocrun(fs, (ino - 1) / fs->sb->groupInodes, 0, 1, 1, res)) < 0)
+		return ret;
+
+	return EOK;
+}
+
+
+int ext2_block_discard(ext2_t *fs, ext2_obj_t *obj)
+{
+	uint32_t offs = obj->prealloc.bno - fs->sb->fstBlock;
+
+	/* Preallocated blocks are only reserved in memory (window doesn't cross group boundary) */
+	if (obj->prealloc.n) {
+		ext2_bmp_release(fs, offs / fs->sb->groupBlocks, offs % fs->sb->groupBlocks + 1, obj->prealloc.n);
+		obj->prealloc.n = 0;
+	}
 
 	return EOK;
 }
@@ -302,10 +332,10 @@ static int ext2_block_readind(ext2_t *fs, ext2_obj_t *obj, uint32_t *bno, int de
 
 	if (!(*bno) || (*bno != obj->ind[depth].bno)) {
 		if (obj->ind[depth].data == NULL) {
-			if ((obj->ind[depth].data = (uint32_t *)malloc(fs->blocksz)) == NULL)
+			if ((obj->ind[depth].data = (uint32_t *)ext2_objs_indalloc(fs)) == NULL)
 				return -ENOMEM;
 		}
-		else {
+		else if (obj->ind[depth].bno) {
 			if ((err = ext2_block_write(fs, obj->ind[depth].bno, obj->ind[depth].data, 1)) < 0)
 				return err;
 		}
@@ -316,6 +346,7 @@ static int ext2_block_readind(ext2_t *fs, ext2_obj_t *obj, uint32_t *bno, int de
 
 			memset(obj->ind[depth].data, 0, fs->blocksz);
 			*bno = obj->ind[depth].bno;
+			obj->inode->blocks += fs->blocksz / INODE_BLOCKSZ;
 		}
 		else {
 			if ((err = ext2_block_read(fs, *bno, obj->ind[depth].data, 1)) < 0)
@@ -331,269 +362,806 @@ static int ext2_block_readind(ext2_t *fs, ext2_obj_t *obj, uint32_t *bno, int de
 }
 
 
-/* Reads indirect blocks */
-static int ext2_block_ind(ext2_t *fs, ext2_obj_t *obj, int depth, uint32_t offs[4], uint32_t *ind[3])
+/* Finds block entry in the inode or indirect blocks, allocates missing indirect blocks if create is set (res = NULL => block isn't mapped, returns missing indirect block depth) */
+static int ext2_block_entry(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint8_t create, uint32_t **res)
 {
-	int err;
+	uint32_t offs[4], *entry, *ind;
+	int err, depth;
+
+	if ((depth = ext2_block_offs(fs, block, offs)) < 0)
+		return depth;
 
-	if (depth == 4) {
-		if ((err = ext2_block_readind(fs, obj, obj->inode->block + offs[3], depth, ind + 2)) < 0)
+	for (entry = obj->inode->block + offs[depth - 1]; depth > 1; depth--) {
+		if (!(*entry) && !create) {
+			*res = NULL;
+			return depth;
+		}
+
+		if ((err = ext2_block_readind(fs, obj, entry, depth, &ind)) < 0)
 			return err;
+
+		entry = ind + offs[depth - 2];
 	}
 
-	if (depth >= 3) {
-		if (depth == 4) {
-			if ((err = ext2_block_readind(fs, obj, ind[2] + offs[2], --depth, ind + 1)) < 0)
-				return err;
+	*res = entry;
+
+	return EOK;
+}
+
+
+/* Returns index of the first cached mapping starting after given block */
+static uint32_t ext2_block_mapidx(ext2_obj_t *obj, uint32_t block)
+{
+	uint32_t l = 0, r = obj->map.n, m;
+
+	while (l < r) {
+		m = (l + r) / 2;
+
+		if (obj->map.runs[m].block <= block)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l;
+}
+
+
+/* Finds cached block mapping, returns number of following blocks mapped the same way (0 => mapping isn't cached) */
+static uint32_t ext2_block_mapfind(ext2_obj_t *obj, uint32_t block, uint32_t *bno)
+{
+	ext2_bmap_t *run;
+	uint32_t i;
+
+	if (!(i = ext2_block_mapidx(obj, block)))
+		return 0;
+
+	run = obj->map.runs + i - 1;
+
+	if (block >= run->block + run->n)
+		return 0;
+
+	run->used = ++obj->map.stamp;
+	*bno = run->bno + block - run->block;
+
+	return run->block + run->n - block;
+}
+
+
+/* Caches mapping of n physically contiguous blocks (caching is best effort) */
+static void ext2_block_mapadd(ext2_obj_t *obj, uint32_t block, uint32_t bno, uint32_t n)
+{
+	ext2_bmap_t *run;
+	uint32_t i, j, size;
+
+	/* Grow mappings array */
+	if ((obj->map.n == obj->map.size) && (obj->map.size < BMAP_SIZE)) {
+		size = (obj->map.size) ? 2 * obj->map.size : BMAP_MINSIZE;
+
+		if (size > BMAP_SIZE)
+			size = BMAP_SIZE;
+
+		if ((run = (ext2_bmap_t *)realloc(obj->map.runs, size * sizeof(ext2_bmap_t))) != NULL) {
+			obj->map.runs = run;
+			obj->map.size = size;
 		}
-		else {
-			if ((err = ext2_block_readind(fs, obj, obj->inode->block + offs[2], depth, ind + 1)) < 0)
-				return err;
+		else if (!obj->map.size) {
+			return;
 		}
 	}
 
-	if (depth >= 2) {
-		if (depth == 3) {
-			if ((err = ext2_block_readind(fs, obj, ind[1] + offs[1], --depth, ind)) < 0)
-				return err;
+	i = ext2_block_mapidx(obj, block);
+
+	/* Don't overlap the following mapping */
+	if ((i < obj->map.n) && (block + n > obj->map.runs[i].block))
+		n = obj->map.runs[i].block - block;
+
+	/* Extend the preceding mapping */
+	if (i && (obj->map.runs[i - 1].block + obj->map.runs[i - 1].n == block) && (obj->map.runs[i - 1].bno + obj->map.runs[i - 1].n == bno)) {
+		run = obj->map.runs + i - 1;
+		run->n += n;
+		run->used = ++obj->map.stamp;
+
+		/* Join the following mapping */
+		if ((i < obj->map.n) && (run->block + run->n == run[1].block) && (run->bno + run->n == run[1].bno)) {
+			run->n += run[1].n;
+			memmove(run + 1, run + 2, (--obj->map.n - i) * sizeof(ext2_bmap_t));
 		}
-		else {
-			if ((err = ext2_block_readind(fs, obj, obj->inode->block + offs[1], depth, ind)) < 0)
-				return err;
+
+		return;
+	}
+
+	/* Extend the following mapping */
+	if ((i < obj->map.n) && (block + n == (run = obj->map.runs + i)->block) && (bno + n == run->bno)) {
+		run->block = block;
+		run->bno = bno;
+		run->n += n;
+		run->used = ++obj->map.stamp;
+		return;
+	}
+
+	/* Evict least recently used mapping */
+	if (obj->map.n == obj->map.size) {
+		for (j = 0, run = obj->map.runs; run < obj->map.runs + obj->map.n; run++) {
+			if (run->used < obj->map.runs[j].used)
+				j = run - obj->map.runs;
+		}
+
+		memmove(obj->map.runs + j, obj->map.runs + j + 1, (--obj->map.n - j) * sizeof(ext2_bmap_t));
+
+		if (j < i)
+			i--;
+	}
+
+	memmove(obj->map.runs + i + 1, obj->map.runs + i, (obj->map.n++ - i) * sizeof(ext2_bmap_t));
+	run = obj->map.runs + i;
+	run->block = block;
+	run->bno = bno;
+	run->n = n;
+	run->used = ++obj->map.stamp;
+}
+
+
+/* Invalidates cached mappings of n blocks starting at given block */
+static void ext2_block_mapdrop(ext2_obj_t *obj, uint32_t block, uint32_t n)
+{
+	ext2_bmap_t *run;
+	uint32_t i, j;
+
+	for (i = 0, j = 0; i < obj->map.n; i++) {
+		run = obj->map.runs + i;
+
+		if ((run->block < block + n) && (run->block + run->n > block)) {
+			if (run->block >= block)
+				continue;
+
+			run->n = block - run->block;
+		}
+
+		obj->map.runs[j++] = *run;
+	}
+
+	obj->map.n = j;
+}
+
+
+/* Calculates physical block number, returns number of following blocks known to be mapped the same way (physically contiguous or not mapped) */
+static int ext2_block_map(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t *bno)
+{
+	uint32_t offs[4], *entry, i, n, end;
+	uint64_t span, pos;
+	int ret, depth;
+
+	if ((ret = ext2_block_mapfind(obj, block, bno)))
+		return ret;
+
+	if (obj->inode->flags & IFLAG_EXTENTS) {
+		if ((ret = ext2_extent_get(fs, obj, block, bno)) < 0)
+			return ret;
+	}
+	else {
+		if ((depth = ext2_block_offs(fs, block, offs)) < 0)
+			return depth;
+
+		if ((ret = ext2_block_entry(fs, obj, block, 0, &entry)) < 0)
+			return ret;
+
+		/* Missing indirect block => the whole range it would map is a hole */
+		if (entry == NULL) {
+			for (i = 0, span = 1, pos = 0; --ret; i++, span *= fs->blocksz / sizeof(uint32_t))
+				pos += span * offs[i];
+
+			/* Hole doesn't need to extend past the end of file */
+			end = (obj->inode->size) ? (obj->inode->size - 1) / fs->blocksz + 1 : 0;
+			*bno = 0;
+
+			if (end <= block)
+				return 1;
+
+			return (span - pos < end - block) ? span - pos : end - block;
 		}
+
+		/* Following entries of the inode or indirect block may continue the run */
+		n = ((depth > 1) ? fs->blocksz / sizeof(uint32_t) : DIRECT_BLOCKS) - offs[0];
+		for (i = 1; (i < n) && (entry[i] == ((*entry) ? *entry + i : 0)); i++);
+
+		*bno = *entry;
+		ret = i;
+	}
+
+	if (*bno)
+		ext2_block_mapadd(obj, block, *bno, ret);
+
+	return ret;
+}
+
+
+int ext2_block_get(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t *bno)
+{
+	int err;
+
+	if ((err = ext2_block_map(fs, obj, block, bno)) < 0)
+		return err;
+
+	return EOK;
+}
+
+
+/* Maps n consecutive blocks to physical blocks starting at bno (given object inode relative block number) */
+static int ext2_block_set(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t bno, uint32_t n)
+{
+	uint32_t i, *entry;
+	int err;
+
+	ext2_block_mapdrop(obj, block, n);
+
+	if (obj->inode->flags & IFLAG_EXTENTS)
+		return ext2_extent_set(fs, obj, block, bno, n);
+
+	for (i = 0; i < n; i++) {
+		if ((err = ext2_block_entry(fs, obj, block + i, 1, &entry)) < 0)
+			return err;
+
+		*entry = bno + i;
 	}
 
 	return EOK;
 }
 
 
-int ext2_block_get(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t **res)
+/* Tries to allocate n consecutive blocks */
+static int ext2_block_create(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t n, uint32_t *res)
 {
-	uint32_t *ind[3] = { NULL, NULL, NULL };
-	uint32_t offs[4] = { 0 };
-	int err, depth;
+	uint32_t lbno = 0, group, goal = 0, start, window = 0;
+	int ret, err;
 
-	if ((depth = ext2_block_offs(fs, block, offs)) < 0)
-		return depth;
+	/* Uninitialized extent blocks (e.g. preallocated by fallocate()) are already allocated */
+	if (obj->inode->flags & IFLAG_EXTENTS) {
+		if ((ret = ext2_extent_map(fs, obj, block, n, &start)) < 0)
+			return ret;
+
+		if (start) {
+			*res = ((uint32_t)ret < n) ? (uint32_t)ret : n;
+			return EOK;
+		}
+
+		/* Don't map blocks over the following extent */
+		if ((uint32_t)ret < n)
+			n = ret;
+	}
 
-	if (depth > 1) {
-		if ((err = ext2_block_ind(fs, obj, depth, offs, ind)) < 0)
+	/* Continue previous block run */
+	if (block && ((err = ext2_block_get(fs, obj, block - 1, &lbno)) < 0))
+		return err;
+
+	/* Non sequential write => release preallocated blocks */
+	if (obj->prealloc.n && (!lbno || (obj->prealloc.bno != lbno + 1))) {
+		if ((err = ext2_block_discard(fs, obj)) < 0)
 			return err;
+	}
+
+	/* Claim reserved blocks */
+	if (obj->prealloc.n) {
+		start = obj->prealloc.bno;
+		group = (start - fs->sb->fstBlock) / fs->sb->groupBlocks;
 
-		*res = ind[0] + offs[0];
+		if ((ret = ext2_bmp_claim(fs, group, (start - fs->sb->fstBlock) % fs->sb->groupBlocks + 1, (n < obj->prealloc.n) ? n : obj->prealloc.n)) <= 0) {
+			ext2_block_discard(fs, obj);
+			return (ret < 0) ? ret : -EIO;
+		}
+
+		ext2_gdt_update(fs, group, -ret, 0, 0);
+		obj->prealloc.bno += ret;
+		obj->prealloc.n -= ret;
 	}
 	else {
-		*res = obj->inode->block + offs[0];
+		if (lbno) {
+			group = (lbno - fs->sb->fstBlock) / fs->sb->groupBlocks;
+			goal = (lbno - fs->sb->fstBlock) % fs->sb->groupBlocks + 2;
+		}
+		else {
+			group = ((uint32_t)obj->id - 1) / fs->sb->groupInodes;
+		}
+
+		/* Reserve blocks for file growth */
+		if (S_ISREG(obj->inode->mode))
+			window = (fs->sb->preallocBlocks) ? fs->sb->preallocBlocks : PREALLOC_BLOCKS;
+
+		if ((ret = ext2_block_allocrun(fs, group, goal, n + window, n, &start)) < 0)
+			return ret;
+
+		if ((uint32_t)ret > n) {
+			obj->prealloc.bno = start + n;
+			obj->prealloc.n = ret - n;
+			ret = n;
+		}
+	}
+
+	if ((err = ext2_block_set(fs, obj, block, start, ret)) < 0) {
+		ext2_block_destroy(fs, start, ret);
+		return err;
 	}
 
+	obj->inode->blocks += ret * (fs->blocksz / INODE_BLOCKSZ);
+	obj->flags |= OFLAG_DIRTY;
+	*res = ret;
+
 	return EOK;
 }
 
 
+/* Returns index of the first buffered block not preceding given block */
+static uint32_t ext2_block_didx(ext2_obj_t *obj, uint32_t block)
+{
+	uint32_t l = 0, r = obj->dalloc.n, m;
+
+	while (l < r) {
+		m = (l + r) / 2;
+
+		if (obj->dalloc.bufs[m].block < block)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l;
+}
+
+
+/* Finds buffered block data (NULL => block isn't buffered) */
+static char *ext2_block_dfind(ext2_obj_t *obj, uint32_t block)
+{
+	uint32_t i = ext2_block_didx(obj, block);
+
+	if ((i < obj->dalloc.n) && (obj->dalloc.bufs[i].block == block))
+		return obj->dalloc.bufs[i].data;
+
+	return NULL;
+}
+
+
+/* Copies buffered blocks over n blocks read into the buffer */
+static void ext2_block_dcopy(ext2_t *fs, ext2_obj_t *obj, uint32_t block, char *buff, uint32_t n)
+{
+	ext2_dblock_t *dblock;
+	uint32_t i;
+
+	for (i = ext2_block_didx(obj, block); i < obj->dalloc.n; i++) {
+		if ((dblock = obj->dalloc.bufs + i)->block - block >= n)
+			break;
+
+		memcpy(buff + (dblock->block - block) * fs->blocksz, dblock->data, fs->blocksz);
+	}
+}
+
+
+/* Buffers not mapped block, returns 1 if the block is buffered, 0 if it should be allocated immediately
+ * and -ENOBUFS if the object buffered blocks have to be allocated first (they may be mapped anywhere) */
+static int ext2_block_dadd(ext2_t *fs, ext2_obj_t *obj, uint32_t block, char **data)
+{
+	ext2_dblock_t *bufs;
+	uint32_t i, size, max = DALLOC_SIZE / fs->blocksz;
+	int err;
+
+	if ((*data = ext2_block_dfind(obj, block)) != NULL)
+		return 1;
+
+	/* Only regular files data allocation is delayed */
+	if (!S_ISREG(obj->inode->mode) || !obj->inode->links)
+		return 0;
+
+	/* Buffers limit reached => unused objects are written back by the flusher thread */
+	if ((err = ext2_gdt_reserve(fs, 1, max)) == -ENOBUFS) {
+		ext2_cache_wakeup(fs);
+
+		if (obj->dalloc.n)
+			return -ENOBUFS;
+	}
+
+	/* Low on free space or buffers => allocate immediately */
+	if (err < 0)
+		return 0;
+
+	if (obj->dalloc.n == obj->dalloc.size) {
+		size = (obj->dalloc.size) ? 2 * obj->dalloc.size : DALLOC_MINSIZE;
+
+		if ((bufs = (ext2_dblock_t *)realloc(obj->dalloc.bufs, size * sizeof(ext2_dblock_t))) == NULL) {
+			ext2_gdt_reserve(fs, -1, max);
+			return 0;
+		}
+
+		obj->dalloc.bufs = bufs;
+		obj->dalloc.size = size;
+	}
+
+	if ((*data = (char *)malloc(fs->blocksz)) == NULL) {
+		ext2_gdt_reserve(fs, -1, max);
+		return 0;
+	}
+
+	memset(*data, 0, fs->blocksz);
+
+	i = ext2_block_didx(obj, block);
+	memmove(obj->dalloc.bufs + i + 1, obj->dalloc.bufs + i, (obj->dalloc.n++ - i) * sizeof(ext2_dblock_t));
+	obj->dalloc.bufs[i].block = block;
+	obj->dalloc.bufs[i].data = *data;
+
+	return 1;
+}
+
+
+int ext2_block_dflush(ext2_t *fs, ext2_obj_t *obj)
+{
+	ext2_dblock_t *bufs = obj->dalloc.bufs;
+	uint32_t i, j, k, n, bno;
+	int ret, err = EOK;
+
+	/* Unlinked object data is dropped with the object */
+	if (!obj->inode->links)
+		return EOK;
+
+	/* Allocate runs of logically contiguous buffered blocks at once */
+	for (i = 0; i < obj->dalloc.n; i += n) {
+		for (j = i + 1; (j < obj->dalloc.n) && (bufs[j].block == bufs[j - 1].block + 1); j++);
+
+		if ((err = ext2_block_create(fs, obj, bufs[i].block, j - i, &n)) < 0)
+			break;
+
+		if ((err = ext2_block_get(fs, obj, bufs[i].block, &bno)) < 0) {
+			n = 0;
+			break;
+		}
+
+		/* Allocated blocks are no longer buffered, even if they fail to be written */
+		for (k = 0; k < n; k++) {
+			if ((ret = ext2_cache_write(fs, bno + k, bufs[i + k].data, 1, ext2_block_data(obj))) < 0)
+				err = ret;
+
+			free(bufs[i + k].data);
+		}
+
+		if (err < 0) {
+			i += n;
+			break;
+		}
+	}
+
+	if (i) {
+		memmove(bufs, bufs + i, (obj->dalloc.n - i) * sizeof(ext2_dblock_t));
+		obj->dalloc.n -= i;
+		ext2_gdt_reserve(fs, -(int32_t)i, 0);
+	}
+
+	return err;
+}
+
+
+void ext2_block_ddrop(ext2_t *fs, ext2_obj_t *obj, uint32_t block)
+{
+	uint32_t i, n = ext2_block_didx(obj, block);
+
+	if (n == obj->dalloc.n)
+		return;
+
+	for (i = n; i < obj->dalloc.n; i++)
+		free(obj->dalloc.bufs[i].data);
+
+	ext2_gdt_reserve(fs, -(int32_t)(obj->dalloc.n - n), 0);
+	obj->dalloc.n = n;
+}
+
+
 int ext2_block_syncone(ext2_t *fs, ext2_obj_t *obj, uint32_t block, const void *buff)
 {
-	uint32_t *bno;
+	uint32_t bno, n;
 	int err;
 
 	if ((err = ext2_block_get(fs, obj, block, &bno)) < 0)
 		return err;
 
-	if (!(*bno)) {
-		if ((err = ext2_block_createone(fs, (uint32_t)obj->id, &block)) < 0)
+	if (!bno) {
+		if ((err = ext2_block_create(fs, obj, block, 1, &n)) < 0)
 			return err;
 
-		*bno = block;
-		obj->inode->blocks += fs->blocksz / fs->sectorsz;
+		if ((err = ext2_block_get(fs, obj, block, &bno)) < 0)
+			return err;
 	}
 
-	return ext2_block_write(fs, *bno, buff, 1);
+	return ext2_cache_write(fs, bno, buff, 1, ext2_block_data(obj));
 }
 
 
-int ext2_block_sync(ext2_t *fs, ext2_obj_t *obj, uint32_t block, const void *buff, uint32_t n)
+int ext2_block_syncpart(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t offs, const void *buff, uint32_t len)
 {
-	uint32_t lbno = 0, i = 0, j = 0, k = 0;
-	uint32_t *bno;
+	uint32_t bno, n;
+	char *data;
 	int err;
 
-	while (j < n) {
-		if ((err = ext2_block_get(fs, obj, block + j, &bno)) < 0)
+	if ((err = ext2_block_get(fs, obj, block, &bno)) < 0)
+		return err;
+
+	if (bno)
+		return ext2_cache_writepart(fs, bno, offs, buff, len, ext2_block_data(obj));
+
+	/* Buffered blocks don't include this block, it stays unmapped */
+	if ((err = ext2_block_dadd(fs, obj, block, &data)) == -ENOBUFS) {
+		if ((err = ext2_block_dflush(fs, obj)) < 0)
 			return err;
 
-		if (!(*bno)) {
-			if (i < j) {
-				if ((err = ext2_block_get(fs, obj, i, &bno)) < 0)
-					return err;
+		err = ext2_block_dadd(fs, obj, block, &data);
+	}
 
-				if ((err = ext2_block_write(fs, *bno, buff + i * fs->blocksz, j - i)) < 0)
-					return err;
+	if (err < 0)
+		return err;
+
+	if (err) {
+		if (buff != NULL)
+			memcpy(data + offs, buff, len);
+		else
+			memset(data + offs, 0, len);
+
+		return EOK;
+	}
+
+	if ((err = ext2_block_create(fs, obj, block, 1, &n)) < 0)
+		return err;
+
+	if ((err = ext2_block_get(fs, obj, block, &bno)) < 0)
+		return err;
+
+	/* New block, the rest of it reads as zeros */
+	return ext2_cache_writenew(fs, bno, offs, buff, len, ext2_block_data(obj));
+}
+
+
+int ext2_block_sync(ext2_t *fs, ext2_obj_t *obj, uint32_t block, const void *buff, uint32_t n)
+{
+	uint32_t i, j, k, start, bno;
+	int ret, err = EOK, delay;
+	char *data;
+
+	for (i = 0; i < n; i = j) {
+		if ((ret = ext2_block_map(fs, obj, block + i, &start)) < 0)
+			return ret;
+
+		/* Allocate and write not mapped blocks */
+		if (!start) {
+			for (j = i + ret; j < n; j += ret) {
+				if ((ret = ext2_block_map(fs, obj, block + j, &bno)) < 0)
+					return ret;
+
+				if (bno)
+					break;
 			}
 
-			for (i = j++; j < n; j++) {
-				if ((err = ext2_block_get(fs, obj, block + j, &bno)) < 0)
+			if (j > n)
+				j = n;
+
+			/* Long runs are allocated at once after already buffered blocks */
+			if ((delay = (j - i < DALLOC_MAXRUN)) == 0 && obj->dalloc.n && obj->inode->links) {
+				if ((err = ext2_block_dflush(fs, obj)) < 0)
 					return err;
 
-				if (*bno)
+				/* Map the run again */
+				j = i;
+				continue;
+			}
+
+			/* Buffer short runs and update already buffered blocks */
+			for (; i < j; i++) {
+				if (delay) {
+					if ((err = ext2_block_dadd(fs, obj, block + i, &data)) <= 0)
+						break;
+				}
+				else if ((data = ext2_block_dfind(obj, block + i)) == NULL) {
 					break;
+				}
+
+				memcpy(data, buff + i * fs->blocksz, fs->blocksz);
 			}
 
+			/* Buffers limit reached => allocate the buffered blocks and map the rest of the run again */
+			if (err == -ENOBUFS) {
+				if ((err = ext2_block_dflush(fs, obj)) < 0)
+					return err;
+
+				j = i;
+				continue;
+			}
+
+			if (err < 0)
+				return err;
+
+			/* Don't allocate blocks that are still buffered */
+			if (((k = ext2_block_didx(obj, block + i)) < obj->dalloc.n) && (obj->dalloc.bufs[k].block < block + j))
+				j = obj->dalloc.bufs[k].block - block;
+
 			for (; i < j; i += k) {
-				if ((err = ext2_block_create(fs, obj, block + i, lbno, j - i, &k)) < 0)
+				if ((err = ext2_block_create(fs, obj, block + i, j - i, &k)) < 0)
 					return err;
 
 				if ((err = ext2_block_get(fs, obj, block + i, &bno)) < 0)
 					return err;
 
-				if ((err = ext2_block_write(fs, *bno, buff + i * fs->blocksz, k)) < 0)
+				if ((err = ext2_cache_write(fs, bno, buff + i * fs->blocksz, k, ext2_block_data(obj))) < 0)
 					return err;
 			}
-
-			lbno = 0;
-		}
-		else if (!lbno || (*bno == lbno + 1)) {
-			lbno = *bno;
-			j++;
 		}
+		/* Write physically contiguous blocks */
 		else {
-			if ((err = ext2_block_get(fs, obj, block + i, &bno)) < 0)
-				return err;
+			for (j = i + ret; j < n; j += ret) {
+				if ((ret = ext2_block_map(fs, obj, block + j, &bno)) < 0)
+					return ret;
 
-			if ((err = ext2_block_write(fs, *bno, buff + i * fs->blocksz, j - i)) < 0)
-				return err;
+				if (bno != start + j - i)
+					break;
+			}
 
-			lbno = 0;
-			i = j++;
+			if (j > n)
+				j = n;
+
+			if ((err = ext2_cache_write(fs, start, buff + i * fs->blocksz, j - i, ext2_block_data(obj))) < 0)
+				return err;
 		}
 	}
 
-	if (i < j) {
-		if ((err = ext2_block_get(fs, obj, block + i, &bno)) < 0)
-			return err;
+	return EOK;
+}
 
-		if ((err = ext2_block_write(fs, *bno, buff + i * fs->blocksz, j - i)) < 0)
-			return err;
-	}
+
+/* Queues object blocks to be destroyed */
+static int ext2_block_release(ext2_t *fs, ext2_obj_t *obj, ext2_bfree_t *batch, uint32_t bno, uint32_t n)
+{
+	int err;
+
+	if ((err = ext2_block_free(fs, batch, bno, n)) < 0)
+		return err;
+
+	obj->inode->blocks -= n * (fs->blocksz / INODE_BLOCKSZ);
 
 	return EOK;
 }
 
 
-/* Destroys a block */
-static int ext2_block_destroyone(ext2_t *fs, uint32_t bno)
+/* Destroys blocks referenced by an indirect block starting at given block (depth: 1 => single indirect block, etc.) */
+static int ext2_block_destroyind(ext2_t *fs, ext2_obj_t *obj, uint32_t *bno, int depth, uint32_t block, ext2_bfree_t *batch)
 {
-	uint32_t group = (bno - 1) / fs->sb->groupBlocks;
-	uint32_t offset = (bno - 1) % fs->sb->groupBlocks + 1;
-	void *bmp;
-	int err;
+	uint32_t i, *data, bits = (8 + fs->sb->logBlocksz) * (depth - 1);
+	int err = EOK;
 
-	if (!bno)
+	if (!(*bno))
 		return EOK;
 
-	if ((bmp = malloc(fs->blocksz)) == NULL)
+	if ((data = (uint32_t *)malloc(fs->blocksz)) == NULL)
 		return -ENOMEM;
 
-	if ((err = ext2_block_read(fs, fs->gdt[group].blockBmp, bmp, 1)) < 0) {
-		free(bmp);
+	if ((err = ext2_block_read(fs, *bno, data, 1)) < 0) {
+		free(data);
 		return err;
 	}
 
-	ext2_togglebit(bmp, offset);
+	for (i = block >> bits; i < fs->blocksz / sizeof(uint32_t); i++) {
+		if (depth > 1) {
+			if ((err = ext2_block_destroyind(fs, obj, data + i, depth - 1, (i == block >> bits) ? block & ((1UL << bits) - 1) : 0, batch)) < 0)
+				break;
+		}
+		else if (data[i]) {
+			if ((err = ext2_block_release(fs, obj, batch, data[i], 1)) < 0)
+				break;
 
-	if ((err = ext2_block_write(fs, fs->gdt[group].blockBmp, bmp, 1)) < 0) {
-		free(bmp);
-		return err;
+			data[i] = 0;
+		}
 	}
 
-	fs->gdt[group].freeBlocks++;
-
-	if ((err = ext2_gdt_syncone(fs, group)) < 0) {
-		ext2_togglebit(bmp, offset);
-
-		if (!ext2_block_write(fs, fs->gdt[group].blockBmp, bmp, 1))
-			fs->gdt[group].freeBlocks--;
-		else
-			fs->sb->freeBlocks++;
-
-		free(bmp);
-		return err;
+	/* Destroy the indirect block if it's no longer used */
+	if (err >= 0) {
+		if (!block) {
+			if ((err = ext2_block_release(fs, obj, batch, *bno, 1)) >= 0)
+				*bno = 0;
+		}
+		else {
+			err = ext2_block_write(fs, *bno, data, 1);
+		}
 	}
 
-	fs->sb->freeBlocks++;
-	free(bmp);
+	free(data);
 
-	return EOK;
+	return err;
 }
 
 
-int ext2_iblock_destroy(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t n)
+int ext2_iblock_destroy(ext2_t *fs, ext2_obj_t *obj, uint32_t block)
 {
-	uint32_t *ind[3] = { NULL, NULL, NULL };
-	uint32_t i, offs[4] = { 0 };
-	int err, depth;
+	uint32_t i, bits = 8 + fs->sb->logBlocksz;
+	ext2_bfree_t batch = { NULL, 0, 0 };
+	uint64_t blocks;
+	int ret, err = EOK;
 
-	for (i = 0; i < n; i++) {
-		if ((depth = ext2_block_offs(fs, block + i, offs)) < 0)
-			return depth;
+	ext2_block_mapdrop(obj, block, UINT32_MAX - block);
+	ext2_block_ddrop(fs, obj, block);
 
-		if ((err = ext2_block_ind(fs, obj, depth, offs, ind)) < 0)
-			return err;
+	do {
+		if (obj->inode->flags & IFLAG_EXTENTS) {
+			err = ext2_extent_truncate(fs, obj, block, &batch);
+			break;
+		}
+
+		/* Write back and invalidate indirect blocks */
+		for (i = 0; i < 3; i++) {
+			if ((obj->ind[i].data != NULL) && obj->ind[i].bno && (err = ext2_block_write(fs, obj->ind[i].bno, obj->ind[i].data, 1)) < 0)
+				break;
 
-		if (ind[0] != NULL)
-			*(ind[0] + offs[0]) = 0;
+			obj->ind[i].bno = 0;
+		}
 
-		switch (depth) {
-		case 1:
-			obj->inode->block[offs[0]] = 0;
+		if (err < 0)
 			break;
 
-		case 2:
-			if (!offs[0]) {
-				if ((err = ext2_block_destroyone(fs, obj->inode->block[offs[1]])) < 0)
-					return err;
+		for (i = block; i < DIRECT_BLOCKS; i++) {
+			if (obj->inode->block[i] && (err = ext2_block_release(fs, obj, &batch, obj->inode->block[i], 1)) < 0)
+				break;
 
-				obj->inode->block[offs[1]] = 0;
-			}
+			obj->inode->block[i] = 0;
+		}
+
+		if (err < 0)
 			break;
 
-		case 3:
-			if (!offs[0]) {
-				if ((err = ext2_block_destroyone(fs, *(ind[1] + offs[1]))) < 0)
-					return err;
+		block = (block > DIRECT_BLOCKS) ? block - DIRECT_BLOCKS : 0;
 
-				*(ind[1] + offs[1]) = 0;
-			}
+		for (i = 1; i < 4; i++) {
+			blocks = 1ULL << (bits * i);
 
-			if (!offs[1]) {
-				if ((err = ext2_block_destroyone(fs, obj->inode->block[offs[2]])) < 0)
-					return err;
+			if (block < blocks) {
+				if ((err = ext2_block_destroyind(fs, obj, obj->inode->block + DIRECT_BLOCKS + i - 1, i, block, &batch)) < 0)
+					break;
 
-				obj->inode->block[offs[2]] = 0;
+				block = 0;
 			}
-			break;
+			else {
+				block -= blocks;
+			}
+		}
+	} while (0);
 
-		case 4:
-			if (!offs[0]) {
-				if ((err = ext2_block_destroyone(fs, *(ind[1] + offs[1]))) < 0)
-					return err;
+	/* Blocks unlinked from the object are destroyed even if truncation failed (they are leaked if that fails too) */
+	if ((ret = ext2_block_freebatch(fs, &batch)) < 0) {
+		free(batch.runs);
+		return ret;
+	}
 
-				*(ind[1] + offs[1]) = 0;
-			}
+	return err;
+}
 
-			if (!offs[1]) {
-				if ((err = ext2_block_destroyone(fs, *(ind[2] + offs[2]))) < 0)
-					return err;
 
-				*(ind[2] + offs[2]) = 0;
-			}
+int ext2_block_load(ext2_t *fs, ext2_obj_t *obj, uint32_t block, void *buff, uint32_t n)
+{
+	uint32_t i, j, start, bno;
+	int ret;
 
-			if (!offs[2]) {
-				if ((err = ext2_block_destroyone(fs, obj->inode->block[offs[3]])) < 0)
-					return err;
+	for (i = 0; i < n; i = j) {
+		if ((ret = ext2_block_map(fs, obj, block + i, &start)) < 0)
+			return ret;
 
-				obj->inode->block[offs[3]] = 0;
-			}
-			break;
+		/* Extend the run of physically contiguous (or not mapped) blocks */
+		for (j = i + ret; j < n; j += ret) {
+			if ((ret = ext2_block_map(fs, obj, block + j, &bno)) < 0)
+				return ret;
+
+			if ((start) ? (bno != start + j - i) : (bno != 0))
+				break;
+		}
+
+		if (j > n)
+			j = n;
+
+		/* Not mapped blocks read as zeros (or buffered data) */
+		if (!start) {
+			memset((char *)buff + i * fs->blocksz, 0, (j - i) * fs->blocksz);
+			ext2_block_dcopy(fs, obj, block + i, (char *)buff + i * fs->blocksz, j - i);
 		}
+		else if ((ret = ext2_cache_read(fs, start, (char *)buff + i * fs->blocksz, j - i, ext2_block_data(obj))) < 0)
+			return ret;
 	}
 
 	return EOK;
@@ -602,11 +1170,64 @@ int ext2_iblock_destroy(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t n)
 
 int ext2_block_init(ext2_t *fs, ext2_obj_t *obj, uint32_t block, void *buff)
 {
-	uint32_t *bno;
+	uint32_t bno;
+	char *data;
+	int err;
+
+	if ((err = ext2_block_get(fs, obj, block, &bno)) < 0)
+		return err;
+
+	/* Not mapped block reads as zeros (or buffered data) */
+	if (!bno) {
+		if ((data = ext2_block_dfind(obj, block)) != NULL)
+			memcpy(buff, data, fs->blocksz);
+		else
+			memset(buff, 0, fs->blocksz);
+
+		return EOK;
+	}
+
+	return ext2_cache_read(fs, bno, buff, 1, ext2_block_data(obj));
+}
+
+
+int ext2_block_loadpart(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t offs, void *buff, uint32_t len)
+{
+	uint32_t bno;
+	char *data;
+	int err;
+
+	if ((err = ext2_block_get(fs, obj, block, &bno)) < 0)
+		return err;
+
+	/* Not mapped block reads as zeros (or buffered data) */
+	if (!bno) {
+		if ((data = ext2_block_dfind(obj, block)) != NULL)
+			memcpy(buff, data + offs, len);
+		else
+			memset(buff, 0, len);
+
+		return EOK;
+	}
+
+	return ext2_cache_readpart(fs, bno, offs, buff, len, ext2_block_data(obj));
+}
+
+
+int ext2_block_zeropart(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t offs, uint32_t len)
+{
+	uint32_t bno;
+	char *data;
 	int err;
 
 	if ((err = ext2_block_get(fs, obj, block, &bno)) < 0)
 		return err;
 
-	return ext2_block_read(fs, *bno, buff, 1);
+	if (bno)
+		return ext2_cache_writepart(fs, bno, offs, NULL, len, ext2_block_data(obj));
+
+	if ((data = ext2_block_dfind(obj, block)) != NULL)
+		memset(data + offs, 0, len);
+
+	return EOK;
 }
@@ -18,9 +18,35 @@
 
 #include <stdint.h>
 
+#include "bmp.h"
 #include "ext2.h"
 
 
+/* Block mapping configuration */
+#define PREALLOC_BLOCKS 32 /* Default number of blocks preallocated for growing files */
+#define BMAP_MINSIZE    4  /* Initial number of cached block mappings per object */
+#define BMAP_SIZE       64 /* Max number of cached block mappings per object */
+
+
+/* Delayed allocation configuration */
+#define DALLOC_SIZE     (256 * 1024) /* Max size of blocks buffered with delayed allocation in bytes */
+#define DALLOC_MINSIZE  8            /* Initial number of buffered blocks per object */
+#define DALLOC_MAXRUN   32           /* Runs of at least that many not mapped blocks are allocated immediately */
+
+
+/* Freed blocks batch configuration */
+#define BFREE_MINSIZE   16   /* Initial number of runs in a batch */
+#define BFREE_SIZE      4096 /* Max number of runs in a batch (full batch is applied) */
+
+
+/* Batch of blocks to be freed */
+typedef struct {
+	ext2_bmprun_t *runs;     /* Block runs (split at group boundaries) */
+	uint32_t n;              /* Number of runs */
+	uint32_t size;           /* Runs array size */
+} ext2_bfree_t;
+
+
 /* Reads blocks */
 extern int ext2_block_read(ext2_t *fs, uint32_t bno, void *buff, uint32_t n);
 
@@ -29,28 +55,88 @@ extern int ext2_block_read(ext2_t *fs, uint32_t bno, void *buff, uint32_t n);
 extern int ext2_block_write(ext2_t *fs, uint32_t bno, const void *buff, uint32_t n);
 
 
+/* Reads part of a block */
+extern int ext2_block_readpart(ext2_t *fs, uint32_t bno, uint32_t offs, void *buff, uint32_t len);
+
+
+/* Writes part of a block (buff = NULL => the part is zero-filled) */
+extern int ext2_block_writepart(ext2_t *fs, uint32_t bno, uint32_t offs, const void *buff, uint32_t len);
+
+
+/* Writes part of a newly allocated block (the rest of the block is zero-filled) */
+extern int ext2_block_writenew(ext2_t *fs, uint32_t bno, uint32_t offs, const void *buff, uint32_t len);
+
+
 /* Destroys blocks */
 extern int ext2_block_destroy(ext2_t *fs, uint32_t bno, uint32_t n);
 
 
-/* Calculates physical block number (given object inode relative block number) */
-extern int ext2_block_get(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t **res);
+/* Queues blocks to be destroyed in a batch */
+extern int ext2_block_free(ext2_t *fs, ext2_bfree_t *batch, uint32_t bno, uint32_t n);
+
+
+/* Marks queued blocks free or used with a single bitmap and group descriptor update per group (the batch is kept) */
+extern int ext2_block_markbatch(ext2_t *fs, ext2_bfree_t *batch, uint8_t used);
+
+
+/* Destroys queued blocks with a single bitmap and group descriptor update per group */
+extern int ext2_block_destroybatch(ext2_t *fs, ext2_bfree_t *batch);
+
+
+/* Destroys queued blocks, if metadata is journalled the blocks are reused after the running transaction is committed */
+extern int ext2_block_freebatch(ext2_t *fs, ext2_bfree_t *batch);
+
+
+/* Allocates one new block */
+extern int ext2_block_createone(ext2_t *fs, uint32_t ino, uint32_t *res);
+
+
+/* Releases object preallocated blocks */
+extern int ext2_block_discard(ext2_t *fs, ext2_obj_t *obj);
+
+
+/* Allocates and writes object blocks buffered with delayed allocation */
+extern int ext2_block_dflush(ext2_t *fs, ext2_obj_t *obj);
+
+
+/* Drops object buffered blocks starting at given block (given object inode relative block number) */
+extern void ext2_block_ddrop(ext2_t *fs, ext2_obj_t *obj, uint32_t block);
+
+
+/* Calculates physical block number, bno = 0 => block isn't mapped (given object inode relative block number) */
+extern int ext2_block_get(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t *bno);
 
 
 /* Synchronizes one block (given object inode relative block number) */
 extern int ext2_block_syncone(ext2_t *fs, ext2_obj_t *obj, uint32_t block, const void *buff);
 
 
-/* Synchronizes blocks (given object inode relative block number) */
+/* Synchronizes part of a block, not mapped block is buffered or allocated (given object inode relative block number) */
+extern int ext2_block_syncpart(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t offs, const void *buff, uint32_t len);
+
+
+/* Synchronizes blocks, short runs of not mapped blocks are buffered with delayed allocation (given object inode relative block number) */
 extern int ext2_block_sync(ext2_t *fs, ext2_obj_t *obj, uint32_t block, const void *buff, uint32_t n);
 
 
-/* Destroys inode blocks (given object inode relative block number) */
-extern int ext2_iblock_destroy(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t n);
+/* Destroys inode blocks starting at given block (given object inode relative block number) */
+extern int ext2_iblock_destroy(ext2_t *fs, ext2_obj_t *obj, uint32_t block);
+
+
+/* Reads blocks, physically contiguous blocks are read in one request (given object inode relative block number) */
+extern int ext2_block_load(ext2_t *fs, ext2_obj_t *obj, uint32_t block, void *buff, uint32_t n);
 
 
 /* Initializes block (given object inode relative block number) */
 extern int ext2_block_init(ext2_t *fs, ext2_obj_t *obj, uint32_t block, void *buff);
 
 
+/* Reads part of a block, not mapped block reads as zeros (given object inode relative block number) */
+extern int ext2_block_loadpart(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t offs, void *buff, uint32_t len);
+
+
+/* Zero-fills part of a block, not mapped block is left as is (given object inode relative block number) */
+extern int ext2_block_zeropart(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t offs, uint32_t len);
+
+
 #endif
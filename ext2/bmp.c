@@ -0,0 +1,628 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Group bitmaps
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/list.h>
+#include <sys/threads.h>
+
+#include "block.h"
+#include "bmp.h"
+
+
+/* Returns bitmap size in bits */
+static inline uint32_t ext2_bmp_size(ext2_t *fs, uint8_t type)
+{
+	return (type == BMP_BLOCK) ? fs->sb->groupBlocks : fs->sb->groupInodes;
+}
+
+
+/* Returns group allocator mutex */
+static inline handle_t ext2_bmp_glock(ext2_t *fs, uint32_t group)
+{
+	return fs->bmps->glocks[group % BMP_LOCKS];
+}
+
+
+/* Returns bitmap block number */
+static inline uint32_t ext2_bmp_block(ext2_t *fs, uint8_t type, uint32_t group)
+{
+	return (type == BMP_BLOCK) ? fs->gdt[group].blockBmp : fs->gdt[group].inodeBmp;
+}
+
+
+/* Computes bitmap summary */
+static void ext2_bmp_summarize(ext2_bmp_t *bmp, uint32_t size, ext2_bsum_t *sum)
+{
+	if (!(sum->ffree = ext2_findzerobit(bmp->data, size, 1)))
+		sum->ffree = size + 1;
+
+	ext2_findzerorun(bmp->data, size, sum->ffree, size, &sum->maxrun);
+}
+
+
+/* Writes back bitmap (requires bitmaps to be locked and bitmap group to be locked or bitmap not to be in use) */
+static int _ext2_bmp_sync(ext2_t *fs, ext2_bmp_t *bmp)
+{
+	int err;
+
+	if (bmp->dirty) {
+		if ((err = ext2_block_write(fs, ext2_bmp_block(fs, bmp->type, bmp->group), bmp->data, 1)) < 0)
+			return err;
+
+		bmp->dirty = 0;
+	}
+
+	return EOK;
+}
+
+
+/* Finds group bitmap in memory (requires bitmaps to be locked) */
+static ext2_bmp_t *_ext2_bmp_find(ext2_bmps_t *bmps, uint8_t type, uint32_t group)
+{
+	ext2_bmp_t *bmp;
+
+	if ((bmp = bmps->lru) != NULL) {
+		do {
+			if ((bmp->group == group) && (bmp->type == type))
+				return bmp;
+		} while ((bmp = bmp->next) != bmps->lru);
+	}
+
+	return NULL;
+}
+
+
+/* Returns least recently used bitmap, which isn't in use (requires bitmaps to be locked) */
+static ext2_bmp_t *_ext2_bmp_victim(ext2_bmps_t *bmps)
+{
+	ext2_bmp_t *bmp;
+
+	if ((bmp = bmps->lru) != NULL) {
+		do {
+			if (!bmp->refs && !bmp->io)
+				return bmp;
+		} while ((bmp = bmp->next) != bmps->lru);
+	}
+
+	return NULL;
+}
+
+
+/* Checks if any bitmap of the groups stripe is being written back by eviction (requires bitmaps to be locked) */
+static int _ext2_bmp_evicting(ext2_bmps_t *bmps, uint32_t stripe)
+{
+	ext2_bmp_t *bmp;
+
+	if ((bmp = bmps->lru) != NULL) {
+		do {
+			if (bmp->io && (bmp->group % BMP_LOCKS == stripe))
+				return 1;
+		} while ((bmp = bmp->next) != bmps->lru);
+	}
+
+	return 0;
+}
+
+
+/* Returns group bitmap, loads it if it's not in memory (requires bitmap group to be locked) */
+static int _ext2_bmp_get(ext2_t *fs, uint8_t type, uint32_t group, ext2_bmp_t **res)
+{
+	ext2_bmps_t *bmps = fs->bmps;
+	ext2_bmp_t *bmp;
+	int err = EOK;
+
+	mutexLock(bmps->lock);
+
+	/* Bitmap evicted by an allocation in another group is reloaded after its write back */
+	while (((bmp = _ext2_bmp_find(bmps, type, group)) != NULL) && bmp->io)
+		condWait(bmps->cond, bmps->lock, 0);
+
+	if (bmp != NULL) {
+		LIST_REMOVE(&bmps->lru, bmp);
+		LIST_ADD(&bmps->lru, bmp);
+		bmp->refs++;
+		mutexUnlock(bmps->lock);
+		*res = bmp;
+		return EOK;
+	}
+
+	/* Reuse least recently used bitmap (if all bitmaps are in use the limit is exceeded) */
+	if ((bmps->count >= BMP_MAX) && ((bmp = _ext2_bmp_victim(bmps)) != NULL)) {
+		/* Victim isn't in use, it's written back without the lock (it stays on the list, so its group lookups wait) */
+		if (bmp->dirty) {
+			bmp->io = 1;
+			mutexUnlock(bmps->lock);
+			err = ext2_block_write(fs, ext2_bmp_block(fs, bmp->type, bmp->group), bmp->data, 1);
+			mutexLock(bmps->lock);
+			bmp->io = 0;
+			condBroadcast(bmps->cond);
+
+			if (err < 0) {
+				mutexUnlock(bmps->lock);
+				return err;
+			}
+
+			bmp->dirty = 0;
+		}
+
+		LIST_REMOVE(&bmps->lru, bmp);
+	}
+	else if ((bmp = (ext2_bmp_t *)malloc(sizeof(ext2_bmp_t) + fs->blocksz)) == NULL) {
+		mutexUnlock(bmps->lock);
+		return -ENOMEM;
+	}
+	else {
+		bmps->count++;
+	}
+
+	/* Group bitmap can't be loaded concurrently, its group is locked */
+	mutexUnlock(bmps->lock);
+
+	if ((err = ext2_block_read(fs, ext2_bmp_block(fs, type, group), bmp->data, 1)) < 0) {
+		mutexLock(bmps->lock);
+		bmps->count--;
+		mutexUnlock(bmps->lock);
+		free(bmp);
+		return err;
+	}
+
+	bmp->group = group;
+	bmp->type = type;
+	bmp->dirty = 0;
+	bmp->io = 0;
+	bmp->refs = 1;
+
+	if (!bmps->sum[type][group].ffree)
+		ext2_bmp_summarize(bmp, ext2_bmp_size(fs, type), &bmps->sum[type][group]);
+
+	mutexLock(bmps->lock);
+
+	LIST_ADD(&bmps->lru, bmp);
+	*res = bmp;
+
+	mutexUnlock(bmps->lock);
+
+	return EOK;
+}
+
+
+/* Releases group bitmap */
+static void ext2_bmp_put(ext2_t *fs, ext2_bmp_t *bmp)
+{
+	mutexLock(fs->bmps->lock);
+
+	bmp->refs--;
+
+	mutexUnlock(fs->bmps->lock);
+}
+
+
+/* Sets or clears group reserved blocks bits, so the allocator skips them (requires group to be locked, reserved bits are never written back) */
+static void _ext2_bmp_overlay(ext2_t *fs, ext2_bmp_t *bmp, uint8_t set)
+{
+	ext2_brsv_t *rsv = &fs->bmps->rsv[bmp->group];
+	uint32_t i;
+
+	if (bmp->type != BMP_BLOCK)
+		return;
+
+	for (i = 0; i < rsv->n; i++)
+		ext2_setbits(bmp->data, rsv->runs[i].start, rsv->runs[i].n, set);
+}
+
+
+/* Adds reserved run of blocks bits, returns number of reserved bits (requires group to be locked) */
+static uint32_t _ext2_bmp_reserve(ext2_t *fs, uint32_t group, uint32_t offs, uint32_t n)
+{
+	ext2_brsv_t *rsv = &fs->bmps->rsv[group];
+	ext2_bmprun_t *runs;
+	uint32_t size;
+
+	/* Reservation is best effort */
+	if (rsv->n == rsv->size) {
+		size = (rsv->size) ? 2 * rsv->size : 4;
+
+		if ((runs = (ext2_bmprun_t *)realloc(rsv->runs, size * sizeof(ext2_bmprun_t))) == NULL)
+			return 0;
+
+		rsv->runs = runs;
+		rsv->size = size;
+	}
+
+	rsv->runs[rsv->n].start = offs;
+	rsv->runs[rsv->n++].n = n;
+
+	return n;
+}
+
+
+/* Removes n bits from the front or the back of a reserved run, returns number of removed bits (requires group to be locked) */
+static uint32_t _ext2_bmp_unreserve(ext2_t *fs, uint32_t group, uint32_t offs, uint32_t n)
+{
+	ext2_brsv_t *rsv = &fs->bmps->rsv[group];
+	ext2_bmprun_t *run;
+	uint32_t i;
+
+	for (i = 0; i < rsv->n; i++) {
+		run = rsv->runs + i;
+
+		if ((offs < run->start) || (offs >= run->start + run->n))
+			continue;
+
+		if (n > run->start + run->n - offs)
+			n = run->start + run->n - offs;
+
+		if (n == run->n) {
+			*run = rsv->runs[--rsv->n];
+		}
+		else if (offs == run->start) {
+			run->start += n;
+			run->n -= n;
+		}
+		else {
+			run->n = offs - run->start;
+		}
+
+		return n;
+	}
+
+	return 0;
+}
+
+
+int ext2_bmp_alloc(ext2_t *fs, uint8_t type, uint32_t group, uint32_t goal, uint32_t min, uint32_t n, uint32_t used, uint32_t *res)
+{
+	ext2_bsum_t *sum = &fs->bmps->sum[type][group];
+	uint32_t offs, size = ext2_bmp_size(fs, type), best = 0, boffs = 0;
+	ext2_bmp_t *bmp;
+	int err;
+
+	mutexLock(ext2_bmp_glock(fs, group));
+
+	/* Group summary says there is no such run, don't load the bitmap */
+	if (sum->ffree && (!sum->maxrun || ((!goal || (goal < sum->ffree)) && (sum->maxrun < min)))) {
+		mutexUnlock(ext2_bmp_glock(fs, group));
+		return 0;
+	}
+
+	if ((err = _ext2_bmp_get(fs, type, group, &bmp)) < 0) {
+		mutexUnlock(ext2_bmp_glock(fs, group));
+		return err;
+	}
+
+	_ext2_bmp_overlay(fs, bmp, 1);
+
+	/* Prefer goal bit */
+	if (goal && (best = ext2_zerorunlen(bmp->data, size, goal, n))) {
+		boffs = goal;
+	}
+	else if (sum->maxrun >= min) {
+		/* Scan from the first free bit, bits before it are known to be in use */
+		if (!(offs = ext2_findzerobit(bmp->data, size, sum->ffree)))
+			sum->ffree = size + 1;
+		else
+			sum->ffree = offs;
+
+		/* Whole bitmap has been scanned, the largest run is known */
+		if ((boffs = ext2_findzerorun(bmp->data, size, sum->ffree, n, &best)) && (best < n))
+			sum->maxrun = best;
+		else if (!boffs)
+			sum->maxrun = 0;
+
+		if (best < min)
+			best = 0;
+	}
+
+	if (best) {
+		/* Bits past the used ones are reserved in memory, nothing reaches the disk until they're claimed */
+		if (best > used)
+			best = used + _ext2_bmp_reserve(fs, group, boffs + used, best - used);
+
+		if (boffs == sum->ffree)
+			sum->ffree += best;
+		*res = boffs;
+	}
+
+	_ext2_bmp_overlay(fs, bmp, 0);
+
+	if (best) {
+		ext2_setbits(bmp->data, boffs, (best < used) ? best : used, 1);
+		bmp->dirty = 1;
+	}
+
+	ext2_bmp_put(fs, bmp);
+	mutexUnlock(ext2_bmp_glock(fs, group));
+
+	return best;
+}
+
+
+/* Sets or clears n consecutive bits, returns number of changed bits (requires group to be locked) */
+static uint32_t _ext2_bmp_mark(ext2_t *fs, ext2_bmp_t *bmp, uint32_t offs, uint32_t n, uint8_t set)
+{
+	uint32_t ret, size = ext2_bmp_size(fs, bmp->type);
+
+	if (!offs || (offs > size))
+		return 0;
+
+	if (n > size - offs + 1)
+		n = size - offs + 1;
+
+	if ((ret = ext2_setbits(bmp->data, offs, n, set)))
+		bmp->dirty = 1;
+
+	return ret;
+}
+
+
+int ext2_bmp_claim(ext2_t *fs, uint32_t group, uint32_t offs, uint32_t n)
+{
+	ext2_bmp_t *bmp;
+	int ret;
+
+	mutexLock(ext2_bmp_glock(fs, group));
+
+	if ((ret = _ext2_bmp_get(fs, BMP_BLOCK, group, &bmp)) >= 0) {
+		if ((ret = _ext2_bmp_unreserve(fs, group, offs, n)))
+			ret = _ext2_bmp_mark(fs, bmp, offs, ret, 1);
+
+		ext2_bmp_put(fs, bmp);
+	}
+
+	mutexUnlock(ext2_bmp_glock(fs, group));
+
+	return ret;
+}
+
+
+void ext2_bmp_release(ext2_t *fs, uint32_t group, uint32_t offs, uint32_t n)
+{
+	ext2_bsum_t *sum = &fs->bmps->sum[BMP_BLOCK][group];
+
+	mutexLock(ext2_bmp_glock(fs, group));
+
+	/* Released bits may have joined free runs, the largest run is unknown until the next bitmap scan */
+	if (_ext2_bmp_unreserve(fs, group, offs, n) && sum->ffree) {
+		if (offs < sum->ffree)
+			sum->ffree = offs;
+
+		sum->maxrun = ext2_bmp_size(fs, BMP_BLOCK);
+	}
+
+	mutexUnlock(ext2_bmp_glock(fs, group));
+}
+
+
+int ext2_bmp_free(ext2_t *fs, uint8_t type, uint32_t group, uint32_t offs, uint32_t n)
+{
+	ext2_bsum_t *sum = &fs->bmps->sum[type][group];
+	uint32_t start, len, size = ext2_bmp_size(fs, type);
+	ext2_bmp_t *bmp;
+	int ret;
+
+	mutexLock(ext2_bmp_glock(fs, group));
+
+	if ((ret = _ext2_bmp_get(fs, type, group, &bmp)) >= 0) {
+		if ((ret = _ext2_bmp_mark(fs, bmp, offs, n, 0))) {
+			if (offs < sum->ffree)
+				sum->ffree = offs;
+
+			/* Freed bits may have joined free runs */
+			start = ext2_findsetbitrev(bmp->data, offs) + 1;
+			if ((len = ext2_zerorunlen(bmp->data, size, start, size)) > sum->maxrun)
+				sum->maxrun = len;
+		}
+
+		ext2_bmp_put(fs, bmp);
+	}
+
+	mutexUnlock(ext2_bmp_glock(fs, group));
+
+	return ret;
+}
+
+
+int ext2_bmp_markruns(ext2_t *fs, uint8_t type, uint32_t group, const ext2_bmprun_t *runs, uint32_t n, uint8_t set)
+{
+	uint32_t i, first = (type == BMP_BLOCK) ? fs->sb->fstBlock + group * fs->sb->groupBlocks : group * fs->sb->groupInodes + 1;
+	ext2_bmp_t *bmp;
+	int ret;
+
+	mutexLock(ext2_bmp_glock(fs, group));
+
+	if ((ret = _ext2_bmp_get(fs, type, group, &bmp)) >= 0) {
+		for (i = 0, ret = 0; i < n; i++)
+			ret += _ext2_bmp_mark(fs, bmp, runs[i].start - first + 1, runs[i].n, set);
+
+		/* Runs may have joined or split, recompute the summary once */
+		if (ret)
+			ext2_bmp_summarize(bmp, ext2_bmp_size(fs, type), &fs->bmps->sum[type][group]);
+
+		ext2_bmp_put(fs, bmp);
+	}
+
+	mutexUnlock(ext2_bmp_glock(fs, group));
+
+	return ret;
+}
+
+
+int ext2_bmps_sync(ext2_t *fs)
+{
+	ext2_bmps_t *bmps = fs->bmps;
+	ext2_bmp_t *bmp;
+	int err = EOK, ret;
+	uint32_t i;
+
+	/* Lock groups one stripe at a time, so allocations in other groups can proceed */
+	for (i = 0; i < BMP_LOCKS; i++) {
+		mutexLock(bmps->glocks[i]);
+		mutexLock(bmps->lock);
+
+		/* Bitmaps evicted by allocations in other groups are written back without the lock */
+		while (_ext2_bmp_evicting(bmps, i))
+			condWait(bmps->cond, bmps->lock, 0);
+
+		if ((bmp = bmps->lru) != NULL) {
+			do {
+				if ((bmp->group % BMP_LOCKS == i) && ((ret = _ext2_bmp_sync(fs, bmp)) < 0))
+					err = ret;
+			} while ((bmp = bmp->next) != bmps->lru);
+		}
+
+		mutexUnlock(bmps->lock);
+		mutexUnlock(bmps->glocks[i]);
+	}
+
+	return err;
+}
+
+
+int ext2_bmps_destroy(ext2_t *fs)
+{
+	ext2_bmps_t *bmps = fs->bmps;
+	ext2_bmp_t *bmp;
+	uint32_t i;
+	int err;
+
+	err = ext2_bmps_sync(fs);
+
+	while ((bmp = bmps->lru) != NULL) {
+		LIST_REMOVE(&bmps->lru, bmp);
+		free(bmp);
+	}
+
+	for (i = 0; i < BMP_LOCKS; i++)
+		resourceDestroy(bmps->glocks[i]);
+
+	resourceDestroy(bmps->cond);
+	resourceDestroy(bmps->lock);
+
+	for (i = 0; i < fs->groups; i++)
+		free(bmps->rsv[i].runs);
+
+	free(bmps->rsv);
+	free(bmps->sum[BMP_BLOCK]);
+	free(bmps);
+
+	return err;
+}
+
+
+/* Recomputes groups free blocks and inodes counters from the bitmaps */
+static int ext2_bmps_count(ext2_t *fs)
+{
+	uint32_t group, size, used, total[2] = { 0, 0 };
+	ext2_bmp_t *bmp;
+	uint8_t type;
+	int err;
+
+	for (type = BMP_BLOCK; type <= BMP_INODE; type++) {
+		size = ext2_bmp_size(fs, type);
+
+		for (group = 0; group < fs->groups; group++) {
+			mutexLock(ext2_bmp_glock(fs, group));
+
+			if ((err = _ext2_bmp_get(fs, type, group, &bmp)) < 0) {
+				mutexUnlock(ext2_bmp_glock(fs, group));
+				return err;
+			}
+
+			used = ext2_countbits(bmp->data, size);
+
+			ext2_bmp_put(fs, bmp);
+			mutexUnlock(ext2_bmp_glock(fs, group));
+
+			if (type == BMP_BLOCK)
+				fs->gdt[group].freeBlocks = size - used;
+			else
+				fs->gdt[group].freeInodes = size - used;
+
+			total[type] += size - used;
+			ext2_gdt_dirty(fs, group);
+		}
+	}
+
+	fs->sb->freeBlocks = total[BMP_BLOCK];
+	fs->sb->freeInodes = total[BMP_INODE];
+
+	return EOK;
+}
+
+
+int ext2_bmps_init(ext2_t *fs)
+{
+	ext2_bmps_t *bmps;
+	uint32_t i;
+	int err;
+
+	if ((bmps = (ext2_bmps_t *)malloc(sizeof(ext2_bmps_t))) == NULL)
+		return -ENOMEM;
+
+	/* Summaries are computed when group bitmap is loaded for the first time */
+	if ((bmps->sum[BMP_BLOCK] = (ext2_bsum_t *)calloc(2 * fs->groups, sizeof(ext2_bsum_t))) == NULL) {
+		free(bmps);
+		return -ENOMEM;
+	}
+	bmps->sum[BMP_INODE] = bmps->sum[BMP_BLOCK] + fs->groups;
+
+	if ((bmps->rsv = (ext2_brsv_t *)calloc(fs->groups, sizeof(ext2_brsv_t))) == NULL) {
+		free(bmps->sum[BMP_BLOCK]);
+		free(bmps);
+		return -ENOMEM;
+	}
+
+	if ((err = mutexCreate(&bmps->lock)) < 0) {
+		free(bmps->rsv);
+		free(bmps->sum[BMP_BLOCK]);
+		free(bmps);
+		return err;
+	}
+
+	if ((err = condCreate(&bmps->cond)) < 0) {
+		resourceDestroy(bmps->lock);
+		free(bmps->rsv);
+		free(bmps->sum[BMP_BLOCK]);
+		free(bmps);
+		return err;
+	}
+
+	for (i = 0; i < BMP_LOCKS; i++) {
+		if ((err = mutexCreate(&bmps->glocks[i])) < 0) {
+			while (i--)
+				resourceDestroy(bmps->glocks[i]);
+			resourceDestroy(bmps->cond);
+			resourceDestroy(bmps->lock);
+			free(bmps->rsv);
+			free(bmps->sum[BMP_BLOCK]);
+			free(bmps);
+			return err;
+		}
+	}
+
+	bmps->lru = NULL;
+	bmps->count = 0;
+	fs->bmps = bmps;
+
+	/* Free counters are committed lazily, they may be stale if filesystem wasn't unmounted cleanly */
+	if (!(fs->sb->state & STATE_VALID) && ((err = ext2_bmps_count(fs)) < 0)) {
+		ext2_bmps_destroy(fs);
+		return err;
+	}
+
+	return EOK;
+}
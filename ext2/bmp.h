@@ -0,0 +1,118 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Group bitmaps
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _BMP_H_
+#define _BMP_H_
+
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "ext2.h"
+
+
+/* Group bitmaps configuration */
+#define BMP_MAX   16 /* Max number of group bitmaps kept in memory */
+#define BMP_LOCKS 16 /* Number of group allocator mutexes (groups are striped across them) */
+
+
+/* Bitmap types */
+enum {
+	BMP_BLOCK = 0, /* Blocks bitmap */
+	BMP_INODE = 1  /* Inodes bitmap */
+};
+
+
+typedef struct _ext2_bmp_t ext2_bmp_t;
+
+
+struct _ext2_bmp_t {
+	uint32_t group;          /* Group number */
+	uint8_t type;            /* Bitmap type */
+	uint8_t dirty;           /* Bitmap needs to be written back */
+	uint8_t io;              /* Evicted bitmap is being written back (lookups wait until it's done) */
+	uint32_t refs;           /* Number of bitmap users (bitmaps in use aren't evicted) */
+	ext2_bmp_t *prev, *next; /* Least Recently Used bitmaps list */
+	uint64_t data[];         /* Bitmap data */
+};
+
+
+/* Run of consecutive blocks or inodes */
+typedef struct {
+	uint32_t start;          /* First block or inode number */
+	uint32_t n;              /* Number of blocks or inodes */
+} ext2_bmprun_t;
+
+
+/* Group bitmap summary */
+typedef struct {
+	uint32_t ffree;          /* All bits before are in use (0 => summary unknown) */
+	uint32_t maxrun;         /* Largest run of free bits is not longer */
+} ext2_bsum_t;
+
+
+/* Group blocks reserved in memory (they aren't marked in the bitmap until they're claimed) */
+typedef struct {
+	ext2_bmprun_t *runs;     /* Reserved runs of bits */
+	uint32_t n;              /* Number of reserved runs */
+	uint32_t size;           /* Runs array size */
+} ext2_brsv_t;
+
+
+struct _ext2_bmps_t {
+	ext2_bmp_t *lru;             /* Least Recently Used bitmaps */
+	uint32_t count;              /* Number of bitmaps in memory */
+	ext2_bsum_t *sum[2];         /* Groups bitmaps summaries */
+	ext2_brsv_t *rsv;            /* Groups reserved blocks (protected by group allocator mutexes) */
+
+	/* Synchronization */
+	handle_t lock;               /* Bitmaps list mutex */
+	handle_t cond;               /* Evicted bitmaps write back completion condition */
+	handle_t glocks[BMP_LOCKS];  /* Group allocator mutexes (protect group bitmaps and summaries) */
+};
+
+
+/* Allocates at least min and up to n consecutive bits in a group (starting at goal bit if it's free), bits following the first used ones are only reserved, returns number of allocated and reserved bits */
+extern int ext2_bmp_alloc(ext2_t *fs, uint8_t type, uint32_t group, uint32_t goal, uint32_t min, uint32_t n, uint32_t used, uint32_t *res);
+
+
+/* Marks n reserved blocks bits starting at given bit used, returns number of claimed bits */
+extern int ext2_bmp_claim(ext2_t *fs, uint32_t group, uint32_t offs, uint32_t n);
+
+
+/* Releases n reserved blocks bits starting at given bit */
+extern void ext2_bmp_release(ext2_t *fs, uint32_t group, uint32_t offs, uint32_t n);
+
+
+/* Frees n consecutive bits in a group, returns number of freed bits */
+extern int ext2_bmp_free(ext2_t *fs, uint8_t type, uint32_t group, uint32_t offs, uint32_t n);
+
+
+/* Frees or marks used runs of blocks or inodes in a group with a single bitmap update (runs can't cross the group boundary), returns number of changed bits */
+extern int ext2_bmp_markruns(ext2_t *fs, uint8_t type, uint32_t group, const ext2_bmprun_t *runs, uint32_t n, uint8_t set);
+
+
+/* Synchronizes bitmaps */
+extern int ext2_bmps_sync(ext2_t *fs);
+
+
+/* Destroys bitmaps (returns write back error) */
+extern int ext2_bmps_destroy(ext2_t *fs);
+
+
+/* Initializes bitmaps */
+extern int ext2_bmps_init(ext2_t *fs);
+
+
+#endif
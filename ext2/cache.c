@@ -0,0 +1,1100 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Block cache
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/list.h>
+#include <sys/threads.h>
+
+#include "cache.h"
+#include "journal.h"
+#include "stats.h"
+
+
+/* Flusher thread states */
+enum {
+	FLUSHER_STOPPED  = 0,
+	FLUSHER_RUNNING  = 1,
+	FLUSHER_STOPPING = 2
+};
+
+
+/* Reads blocks from the device (data != 0 => regular file data) */
+static int ext2_cache_devread(ext2_t *fs, uint32_t bno, void *buff, uint32_t n, uint8_t data)
+{
+	ssize_t size = n * fs->blocksz;
+
+	ext2_stats_io(fs, bno, n, data, 0);
+
+	if (fs->read(fs->oid.id, (offs_t)bno * fs->blocksz, buff, size) != size)
+		return -EIO;
+
+	return EOK;
+}
+
+
+/* Writes blocks to the device (blocks are accounted in statistics by the caller) */
+static int ext2_cache_devput(ext2_t *fs, uint32_t bno, const void *buff, uint32_t n)
+{
+	ssize_t size = n * fs->blocksz;
+
+	if (fs->write(fs->oid.id, (offs_t)bno * fs->blocksz, buff, size) != size)
+		return -EIO;
+
+	return EOK;
+}
+
+
+/* Writes blocks to the device (data != 0 => regular file data) */
+static int ext2_cache_devwrite(ext2_t *fs, uint32_t bno, const void *buff, uint32_t n, uint8_t data)
+{
+	ext2_stats_io(fs, bno, n, data, 1);
+
+	return ext2_cache_devput(fs, bno, buff, n);
+}
+
+
+/* Finds cached block (requires cache to be locked) */
+static ext2_buff_t *_ext2_cache_find(ext2_cache_t *cache, uint32_t bno)
+{
+	ext2_buff_t *head = cache->hash[bno & (cache->hashsz - 1)], *b;
+
+	if ((b = head) != NULL) {
+		do {
+			if (b->bno == bno)
+				return b;
+		} while ((b = b->hnext) != head);
+	}
+
+	return NULL;
+}
+
+
+/* Finds cached block, waits until its device read or write completes (requires cache to be locked) */
+static ext2_buff_t *_ext2_cache_lookup(ext2_cache_t *cache, uint32_t bno)
+{
+	ext2_buff_t *b;
+
+	while (((b = _ext2_cache_find(cache, bno)) != NULL) && (b->flags & BFLAG_IO))
+		condWait(cache->iocond, cache->lock, 0);
+
+	return b;
+}
+
+
+/* Checks if any of n consecutive blocks is being written directly to the device (requires cache to be locked) */
+static int _ext2_cache_writing(ext2_cache_t *cache, uint32_t bno, uint32_t n)
+{
+	ext2_wrun_t *w;
+
+	if ((w = cache->wruns) != NULL) {
+		do {
+			if ((bno < w->bno + w->n) && (w->bno < bno + n))
+				return 1;
+		} while ((w = w->next) != cache->wruns);
+	}
+
+	return 0;
+}
+
+
+/* Returns list of blocks with given flags (dirty, committed and in flight blocks can't be evicted) */
+static inline ext2_buff_t **ext2_cache_list(ext2_cache_t *cache, uint8_t flags)
+{
+	return (flags & (BFLAG_DIRTY | BFLAG_COMMIT | BFLAG_IO)) ? &cache->busy : &cache->clean;
+}
+
+
+/* Sets cached block flags, moves the block between clean and busy blocks lists (requires cache to be locked) */
+static void _ext2_cache_flags(ext2_cache_t *cache, ext2_buff_t *b, uint8_t flags)
+{
+	ext2_buff_t **from = ext2_cache_list(cache, b->flags), **to = ext2_cache_list(cache, flags);
+
+	if (from != to) {
+		LIST_REMOVE(from, b);
+		LIST_ADD(to, b);
+	}
+
+	if ((flags & (BFLAG_COMMIT | BFLAG_IO)) && !(b->flags & (BFLAG_COMMIT | BFLAG_IO)))
+		cache->pinned++;
+	else if (!(flags & (BFLAG_COMMIT | BFLAG_IO)) && (b->flags & (BFLAG_COMMIT | BFLAG_IO)))
+		cache->pinned--;
+
+	b->flags = flags;
+}
+
+
+/* Marks cached block as most recently used (requires cache to be locked) */
+static void _ext2_cache_touch(ext2_cache_t *cache, ext2_buff_t *b)
+{
+	ext2_buff_t **list = ext2_cache_list(cache, b->flags);
+
+	LIST_REMOVE(list, b);
+	LIST_ADD(list, b);
+}
+
+
+/* Adds block to the cache (requires cache to be locked) */
+static void _ext2_cache_insert(ext2_cache_t *cache, ext2_buff_t *b, uint32_t bno, uint8_t flags)
+{
+	b->bno = bno;
+	b->flags = flags;
+	LIST_ADD_EX(&cache->hash[bno & (cache->hashsz - 1)], b, hnext, hprev);
+	LIST_ADD(ext2_cache_list(cache, flags), b);
+
+	if (flags & (BFLAG_COMMIT | BFLAG_IO))
+		cache->pinned++;
+}
+
+
+/* Removes block from the cache, the buffer isn't released (requires cache to be locked) */
+static void _ext2_cache_remove(ext2_cache_t *cache, ext2_buff_t *b)
+{
+	LIST_REMOVE_EX(&cache->hash[b->bno & (cache->hashsz - 1)], b, hnext, hprev);
+	LIST_REMOVE(ext2_cache_list(cache, b->flags), b);
+
+	if (b->flags & (BFLAG_COMMIT | BFLAG_IO))
+		cache->pinned--;
+}
+
+
+/* Marks cached block dirty (requires cache to be locked, data != 0 => regular file data) */
+static void _ext2_cache_dirty(ext2_cache_t *cache, ext2_buff_t *b, uint8_t data)
+{
+	if ((b->flags & (BFLAG_DIRTY | BFLAG_DATA)) == BFLAG_DIRTY)
+		cache->mdirty--;
+
+	if (!(b->flags & BFLAG_DIRTY))
+		cache->dirty++;
+
+	if (!data)
+		cache->mdirty++;
+
+	_ext2_cache_flags(cache, b, (b->flags & ~BFLAG_DATA) | BFLAG_DIRTY | ((data) ? BFLAG_DATA : 0));
+}
+
+
+/* Marks cached block clean (requires cache to be locked) */
+static void _ext2_cache_clean(ext2_cache_t *cache, ext2_buff_t *b)
+{
+	if (!(b->flags & BFLAG_DIRTY))
+		return;
+
+	if (!(b->flags & BFLAG_DATA))
+		cache->mdirty--;
+
+	cache->dirty--;
+	_ext2_cache_flags(cache, b, b->flags & ~BFLAG_DIRTY);
+}
+
+
+static int ext2_cache_cmp(const void *b1, const void *b2)
+{
+	uint32_t bno1 = (*(ext2_buff_t **)b1)->bno;
+	uint32_t bno2 = (*(ext2_buff_t **)b2)->bno;
+
+	if (bno1 > bno2)
+		return 1;
+	else if (bno1 < bno2)
+		return -1;
+
+	return 0;
+}
+
+
+/* Writes back dirty blocks (requires cache to be locked, it's released for the device writes) */
+static int _ext2_cache_flush(ext2_t *fs)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_buff_t *b;
+	uint32_t i, j, k, l, n = 0;
+	int err = EOK;
+
+	/* Sorted blocks array is in use by another write back */
+	while (cache->flushing)
+		condWait(cache->iocond, cache->lock, 0);
+
+	if (!cache->dirty)
+		return EOK;
+
+	/* Journalled metadata blocks are written back by the journal checkpoint, blocks in flight are written by their writers */
+	b = cache->busy;
+	do {
+		if (((b->flags & (BFLAG_DIRTY | BFLAG_IO)) == BFLAG_DIRTY) && (!cache->journal || (b->flags & BFLAG_DATA)))
+			cache->sorted[n++] = b;
+	} while ((b = b->next) != cache->busy);
+
+	for (i = 0; i < n; i++)
+		_ext2_cache_flags(cache, cache->sorted[i], cache->sorted[i]->flags | BFLAG_IO);
+
+	qsort(cache->sorted, n, sizeof(ext2_buff_t *), ext2_cache_cmp);
+	cache->flushing = 1;
+
+	/* Write back physically contiguous blocks in one device request */
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; (j < n) && (j - i < cache->runsz) && (cache->sorted[j]->bno == cache->sorted[j - 1]->bno + 1); j++);
+
+		/* Runs may mix file data and metadata blocks, account the data blocks separately */
+		for (k = i + 1, l = i; k <= j; k++) {
+			if ((k == j) || ((cache->sorted[k]->flags ^ cache->sorted[l]->flags) & BFLAG_DATA)) {
+				ext2_stats_io(fs, cache->sorted[l]->bno, k - l, cache->sorted[l]->flags & BFLAG_DATA, 1);
+				l = k;
+			}
+		}
+
+		for (k = i; (j - i > 1) && (k < j); k++)
+			memcpy(cache->wbuff + (k - i) * fs->blocksz, cache->sorted[k]->data, fs->blocksz);
+
+		/* Blocks in flight aren't modified, don't block cache users for the device write time */
+		b = cache->sorted[i];
+		mutexUnlock(cache->lock);
+		err = ext2_cache_devput(fs, b->bno, (j - i > 1) ? cache->wbuff : b->data, j - i);
+		mutexLock(cache->lock);
+
+		if (err < 0)
+			break;
+
+		for (k = i; k < j; k++) {
+			_ext2_cache_clean(cache, cache->sorted[k]);
+			_ext2_cache_flags(cache, cache->sorted[k], cache->sorted[k]->flags & ~BFLAG_IO);
+		}
+
+		cache->wbacks += j - i;
+		condBroadcast(cache->iocond);
+	}
+
+	/* Blocks which weren't written back stay dirty */
+	for (k = i; k < n; k++)
+		_ext2_cache_flags(cache, cache->sorted[k], cache->sorted[k]->flags & ~BFLAG_IO);
+
+	cache->flushing = 0;
+	condBroadcast(cache->iocond);
+
+	return err;
+}
+
+
+/* Allocates buffer over the cache limit, when the cache is full of the running transaction metadata (requires cache to be locked) */
+static ext2_buff_t *_ext2_cache_grow(ext2_t *fs)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_buff_t **sorted, *b;
+
+	/* Request journal commit */
+	condSignal(cache->cond);
+
+	/* New handles commit the running transaction first when it takes up half of the cache, handles in progress are bounded by the log size */
+	if (!cache->journal || (cache->count >= cache->max + fs->journal->tmax))
+		return NULL;
+
+	if (cache->count == cache->sortsz) {
+		if ((sorted = (ext2_buff_t **)realloc(cache->sorted, 2 * cache->sortsz * sizeof(ext2_buff_t *))) == NULL)
+			return NULL;
+
+		cache->sorted = sorted;
+		cache->sortsz *= 2;
+	}
+
+	if ((b = (ext2_buff_t *)malloc(sizeof(ext2_buff_t) + fs->blocksz)) == NULL)
+		return NULL;
+
+	cache->count++;
+
+	return b;
+}
+
+
+/* Returns buffer for a new cached block (requires cache to be locked, it's released while the cache is full of busy blocks) */
+static ext2_buff_t *_ext2_cache_alloc(ext2_t *fs)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_buff_t *b;
+
+	for (;;) {
+		if (cache->count < cache->max) {
+			if ((b = (ext2_buff_t *)malloc(sizeof(ext2_buff_t) + fs->blocksz)) != NULL) {
+				cache->count++;
+				return b;
+			}
+
+			if (cache->clean == NULL)
+				return NULL;
+		}
+
+		/* Reuse least recently used clean block */
+		if ((b = cache->clean) != NULL) {
+			_ext2_cache_remove(cache, b);
+			return b;
+		}
+
+		/* Memory pressure => write back dirty blocks (journalled metadata blocks stay in the cache until they're committed) */
+		if (cache->dirty > ((cache->journal) ? cache->mdirty : 0)) {
+			if (_ext2_cache_flush(fs) < 0)
+				return NULL;
+
+			if (cache->clean != NULL)
+				continue;
+		}
+
+		/* Committed and in flight blocks become clean without waiting for handles in progress */
+		if (cache->pinned) {
+			condWait(cache->iocond, cache->lock, 0);
+			continue;
+		}
+
+		return _ext2_cache_grow(fs);
+	}
+}
+
+
+/* Inserts in flight buffers for up to n consecutive blocks, which aren't cached, returns number of inserted blocks (requires cache to be locked) */
+static uint32_t _ext2_cache_reserve(ext2_t *fs, uint32_t bno, uint32_t n, ext2_buff_t **bufs)
+{
+	ext2_cache_t *cache = fs->cache;
+	uint32_t i, m;
+
+	for (m = 0; (m < n) && ((bufs[m] = _ext2_cache_alloc(fs)) != NULL); m++);
+
+	/* Blocks read while they're written directly to the device might be stale */
+	while (m && _ext2_cache_writing(cache, bno, m))
+		condWait(cache->iocond, cache->lock, 0);
+
+	/* Blocks might have been cached while the lock was released */
+	for (i = 0; (i < m) && (_ext2_cache_find(cache, bno + i) == NULL); i++)
+		_ext2_cache_insert(cache, bufs[i], bno + i, BFLAG_IO);
+
+	for (n = i; i < m; i++) {
+		free(bufs[i]);
+		cache->count--;
+	}
+
+	return n;
+}
+
+
+/* Completes device read of in flight blocks (requires cache to be locked, data = NULL => blocks were read in place, err < 0 => blocks are dropped) */
+static void _ext2_cache_fill(ext2_t *fs, ext2_buff_t **bufs, uint32_t n, const char *data, int err)
+{
+	ext2_cache_t *cache = fs->cache;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		if (err < 0) {
+			_ext2_cache_remove(cache, bufs[i]);
+			free(bufs[i]);
+			cache->count--;
+			continue;
+		}
+
+		if (data != NULL)
+			memcpy(bufs[i]->data, data + i * fs->blocksz, fs->blocksz);
+
+		_ext2_cache_flags(cache, bufs[i], bufs[i]->flags & ~BFLAG_IO);
+	}
+
+	if (n)
+		condBroadcast(cache->iocond);
+}
+
+
+int ext2_cache_read(ext2_t *fs, uint32_t bno, void *buff, uint32_t n, uint8_t data)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_buff_t *b, *bufs[CACHE_MAXRUN];
+	uint32_t i, j, k;
+	int err = EOK;
+
+	if (!cache->max)
+		return ext2_cache_devread(fs, bno, buff, n, data);
+
+	mutexLock(cache->lock);
+
+	for (i = 0; i < n; i = j) {
+		if ((b = _ext2_cache_lookup(cache, bno + i)) != NULL) {
+			memcpy((char *)buff + i * fs->blocksz, b->data, fs->blocksz);
+			_ext2_cache_touch(cache, b);
+			cache->hits++;
+			j = i + 1;
+			continue;
+		}
+
+		/* Read consecutive missing blocks in one device request */
+		for (j = i + 1; (j < n) && (_ext2_cache_find(cache, bno + j) == NULL); j++);
+		k = 0;
+
+		/* Large runs are read directly into the caller buffer only, caching them would only flush the cache */
+		if ((j - i == 1) || (j - i < cache->runsz)) {
+			/* Missing blocks are in flight until they're read, so concurrent lookups don't read them again */
+			if ((k = _ext2_cache_reserve(fs, bno + i, j - i, bufs)) > 0) {
+				j = i + k;
+			}
+			/* No memory => read blocks without caching them (they might have been cached in the meantime) */
+			else {
+				for (j = i; (j < n) && (_ext2_cache_find(cache, bno + j) == NULL); j++);
+
+				if (j == i)
+					continue;
+			}
+		}
+
+		mutexUnlock(cache->lock);
+		err = ext2_cache_devread(fs, bno + i, (char *)buff + i * fs->blocksz, j - i, data);
+		mutexLock(cache->lock);
+
+		_ext2_cache_fill(fs, bufs, k, (char *)buff + i * fs->blocksz, err);
+
+		if (err < 0)
+			break;
+
+		cache->misses += j - i;
+	}
+
+	mutexUnlock(cache->lock);
+
+	return err;
+}
+
+
+/* Returns cached block, reads the block if it isn't cached (requires cache to be locked, zero => new block is zero-filled instead of being read) */
+static int _ext2_cache_get(ext2_t *fs, uint32_t bno, uint8_t zero, uint8_t data, ext2_buff_t **res)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_buff_t *b;
+	int err = EOK;
+
+	while ((b = _ext2_cache_lookup(cache, bno)) == NULL) {
+		if (!_ext2_cache_reserve(fs, bno, 1, &b)) {
+			/* Block might have been cached in the meantime */
+			if (_ext2_cache_find(cache, bno) == NULL)
+				return -ENOMEM;
+
+			continue;
+		}
+
+		if (zero) {
+			memset(b->data, 0, fs->blocksz);
+		}
+		else {
+			mutexUnlock(cache->lock);
+			err = ext2_cache_devread(fs, bno, b->data, 1, data);
+			mutexLock(cache->lock);
+		}
+
+		_ext2_cache_fill(fs, &b, 1, NULL, err);
+
+		if (err < 0)
+			return err;
+
+		if (!zero)
+			cache->misses++;
+
+		*res = b;
+
+		return EOK;
+	}
+
+	_ext2_cache_touch(cache, b);
+	cache->hits++;
+
+	if (zero)
+		memset(b->data, 0, fs->blocksz);
+
+	*res = b;
+
+	return EOK;
+}
+
+
+/* Reads or writes part of a block directly from/to the device (write > 1 => the rest of the block is zero-filled, buff = NULL => the written part is zero-filled) */
+static int ext2_cache_devpart(ext2_t *fs, uint32_t bno, uint32_t offs, void *buff, uint32_t len, int write, uint8_t data)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_wrun_t wrun;
+	char *block;
+	int err = EOK;
+
+	if ((block = (char *)malloc(fs->blocksz)) == NULL)
+		return -ENOMEM;
+
+	/* Block read-modify-write would lose concurrent partial writes of the block, they're serialized */
+	if (write) {
+		mutexLock(cache->lock);
+
+		while (_ext2_cache_writing(cache, bno, 1))
+			condWait(cache->iocond, cache->lock, 0);
+
+		wrun.bno = bno;
+		wrun.n = 1;
+		LIST_ADD(&cache->wruns, &wrun);
+
+		mutexUnlock(cache->lock);
+	}
+
+	do {
+		if (write > 1)
+			memset(block, 0, fs->blocksz);
+		else if ((err = ext2_cache_devread(fs, bno, block, 1, data)) < 0)
+			break;
+
+		if (!write) {
+			memcpy(buff, block + offs, len);
+			break;
+		}
+
+		if (buff == NULL)
+			memset(block + offs, 0, len);
+		else
+			memcpy(block + offs, buff, len);
+
+		err = ext2_cache_devwrite(fs, bno, block, 1, data);
+	} while (0);
+
+	if (write) {
+		mutexLock(cache->lock);
+
+		LIST_REMOVE(&cache->wruns, &wrun);
+		condBroadcast(cache->iocond);
+
+		mutexUnlock(cache->lock);
+	}
+
+	free(block);
+
+	return err;
+}
+
+
+int ext2_cache_readpart(ext2_t *fs, uint32_t bno, uint32_t offs, void *buff, uint32_t len, uint8_t data)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_buff_t *b;
+	int err;
+
+	if (!cache->max)
+		return ext2_cache_devpart(fs, bno, offs, buff, len, 0, data);
+
+	mutexLock(cache->lock);
+
+	if ((err = _ext2_cache_get(fs, bno, 0, data, &b)) >= 0)
+		memcpy(buff, b->data + offs, len);
+
+	mutexUnlock(cache->lock);
+
+	return err;
+}
+
+
+/* Writes part of a block through the cache (zero => the rest of the block is zero-filled, buff = NULL => the part is zero-filled) */
+static int ext2_cache_part(ext2_t *fs, uint32_t bno, uint32_t offs, const void *buff, uint32_t len, uint8_t zero, uint8_t data)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_buff_t *b;
+	int err;
+
+	if (!cache->max)
+		return ext2_cache_devpart(fs, bno, offs, (void *)buff, len, 1 + zero, data);
+
+	mutexLock(cache->lock);
+
+	if ((err = _ext2_cache_get(fs, bno, zero, data, &b)) >= 0) {
+		if (buff == NULL)
+			memset(b->data + offs, 0, len);
+		else
+			memcpy(b->data + offs, buff, len);
+
+		_ext2_cache_dirty(cache, b, data);
+
+		if (cache->dirty > cache->max / 2)
+			condSignal(cache->cond);
+	}
+
+	mutexUnlock(cache->lock);
+
+	return err;
+}
+
+
+int ext2_cache_writepart(ext2_t *fs, uint32_t bno, uint32_t offs, const void *buff, uint32_t len, uint8_t data)
+{
+	return ext2_cache_part(fs, bno, offs, buff, len, 0, data);
+}
+
+
+int ext2_cache_writenew(ext2_t *fs, uint32_t bno, uint32_t offs, const void *buff, uint32_t len, uint8_t data)
+{
+	return ext2_cache_part(fs, bno, offs, buff, len, 1, data);
+}
+
+
+/* Writes blocks directly to the device and updates cached copies (requires cache to be locked, it's released for the device write) */
+static int _ext2_cache_writethrough(ext2_t *fs, uint32_t bno, const void *buff, uint32_t n, uint8_t data)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_wrun_t wrun;
+	ext2_buff_t *b;
+	uint32_t i;
+	int err;
+
+	/* Blocks aren't read into the cache until the write completes */
+	wrun.bno = bno;
+	wrun.n = n;
+	LIST_ADD(&cache->wruns, &wrun);
+
+	/* Cached copies are in flight until they're updated (blocks are marked in ascending order, concurrent writers don't deadlock) */
+	for (i = 0; i < n; i++) {
+		if ((b = _ext2_cache_lookup(cache, bno + i)) != NULL)
+			_ext2_cache_flags(cache, b, b->flags | BFLAG_IO);
+	}
+
+	mutexUnlock(cache->lock);
+	err = ext2_cache_devwrite(fs, bno, buff, n, data);
+	mutexLock(cache->lock);
+
+	for (i = 0; i < n; i++) {
+		if ((b = _ext2_cache_find(cache, bno + i)) == NULL)
+			continue;
+
+		if (err >= 0) {
+			memcpy(b->data, (const char *)buff + i * fs->blocksz, fs->blocksz);
+			_ext2_cache_clean(cache, b);
+		}
+
+		_ext2_cache_flags(cache, b, b->flags & ~BFLAG_IO);
+	}
+
+	LIST_REMOVE(&cache->wruns, &wrun);
+	condBroadcast(cache->iocond);
+
+	return err;
+}
+
+
+int ext2_cache_write(ext2_t *fs, uint32_t bno, const void *buff, uint32_t n, uint8_t data)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_buff_t *b;
+	uint32_t i;
+	int err = EOK;
+
+	if (!cache->max)
+		return ext2_cache_devwrite(fs, bno, buff, n, data);
+
+	mutexLock(cache->lock);
+
+	/* Large runs would only flush the cache => write them in one device request and update cached copies (journalled metadata is always cached) */
+	if ((n > 1) && (n >= cache->runsz) && (data || !cache->journal)) {
+		err = _ext2_cache_writethrough(fs, bno, buff, n, data);
+		mutexUnlock(cache->lock);
+
+		return err;
+	}
+
+	for (i = 0; i < n; i++) {
+		if ((err = _ext2_cache_get(fs, bno + i, 1, data, &b)) < 0) {
+			/* No memory => write through (journalled metadata can't be written before it's committed) */
+			if ((err != -ENOMEM) || (!data && cache->journal))
+				break;
+
+			if ((err = _ext2_cache_writethrough(fs, bno + i, (const char *)buff + i * fs->blocksz, 1, data)) < 0)
+				break;
+			continue;
+		}
+
+		memcpy(b->data, (const char *)buff + i * fs->blocksz, fs->blocksz);
+		_ext2_cache_dirty(cache, b, data);
+	}
+
+	/* Wake up flusher before the cache fills up with dirty blocks */
+	if (cache->dirty > cache->max / 2)
+		condSignal(cache->cond);
+
+	mutexUnlock(cache->lock);
+
+	return err;
+}
+
+
+int ext2_cache_sync(ext2_t *fs)
+{
+	int err;
+
+	mutexLock(fs->cache->lock);
+
+	err = _ext2_cache_flush(fs);
+
+	mutexUnlock(fs->cache->lock);
+
+	return err;
+}
+
+
+uint32_t ext2_cache_mdirty(ext2_t *fs)
+{
+	uint32_t ret;
+
+	mutexLock(fs->cache->lock);
+	ret = fs->cache->mdirty;
+	mutexUnlock(fs->cache->lock);
+
+	return ret;
+}
+
+
+int ext2_cache_freeze(ext2_t *fs, uint32_t **bnos, char **data)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_buff_t *b;
+	uint32_t i, n = 0;
+	int err = EOK;
+
+	*bnos = NULL;
+	*data = NULL;
+
+	mutexLock(cache->lock);
+
+	/* Sorted blocks array is in use by the write back */
+	while (cache->flushing)
+		condWait(cache->iocond, cache->lock, 0);
+
+	if ((b = cache->busy) != NULL) {
+		do {
+			if ((b->flags & (BFLAG_DIRTY | BFLAG_DATA)) == BFLAG_DIRTY)
+				cache->sorted[n++] = b;
+		} while ((b = b->next) != cache->busy);
+	}
+
+	if (n) {
+		qsort(cache->sorted, n, sizeof(ext2_buff_t *), ext2_cache_cmp);
+
+		if (((*bnos = (uint32_t *)malloc(n * sizeof(uint32_t))) == NULL) || ((*data = (char *)malloc(n * fs->blocksz)) == NULL)) {
+			free(*bnos);
+			*bnos = NULL;
+			err = -ENOMEM;
+		}
+		else {
+			/* Blocks modified after the copy is taken are committed with the next transaction */
+			for (i = 0; i < n; i++) {
+				b = cache->sorted[i];
+				(*bnos)[i] = b->bno;
+				memcpy(*data + i * fs->blocksz, b->data, fs->blocksz);
+				_ext2_cache_flags(cache, b, b->flags | BFLAG_COMMIT);
+				_ext2_cache_clean(cache, b);
+			}
+		}
+	}
+
+	mutexUnlock(cache->lock);
+
+	return (err < 0) ? err : (int)n;
+}
+
+
+void ext2_cache_thaw(ext2_t *fs, const uint32_t *bnos, uint32_t n, uint8_t dirty)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_buff_t *b;
+	uint32_t i;
+
+	mutexLock(cache->lock);
+
+	for (i = 0; i < n; i++) {
+		if ((b = _ext2_cache_find(cache, bnos[i])) == NULL)
+			continue;
+
+		if (dirty)
+			_ext2_cache_dirty(cache, b, b->flags & BFLAG_DATA);
+
+		_ext2_cache_flags(cache, b, b->flags & ~BFLAG_COMMIT);
+	}
+
+	/* Release blocks allocated over the limit while the cache was full of metadata waiting for commit */
+	while ((cache->count > cache->max) && ((b = cache->clean) != NULL)) {
+		_ext2_cache_remove(cache, b);
+		free(b);
+		cache->count--;
+	}
+
+	/* Wake up threads waiting for the committed blocks */
+	condBroadcast(cache->iocond);
+
+	mutexUnlock(cache->lock);
+}
+
+
+void ext2_cache_readahead(ext2_t *fs, uint32_t bno, uint32_t n)
+{
+	ext2_cache_t *cache = fs->cache;
+
+	/* Don't let readahead flush the whole cache */
+	if (n > cache->max / 4)
+		n = cache->max / 4;
+
+	if (!n)
+		return;
+
+	mutexLock(cache->lock);
+
+	/* Skip cached blocks at both ends of the range, don't queue cached ranges */
+	for (; n && (_ext2_cache_find(cache, bno) != NULL); bno++, n--);
+	for (; n && (_ext2_cache_find(cache, bno + n - 1) != NULL); n--);
+
+	/* Readahead is only a hint => drop the request if the queue is full */
+	if (n && (cache->state == FLUSHER_RUNNING) && (cache->ranum < CACHE_RAQUEUE)) {
+		cache->raq[(cache->rahead + cache->ranum) % CACHE_RAQUEUE].bno = bno;
+		cache->raq[(cache->rahead + cache->ranum) % CACHE_RAQUEUE].n = n;
+		cache->ranum++;
+		condSignal(cache->cond);
+	}
+
+	mutexUnlock(cache->lock);
+}
+
+
+/* Reads queued readahead blocks into the cache (requires cache to be locked) */
+static void _ext2_cache_prefetch(ext2_t *fs)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_buff_t *bufs[CACHE_MAXRUN];
+	uint32_t bno, n, i, j, k;
+	int err;
+
+	while (cache->ranum) {
+		bno = cache->raq[cache->rahead].bno;
+		n = cache->raq[cache->rahead].n;
+		cache->rahead = (cache->rahead + 1) % CACHE_RAQUEUE;
+		cache->ranum--;
+
+		for (i = 0; i < n; i = j) {
+			if (_ext2_cache_find(cache, bno + i) != NULL) {
+				j = i + 1;
+				continue;
+			}
+
+			for (j = i + 1; (j < n) && (j - i < cache->runsz) && (_ext2_cache_find(cache, bno + j) == NULL); j++);
+
+			/* Blocks are in flight until they're read, lookups wait for them instead of reading them again */
+			if ((k = _ext2_cache_reserve(fs, bno + i, j - i, bufs)) == 0) {
+				if (_ext2_cache_find(cache, bno + i) == NULL)
+					break;
+
+				j = i + 1;
+				continue;
+			}
+
+			/* Don't block cache users for the device read time */
+			j = i + k;
+			mutexUnlock(cache->lock);
+			err = ext2_cache_devread(fs, bno + i, cache->rbuff, k, 1);
+			mutexLock(cache->lock);
+
+			_ext2_cache_fill(fs, bufs, k, cache->rbuff, err);
+
+			if (err < 0)
+				break;
+
+			cache->rablocks += k;
+		}
+	}
+}
+
+
+/* Commits filesystem metadata and writes back dirty blocks periodically, serves readahead requests */
+static void ext2_cache_flusher(void *arg)
+{
+	ext2_t *fs = (ext2_t *)arg;
+	ext2_cache_t *cache = fs->cache;
+	time_t commit = time(NULL);
+
+	mutexLock(cache->lock);
+
+	while (cache->state == FLUSHER_RUNNING) {
+		if (!cache->ranum)
+			condWait(cache->cond, cache->lock, CACHE_INTERVAL);
+
+		if (cache->state != FLUSHER_RUNNING)
+			break;
+
+		if (cache->ranum) {
+			_ext2_cache_prefetch(fs);
+
+			/* Commit only if it's due or the cache fills up with dirty blocks */
+			if ((time(NULL) - commit < CACHE_INTERVAL / 1000000) && (cache->dirty <= cache->max / 2))
+				continue;
+		}
+
+		/* Objects and metadata are written back through the cache */
+		mutexUnlock(cache->lock);
+		ext2_journal_start(fs);
+		ext2_objs_writeback(fs);
+		ext2_journal_stop(fs);
+		ext2_commit(fs);
+		mutexLock(cache->lock);
+
+		_ext2_cache_flush(fs);
+		commit = time(NULL);
+	}
+
+	cache->state = FLUSHER_STOPPED;
+	condBroadcast(cache->cond);
+
+	mutexUnlock(cache->lock);
+	endthread();
+}
+
+
+void ext2_cache_wakeup(ext2_t *fs)
+{
+	condSignal(fs->cache->cond);
+}
+
+
+int ext2_cache_start(ext2_t *fs)
+{
+	ext2_cache_t *cache = fs->cache;
+	int err;
+
+	cache->state = FLUSHER_RUNNING;
+
+	if ((err = beginthread(ext2_cache_flusher, 4, cache->stack, sizeof(cache->stack), fs)) < 0) {
+		cache->state = FLUSHER_STOPPED;
+		return err;
+	}
+
+	return EOK;
+}
+
+
+void ext2_cache_stop(ext2_t *fs)
+{
+	ext2_cache_t *cache = fs->cache;
+
+	mutexLock(cache->lock);
+
+	if (cache->state == FLUSHER_RUNNING) {
+		cache->state = FLUSHER_STOPPING;
+		condBroadcast(cache->cond);
+
+		while (cache->state != FLUSHER_STOPPED)
+			condWait(cache->cond, cache->lock, 0);
+	}
+
+	mutexUnlock(cache->lock);
+}
+
+
+int ext2_cache_destroy(ext2_t *fs)
+{
+	ext2_cache_t *cache = fs->cache;
+	ext2_buff_t *b;
+	int err;
+
+	ext2_cache_stop(fs);
+
+	mutexLock(cache->lock);
+
+	err = _ext2_cache_flush(fs);
+
+	while ((b = cache->clean) != NULL) {
+		LIST_REMOVE(&cache->clean, b);
+		free(b);
+	}
+
+	while ((b = cache->busy) != NULL) {
+		LIST_REMOVE(&cache->busy, b);
+		free(b);
+	}
+
+	mutexUnlock(cache->lock);
+
+	resourceDestroy(cache->iocond);
+	resourceDestroy(cache->cond);
+	resourceDestroy(cache->lock);
+	free(cache->hash);
+	free(cache->sorted);
+	free(cache->wbuff);
+	free(cache->rbuff);
+	free(cache);
+
+	return err;
+}
+
+
+int ext2_cache_init(ext2_t *fs, size_t size)
+{
+	ext2_cache_t *cache;
+	int err = -ENOMEM;
+
+	if ((cache = (ext2_cache_t *)malloc(sizeof(ext2_cache_t))) == NULL)
+		return -ENOMEM;
+
+	memset(cache, 0, sizeof(ext2_cache_t));
+
+	do {
+		if (size) {
+			/* Write back and readahead buffers take up to 1/8 of the cache size each */
+			for (cache->runsz = CACHE_MAXRUN; (cache->runsz > 1) && (cache->runsz * fs->blocksz > size / 8); cache->runsz >>= 1);
+
+			if ((size_t)2 * cache->runsz * fs->blocksz < size)
+				cache->max = (size - 2 * cache->runsz * fs->blocksz) / (sizeof(ext2_buff_t) + fs->blocksz);
+
+			if (cache->max < CACHE_MINBLOCKS)
+				cache->max = CACHE_MINBLOCKS;
+
+			for (cache->hashsz = 1; cache->hashsz < cache->max / 2; cache->hashsz <<= 1);
+
+			if ((cache->hash = (ext2_buff_t **)calloc(cache->hashsz, sizeof(ext2_buff_t *))) == NULL)
+				break;
+
+			if ((cache->sorted = (ext2_buff_t **)malloc(cache->max * sizeof(ext2_buff_t *))) == NULL)
+				break;
+			cache->sortsz = cache->max;
+
+			if ((cache->runsz > 1) && ((cache->wbuff = (char *)malloc(cache->runsz * fs->blocksz)) == NULL))
+				break;
+
+			if ((cache->rbuff = (char *)malloc(cache->runsz * fs->blocksz)) == NULL)
+				break;
+		}
+
+		if ((err = mutexCreate(&cache->lock)) < 0)
+			break;
+
+		if ((err = condCreate(&cache->cond)) < 0) {
+			resourceDestroy(cache->lock);
+			break;
+		}
+
+		if ((err = condCreate(&cache->iocond)) < 0) {
+			resourceDestroy(cache->cond);
+			resourceDestroy(cache->lock);
+			break;
+		}
+
+		cache->state = FLUSHER_STOPPED;
+		fs->cache = cache;
+
+		return EOK;
+	} while (0);
+
+	free(cache->hash);
+	free(cache->sorted);
+	free(cache->wbuff);
+	free(cache->rbuff);
+	free(cache);
+
+	return err;
+}
@@ -0,0 +1,173 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Block cache
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "ext2.h"
+
+
+/* Cache configuration */
+#define CACHE_SIZE      (256 * 1024) /* Default cache size in bytes */
+#define CACHE_MINBLOCKS 16           /* Min number of cached blocks */
+#define CACHE_MAXRUN    32           /* Max number of blocks written back in one device request */
+#define CACHE_INTERVAL  5000000      /* Metadata commit and dirty blocks write back interval in microseconds */
+#define CACHE_STACKSZ   4096         /* Flusher thread stack size */
+#define CACHE_RAQUEUE   8            /* Max number of queued readahead requests */
+
+
+/* Cached block flags */
+enum {
+	BFLAG_DIRTY  = 0x01, /* Block needs to be written back */
+	BFLAG_DATA   = 0x02, /* Block holds regular file data (it isn't journalled) */
+	BFLAG_COMMIT = 0x04, /* Block is being committed to the journal (it isn't evicted until it's checkpointed) */
+	BFLAG_IO     = 0x08  /* Block is being read from or written to the device (lookups wait until it's done) */
+};
+
+
+typedef struct _ext2_buff_t ext2_buff_t;
+
+
+typedef struct _ext2_wrun_t ext2_wrun_t;
+
+
+struct _ext2_buff_t {
+	uint32_t bno;               /* Block number */
+	uint8_t flags;              /* Block flags */
+	ext2_buff_t *hprev, *hnext; /* Hash bucket list */
+	ext2_buff_t *prev, *next;   /* Clean or busy blocks list */
+	char data[];                /* Block data */
+};
+
+
+/* Run of blocks being written directly to the device */
+struct _ext2_wrun_t {
+	uint32_t bno;               /* First block number */
+	uint32_t n;                 /* Number of blocks */
+	ext2_wrun_t *prev, *next;   /* Runs list */
+};
+
+
+struct _ext2_cache_t {
+	ext2_buff_t **hash;         /* Hash table */
+	uint32_t hashsz;            /* Hash table size (power of 2) */
+	ext2_buff_t *clean;         /* Least Recently Used clean blocks list (blocks are evicted from its head) */
+	ext2_buff_t *busy;          /* Dirty, committed and in flight blocks list (they aren't evicted) */
+	uint32_t count;             /* Number of cached blocks */
+	uint32_t max;               /* Max number of cached blocks (0 => cache disabled) */
+	uint32_t dirty;             /* Number of dirty blocks */
+	uint32_t pinned;            /* Number of committed and in flight blocks (they become clean without a new commit) */
+	uint32_t mdirty;            /* Number of dirty metadata blocks (running journal transaction size) */
+	uint8_t journal;            /* Dirty metadata blocks are written back only through the journal */
+
+	/* Write back */
+	ext2_buff_t **sorted;       /* Dirty blocks sorted by block number */
+	uint32_t sortsz;            /* Sorted blocks array size */
+	char *wbuff;                /* Contiguous blocks write back buffer */
+	uint32_t runsz;             /* Write back buffer size in blocks */
+	uint8_t flushing;           /* Dirty blocks are being written back (sorted blocks array is in use) */
+	ext2_wrun_t *wruns;         /* Blocks written directly to the device (they aren't read into the cache or partially written until it's done) */
+
+	/* Readahead */
+	struct {
+		uint32_t bno;           /* First block number */
+		uint32_t n;             /* Number of blocks */
+	} raq[CACHE_RAQUEUE];       /* Queued readahead requests */
+	uint32_t rahead;            /* First queued request */
+	uint32_t ranum;             /* Number of queued requests */
+	char *rbuff;                /* Readahead buffer */
+
+	/* Statistics */
+	uint64_t hits;              /* Number of cache hits */
+	uint64_t misses;            /* Number of cache misses */
+	uint64_t wbacks;            /* Number of written back blocks */
+	uint64_t rablocks;          /* Number of blocks read ahead */
+
+	/* Flusher thread */
+	uint8_t state;              /* Flusher thread state */
+	char stack[CACHE_STACKSZ] __attribute__ ((aligned(8)));
+
+	/* Synchronization */
+	handle_t lock;              /* Access mutex */
+	handle_t cond;              /* Flusher thread condition */
+	handle_t iocond;            /* Blocks device I/O completion condition */
+};
+
+
+/* Reads blocks through the cache (data != 0 => regular file data) */
+extern int ext2_cache_read(ext2_t *fs, uint32_t bno, void *buff, uint32_t n, uint8_t data);
+
+
+/* Writes blocks through the cache (data != 0 => regular file data) */
+extern int ext2_cache_write(ext2_t *fs, uint32_t bno, const void *buff, uint32_t n, uint8_t data);
+
+
+/* Reads part of a block through the cache (data != 0 => regular file data) */
+extern int ext2_cache_readpart(ext2_t *fs, uint32_t bno, uint32_t offs, void *buff, uint32_t len, uint8_t data);
+
+
+/* Writes part of a block through the cache (updates cached block in place, buff = NULL => the part is zero-filled) */
+extern int ext2_cache_writepart(ext2_t *fs, uint32_t bno, uint32_t offs, const void *buff, uint32_t len, uint8_t data);
+
+
+/* Writes part of a newly allocated block through the cache (the rest of the block is zero-filled, the block isn't read) */
+extern int ext2_cache_writenew(ext2_t *fs, uint32_t bno, uint32_t offs, const void *buff, uint32_t len, uint8_t data);
+
+
+/* Writes back dirty blocks (only file data blocks if metadata is journalled) */
+extern int ext2_cache_sync(ext2_t *fs);
+
+
+/* Returns number of dirty metadata blocks */
+extern uint32_t ext2_cache_mdirty(ext2_t *fs);
+
+
+/* Copies dirty metadata blocks sorted by block number for the journal commit, marks them clean and keeps them cached until ext2_cache_thaw(), returns number of blocks */
+extern int ext2_cache_freeze(ext2_t *fs, uint32_t **bnos, char **data);
+
+
+/* Releases blocks frozen for the journal commit (dirty != 0 => the commit failed, blocks are marked dirty again) */
+extern void ext2_cache_thaw(ext2_t *fs, const uint32_t *bnos, uint32_t n, uint8_t dirty);
+
+
+/* Queues blocks to be read into the cache in the background by the flusher thread */
+extern void ext2_cache_readahead(ext2_t *fs, uint32_t bno, uint32_t n);
+
+
+/* Wakes up flusher thread */
+extern void ext2_cache_wakeup(ext2_t *fs);
+
+
+/* Starts flusher thread (commits metadata, writes back dirty blocks periodically and serves readahead) */
+extern int ext2_cache_start(ext2_t *fs);
+
+
+/* Stops flusher thread */
+extern void ext2_cache_stop(ext2_t *fs);
+
+
+/* Destroys cache (returns write back error) */
+extern int ext2_cache_destroy(ext2_t *fs);
+
+
+/* Initializes cache (size given in bytes, 0 disables caching) */
+extern int ext2_cache_init(ext2_t *fs, size_t size);
+
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Directory entry cache
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/list.h>
+#include <sys/threads.h>
+
+#include "dcache.h"
+
+
+static uint32_t ext2_dcache_hash(uint32_t dir, const char *name, uint8_t len)
+{
+	uint32_t hash = dir;
+	uint8_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash << 5) + hash + (uint8_t)name[i];
+
+	return hash;
+}
+
+
+/* Finds cached entry (requires cache to be locked) */
+static ext2_dentry_t *_ext2_dcache_find(ext2_dcache_t *dcache, uint32_t hash, uint32_t dir, const char *name, uint8_t len)
+{
+	ext2_dentry_t *head = dcache->hash[hash & (DCACHE_HASHSZ - 1)], *d;
+
+	if ((d = head) != NULL) {
+		do {
+			if ((d->hash == hash) && (d->dir == dir) && (d->len == len) && !memcmp(d->name, name, len))
+				return d;
+		} while ((d = d->hnext) != head);
+	}
+
+	return NULL;
+}
+
+
+/* Removes entry from the cache (requires cache to be locked) */
+static void _ext2_dcache_remove(ext2_dcache_t *dcache, ext2_dentry_t *d)
+{
+	LIST_REMOVE_EX(&dcache->hash[d->hash & (DCACHE_HASHSZ - 1)], d, hnext, hprev);
+	LIST_REMOVE(&dcache->lru, d);
+	dcache->count--;
+	free(d);
+}
+
+
+int ext2_dcache_find(ext2_t *fs, uint32_t dir, const char *name, uint8_t len, uint32_t *ino)
+{
+	ext2_dcache_t *dcache = fs->dcache;
+	uint32_t hash = ext2_dcache_hash(dir, name, len);
+	ext2_dentry_t *d;
+
+	mutexLock(dcache->lock);
+
+	if ((d = _ext2_dcache_find(dcache, hash, dir, name, len)) == NULL) {
+		dcache->misses++;
+		mutexUnlock(dcache->lock);
+		return 0;
+	}
+
+	LIST_REMOVE(&dcache->lru, d);
+	LIST_ADD(&dcache->lru, d);
+	dcache->hits++;
+	*ino = d->ino;
+
+	mutexUnlock(dcache->lock);
+
+	return 1;
+}
+
+
+void ext2_dcache_add(ext2_t *fs, uint32_t dir, const char *name, uint8_t len, uint32_t ino)
+{
+	ext2_dcache_t *dcache = fs->dcache;
+	uint32_t hash = ext2_dcache_hash(dir, name, len);
+	ext2_dentry_t *d;
+
+	mutexLock(dcache->lock);
+
+	if ((d = _ext2_dcache_find(dcache, hash, dir, name, len)) != NULL) {
+		d->ino = ino;
+		LIST_REMOVE(&dcache->lru, d);
+		LIST_ADD(&dcache->lru, d);
+		mutexUnlock(dcache->lock);
+		return;
+	}
+
+	/* Evict least recently used entry */
+	if (dcache->count >= DCACHE_SIZE)
+		_ext2_dcache_remove(dcache, dcache->lru);
+
+	/* Caching is best effort, ignore allocation failures */
+	if ((d = (ext2_dentry_t *)malloc(sizeof(ext2_dentry_t) + len)) != NULL) {
+		d->dir = dir;
+		d->ino = ino;
+		d->hash = hash;
+		d->len = len;
+		memcpy(d->name, name, len);
+		LIST_ADD_EX(&dcache->hash[hash & (DCACHE_HASHSZ - 1)], d, hnext, hprev);
+		LIST_ADD(&dcache->lru, d);
+		dcache->count++;
+	}
+
+	mutexUnlock(dcache->lock);
+}
+
+
+void ext2_dcache_remove(ext2_t *fs, uint32_t dir, const char *name, uint8_t len)
+{
+	ext2_dcache_t *dcache = fs->dcache;
+	ext2_dentry_t *d;
+
+	mutexLock(dcache->lock);
+
+	if ((d = _ext2_dcache_find(dcache, ext2_dcache_hash(dir, name, len), dir, name, len)) != NULL)
+		_ext2_dcache_remove(dcache, d);
+
+	mutexUnlock(dcache->lock);
+}
+
+
+void ext2_dcache_purge(ext2_t *fs, uint32_t dir)
+{
+	ext2_dcache_t *dcache = fs->dcache;
+	ext2_dentry_t *d, *next;
+	uint32_t i, n;
+
+	mutexLock(dcache->lock);
+
+	for (i = 0, n = dcache->count, d = dcache->lru; i < n; i++, d = next) {
+		next = d->next;
+
+		if (d->dir == dir)
+			_ext2_dcache_remove(dcache, d);
+	}
+
+	mutexUnlock(dcache->lock);
+}
+
+
+void ext2_dcache_destroy(ext2_t *fs)
+{
+	ext2_dcache_t *dcache = fs->dcache;
+
+	while (dcache->lru != NULL)
+		_ext2_dcache_remove(dcache, dcache->lru);
+
+	resourceDestroy(dcache->lock);
+	free(dcache);
+}
+
+
+int ext2_dcache_init(ext2_t *fs)
+{
+	ext2_dcache_t *dcache;
+	int err;
+
+	if ((dcache = (ext2_dcache_t *)malloc(sizeof(ext2_dcache_t))) == NULL)
+		return -ENOMEM;
+
+	memset(dcache, 0, sizeof(ext2_dcache_t));
+
+	if ((err = mutexCreate(&dcache->lock)) < 0) {
+		free(dcache);
+		return err;
+	}
+
+	fs->dcache = dcache;
+
+	return EOK;
+}
@@ -0,0 +1,82 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Directory entry cache
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "ext2.h"
+
+
+/* Directory entry cache configuration */
+#define DCACHE_SIZE   1024 /* Max number of cached entries */
+#define DCACHE_HASHSZ 256  /* Hash table size (power of 2) */
+
+
+typedef struct _ext2_dentry_t ext2_dentry_t;
+
+
+struct _ext2_dentry_t {
+	uint32_t dir;                 /* Parent directory inode number */
+	uint32_t ino;                 /* Entry inode number (0 => negative entry, name doesn't exist) */
+	uint32_t hash;                /* Entry hash */
+	uint8_t len;                  /* Entry name length */
+	ext2_dentry_t *hprev, *hnext; /* Hash bucket list */
+	ext2_dentry_t *prev, *next;   /* LRU list */
+	char name[];                  /* Entry name */
+};
+
+
+struct _ext2_dcache_t {
+	ext2_dentry_t *hash[DCACHE_HASHSZ]; /* Hash table */
+	ext2_dentry_t *lru;                 /* Least Recently Used entries list */
+	uint32_t count;                     /* Number of cached entries */
+
+	/* Statistics */
+	uint64_t hits;                      /* Number of cache hits */
+	uint64_t misses;                    /* Number of cache misses */
+
+	/* Synchronization */
+	handle_t lock;                      /* Access mutex */
+};
+
+
+/* Finds cached entry, returns 1 and entry inode number (0 for negative entries) if the entry is cached */
+extern int ext2_dcache_find(ext2_t *fs, uint32_t dir, const char *name, uint8_t len, uint32_t *ino);
+
+
+/* Adds or updates cached entry (ino = 0 adds negative entry) */
+extern void ext2_dcache_add(ext2_t *fs, uint32_t dir, const char *name, uint8_t len, uint32_t ino);
+
+
+/* Removes cached entry */
+extern void ext2_dcache_remove(ext2_t *fs, uint32_t dir, const char *name, uint8_t len);
+
+
+/* Removes all cached entries of a directory */
+extern void ext2_dcache_purge(ext2_t *fs, uint32_t dir);
+
+
+/* Destroys directory entry cache */
+extern void ext2_dcache_destroy(ext2_t *fs);
+
+
+/* Initializes directory entry cache */
+extern int ext2_dcache_init(ext2_t *fs);
+
+
+#endif
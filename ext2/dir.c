@@ -14,6 +14,7 @@
  */
 
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -21,50 +22,108 @@
 #include <sys/stat.h>
 
 #include "block.h"
+#include "dcache.h"
 #include "dir.h"
 #include "file.h"
+#include "htree.h"
+#include "inode.h"
+
+
+uint8_t ext2_dir_type(uint16_t mode)
+{
+	if (S_ISDIR(mode))
+		return DIRENT_DIR;
+	else if (S_ISCHR(mode))
+		return DIRENT_CHRDEV;
+	else if (S_ISBLK(mode))
+		return DIRENT_BLKDEV;
+	else if (S_ISREG(mode))
+		return DIRENT_FILE;
+
+	return DIRENT_UNKNOWN;
+}
+
+
+int ext2_dir_insert(ext2_t *fs, char *buff, const char *name, uint8_t len, uint16_t mode, uint32_t ino)
+{
+	ext2_dirent_t *entry, *nentry;
+	uint32_t offs, used;
+
+	for (offs = 0; offs < fs->blocksz; offs += entry->size) {
+		entry = (ext2_dirent_t *)(buff + offs);
+
+		if (!entry->size)
+			return -EINVAL;
+
+		used = (entry->ino) ? DIRENT_SIZE(entry->len) : 0;
+
+		if (entry->size >= used + DIRENT_SIZE(len)) {
+			if (used) {
+				nentry = (ext2_dirent_t *)(buff + offs + used);
+				nentry->size = entry->size - used;
+				entry->size = used;
+				entry = nentry;
+			}
+
+			entry->ino = ino;
+			entry->len = len;
+			entry->type = ext2_dir_type(mode);
+			memcpy(entry->name, name, len);
+
+			return EOK;
+		}
+	}
+
+	return -ENOSPC;
+}
+
+
+/* Checks if directory uses hashed index */
+static inline int ext2_dir_indexed(ext2_t *fs, ext2_obj_t *dir)
+{
+	return (fs->sb->featureCompat & COMPAT_DIR_INDEX) && (dir->inode->flags & IFLAG_INDEX);
+}
 
 
 int _ext2_dir_empty(ext2_t *fs, ext2_obj_t *dir)
 {
 	ext2_dirent_t *entry;
-	uint32_t offs = 0;
+	uint32_t boffs, offs;
 	ssize_t ret;
 	char *buff;
 
-	if (!dir->inode->size)
-		return EOK;
-
-	if (dir->inode->size > fs->blocksz)
-		return -EBUSY;
-
 	if ((buff = (char *)malloc(fs->blocksz)) == NULL)
 		return -ENOMEM;
 
-	if ((ret = _ext2_file_read(fs, dir, offs, buff, fs->blocksz)) != fs->blocksz) {
-		free(buff);
-		return (ret < 0) ? (int)ret : -EINVAL;
-	}
+	for (boffs = 0; boffs < dir->inode->size; boffs += fs->blocksz) {
+		if ((ret = _ext2_file_read(fs, dir, boffs, buff, fs->blocksz)) != fs->blocksz) {
+			free(buff);
+			return (ret < 0) ? (int)ret : -EINVAL;
+		}
 
-	entry = (ext2_dirent_t *)buff;
+		for (offs = 0; offs < fs->blocksz; offs += entry->size) {
+			entry = (ext2_dirent_t *)(buff + offs);
 
-	if ((entry->len != 1) || strncmp(entry->name, ".", 1)) {
-		free(buff);
-		return -EINVAL;
-	}
+			if (!entry->size)
+				break;
 
-	offs += entry->size;
-	entry = (ext2_dirent_t *)(buff + offs);
+			if (!entry->ino)
+				continue;
 
-	if ((entry->len != 2) || strncmp(entry->name, "..", 2)) {
-		free(buff);
-		return -EINVAL;
+			if ((entry->len == 1) && !strncmp(entry->name, ".", 1))
+				continue;
+
+			if ((entry->len == 2) && !strncmp(entry->name, "..", 2))
+				continue;
+
+			free(buff);
+			return 0;
+		}
 	}
 
-	offs += entry->size;
 	free(buff);
 
-	return (offs == fs->blocksz);
+	return 1;
 }
 
 
@@ -74,6 +133,13 @@ static int _ext2_dir_find(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t
 	uint32_t boffs;
 	ssize_t ret;
 
+	/* "." and ".." entries aren't indexed */
+	if (ext2_dir_indexed(fs, dir) && !(*offs) && ((len > 2) || (name[0] != '.') || ((len == 2) && (name[1] != '.')))) {
+		/* Fall back to linear search if the index isn't supported */
+		if ((ret = _ext2_htree_find(fs, dir, name, len, buff, offs)) != -EINVAL)
+			return ret;
+	}
+
 	for (boffs = *offs; boffs < dir->inode->size; boffs += fs->blocksz) {
 		if ((ret = _ext2_file_read(fs, dir, boffs, buff, fs->blocksz)) != fs->blocksz)
 			return (ret < 0) ? (int)ret : -EINVAL;
@@ -84,7 +150,7 @@ static int _ext2_dir_find(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t
 			if (!entry->size)
 				break;
 
-			if ((entry->len == len) && !strncmp(entry->name, name, len))
+			if (entry->ino && (entry->len == len) && !strncmp(entry->name, name, len))
 				return boffs;
 		}
 	}
@@ -95,18 +161,30 @@ static int _ext2_dir_find(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t
 
 int _ext2_dir_search(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t len, id_t *res)
 {
-	uint32_t offs = 0;
+	uint32_t ino, offs = 0;
 	char *buff;
 	int err;
 
+	if (ext2_dcache_find(fs, (uint32_t)dir->id, name, len, &ino)) {
+		if (!ino)
+			return -ENOENT;
+
+		*res = ino;
+		return EOK;
+	}
+
 	if ((buff = (char *)malloc(fs->blocksz)) == NULL)
 		return -ENOMEM;
 
 	do {
-		if ((err = _ext2_dir_find(fs, dir, name, len, buff, &offs)) < 0)
+		if ((err = _ext2_dir_find(fs, dir, name, len, buff, &offs)) < 0) {
+			if (err == -ENOENT)
+				ext2_dcache_add(fs, (uint32_t)dir->id, name, len, 0);
 			break;
+		}
 
-		*res = ((ext2_dirent_t *)(buff + offs))->ino;
+		*res = ino = ((ext2_dirent_t *)(buff + offs))->ino;
+		ext2_dcache_add(fs, (uint32_t)dir->id, name, len, ino);
 	} while (0);
 
 	free(buff);
@@ -115,138 +193,332 @@ int _ext2_dir_search(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t len,
 }
 
 
+/* Returns directory entry at offs if it's valid */
+static inline ext2_dirent_t *ext2_dir_entry(ext2_t *fs, const char *buff, uint32_t offs)
+{
+	ext2_dirent_t *entry = (ext2_dirent_t *)(buff + offs);
+
+	if ((offs + sizeof(ext2_dirent_t) > fs->blocksz) || (entry->size < sizeof(ext2_dirent_t)) ||
+		(offs + entry->size > fs->blocksz) || (entry->len > entry->size - sizeof(ext2_dirent_t)))
+		return NULL;
+
+	return entry;
+}
+
+
+/* Collects inodes of directory block entries for readahead, each block is scanned once per listing (requires object to be locked) */
+static uint32_t _ext2_dir_statahead(ext2_t *fs, ext2_obj_t *dir, const char *buff, uint32_t start, uint32_t *inos, uint32_t n)
+{
+	ext2_dirent_t *entry;
+	uint32_t offs;
+
+	if (start + fs->blocksz <= dir->sa)
+		return n;
+
+	offs = (dir->sa > start) ? dir->sa - start : 0;
+	dir->sa = start + fs->blocksz;
+
+	for (; (entry = ext2_dir_entry(fs, buff, offs)) != NULL; offs += entry->size) {
+		/* Skip unused entries, "." and ".." */
+		if (!entry->ino || ((entry->len <= 2) && !strncmp(entry->name, "..", entry->len)))
+			continue;
+
+		inos[n++] = entry->ino;
+
+		if (n == STATAHEAD_MAX) {
+			ext2_inode_readahead(fs, inos, n);
+			n = 0;
+		}
+	}
+
+	return n;
+}
+
+
 int _ext2_dir_read(ext2_t *fs, ext2_obj_t *dir, offs_t offs, struct dirent *res, size_t len)
 {
+	uint32_t inos[STATAHEAD_MAX], n = 0;
+	struct dirent *d = res;
 	ext2_dirent_t *entry;
+	uint32_t skip = 0;
+	size_t used = 0, end;
+	offs_t start = -1;
 	ssize_t ret;
+	char *buff;
+	int err = -ENOENT;
 
 	if (!dir->inode->size || !dir->inode->links)
 		return -ENOENT;
 
-	if (len < sizeof(ext2_dirent_t))
+	/* Fits at least an entry with a single character name */
+	if (len < sizeof(struct dirent) + 2)
 		return -EINVAL;
 
-	if ((entry = (ext2_dirent_t *)malloc(len)) == NULL)
+	if ((buff = malloc(fs->blocksz)) == NULL)
 		return -ENOMEM;
 
-	if ((ret = _ext2_file_read(fs, dir, offs, (char *)entry, len)) != len) {
-		free(entry);
-		return (ret < 0) ? (int)ret : -ENOENT;
-	}
+	/* New listing => read ahead inodes from the first block again */
+	if (!offs)
+		dir->sa = 0;
 
-	if (!entry->len) {
-		free(entry);
-		return -ENOENT;
+	/* Pack entries from each directory block read into the buffer */
+	while (offs + sizeof(ext2_dirent_t) <= dir->inode->size) {
+		if ((start < 0) || (offs - start >= fs->blocksz)) {
+			start = offs - offs % fs->blocksz;
+			if ((ret = _ext2_file_read(fs, dir, start, buff, fs->blocksz)) <= 0) {
+				err = (ret < 0) ? (int)ret : -ENOENT;
+				break;
+			}
+
+			/* Listed entries are likely to be stat'ed next => prefetch inodes of the whole block */
+			n = _ext2_dir_statahead(fs, dir, buff, start, inos, n);
+		}
+
+		/* Stop at corrupted entries, entries never cross directory blocks */
+		if ((entry = ext2_dir_entry(fs, buff, offs - start)) == NULL)
+			break;
+
+		/* Record length has to fit d_reclen, return unused entries span as an unnamed record if nothing is packed yet */
+		if (skip + entry->size > USHRT_MAX) {
+			if (!used) {
+				d->d_ino = 0;
+				d->d_type = dtUnknown;
+				d->d_reclen = skip;
+				d->d_namlen = 0;
+				d->d_name[0] = '\0';
+				used = sizeof(struct dirent) + 1;
+			}
+			break;
+		}
+
+		/* Skip unused entries (removed entries and directory index nodes) */
+		if (!entry->ino) {
+			skip += entry->size;
+			offs += entry->size;
+			continue;
+		}
+
+		if (!entry->len)
+			break;
+
+		/* Entries are packed at DIRENT_ALIGN aligned offsets */
+		end = used + sizeof(struct dirent) + entry->len + 1;
+		if (end > len) {
+			if (!used)
+				err = -EINVAL;
+			break;
+		}
+		d = (struct dirent *)((char *)res + used);
+
+		switch (entry->type) {
+		case DIRENT_DIR:
+			d->d_type = dtDir;
+			break;
+
+		case DIRENT_CHRDEV:
+		case DIRENT_BLKDEV:
+			d->d_type = dtDev;
+			break;
+
+		default:
+			d->d_type = dtFile;
+		}
+
+		d->d_ino = entry->ino;
+		d->d_reclen = skip + entry->size;
+		d->d_namlen = entry->len;
+		memcpy(d->d_name, entry->name, entry->len);
+		d->d_name[entry->len] = '\0';
+
+		if ((dir->flags & OFLAG_MOUNTPOINT) && (entry->len == 2) && !strncmp(d->d_name, "..", 2))
+			d->d_ino = (ino_t)dir->mnt.id;
+
+		used = (end + DIRENT_ALIGN - 1) & ~(DIRENT_ALIGN - 1);
+		offs += entry->size;
+		skip = 0;
 	}
 
-	if (len <= entry->len + sizeof(struct dirent)) {
-		free(entry);
-		return -EINVAL;
+	free(buff);
+	ext2_inode_readahead(fs, inos, n);
+
+	if (!used)
+		return err;
+
+	dir->inode->atime = time(NULL);
+
+	return (used < len) ? used : len;
+}
+
+
+/* Returns largest free space for a new entry in a directory block */
+static uint16_t ext2_dir_gap(ext2_t *fs, const char *buff)
+{
+	const ext2_dirent_t *entry;
+	uint32_t offs, used, gap = 0;
+
+	for (offs = 0; offs + sizeof(ext2_dirent_t) <= fs->blocksz; offs += entry->size) {
+		entry = (const ext2_dirent_t *)(buff + offs);
+
+		if (!entry->size)
+			break;
+
+		used = (entry->ino) ? DIRENT_SIZE(entry->len) : 0;
+
+		if ((entry->size > used) && (entry->size - used > gap))
+			gap = entry->size - used;
 	}
 
-	switch (entry->type) {
-	case DIRENT_DIR:
-		res->d_type = dtDir;
-		break;
+	return gap;
+}
+
+
+/* Sets free space of a directory block, the map grows with the directory (requires object to be locked) */
+static int _ext2_dir_fmapset(ext2_obj_t *dir, uint32_t block, uint16_t gap)
+{
+	uint16_t *gaps;
+	uint32_t size;
 
-	case DIRENT_CHRDEV:
-	case DIRENT_BLKDEV:
-		res->d_type = dtDev;
-		break;
+	if (block >= dir->fmap.size) {
+		for (size = (dir->fmap.size) ? dir->fmap.size : DIR_FMAPSIZE; size <= block; size *= 2);
 
-	default:
-		res->d_type = dtFile;
+		if ((gaps = (uint16_t *)realloc(dir->fmap.gaps, size * sizeof(uint16_t))) == NULL)
+			return -ENOMEM;
+
+		dir->fmap.gaps = gaps;
+		dir->fmap.size = size;
 	}
 
-	res->d_ino = entry->ino;
-	res->d_reclen = entry->size;
-	res->d_namlen = entry->len;
-	memcpy(res->d_name, entry->name, entry->len);
-	res->d_name[entry->len] = '\0';
-	free(entry);
+	dir->fmap.gaps[block] = gap;
 
-	if ((dir->flags & OFLAG_MOUNTPOINT) && !strncmp(res->d_name, "..", 2))
-		res->d_ino = (ino_t)dir->mnt.id;
+	if (block >= dir->fmap.n)
+		dir->fmap.n = block + 1;
 
-	dir->inode->atime = time(NULL);
+	return EOK;
+}
 
-	return res->d_reclen;
+
+/* Drops directory free space map (requires object to be locked) */
+static void _ext2_dir_fmapdrop(ext2_obj_t *dir)
+{
+	free(dir->fmap.gaps);
+	dir->fmap.gaps = NULL;
+	dir->fmap.n = 0;
+	dir->fmap.size = 0;
+}
+
+
+/* Builds directory free space map on the first entry insertion (requires object to be locked) */
+static int _ext2_dir_fmap(ext2_t *fs, ext2_obj_t *dir, char *buff)
+{
+	uint32_t block;
+	ssize_t ret;
+	int err;
+
+	if (dir->fmap.gaps != NULL)
+		return EOK;
+
+	for (block = 0; block < dir->inode->size / fs->blocksz; block++) {
+		if ((ret = _ext2_file_read(fs, dir, block * fs->blocksz, buff, fs->blocksz)) != fs->blocksz)
+			err = (ret < 0) ? (int)ret : -EINVAL;
+		else
+			err = _ext2_dir_fmapset(dir, block, ext2_dir_gap(fs, buff));
+
+		if (err < 0) {
+			_ext2_dir_fmapdrop(dir);
+			return err;
+		}
+	}
+
+	return EOK;
 }
 
 
 int _ext2_dir_add(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t len, uint16_t mode, uint32_t ino)
 {
-	uint32_t offs, size = 0;
 	ext2_dirent_t *entry;
-	char *buff;
+	uint32_t block;
 	ssize_t ret;
+	char *buff;
+	int err;
+
+	/* Drop cached (negative) entry, it's cached again on the next search */
+	ext2_dcache_remove(fs, (uint32_t)dir->id, name, len);
+
+	if (ext2_dir_indexed(fs, dir)) {
+		if ((err = _ext2_htree_add(fs, dir, name, len, mode, ino)) != -EINVAL)
+			return err;
+
+		/* Index isn't supported => drop it */
+		dir->inode->flags &= ~IFLAG_INDEX;
+		dir->flags |= OFLAG_DIRTY;
+	}
 
 	if ((buff = (char *)malloc(fs->blocksz)) == NULL)
 		return -ENOMEM;
 
-	if (!dir->inode->size) {
-		offs = fs->blocksz;
+	if ((err = _ext2_dir_fmap(fs, dir, buff)) < 0) {
+		free(buff);
+		return err;
 	}
-	else {
-		if ((ret = _ext2_file_read(fs, dir, dir->inode->size - fs->blocksz, buff, fs->blocksz)) != fs->blocksz) {
+
+	/* Insert entry into the first block with enough free space, removed entries space is reused */
+	for (block = 0; block < dir->fmap.n; block++) {
+		if (dir->fmap.gaps[block] < DIRENT_SIZE(len))
+			continue;
+
+		if ((ret = _ext2_file_read(fs, dir, block * fs->blocksz, buff, fs->blocksz)) != fs->blocksz) {
 			free(buff);
 			return (ret < 0) ? (int)ret : -EINVAL;
 		}
 
-		for (offs = 0; offs < fs->blocksz; offs += entry->size) {
-			entry = (ext2_dirent_t *)(buff + offs);
-
-			if (!entry->size)
-				break;
+		/* Out of date map or corrupted block => skip the block */
+		if ((err = ext2_dir_insert(fs, buff, name, len, mode, ino)) < 0) {
+			dir->fmap.gaps[block] = 0;
+			continue;
+		}
 
-			if (offs + entry->size == fs->blocksz) {
-				entry->size = (entry->len) ? (entry->len + sizeof(ext2_dirent_t) + 3) & ~3 : 0;
-				offs += entry->size;
+		if ((ret = _ext2_file_write(fs, dir, block * fs->blocksz, buff, fs->blocksz)) != fs->blocksz) {
+			free(buff);
+			return (ret < 0) ? (int)ret : -EINVAL;
+		}
 
-				if ((size = (len + sizeof(ext2_dirent_t) + 3) & ~3) >= fs->blocksz - offs) {
-					entry->size += fs->blocksz - offs;
-					offs = fs->blocksz;
-					break;
-				}
+		dir->fmap.gaps[block] = ext2_dir_gap(fs, buff);
+		free(buff);
 
-				size = fs->blocksz - offs;
-				break;
-			}
-		}
+		return EOK;
 	}
 
-	/* No space in this block => alloc new one */
-	if (offs >= fs->blocksz) {
-		dir->inode->size += fs->blocksz;
-		memset(buff, 0, fs->blocksz);
-		size = fs->blocksz;
-		offs = 0;
+	/* No space in the directory => alloc new block */
+	if ((dir->inode->size == fs->blocksz) && (fs->sb->featureCompat & COMPAT_DIR_INDEX) && ((err = _ext2_htree_init(fs, dir)) != -EINVAL)) {
+		/* Index directory growing beyond one block */
+		free(buff);
+		_ext2_dir_fmapdrop(dir);
+
+		if (err < 0)
+			return err;
+
+		return _ext2_htree_add(fs, dir, name, len, mode, ino);
 	}
 
-	entry = (ext2_dirent_t *)(buff + offs);
+	memset(buff, 0, fs->blocksz);
+	entry = (ext2_dirent_t *)buff;
 	entry->ino = ino;
-	entry->size = size;
+	entry->size = fs->blocksz;
 	entry->len = len;
+	entry->type = ext2_dir_type(mode);
 	memcpy(entry->name, name, len);
 
-	if (S_ISDIR(mode))
-		entry->type = DIRENT_DIR;
-	else if (S_ISCHR(mode))
-		entry->type = DIRENT_CHRDEV;
-	else if (S_ISBLK(mode))
-		entry->type = DIRENT_BLKDEV;
-	else if (S_ISREG(mode))
-		entry->type = DIRENT_FILE;
-	else
-		entry->type = DIRENT_UNKNOWN;
-
-	offs = (dir->inode->size > fs->blocksz) ? dir->inode->size - fs->blocksz : 0;
+	block = dir->inode->size / fs->blocksz;
 
-	if ((ret = _ext2_file_write(fs, dir, offs, buff, fs->blocksz)) != fs->blocksz) {
+	if ((ret = _ext2_file_write(fs, dir, block * fs->blocksz, buff, fs->blocksz)) != fs->blocksz) {
 		free(buff);
 		return (ret < 0) ? (int)ret : -EINVAL;
 	}
 
+	/* Map failure only drops the map, it's rebuilt on the next insertion */
+	if (_ext2_dir_fmapset(dir, block, fs->blocksz - DIRENT_SIZE(len)) < 0)
+		_ext2_dir_fmapdrop(dir);
+
 	free(buff);
 
 	return EOK;
@@ -285,6 +557,15 @@ int _ext2_dir_remove(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t len)
 		else
 			err = EOK;
 	}
+	/* Indexed directory blocks can't be moved => mark entry unused */
+	else if (ext2_dir_indexed(fs, dir)) {
+		entry->ino = 0;
+
+		if ((ret = _ext2_file_write(fs, dir, boffs, buff, fs->blocksz)) != fs->blocksz)
+			err = (ret < 0) ? (int)ret : -EINVAL;
+		else
+			err = EOK;
+	}
 	/* Entry takes entire block */
 	else if (entry->size == fs->blocksz) {
 		/* Last block => truncate */
@@ -319,7 +600,120 @@ int _ext2_dir_remove(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t len)
 			err = EOK;
 	}
 
+	/* Update free space of the modified block (it holds the moved last block if the directory shrank) */
+	if ((err >= 0) && (dir->fmap.gaps != NULL)) {
+		dir->fmap.n = dir->inode->size / fs->blocksz;
+
+		if (boffs < dir->inode->size)
+			dir->fmap.gaps[boffs / fs->blocksz] = ext2_dir_gap(fs, buff);
+	}
+
 	free(buff);
 
+	if (err < 0)
+		ext2_dcache_remove(fs, (uint32_t)dir->id, name, len);
+	else
+		ext2_dcache_add(fs, (uint32_t)dir->id, name, len, 0);
+
+	return err;
+}
+
+
+int _ext2_dir_compact(ext2_t *fs, ext2_obj_t *dir)
+{
+	uint32_t boffs, offs, size, pos = 0, blocks = 0;
+	ext2_dirent_t *entry, *last = NULL;
+	char *buff, *cbuff;
+	ssize_t ret;
+	int err = EOK, pass;
+
+	if (!dir->inode->size || !dir->inode->links)
+		return -ENOENT;
+
+	if ((buff = (char *)malloc(2 * fs->blocksz)) == NULL)
+		return -ENOMEM;
+
+	cbuff = buff + fs->blocksz;
+
+	/* First pass counts compacted directory blocks, the second one packs entries in the directory order */
+	for (pass = 0; pass < 2; pass++) {
+		memset(cbuff, 0, fs->blocksz);
+		pos = 0;
+
+		for (boffs = 0; boffs < dir->inode->size; boffs += fs->blocksz) {
+			if ((ret = _ext2_file_read(fs, dir, boffs, buff, fs->blocksz)) != fs->blocksz) {
+				err = (ret < 0) ? (int)ret : -EINVAL;
+				break;
+			}
+
+			for (offs = 0; offs < fs->blocksz; offs += entry->size) {
+				if ((entry = ext2_dir_entry(fs, buff, offs)) == NULL) {
+					err = -EINVAL;
+					break;
+				}
+
+				/* Skip unused entries (removed entries and directory index nodes) */
+				if (!entry->ino)
+					continue;
+
+				/* Compacted block is written once it's full, it always precedes the block being read */
+				if (pos + (size = DIRENT_SIZE(entry->len)) > fs->blocksz) {
+					/* Last entry takes the rest of the block */
+					last->size += fs->blocksz - pos;
+
+					if (pass && ((ret = _ext2_file_write(fs, dir, blocks * fs->blocksz, cbuff, fs->blocksz)) != fs->blocksz)) {
+						err = (ret < 0) ? (int)ret : -EINVAL;
+						break;
+					}
+
+					memset(cbuff, 0, fs->blocksz);
+					pos = 0;
+					blocks++;
+				}
+
+				last = (ext2_dirent_t *)(cbuff + pos);
+				memcpy(last, entry, sizeof(ext2_dirent_t) + entry->len);
+				last->size = size;
+				pos += size;
+			}
+
+			if (err < 0)
+				break;
+		}
+
+		/* Directory has at least "." and ".." entries */
+		if ((err >= 0) && (last == NULL))
+			err = -EINVAL;
+
+		if (err < 0)
+			break;
+
+		if (pass) {
+			last->size += fs->blocksz - pos;
+
+			if ((ret = _ext2_file_write(fs, dir, blocks * fs->blocksz, cbuff, fs->blocksz)) != fs->blocksz)
+				err = (ret < 0) ? (int)ret : -EINVAL;
+			else
+				err = _ext2_file_truncate(fs, dir, (blocks + 1) * fs->blocksz);
+			break;
+		}
+
+		/* Nothing to reclaim or indexed directory doesn't fit in one block (the index can't be rebuilt in place) */
+		if ((blocks + 1 >= dir->inode->size / fs->blocksz) || (ext2_dir_indexed(fs, dir) && blocks))
+			break;
+
+		blocks = 0;
+		last = NULL;
+	}
+
+	free(buff);
+
+	/* Compacted directory is linear, it's indexed again once it grows beyond one block */
+	if ((err >= 0) && pass) {
+		dir->inode->flags &= ~IFLAG_INDEX;
+		dir->flags |= OFLAG_DIRTY;
+		_ext2_dir_fmapdrop(dir);
+	}
+
 	return err;
 }
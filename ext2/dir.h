@@ -37,6 +37,18 @@ enum {
 };
 
 
+/* Directory entry size (given entry name length) */
+#define DIRENT_SIZE(len) (((len) + sizeof(ext2_dirent_t) + 3) & ~3)
+
+
+/* Alignment of entries packed into readdir buffer */
+#define DIRENT_ALIGN 8
+
+
+/* Initial size of directory free space map (in directory blocks) */
+#define DIR_FMAPSIZE 8
+
+
 typedef struct {
 	uint32_t ino;  /* Entry inode number */
 	uint16_t size; /* Entry size */
@@ -46,6 +58,14 @@ typedef struct {
 } ext2_dirent_t;
 
 
+/* Returns directory entry type (given object mode) */
+extern uint8_t ext2_dir_type(uint16_t mode);
+
+
+/* Inserts entry into directory block, returns -ENOSPC if there is no space left in the block */
+extern int ext2_dir_insert(ext2_t *fs, char *buff, const char *name, uint8_t len, uint16_t mode, uint32_t ino);
+
+
 /* Checks if directory is empty (requires object to be locked) */
 extern int _ext2_dir_empty(ext2_t *fs, ext2_obj_t *dir);
 
@@ -54,7 +74,8 @@ extern int _ext2_dir_empty(ext2_t *fs, ext2_obj_t *dir);
 extern int _ext2_dir_search(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t len, id_t *res);
 
 
-/* Reads directory entry (requires object to be locked) */
+/* Reads directory entries starting at offs, packs as many as fit into the buffer at DIRENT_ALIGN aligned offsets,
+ * each d_reclen advances the directory offset past its entry, returns number of used buffer bytes (requires object to be locked) */
 extern int _ext2_dir_read(ext2_t *fs, ext2_obj_t *dir, offs_t offs, struct dirent *res, size_t len);
 
 
@@ -66,4 +87,9 @@ extern int _ext2_dir_add(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t
 extern int _ext2_dir_remove(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t len);
 
 
+/* Packs directory entries into as few blocks as possible and truncates the directory, indexed directories are compacted only
+ * if their entries fit in one block (the index is dropped), directory offsets of the entries change (requires object to be locked) */
+extern int _ext2_dir_compact(ext2_t *fs, ext2_obj_t *dir);
+
+
 #endif
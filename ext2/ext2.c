@@ -22,9 +22,13 @@
 #include <sys/stat.h>
 #include <sys/threads.h>
 
+#include "block.h"
+#include "bmp.h"
+#include "cache.h"
 #include "dir.h"
 #include "ext2.h"
 #include "file.h"
+#include "journal.h"
 
 
 int ext2_create(ext2_t *fs, id_t id, const char *name, uint8_t len, oid_t *dev, uint16_t mode, id_t *res)
@@ -32,7 +36,7 @@ int ext2_create(ext2_t *fs, id_t id, const char *name, uint8_t len, oid_t *dev,
 	ext2_obj_t *obj;
 	int err;
 
-	if ((err = ext2_obj_create(fs, (uint32_t)id, NULL, mode, &obj)) < 0)
+	if ((err = ext2_obj_create(fs, (uint32_t)id, mode, &obj)) < 0)
 		return err;
 
 	if (ext2_link(fs, id, name, len, obj->id) < 0)
@@ -48,6 +52,39 @@ int ext2_create(ext2_t *fs, id_t id, const char *name, uint8_t len, oid_t *dev,
 }
 
 
+int ext2_symlink(ext2_t *fs, id_t id, const char *name, uint8_t len, const char *target, size_t tlen, uint16_t mode, id_t *res)
+{
+	ext2_obj_t *obj;
+	ssize_t ret;
+	int err;
+
+	/* Target has to fit in one block */
+	if (!tlen)
+		return -EINVAL;
+
+	if (tlen >= fs->blocksz)
+		return -ENAMETOOLONG;
+
+	if ((err = ext2_obj_create(fs, (uint32_t)id, mode, &obj)) < 0)
+		return err;
+
+	/* Short targets are stored in the inode (fast symlink) */
+	mutexLock(obj->lock);
+	ret = _ext2_file_write(fs, obj, 0, target, tlen);
+	mutexUnlock(obj->lock);
+
+	if ((err = (ret < 0) ? (int)ret : ext2_link(fs, id, name, len, obj->id)) < 0) {
+		ext2_obj_destroy(fs, obj);
+		return err;
+	}
+
+	*res = obj->id;
+	ext2_obj_put(fs, obj);
+
+	return EOK;
+}
+
+
 int ext2_destroy(ext2_t *fs, id_t id)
 {
 	ext2_obj_t *obj;
@@ -109,8 +146,9 @@ int ext2_lookup(ext2_t *fs, id_t id, const char *name, uint8_t len, id_t *res, o
 			if ((err = _ext2_dir_search(fs, dir, name + i, j - i, res)) < 0)
 				break;
 
+			/* Entry points to invalid inode, remove it */
 			if ((obj = ext2_obj_get(fs, *res)) == NULL) {
-				ext2_unlink(fs, dir->id, name + i, j - i);
+				_ext2_dir_remove(fs, dir, name + i, j - i);
 				err = -ENOENT;
 				break;
 			}
@@ -165,13 +203,19 @@ int ext2_close(ext2_t *fs, id_t id)
 	if ((obj = ext2_obj_get(fs, id)) == NULL)
 		return -EINVAL;
 
-	if ((err = ext2_obj_sync(fs, obj)) < 0)
-		return err;
+	mutexLock(obj->lock);
 
+	/* Allocate buffered blocks and release blocks reserved for file growth */
+	if (((err = ext2_block_dflush(fs, obj)) >= 0) && ((err = ext2_block_discard(fs, obj)) >= 0))
+		err = _ext2_obj_sync(fs, obj);
+
+	mutexUnlock(obj->lock);
+
+	/* Object is closed even if its write back fails */
 	ext2_obj_put(fs, obj);
 	ext2_obj_put(fs, obj);
 
-	return EOK;
+	return (err < 0) ? err : EOK;
 }
 
 
@@ -250,11 +294,7 @@ int ext2_truncate(ext2_t *fs, id_t id, size_t size)
 
 		mutexUnlock(obj->lock);
 
-		if ((err = ext2_obj_truncate(fs, obj, size)) < 0)
-			break;
-
-		if ((err = ext2_sb_sync(fs)) < 0)
-			break;
+		err = ext2_obj_truncate(fs, obj, size);
 	} while (0);
 
 	ext2_obj_put(fs, obj);
@@ -267,7 +307,7 @@ int ext2_getattr(ext2_t *fs, id_t id, int type, int *attr)
 {
 	ext2_obj_t *obj;
 
-	if ((obj = ext2_obj_get(fs, id)) < 0)
+	if ((obj = ext2_obj_get(fs, id)) == NULL)
 		return -EINVAL;
 
 	mutexLock(obj->lock);
@@ -350,14 +390,16 @@ int ext2_setattr(ext2_t *fs, id_t id, int type, int attr)
 		break;
 
 	case atSize:
-		if ((err = _ext2_file_truncate(fs, obj, attr)) < 0)
+		/* Directories are resized only by entries operations */
+		if (S_ISDIR(obj->inode->mode)) {
+			err = -EISDIR;
 			break;
+		}
 
-		if ((err = _ext2_obj_sync(fs, obj)) < 0)
+		if ((err = _ext2_file_truncate(fs, obj, attr)) < 0)
 			break;
 
-		if ((err = ext2_sb_sync(fs)) < 0)
-			break;
+		err = _ext2_obj_sync(fs, obj);
 		break;
 	}
 
@@ -485,8 +527,9 @@ int ext2_unlink(ext2_t *fs, id_t id, const char *name, uint8_t len)
 				break;
 			}
 
-			if (S_ISDIR(obj->inode->mode) && !_ext2_dir_empty(fs, obj)) {
-				err = -EACCES;
+			if (S_ISDIR(obj->inode->mode) && ((err = _ext2_dir_empty(fs, obj)) <= 0)) {
+				if (!err)
+					err = -EACCES;
 				break;
 			}
 
@@ -494,8 +537,10 @@ int ext2_unlink(ext2_t *fs, id_t id, const char *name, uint8_t len)
 				break;
 
 			obj->inode->links--;
+			obj->flags |= OFLAG_DIRTY;
 			if (S_ISDIR(obj->inode->mode)) {
 				dir->inode->links--;
+				dir->flags |= OFLAG_DIRTY;
 				obj->inode->links--;
 				break;
 			}
@@ -512,3 +557,75 @@ int ext2_unlink(ext2_t *fs, id_t id, const char *name, uint8_t len)
 
 	return err;
 }
+
+
+int ext2_compact(ext2_t *fs, id_t id)
+{
+	ext2_obj_t *dir;
+	int err;
+
+	if ((dir = ext2_obj_get(fs, id)) == NULL)
+		return -ENOENT;
+
+	mutexLock(dir->lock);
+
+	if (!S_ISDIR(dir->inode->mode))
+		err = -ENOTDIR;
+	else if ((err = _ext2_dir_compact(fs, dir)) >= 0)
+		err = _ext2_obj_sync(fs, dir);
+
+	mutexUnlock(dir->lock);
+	ext2_obj_put(fs, dir);
+
+	return err;
+}
+
+
+int ext2_msync(ext2_t *fs)
+{
+	int err;
+
+	if ((err = ext2_bmps_sync(fs)) < 0)
+		return err;
+
+	mutexLock(fs->mlock);
+
+	if (fs->mdirty) {
+		fs->mdirty = 0;
+
+		if (((err = _ext2_gdt_sync(fs)) < 0) || ((err = ext2_sb_sync(fs)) < 0))
+			fs->mdirty++;
+	}
+
+	mutexUnlock(fs->mlock);
+
+	return err;
+}
+
+
+int ext2_commit(ext2_t *fs)
+{
+	if (fs->journal != NULL)
+		return ext2_journal_commit(fs);
+
+	return ext2_msync(fs);
+}
+
+
+int ext2_sync(ext2_t *fs)
+{
+	int err;
+
+	/* Buffered blocks allocation is a journal handle, the commit waits for it */
+	ext2_journal_start(fs);
+	err = ext2_objs_sync(fs);
+	ext2_journal_stop(fs);
+
+	if (err < 0)
+		return err;
+
+	if ((err = ext2_commit(fs)) < 0)
+		return err;
+
+	return ext2_cache_sync(fs);
+}
@@ -16,22 +16,26 @@
 #ifndef _EXT2_H_
 #define _EXT2_H_
 
-#include <limits.h>
 #include <stdint.h>
 
 #include <sys/types.h>
 
 
 /* Misc definitions */
-#define ROOT_INO    2   /* Root inode number */
-#define MAX_OBJECTS 512 /* Max number of filesystem objects in use */
+#define ROOT_INO         2   /* Root inode number */
+#define COMMIT_THRESHOLD 64  /* Max number of uncommitted group descriptor changes */
 
 
 /* Filesystem common data types forward declaration */
-typedef struct _ext2_sb_t   ext2_sb_t;   /* SuperBlock */
-typedef struct _ext2_gd_t   ext2_gd_t;   /* Group Descriptor*/
-typedef struct _ext2_obj_t  ext2_obj_t;  /* Filesystem object */
-typedef struct _ext2_objs_t ext2_objs_t; /* Filesystem objects */
+typedef struct _ext2_sb_t      ext2_sb_t;      /* SuperBlock */
+typedef struct _ext2_gd_t      ext2_gd_t;      /* Group Descriptor*/
+typedef struct _ext2_obj_t     ext2_obj_t;     /* Filesystem object */
+typedef struct _ext2_objs_t    ext2_objs_t;    /* Filesystem objects */
+typedef struct _ext2_bmps_t    ext2_bmps_t;    /* Group bitmaps */
+typedef struct _ext2_cache_t   ext2_cache_t;   /* Block cache */
+typedef struct _ext2_dcache_t  ext2_dcache_t;  /* Directory entry cache */
+typedef struct _ext2_journal_t ext2_journal_t; /* Metadata journal */
+typedef struct _ext2_stats_t   ext2_stats_t;   /* Statistics */
 
 
 /* Device access callbacks */
@@ -41,20 +45,33 @@ typedef ssize_t (*dev_write)(id_t, offs_t, const char *, size_t);
 
 typedef struct {
 	/* Device info */
-	uint32_t sectorsz; /* Device sector size */
-	dev_read read;     /* Device read callback */
-	dev_write write;   /* Device write callback */
+	uint32_t sectorsz;       /* Device sector size */
+	dev_read read;           /* Device read callback */
+	dev_write write;         /* Device write callback */
 
 	/* Filesystem info */
-	oid_t oid;         /* Filesystem port and device ID */
-	ext2_sb_t *sb;     /* SuperBlock */
-	ext2_gd_t *gdt;    /* Group Descriptors Table */
-	uint32_t blocksz;  /* Block size */
-	uint32_t groups;   /* Number of groups */
+	oid_t oid;               /* Filesystem port and device ID */
+	ext2_sb_t *sb;           /* SuperBlock */
+	ext2_gd_t *gdt;          /* Group Descriptors Table */
+	uint8_t *gdtdirty;       /* Dirty GDT blocks */
+	uint32_t mdirty;         /* Number of uncommitted metadata changes */
+	uint32_t dblocks;        /* Number of free blocks reserved for delayed allocation */
+	handle_t mlock;          /* Metadata (SuperBlock counters and GDT) mutex */
+	uint32_t blocksz;        /* Block size */
+	uint32_t groups;         /* Number of groups */
+	ext2_bmps_t *bmps;       /* Group bitmaps */
+	ext2_journal_t *journal; /* Metadata journal (NULL => metadata isn't journalled) */
 
 	/* Filesystem objects */
-	ext2_obj_t *root;  /* Root object */
-	ext2_objs_t *objs; /* Filesystem objects */
+	ext2_obj_t *root;        /* Root object */
+	ext2_objs_t *objs;       /* Filesystem objects */
+
+	/* Caches */
+	ext2_cache_t *cache;     /* Block cache */
+	ext2_dcache_t *dcache;   /* Directory entry cache */
+
+	/* Statistics */
+	ext2_stats_t *stats;     /* Device I/O and requests latency statistics */
 } ext2_t;
 
 
@@ -68,6 +85,10 @@ typedef struct {
 extern int ext2_create(ext2_t *fs, id_t id, const char *name, uint8_t len, oid_t *dev, uint16_t mode, id_t *res);
 
 
+/* Creates a symbolic link with a given target */
+extern int ext2_symlink(ext2_t *fs, id_t id, const char *name, uint8_t len, const char *target, size_t tlen, uint16_t mode, id_t *res);
+
+
 /* Destroys a file */
 extern int ext2_destroy(ext2_t *fs, id_t id);
 
@@ -112,37 +133,145 @@ extern int ext2_link(ext2_t *fs, id_t id, const char *name, uint8_t len, id_t li
 extern int ext2_unlink(ext2_t *fs, id_t id, const char *name, uint8_t len);
 
 
-/* Bitmap bit operations */
-static inline uint32_t ext2_findzerobit(uint32_t *bmp, uint32_t size, uint32_t offs)
+/* Compacts a directory (reclaims space of removed entries) */
+extern int ext2_compact(ext2_t *fs, id_t id);
+
+
+/* Writes back filesystem metadata (bitmaps, GDT and SuperBlock) through the cache */
+extern int ext2_msync(ext2_t *fs);
+
+
+/* Commits filesystem metadata (bitmaps, GDT and SuperBlock), commits the journal transaction if metadata is journalled */
+extern int ext2_commit(ext2_t *fs);
+
+
+/* Synchronizes filesystem */
+extern int ext2_sync(ext2_t *fs);
+
+
+/* Bitmap operations (bits are numbered from 1, bitmaps are scanned in 64-bit words) */
+static inline uint32_t ext2_findbit(const uint64_t *bmp, uint32_t size, uint32_t offs, uint8_t set)
+{
+	uint32_t i = (offs - 1) / 64, last = (size - 1) / 64;
+	uint64_t w;
+
+	if (!offs || (offs > size))
+		return 0;
+
+	/* Invert the words when searching for a zero bit, mask bits before offs */
+	w = ((set) ? bmp[i] : ~bmp[i]) & (~0ULL << ((offs - 1) % 64));
+
+	while (!w) {
+		if (++i > last)
+			return 0;
+
+		w = (set) ? bmp[i] : ~bmp[i];
+	}
+
+	offs = i * 64 + __builtin_ctzll(w) + 1;
+
+	return (offs > size) ? 0 : offs;
+}
+
+
+/* Finds first zero bit starting at offs bit (returns 0 if there is no zero bit) */
+static inline uint32_t ext2_findzerobit(const uint64_t *bmp, uint32_t size, uint32_t offs)
+{
+	return ext2_findbit(bmp, size, offs, 0);
+}
+
+
+/* Finds last set bit before offs bit (returns 0 if there is no set bit) */
+static inline uint32_t ext2_findsetbitrev(const uint64_t *bmp, uint32_t offs)
+{
+	uint32_t i;
+	uint64_t w;
+
+	if (offs-- <= 1)
+		return 0;
+
+	i = (offs - 1) / 64;
+	w = bmp[i] & (~0ULL >> (63 - (offs - 1) % 64));
+
+	while (!w) {
+		if (!i--)
+			return 0;
+
+		w = bmp[i];
+	}
+
+	return i * 64 + 64 - __builtin_clzll(w);
+}
+
+
+/* Returns length of zero bits run starting at offs bit (up to n bits) */
+static inline uint32_t ext2_zerorunlen(const uint64_t *bmp, uint32_t size, uint32_t offs, uint32_t n)
+{
+	uint32_t end;
+
+	if (!offs || (offs > size))
+		return 0;
+
+	if (n > size - offs + 1)
+		n = size - offs + 1;
+
+	return ((end = ext2_findbit(bmp, offs + n - 1, offs, 1))) ? end - offs : n;
+}
+
+
+/* Finds first run of n zero bits starting at offs bit, if there is no such run finds the longest one (returns 0 if there is no zero bit) */
+static inline uint32_t ext2_findzerorun(const uint64_t *bmp, uint32_t size, uint32_t offs, uint32_t n, uint32_t *len)
 {
-	uint32_t len = (size - 1) / (CHAR_BIT * sizeof(uint32_t)) + 1;
-	uint32_t tmp, i;
+	uint32_t l, best = 0;
+
+	for (*len = 0; (offs = ext2_findzerobit(bmp, size, offs)); offs += l) {
+		if ((l = ext2_zerorunlen(bmp, size, offs, n)) > *len) {
+			*len = l;
+			best = offs;
 
-	for (i = offs / (CHAR_BIT * sizeof(uint32_t)); i < len; i++) {
-		if ((tmp = bmp[i] ^ ~0UL)) {
-			offs = i * (CHAR_BIT * sizeof(uint32_t)) + __builtin_ffsl(tmp);
-			return (offs > size) ? 0 : offs;
+			if (l >= n)
+				break;
 		}
 	}
 
-	return 0;
+	return best;
 }
 
 
-static inline uint8_t ext2_checkbit(uint32_t *bmp, uint32_t offs)
+/* Sets or clears n bits starting at offs bit, returns number of changed bits */
+static inline uint32_t ext2_setbits(uint64_t *bmp, uint32_t offs, uint32_t n, uint8_t set)
 {
-	uint32_t woffs = (offs - 1) % (CHAR_BIT * sizeof(uint32_t));
-	uint32_t aoffs = (offs - 1) / (CHAR_BIT * sizeof(uint32_t));
+	uint32_t i = (offs - 1) / 64, ret = 0, l;
+	uint64_t mask;
+
+	for (offs = (offs - 1) % 64; n; n -= l, offs = 0, i++) {
+		l = (n < 64 - offs) ? n : 64 - offs;
+		mask = ((l < 64) ? ((1ULL << l) - 1) : ~0ULL) << offs;
 
-	return !!(bmp[aoffs] & (1UL << woffs));
+		ret += __builtin_popcountll(((set) ? ~bmp[i] : bmp[i]) & mask);
+
+		if (set)
+			bmp[i] |= mask;
+		else
+			bmp[i] &= ~mask;
+	}
+
+	return ret;
 }
 
 
-static inline void ext2_togglebit(uint32_t *bmp, uint32_t offs)
+/* Counts set bits */
+static inline uint32_t ext2_countbits(const uint64_t *bmp, uint32_t size)
 {
-	uint32_t woffs = (offs - 1) % (CHAR_BIT * sizeof(uint32_t));
-	uint32_t aoffs = (offs - 1) / (CHAR_BIT * sizeof(uint32_t));
-	bmp[aoffs] ^= 1UL << woffs;
+	uint32_t i, ret = 0;
+
+	for (i = 0; i < size / 64; i++)
+		ret += __builtin_popcountll(bmp[i]);
+
+	if (size % 64)
+		ret += __builtin_popcountll(bmp[i] & ((1ULL << (size % 64)) - 1));
+
+	return ret;
 }
 
 
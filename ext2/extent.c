@@ -0,0 +1,622 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Extent tree
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "extent.h"
+
+
+/* Extent tree path node */
+typedef struct {
+	uint32_t bno;           /* Node block number (0 => tree root stored in the inode) */
+	ext2_extent_hdr_t *hdr; /* Node header */
+	int idx;                /* Entry index */
+} ext2_extent_path_t;
+
+
+/* Returns node index entries */
+static inline ext2_extent_idx_t *ext2_extent_idx(ext2_extent_hdr_t *hdr)
+{
+	return (ext2_extent_idx_t *)(hdr + 1);
+}
+
+
+/* Returns node leaf entries */
+static inline ext2_extent_t *ext2_extent_leaf(ext2_extent_hdr_t *hdr)
+{
+	return (ext2_extent_t *)(hdr + 1);
+}
+
+
+/* Returns extent length */
+static inline uint32_t ext2_extent_len(ext2_extent_t *ex)
+{
+	return (ex->len > EXTENT_MAXLEN) ? ex->len - EXTENT_MAXLEN : ex->len;
+}
+
+
+/* Finds last node entry starting at or before given block (index and leaf entries have the same size and key) */
+static int ext2_extent_search(ext2_extent_hdr_t *hdr, uint32_t block)
+{
+	ext2_extent_idx_t *idx = ext2_extent_idx(hdr);
+	int l = 0, r = hdr->entries - 1, m;
+
+	while (l < r) {
+		m = (l + r + 1) / 2;
+
+		if (idx[m].block <= block)
+			l = m;
+		else
+			r = m - 1;
+	}
+
+	return l;
+}
+
+
+/* Writes back extent tree node */
+static int ext2_extent_write(ext2_t *fs, ext2_obj_t *obj, ext2_extent_path_t *node)
+{
+	if (!node->bno) {
+		obj->flags |= OFLAG_DIRTY;
+		return EOK;
+	}
+
+	return ext2_block_write(fs, node->bno, node->hdr, 1);
+}
+
+
+/* Finds path to the leaf node covering given block (buff holds tree depth blocks), returns leaf node level */
+static int ext2_extent_find(ext2_t *fs, ext2_obj_t *obj, uint32_t block, ext2_extent_path_t *path, char *buff)
+{
+	ext2_extent_hdr_t *hdr;
+	int i, err;
+
+	path[0].bno = 0;
+	path[0].hdr = (ext2_extent_hdr_t *)obj->inode->block;
+
+	for (i = 0;; i++) {
+		hdr = path[i].hdr;
+
+		if ((hdr->magic != EXTENT_MAGIC) || (hdr->entries > hdr->max))
+			return -EINVAL;
+
+		path[i].idx = ext2_extent_search(hdr, block);
+
+		if (!hdr->depth)
+			break;
+
+		if (!hdr->entries || (i + 1 >= EXTENT_MAXDEPTH))
+			return -EINVAL;
+
+		path[i + 1].bno = ext2_extent_idx(hdr)[path[i].idx].leafLo;
+		path[i + 1].hdr = (ext2_extent_hdr_t *)(buff + i * fs->blocksz);
+
+		if ((err = ext2_block_read(fs, path[i + 1].bno, path[i + 1].hdr, 1)) < 0)
+			return err;
+	}
+
+	return i;
+}
+
+
+/* Returns number of not mapped blocks following given block (block is past the path leaf extent, max => no extent follows) */
+static uint32_t ext2_extent_hole(ext2_extent_path_t *path, int level, uint32_t block, uint32_t max)
+{
+	ext2_extent_hdr_t *hdr;
+
+	/* Hole ends at the next extent (index and leaf entries have the same key) */
+	for (; level >= 0; level--) {
+		hdr = path[level].hdr;
+
+		if (path[level].idx + 1 < hdr->entries)
+			return ext2_extent_idx(hdr)[path[level].idx + 1].block - block;
+	}
+
+	return max;
+}
+
+
+int ext2_extent_get(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t *bno)
+{
+	ext2_extent_path_t path[EXTENT_MAXDEPTH];
+	ext2_extent_hdr_t *hdr = (ext2_extent_hdr_t *)obj->inode->block;
+	ext2_extent_t *ex;
+	uint32_t end, max;
+	char *buff = NULL;
+	int level, ret = 1;
+
+	if (hdr->depth && ((buff = (char *)malloc(hdr->depth * fs->blocksz)) == NULL))
+		return -ENOMEM;
+
+	/* Hole with no next extent ends at the end of file */
+	end = (obj->inode->size) ? (obj->inode->size - 1) / fs->blocksz + 1 : 0;
+	max = (end > block + 1) ? end - block : 1;
+
+	do {
+		if ((ret = level = ext2_extent_find(fs, obj, block, path, buff)) < 0)
+			break;
+
+		hdr = path[level].hdr;
+		ex = ext2_extent_leaf(hdr) + path[level].idx;
+		*bno = 0;
+
+		if (!hdr->entries) {
+			ret = ext2_extent_hole(path, level, block, max);
+			break;
+		}
+
+		/* Hole before the extent */
+		if (block < ex->block) {
+			ret = ex->block - block;
+			break;
+		}
+
+		/* Hole after the extent */
+		if (block >= ex->block + ext2_extent_len(ex)) {
+			ret = ext2_extent_hole(path, level, block, max);
+			break;
+		}
+
+		ret = ex->block + ext2_extent_len(ex) - block;
+
+		/* Uninitialized extents (e.g. preallocated by fallocate()) read as holes */
+		if (ex->len <= EXTENT_MAXLEN)
+			*bno = ex->startLo + block - ex->block;
+	} while (0);
+
+	free(buff);
+
+	return ret;
+}
+
+
+/* Updates index keys after node first entry has changed */
+static int ext2_extent_fixkeys(ext2_t *fs, ext2_obj_t *obj, ext2_extent_path_t *path, int level)
+{
+	uint32_t key = ext2_extent_idx(path[level].hdr)->block;
+	ext2_extent_idx_t *idx;
+	int err;
+
+	while (level--) {
+		idx = ext2_extent_idx(path[level].hdr) + path[level].idx;
+
+		if (idx->block == key)
+			break;
+
+		idx->block = key;
+
+		if ((err = ext2_extent_write(fs, obj, path + level)) < 0)
+			return err;
+
+		if (path[level].idx)
+			break;
+	}
+
+	return EOK;
+}
+
+
+/* Allocates new extent tree node */
+static int ext2_extent_alloc(ext2_t *fs, ext2_obj_t *obj, ext2_extent_hdr_t *hdr, uint16_t depth, uint32_t *bno)
+{
+	int err;
+
+	if ((err = ext2_block_createone(fs, (uint32_t)obj->id, bno)) < 0)
+		return err;
+
+	obj->inode->blocks += fs->blocksz / INODE_BLOCKSZ;
+
+	memset(hdr, 0, fs->blocksz);
+	hdr->magic = EXTENT_MAGIC;
+	hdr->max = (fs->blocksz - sizeof(ext2_extent_hdr_t)) / sizeof(ext2_extent_t);
+	hdr->depth = depth;
+
+	return EOK;
+}
+
+
+/* Inserts entry into the node at given position, splits full nodes (buff holds two blocks for new nodes) */
+static int ext2_extent_insert(ext2_t *fs, ext2_obj_t *obj, ext2_extent_path_t *path, int level, int pos, const ext2_extent_idx_t *entry, char *buff)
+{
+	ext2_extent_hdr_t *hdr = path[level].hdr, *nhdr;
+	ext2_extent_idx_t *idx = ext2_extent_idx(hdr), nentry;
+	ext2_extent_path_t node;
+	int i, split, err;
+
+	if (hdr->entries < hdr->max) {
+		memmove(idx + pos + 1, idx + pos, (hdr->entries - pos) * sizeof(ext2_extent_idx_t));
+		memcpy(idx + pos, entry, sizeof(ext2_extent_idx_t));
+		hdr->entries++;
+
+		if ((err = ext2_extent_write(fs, obj, path + level)) < 0)
+			return err;
+
+		if (!pos)
+			return ext2_extent_fixkeys(fs, obj, path, level);
+
+		return EOK;
+	}
+
+	/* Root node is full => move its entries to a new node and increase tree depth */
+	if (!level) {
+		for (i = 0; (i < EXTENT_MAXDEPTH) && path[i].hdr->depth; i++);
+
+		if (i + 1 >= EXTENT_MAXDEPTH)
+			return -ENOSPC;
+
+		nhdr = (ext2_extent_hdr_t *)buff;
+
+		if ((err = ext2_extent_alloc(fs, obj, nhdr, hdr->depth, &node.bno)) < 0)
+			return err;
+
+		memcpy(ext2_extent_idx(nhdr), idx, hdr->entries * sizeof(ext2_extent_idx_t));
+		nhdr->entries = hdr->entries;
+
+		hdr->depth++;
+		hdr->entries = 1;
+		idx->block = ext2_extent_idx(nhdr)->block;
+		idx->leafLo = node.bno;
+		idx->leafHi = 0;
+		idx->unused = 0;
+
+		node.hdr = nhdr;
+		node.idx = path[0].idx;
+
+		if ((err = ext2_extent_write(fs, obj, &node)) < 0)
+			return err;
+
+		if ((err = ext2_extent_write(fs, obj, path)) < 0)
+			return err;
+
+		memmove(path + 2, path + 1, i * sizeof(ext2_extent_path_t));
+		path[0].idx = 0;
+		path[1] = node;
+
+		return ext2_extent_insert(fs, obj, path, 1, pos, entry, buff + fs->blocksz);
+	}
+
+	/* Split node, appended entry starts a new node */
+	nhdr = (ext2_extent_hdr_t *)buff;
+
+	if ((err = ext2_extent_alloc(fs, obj, nhdr, hdr->depth, &node.bno)) < 0)
+		return err;
+
+	split = (pos == hdr->entries) ? pos : hdr->entries / 2;
+	memcpy(ext2_extent_idx(nhdr), idx + split, (hdr->entries - split) * sizeof(ext2_extent_idx_t));
+	nhdr->entries = hdr->entries - split;
+	hdr->entries = split;
+
+	if (pos >= split) {
+		hdr = nhdr;
+		pos -= split;
+	}
+
+	idx = ext2_extent_idx(hdr);
+	memmove(idx + pos + 1, idx + pos, (hdr->entries - pos) * sizeof(ext2_extent_idx_t));
+	memcpy(idx + pos, entry, sizeof(ext2_extent_idx_t));
+	hdr->entries++;
+
+	node.hdr = nhdr;
+
+	if ((err = ext2_extent_write(fs, obj, &node)) < 0)
+		return err;
+
+	if ((err = ext2_extent_write(fs, obj, path + level)) < 0)
+		return err;
+
+	if (!pos && (hdr == path[level].hdr) && ((err = ext2_extent_fixkeys(fs, obj, path, level)) < 0))
+		return err;
+
+	nentry.block = ext2_extent_idx(nhdr)->block;
+	nentry.leafLo = node.bno;
+	nentry.leafHi = 0;
+	nentry.unused = 0;
+
+	return ext2_extent_insert(fs, obj, path, level - 1, path[level - 1].idx + 1, &nentry, buff);
+}
+
+
+/* Maps up to EXTENT_MAXLEN consecutive logical blocks to consecutive physical blocks */
+static int ext2_extent_add(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t bno, uint16_t n)
+{
+	ext2_extent_path_t path[EXTENT_MAXDEPTH];
+	ext2_extent_hdr_t *hdr;
+	ext2_extent_t *ex, entry;
+	int level, pos, err;
+	char *buff;
+
+	/* New nodes + tree nodes buffers */
+	if ((buff = (char *)malloc((((ext2_extent_hdr_t *)obj->inode->block)->depth + 2) * fs->blocksz)) == NULL)
+		return -ENOMEM;
+
+	do {
+		if ((err = level = ext2_extent_find(fs, obj, block, path, buff + 2 * fs->blocksz)) < 0)
+			break;
+
+		hdr = path[level].hdr;
+		ex = ext2_extent_leaf(hdr) + (pos = path[level].idx);
+
+		if (hdr->entries) {
+			/* Extend extent */
+			if ((ex->len + n <= EXTENT_MAXLEN) && (ex->block + ex->len == block) && (ex->startLo + ex->len == bno)) {
+				ex->len += n;
+				err = ext2_extent_write(fs, obj, path + level);
+				break;
+			}
+
+			if (block > ex->block)
+				pos++;
+		}
+
+		entry.block = block;
+		entry.len = n;
+		entry.startHi = 0;
+		entry.startLo = bno;
+
+		err = ext2_extent_insert(fs, obj, path, level, pos, (ext2_extent_idx_t *)&entry, buff);
+	} while (0);
+
+	free(buff);
+
+	return err;
+}
+
+
+int ext2_extent_set(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t bno, uint32_t n)
+{
+	uint32_t len;
+	int err;
+
+	for (; n; block += len, bno += len, n -= len) {
+		len = (n < EXTENT_MAXLEN) ? n : EXTENT_MAXLEN;
+
+		if ((err = ext2_extent_add(fs, obj, block, bno, len)) < 0)
+			return err;
+	}
+
+	return EOK;
+}
+
+
+/* Marks n blocks of uninitialized extent starting at given block initialized, splits the extent (buff holds two blocks for new nodes followed by tree nodes buffers) */
+static int ext2_extent_split(ext2_t *fs, ext2_obj_t *obj, ext2_extent_path_t *path, int level, uint32_t block, uint32_t n, char *buff)
+{
+	ext2_extent_hdr_t *hdr = path[level].hdr;
+	ext2_extent_t *ex = ext2_extent_leaf(hdr) + path[level].idx, *prev = ex - 1, entry;
+	uint32_t start = ex->block, bno = ex->startLo, len = ext2_extent_len(ex);
+	int err;
+
+	/* Written blocks continue the preceding initialized extent */
+	if ((block == start) && path[level].idx && (prev->len + n <= EXTENT_MAXLEN) && (prev->block + prev->len == start) && (prev->startLo + prev->len == bno)) {
+		prev->len += n;
+
+		if (n == len) {
+			memmove(ex, ex + 1, (hdr->entries - path[level].idx - 1) * sizeof(ext2_extent_t));
+			hdr->entries--;
+		}
+		else {
+			ex->block += n;
+			ex->startLo += n;
+			ex->len -= n;
+		}
+
+		return ext2_extent_write(fs, obj, path + level);
+	}
+
+	/* Extent keeps the written blocks or the uninitialized blocks preceding them */
+	ex->len = (block == start) ? n : block - start + EXTENT_MAXLEN;
+
+	if ((err = ext2_extent_write(fs, obj, path + level)) < 0)
+		return err;
+
+	if (block > start) {
+		entry.block = block;
+		entry.len = n;
+		entry.startHi = 0;
+		entry.startLo = bno + block - start;
+
+		if ((err = ext2_extent_insert(fs, obj, path, level, path[level].idx + 1, (ext2_extent_idx_t *)&entry, buff)) < 0)
+			return err;
+
+		/* Insertion may have split the leaf node */
+		if ((err = level = ext2_extent_find(fs, obj, block, path, buff + 2 * fs->blocksz)) < 0)
+			return err;
+	}
+
+	/* Uninitialized blocks following the written ones */
+	if (block + n < start + len) {
+		entry.block = block + n;
+		entry.len = start + len - block - n + EXTENT_MAXLEN;
+		entry.startHi = 0;
+		entry.startLo = bno + block + n - start;
+
+		return ext2_extent_insert(fs, obj, path, level, path[level].idx + 1, (ext2_extent_idx_t *)&entry, buff);
+	}
+
+	return EOK;
+}
+
+
+int ext2_extent_map(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t n, uint32_t *bno)
+{
+	ext2_extent_path_t path[EXTENT_MAXDEPTH];
+	ext2_extent_hdr_t *hdr;
+	ext2_extent_t *ex;
+	int level, ret, err;
+	char *buff;
+
+	/* New nodes + tree nodes buffers (split extent may add one tree level) */
+	if ((buff = (char *)malloc((((ext2_extent_hdr_t *)obj->inode->block)->depth + 3) * fs->blocksz)) == NULL)
+		return -ENOMEM;
+
+	do {
+		if ((ret = level = ext2_extent_find(fs, obj, block, path, buff + 2 * fs->blocksz)) < 0)
+			break;
+
+		hdr = path[level].hdr;
+		ex = ext2_extent_leaf(hdr) + path[level].idx;
+		*bno = 0;
+
+		if (!hdr->entries) {
+			ret = ext2_extent_hole(path, level, block, n);
+			break;
+		}
+
+		/* Hole before the extent */
+		if (block < ex->block) {
+			ret = ex->block - block;
+			break;
+		}
+
+		/* Hole after the extent */
+		if (block >= ex->block + ext2_extent_len(ex)) {
+			ret = ext2_extent_hole(path, level, block, n);
+			break;
+		}
+
+		*bno = ex->startLo + block - ex->block;
+		ret = ex->block + ext2_extent_len(ex) - block;
+
+		/* Written blocks of uninitialized extent are marked initialized */
+		if (ex->len > EXTENT_MAXLEN) {
+			if ((uint32_t)ret > n)
+				ret = n;
+
+			if ((err = ext2_extent_split(fs, obj, path, level, block, ret, buff)) < 0)
+				ret = err;
+		}
+	} while (0);
+
+	free(buff);
+
+	return ret;
+}
+
+
+/* Destroys blocks starting at given logical block in the subtree, returns number of entries left in the node */
+static int ext2_extent_destroy(ext2_t *fs, ext2_obj_t *obj, ext2_extent_hdr_t *hdr, uint32_t block, ext2_bfree_t *batch)
+{
+	ext2_extent_hdr_t *child;
+	ext2_extent_idx_t *idx;
+	ext2_extent_t *ex;
+	uint32_t len;
+	int ret, err;
+
+	if (!hdr->depth) {
+		while (hdr->entries) {
+			ex = ext2_extent_leaf(hdr) + hdr->entries - 1;
+			len = ext2_extent_len(ex);
+
+			if (ex->block + len <= block)
+				break;
+
+			if (ex->block >= block) {
+				if ((err = ext2_block_free(fs, batch, ex->startLo, len)) < 0)
+					return err;
+
+				obj->inode->blocks -= len * (fs->blocksz / INODE_BLOCKSZ);
+				hdr->entries--;
+				continue;
+			}
+
+			if ((err = ext2_block_free(fs, batch, ex->startLo + block - ex->block, ex->block + len - block)) < 0)
+				return err;
+
+			obj->inode->blocks -= (ex->block + len - block) * (fs->blocksz / INODE_BLOCKSZ);
+			ex->len -= ex->block + len - block;
+			break;
+		}
+
+		return hdr->entries;
+	}
+
+	if ((child = (ext2_extent_hdr_t *)malloc(fs->blocksz)) == NULL)
+		return -ENOMEM;
+
+	while (hdr->entries) {
+		idx = ext2_extent_idx(hdr) + hdr->entries - 1;
+
+		if ((err = ext2_block_read(fs, idx->leafLo, child, 1)) < 0) {
+			free(child);
+			return err;
+		}
+
+		if ((child->magic != EXTENT_MAGIC) || (child->entries > child->max)) {
+			free(child);
+			return -EINVAL;
+		}
+
+		if ((ret = ext2_extent_destroy(fs, obj, child, block, batch)) < 0) {
+			free(child);
+			return ret;
+		}
+
+		/* Remaining blocks are all before the given block */
+		if (ret) {
+			if ((err = ext2_block_write(fs, idx->leafLo, child, 1)) < 0) {
+				free(child);
+				return err;
+			}
+			break;
+		}
+
+		if ((err = ext2_block_free(fs, batch, idx->leafLo, 1)) < 0) {
+			free(child);
+			return err;
+		}
+
+		obj->inode->blocks -= fs->blocksz / INODE_BLOCKSZ;
+		hdr->entries--;
+	}
+
+	free(child);
+
+	return hdr->entries;
+}
+
+
+int ext2_extent_truncate(ext2_t *fs, ext2_obj_t *obj, uint32_t block, ext2_bfree_t *batch)
+{
+	ext2_extent_hdr_t *hdr = (ext2_extent_hdr_t *)obj->inode->block;
+	int ret;
+
+	if ((hdr->magic != EXTENT_MAGIC) || (hdr->entries > hdr->max))
+		return -EINVAL;
+
+	if ((ret = ext2_extent_destroy(fs, obj, hdr, block, batch)) < 0)
+		return ret;
+
+	/* Empty tree => reset root to leaf node */
+	if (!ret)
+		ext2_extent_init(obj->inode);
+
+	obj->flags |= OFLAG_DIRTY;
+
+	return EOK;
+}
+
+
+void ext2_extent_init(ext2_inode_t *inode)
+{
+	ext2_extent_hdr_t *hdr = (ext2_extent_hdr_t *)inode->block;
+
+	memset(inode->block, 0, sizeof(inode->block));
+	hdr->magic = EXTENT_MAGIC;
+	hdr->max = (sizeof(inode->block) - sizeof(ext2_extent_hdr_t)) / sizeof(ext2_extent_t);
+	inode->flags |= IFLAG_EXTENTS;
+}
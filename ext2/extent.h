@@ -0,0 +1,76 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Extent tree
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _EXTENT_H_
+#define _EXTENT_H_
+
+#include <stdint.h>
+
+#include "block.h"
+#include "ext2.h"
+#include "inode.h"
+
+
+/* Extent tree definitions */
+#define EXTENT_MAGIC    0xf30a /* Extent tree node magic */
+#define EXTENT_MAXDEPTH 5      /* Max extent tree depth */
+#define EXTENT_MAXLEN   32768  /* Max initialized extent length */
+
+
+typedef struct {
+	uint16_t magic;      /* Magic number (EXTENT_MAGIC) */
+	uint16_t entries;    /* Number of valid entries */
+	uint16_t max;        /* Max number of entries */
+	uint16_t depth;      /* Node depth (0 => leaf node) */
+	uint32_t generation; /* Tree generation */
+} __attribute__ ((packed)) ext2_extent_hdr_t;
+
+
+typedef struct {
+	uint32_t block;      /* First logical block covered by the child node */
+	uint32_t leafLo;     /* Child node block number (low 32 bits) */
+	uint16_t leafHi;     /* Child node block number (high 16 bits) */
+	uint16_t unused;     /* Unused */
+} __attribute__ ((packed)) ext2_extent_idx_t;
+
+
+typedef struct {
+	uint32_t block;      /* First logical block */
+	uint16_t len;        /* Number of blocks (> EXTENT_MAXLEN => uninitialized extent) */
+	uint16_t startHi;    /* First physical block (high 16 bits) */
+	uint32_t startLo;    /* First physical block (low 32 bits) */
+} __attribute__ ((packed)) ext2_extent_t;
+
+
+/* Maps logical block to physical block (bno = 0 => hole, uninitialized extents read as holes), returns number of mapped consecutive blocks */
+extern int ext2_extent_get(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t *bno);
+
+
+/* Maps logical block to be written (bno = 0 => hole), marks up to n blocks of uninitialized extent initialized, returns number of mapped consecutive blocks */
+extern int ext2_extent_map(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t n, uint32_t *bno);
+
+
+/* Maps n consecutive logical blocks (not mapped yet) to consecutive physical blocks */
+extern int ext2_extent_set(ext2_t *fs, ext2_obj_t *obj, uint32_t block, uint32_t bno, uint32_t n);
+
+
+/* Destroys blocks starting at given logical block (freed blocks are queued in the batch) */
+extern int ext2_extent_truncate(ext2_t *fs, ext2_obj_t *obj, uint32_t block, ext2_bfree_t *batch);
+
+
+/* Initializes empty extent tree in the inode */
+extern void ext2_extent_init(ext2_inode_t *inode);
+
+
+#endif
@@ -14,129 +14,199 @@
  */
 
 #include <errno.h>
-#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include <sys/stat.h>
+
 #include "block.h"
+#include "cache.h"
 #include "file.h"
+#include "inode.h"
+
+
+/* Detects sequential reads and queues following file blocks for readahead (requires object to be locked) */
+static void _ext2_file_readahead(ext2_t *fs, ext2_obj_t *obj, uint32_t start, uint32_t end)
+{
+	uint32_t block, last, bno, run, n = 0;
+
+	/* Sequential access continues in the last read block or in the next one */
+	if ((start == obj->ra.block) || (start + 1 == obj->ra.block)) {
+		if (!obj->ra.n)
+			obj->ra.n = READAHEAD_MIN;
+		else if (obj->ra.n < READAHEAD_MAX)
+			obj->ra.n <<= 1;
+	}
+	/* Random access => shrink readahead window */
+	else {
+		obj->ra.n = 0;
+		obj->ra.end = 0;
+	}
+
+	obj->ra.block = end + 1;
+
+	if (!obj->ra.n)
+		return;
+
+	/* Read ahead blocks in half window sized batches */
+	if (obj->ra.end < end + 1)
+		obj->ra.end = end + 1;
+	else if (obj->ra.end - end > obj->ra.n / 2)
+		return;
+
+	last = end + obj->ra.n;
+	if (last > (obj->inode->size - 1) / fs->blocksz)
+		last = (obj->inode->size - 1) / fs->blocksz;
+
+	/* Queue physically contiguous runs of blocks */
+	for (block = obj->ra.end, run = 0; block <= last; block++) {
+		if (ext2_block_get(fs, obj, block, &bno) < 0)
+			break;
+
+		if (run && (bno != run + n)) {
+			ext2_cache_readahead(fs, run, n);
+			run = 0;
+		}
+
+		if (bno && !run) {
+			run = bno;
+			n = 0;
+		}
+
+		if (run)
+			n++;
+	}
+
+	if (run)
+		ext2_cache_readahead(fs, run, n);
+
+	obj->ra.end = block;
+}
 
 
 ssize_t _ext2_file_read(ext2_t *fs, ext2_obj_t *obj, offs_t offs, char *buff, size_t len)
 {
 	uint32_t block = offs / fs->blocksz;
 	size_t l = 0;
-	void *data;
 	int err;
 
 	if ((offs < 0) || (offs >= obj->inode->size))
 		return 0;
 
-	if (len > obj->inode->size - offs)
+	if (len > (size_t)(obj->inode->size - offs))
 		len = obj->inode->size - offs;
 
 	if (!len)
 		return 0;
 
-	if (offs % fs->blocksz || len < fs->blocksz) {
-		if ((data = malloc(fs->blocksz)) == NULL)
-			return -ENOMEM;
+	/* Fast symlink target is stored in the inode */
+	if (ext2_inode_fastlink(fs, obj->inode)) {
+		memcpy(buff, (char *)obj->inode->block + offs, len);
+		obj->inode->atime = time(NULL);
 
-		if ((err = ext2_block_init(fs, obj, block, data)) < 0) {
-			free(data);
-			return err;
-		}
+		return len;
+	}
+
+	if (S_ISREG(obj->inode->mode))
+		_ext2_file_readahead(fs, obj, block, (offs + len - 1) / fs->blocksz);
 
+	/* Partial blocks are copied from the cache, whole blocks are read directly into the buffer */
+	if (offs % fs->blocksz || len < fs->blocksz) {
 		if ((l = fs->blocksz - offs % fs->blocksz) > len)
 			l = len;
 
-		memcpy(buff, data + offs % fs->blocksz, l);
-		free(data);
-		block++;
-	}
-
-	for (; block < (offs + len) / fs->blocksz; block++, l += fs->blocksz) {
-		if ((err = ext2_block_init(fs, obj, block, buff + l)) < 0)
+		if ((err = ext2_block_loadpart(fs, obj, block, offs % fs->blocksz, buff, l)) < 0)
 			return err;
-	}
 
-	if (len > l) {
-		if ((data = malloc(fs->blocksz)) == NULL)
-			return -ENOMEM;
+		block++;
+	}
 
-		if ((err = ext2_block_init(fs, obj, block, data)) < 0) {
-			free(data);
+	if (block < (offs + len) / fs->blocksz) {
+		if ((err = ext2_block_load(fs, obj, block, buff + l, (offs + len) / fs->blocksz - block)) < 0)
 			return err;
-		}
 
-		memcpy(buff + l, data, len - l);
-		free(data);
+		l += fs->blocksz * ((offs + len) / fs->blocksz - block);
+		block = (offs + len) / fs->blocksz;
 	}
 
+	if ((len > l) && ((err = ext2_block_loadpart(fs, obj, block, 0, buff + l, len - l)) < 0))
+		return err;
+
 	obj->inode->atime = time(NULL);
 
 	return len;
 }
 
 
-ssize_t _ext2_file_write(ext2_t *fs, ext2_obj_t *obj, offs_t offs, const char *buff, size_t len)
+/* Moves fast symlink target to a data block (requires object to be locked) */
+static int _ext2_file_slowlink(ext2_t *fs, ext2_obj_t *obj)
 {
-	uint32_t block = offs / fs->blocksz;
-	size_t l = 0;
-	void *data;
+	char target[FASTLINK_MAX];
+	uint32_t size = obj->inode->size;
 	int err;
 
-	if (!len)
-		return 0;
+	/* Symlink stays fast until its first block is allocated */
+	if (!size)
+		return EOK;
 
-	if (offs % fs->blocksz || len < fs->blocksz) {
-		if ((data = malloc(fs->blocksz)) == NULL)
-			return -ENOMEM;
+	memcpy(target, obj->inode->block, size);
+	memset(obj->inode->block, 0, sizeof(obj->inode->block));
 
-		if ((err = ext2_block_init(fs, obj, block, data)) < 0) {
-			free(data);
-			return err;
-		}
+	if ((err = ext2_block_syncpart(fs, obj, 0, 0, target, size)) < 0) {
+		memcpy(obj->inode->block, target, size);
+		return err;
+	}
+	obj->flags |= OFLAG_DIRTY;
 
-		if ((l = fs->blocksz - offs % fs->blocksz) > len)
-			l = len;
+	return EOK;
+}
 
-		memcpy(data + offs % fs->blocksz, buff, l);
 
-		if ((err = ext2_block_syncone(fs, obj, block, data)) < 0) {
-			free(data);
-			return err;
-		}
+ssize_t _ext2_file_write(ext2_t *fs, ext2_obj_t *obj, offs_t offs, const char *buff, size_t len)
+{
+	uint32_t block = offs / fs->blocksz;
+	size_t l = 0;
+	int err, fast;
 
-		free(data);
-		block++;
-	}
+	if (offs < 0)
+		return -EINVAL;
 
-	if (block < (offs + len) / fs->blocksz) {
-		if ((err = ext2_block_sync(fs, obj, block, buff + l, (offs + len) / fs->blocksz - block)) < 0)
+	if (!len)
+		return 0;
+
+	/* Targets shorter than FASTLINK_MAX are stored in the inode, longer targets in data blocks */
+	if ((fast = ext2_inode_fastlink(fs, obj->inode)) && (offs + len >= FASTLINK_MAX)) {
+		if ((err = _ext2_file_slowlink(fs, obj)) < 0)
 			return err;
 
-		l += fs->blocksz * ((offs + len) / fs->blocksz - block);
-		block = (offs + len) / fs->blocksz;
+		fast = 0;
 	}
 
-	if (len > l) {
-		if ((data = malloc(fs->blocksz)) == NULL)
-			return -ENOMEM;
+	if (fast) {
+		memcpy((char *)obj->inode->block + offs, buff, len);
+	}
+	else {
+		/* Partial blocks are updated in place in the cache */
+		if (offs % fs->blocksz || len < fs->blocksz) {
+			if ((l = fs->blocksz - offs % fs->blocksz) > len)
+				l = len;
 
-		if ((err = ext2_block_init(fs, obj, block, data)) < 0) {
-			free(data);
-			return err;
+			if ((err = ext2_block_syncpart(fs, obj, block, offs % fs->blocksz, buff, l)) < 0)
+				return err;
+
+			block++;
 		}
 
-		memcpy(data, buff + l, len - l);
+		if (block < (offs + len) / fs->blocksz) {
+			if ((err = ext2_block_sync(fs, obj, block, buff + l, (offs + len) / fs->blocksz - block)) < 0)
+				return err;
 
-		if ((err = ext2_block_syncone(fs, obj, block, data)) < 0) {
-			free(data);
-			return err;
+			l += fs->blocksz * ((offs + len) / fs->blocksz - block);
+			block = (offs + len) / fs->blocksz;
 		}
 
-		free(data);
+		if ((len > l) && ((err = ext2_block_syncpart(fs, obj, block, 0, buff + l, len - l)) < 0))
+			return err;
 	}
 
 	if (offs + len > obj->inode->size)
@@ -148,56 +218,38 @@ ssize_t _ext2_file_write(ext2_t *fs, ext2_obj_t *obj, offs_t offs, const char *b
 	if ((err = _ext2_obj_sync(fs, obj)) < 0)
 		return err;
 
-	if ((err = ext2_sb_sync(fs)) < 0)
-		return err;
-
 	return len;
 }
 
 
 int _ext2_file_truncate(ext2_t *fs, ext2_obj_t *obj, size_t size)
 {
-	uint32_t *bno, block, start = size / fs->blocksz, end = obj->inode->size / fs->blocksz, lbno = 0, n = 0;
-	int err;
-
-	if (obj->inode->size > size) {
-		for (block = start; block < end; block++) {
-			if ((err = ext2_block_get(fs, obj, block, &bno)) < 0)
-				return err;
-
-			if (!lbno || (*bno == lbno + 1)) {
-				n++;
-			}
-			else {
-				if ((err = ext2_block_destroy(fs, lbno + 1 - n, n)) < 0)
-					return err;
-
-				n = 1;
-			}
+	int err, fast;
 
-			lbno = *bno;
-		}
-
-		if (n && (err = ext2_block_destroy(fs, lbno + 1 - n, n)) < 0)
-			return err;
+	if ((err = ext2_block_discard(fs, obj)) < 0)
+		return err;
 
-		if ((err = ext2_iblock_destroy(fs, obj, start, end - start)) < 0)
+	/* Fast symlink grown past the inode is moved to a data block first */
+	if ((fast = ext2_inode_fastlink(fs, obj->inode)) && (size >= FASTLINK_MAX)) {
+		if ((err = _ext2_file_slowlink(fs, obj)) < 0)
 			return err;
 
-		if (!size) {
-			if ((err = ext2_block_get(fs, obj, 0, &bno)) < 0)
-				return err;
+		fast = 0;
+	}
 
-			if ((err = ext2_block_destroy(fs, *bno, 1)) < 0)
-				return err;
+	/* Fast symlink target tail is zeroed in the inode */
+	if (fast) {
+		if (obj->inode->size > size)
+			memset((char *)obj->inode->block + size, 0, obj->inode->size - size);
+	}
+	else if (obj->inode->size > size) {
+		if ((err = ext2_iblock_destroy(fs, obj, (size + fs->blocksz - 1) / fs->blocksz)) < 0)
+			return err;
 
-			if ((err = ext2_iblock_destroy(fs, obj, 0, 1)) < 0)
+		/* Zero the last block tail, so the file can be extended later without exposing stale data */
+		if (size % fs->blocksz) {
+			if ((err = ext2_block_zeropart(fs, obj, size / fs->blocksz, size % fs->blocksz, fs->blocksz - size % fs->blocksz)) < 0)
 				return err;
-
-			obj->inode->blocks = 0;
-		}
-		else {
-			obj->inode->blocks -= (end - start) * fs->blocksz / fs->sectorsz;
 		}
 	}
 
@@ -23,6 +23,11 @@
 #include "ext2.h"
 
 
+/* Readahead configuration */
+#define READAHEAD_MIN 4  /* Initial readahead window in blocks */
+#define READAHEAD_MAX 64 /* Max readahead window in blocks */
+
+
 /* Reads a file (requires object to be locked) */
 extern ssize_t _ext2_file_read(ext2_t *fs, ext2_obj_t *obj, offs_t offs, char *buff, size_t len);
 
@@ -17,39 +17,140 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/threads.h>
+
 #include "block.h"
+#include "cache.h"
 #include "gdt.h"
 
 
-int ext2_gdt_syncone(ext2_t *fs, uint32_t group)
+/* Marks group descriptor dirty (requires metadata to be locked) */
+static void _ext2_gdt_dirty(ext2_t *fs, uint32_t group)
 {
-	uint32_t blocks = (sizeof(ext2_gd_t) - 1) / fs->blocksz + 1;
-	uint32_t bno = fs->sb->fstBlock + group * sizeof(ext2_gd_t) / fs->blocksz + 1;
-	void *buff;
-	int err;
+	fs->gdtdirty[group * sizeof(ext2_gd_t) / fs->blocksz] = 1;
 
-	if ((buff = malloc(blocks * fs->blocksz)) == NULL)
-		return -ENOMEM;
+	/* Too many uncommitted changes => request commit */
+	if (++fs->mdirty >= COMMIT_THRESHOLD)
+		ext2_cache_wakeup(fs);
+}
 
-	if ((err = ext2_block_read(fs, bno, buff, blocks)) < 0) {
-		free(buff);
-		return err;
+
+void ext2_gdt_dirty(ext2_t *fs, uint32_t group)
+{
+	mutexLock(fs->mlock);
+
+	_ext2_gdt_dirty(fs, group);
+
+	mutexUnlock(fs->mlock);
+}
+
+
+void ext2_gdt_update(ext2_t *fs, uint32_t group, int32_t blocks, int32_t inodes, int32_t dirs)
+{
+	mutexLock(fs->mlock);
+
+	fs->gdt[group].freeBlocks += blocks;
+	fs->gdt[group].freeInodes += inodes;
+	fs->gdt[group].dirs += dirs;
+	fs->sb->freeBlocks += blocks;
+	fs->sb->freeInodes += inodes;
+	_ext2_gdt_dirty(fs, group);
+
+	mutexUnlock(fs->mlock);
+}
+
+
+void ext2_gdt_free(ext2_t *fs, uint32_t group, uint32_t *blocks, uint32_t *inodes)
+{
+	mutexLock(fs->mlock);
+
+	if (group < fs->groups) {
+		*blocks = fs->gdt[group].freeBlocks;
+		*inodes = fs->gdt[group].freeInodes;
+	}
+	else {
+		*blocks = fs->sb->freeBlocks;
+		*inodes = fs->sb->freeInodes;
 	}
 
-	memcpy(buff + group * sizeof(ext2_gd_t) % fs->blocksz, fs->gdt + group, sizeof(ext2_gd_t));
+	mutexUnlock(fs->mlock);
+}
 
-	if ((err = ext2_block_write(fs, bno, buff, blocks)) < 0) {
-		free(buff);
-		return err;
+
+int ext2_gdt_reserve(ext2_t *fs, int32_t blocks, uint32_t max)
+{
+	int err = EOK;
+
+	mutexLock(fs->mlock);
+
+	/* Keep at least half of free blocks for metadata and not delayed allocations */
+	if ((blocks > 0) && (fs->dblocks + blocks > max))
+		err = -ENOBUFS;
+	else if ((blocks > 0) && (2 * ((uint64_t)fs->dblocks + blocks) > fs->sb->freeBlocks))
+		err = -ENOSPC;
+	else
+		fs->dblocks += blocks;
+
+	mutexUnlock(fs->mlock);
+
+	return err;
+}
+
+
+int _ext2_gdt_sync(ext2_t *fs)
+{
+	uint32_t gdtsz = fs->groups * sizeof(ext2_gd_t);
+	uint32_t blocks = (gdtsz - 1) / fs->blocksz + 1;
+	uint32_t i, len, bno = fs->sb->fstBlock + 1;
+	void *buff = NULL;
+	int err = EOK;
+
+	for (i = 0; i < blocks; i++) {
+		if (!fs->gdtdirty[i])
+			continue;
+
+		fs->gdtdirty[i] = 0;
+
+		if ((len = gdtsz - i * fs->blocksz) >= fs->blocksz) {
+			err = ext2_block_write(fs, bno + i, (char *)fs->gdt + i * fs->blocksz, 1);
+		}
+		/* Last GDT block is shared with reserved GDT entries */
+		else if ((buff != NULL) || ((buff = malloc(fs->blocksz)) != NULL)) {
+			if ((err = ext2_block_read(fs, bno + i, buff, 1)) >= 0) {
+				memcpy(buff, (char *)fs->gdt + i * fs->blocksz, len);
+				err = ext2_block_write(fs, bno + i, buff, 1);
+			}
+		}
+		else {
+			err = -ENOMEM;
+		}
+
+		if (err < 0) {
+			fs->gdtdirty[i] = 1;
+			break;
+		}
 	}
 
 	free(buff);
 
-	return EOK;
+	return err;
 }
 
 
-int ext2_gdt_sync(ext2_t *fs)
+int ext2_gdt_destroy(ext2_t *fs)
+{
+	int err = _ext2_gdt_sync(fs);
+
+	resourceDestroy(fs->mlock);
+	free(fs->gdtdirty);
+	free(fs->gdt);
+	fs->gdt = NULL;
+
+	return err;
+}
+
+
+int ext2_gdt_load(ext2_t *fs)
 {
 	uint32_t gdtsz = fs->groups * sizeof(ext2_gd_t);
 	uint32_t blocks = gdtsz / fs->blocksz;
@@ -57,9 +158,10 @@ int ext2_gdt_sync(ext2_t *fs)
 	void *buff;
 	int err;
 
-	if ((err = ext2_block_write(fs, bno, fs->gdt, blocks)) < 0)
+	if ((err = ext2_block_read(fs, bno, fs->gdt, blocks)) < 0)
 		return err;
 
+	/* Last GDT block is shared with reserved GDT entries */
 	if (gdtsz % fs->blocksz) {
 		if ((buff = malloc(fs->blocksz)) == NULL)
 			return -ENOMEM;
@@ -69,13 +171,7 @@ int ext2_gdt_sync(ext2_t *fs)
 			return err;
 		}
 
-		memcpy(buff, (char *)fs->gdt + blocks * fs->blocksz, gdtsz % fs->blocksz);
-
-		if ((err = ext2_block_write(fs, bno + blocks, buff, 1)) < 0) {
-			free(buff);
-			return err;
-		}
-
+		memcpy((char *)fs->gdt + blocks * fs->blocksz, buff, gdtsz % fs->blocksz);
 		free(buff);
 	}
 
@@ -83,47 +179,36 @@ int ext2_gdt_sync(ext2_t *fs)
 }
 
 
-void ext2_gdt_destroy(ext2_t *fs)
-{
-	ext2_gdt_sync(fs);
-	free(fs->gdt);
-}
-
-
 int ext2_gdt_init(ext2_t *fs)
 {
 	uint32_t groups = (fs->sb->inodes - 1) / fs->sb->groupInodes + 1;
 	uint32_t gdtsz = groups * sizeof(ext2_gd_t);
-	uint32_t blocks = gdtsz / fs->blocksz;
-	uint32_t bno = fs->sb->fstBlock + 1;
-	void *buff;
 	int err;
 
 	if ((fs->gdt = (ext2_gd_t *)malloc(gdtsz)) == NULL)
 		return -ENOMEM;
 
-	if ((err = ext2_block_read(fs, bno, fs->gdt, blocks)) < 0) {
+	if ((fs->gdtdirty = (uint8_t *)calloc((gdtsz - 1) / fs->blocksz + 1, sizeof(uint8_t))) == NULL) {
 		free(fs->gdt);
-		return err;
+		return -ENOMEM;
 	}
 
-	if (gdtsz % fs->blocksz) {
-		if ((buff = malloc(fs->blocksz)) == NULL) {
-			free(fs->gdt);
-			return -ENOMEM;
-		}
+	fs->groups = groups;
 
-		if ((err = ext2_block_read(fs, bno + blocks, buff, 1)) < 0) {
-			free(fs->gdt);
-			free(buff);
-			return err;
-		}
+	if ((err = ext2_gdt_load(fs)) < 0) {
+		free(fs->gdtdirty);
+		free(fs->gdt);
+		return err;
+	}
 
-		memcpy((char *)fs->gdt + blocks * fs->blocksz, buff, gdtsz % fs->blocksz);
-		free(buff);
+	if ((err = mutexCreate(&fs->mlock)) < 0) {
+		free(fs->gdtdirty);
+		free(fs->gdt);
+		return err;
 	}
 
-	fs->groups = groups;
+	fs->mdirty = 0;
+	fs->dblocks = 0;
 
 	return EOK;
 }
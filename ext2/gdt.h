@@ -33,16 +33,32 @@ struct _ext2_gd_t {
 } __attribute__ ((packed));
 
 
-/* Synchronizes one group descriptor */
-extern int ext2_gdt_syncone(ext2_t *fs, uint32_t group);
+/* Marks group descriptor dirty (it's written back on metadata commit) */
+extern void ext2_gdt_dirty(ext2_t *fs, uint32_t group);
 
 
-/* Synchronizes GDT */
-extern int ext2_gdt_sync(ext2_t *fs);
+/* Adjusts group and SuperBlock free blocks, free inodes and directories counters, marks group descriptor dirty */
+extern void ext2_gdt_update(ext2_t *fs, uint32_t group, int32_t blocks, int32_t inodes, int32_t dirs);
 
 
-/* Destroys GDT */
-extern void ext2_gdt_destroy(ext2_t *fs);
+/* Returns group (or whole filesystem if group is out of range) free blocks and inodes counters, they are only hints (bitmaps are authoritative) */
+extern void ext2_gdt_free(ext2_t *fs, uint32_t group, uint32_t *blocks, uint32_t *inodes);
+
+
+/* Reserves free blocks for delayed allocation (blocks < 0 => releases reserved blocks), returns -ENOBUFS if more than max blocks would be reserved */
+extern int ext2_gdt_reserve(ext2_t *fs, int32_t blocks, uint32_t max);
+
+
+/* Synchronizes dirty GDT blocks (requires metadata to be locked) */
+extern int _ext2_gdt_sync(ext2_t *fs);
+
+
+/* Rereads GDT from the disk (e.g. after journal recovery) */
+extern int ext2_gdt_load(ext2_t *fs);
+
+
+/* Destroys GDT (returns write back error) */
+extern int ext2_gdt_destroy(ext2_t *fs);
 
 
 /* Initializes GDT */
@@ -0,0 +1,730 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Hashed directory index (HTree)
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "block.h"
+#include "dir.h"
+#include "htree.h"
+#include "inode.h"
+
+
+/* Index node path entry */
+typedef struct {
+	uint32_t block;               /* Node directory block */
+	char *data;                   /* Node data */
+	ext2_htree_entry_t *entries;  /* Node entries */
+	ext2_htree_entry_t *at;       /* Selected entry */
+} ext2_htree_path_t;
+
+
+/* Leaf block entry hash (used for splitting leaf blocks) */
+typedef struct {
+	uint32_t hash;                /* Entry hash */
+	uint16_t offs;                /* Entry offset */
+	uint16_t size;                /* Entry size */
+} ext2_htree_map_t;
+
+
+/* Returns index node entries count and limit */
+static inline ext2_htree_cnt_t *ext2_htree_cnt(ext2_htree_path_t *node)
+{
+	return (ext2_htree_cnt_t *)node->entries;
+}
+
+
+/* Legacy hash */
+static uint32_t ext2_htree_legacy(const char *name, uint8_t len, uint8_t sign)
+{
+	uint32_t hash, h0 = 0x12a3fe2d, h1 = 0x37abe8f9;
+	int c;
+
+	while (len--) {
+		c = (sign) ? (int)(signed char)*name++ : (int)(unsigned char)*name++;
+		hash = h1 + (h0 ^ (uint32_t)(c * 7152373));
+
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+
+		h1 = h0;
+		h0 = hash;
+	}
+
+	return h0 << 1;
+}
+
+
+/* Converts name to hash input buffer */
+static void ext2_htree_str2buf(const char *name, int len, uint32_t *buf, int num, uint8_t sign)
+{
+	uint32_t pad, val;
+	int i, c;
+
+	pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+	val = pad;
+
+	if (len > num * 4)
+		len = num * 4;
+
+	for (i = 0; i < len; i++) {
+		c = (sign) ? (int)(signed char)name[i] : (int)(unsigned char)name[i];
+		val = (uint32_t)c + (val << 8);
+
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+
+	if (--num >= 0)
+		*buf++ = val;
+
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+
+/* Half MD4 transform */
+static void ext2_htree_md4(uint32_t buf[4], const uint32_t in[8])
+{
+	static const uint8_t idx[3][8] = { { 0, 1, 2, 3, 4, 5, 6, 7 }, { 1, 3, 5, 7, 0, 2, 4, 6 }, { 3, 7, 2, 6, 1, 5, 0, 4 } };
+	static const uint8_t shift[3][4] = { { 3, 7, 11, 19 }, { 3, 5, 9, 13 }, { 3, 9, 11, 15 } };
+	static const uint32_t k[3] = { 0, 013240474631, 015666365641 };
+	uint32_t r[4], x, y, z, f;
+	int i, j, t;
+
+	memcpy(r, buf, sizeof(r));
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 8; j++) {
+			t = (4 - j % 4) % 4;
+			x = r[(t + 1) % 4];
+			y = r[(t + 2) % 4];
+			z = r[(t + 3) % 4];
+
+			if (i == 0)
+				f = z ^ (x & (y ^ z));
+			else if (i == 1)
+				f = (x & y) + ((x ^ y) & z);
+			else
+				f = x ^ y ^ z;
+
+			r[t] += f + in[idx[i][j]] + k[i];
+			r[t] = (r[t] << shift[i][j % 4]) | (r[t] >> (32 - shift[i][j % 4]));
+		}
+	}
+
+	for (i = 0; i < 4; i++)
+		buf[i] += r[i];
+}
+
+
+/* TEA transform */
+static void ext2_htree_tea(uint32_t buf[4], const uint32_t in[4])
+{
+	uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		sum += 0x9e3779b9;
+		b0 += ((b1 << 4) + in[0]) ^ (b1 + sum) ^ ((b1 >> 5) + in[1]);
+		b1 += ((b0 << 4) + in[2]) ^ (b0 + sum) ^ ((b0 >> 5) + in[3]);
+	}
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+
+int ext2_htree_hash(ext2_t *fs, uint8_t algo, const char *name, uint8_t len, uint32_t *hash)
+{
+	uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 }, in[8];
+	uint8_t sign = 1;
+	int i, l;
+
+	for (i = 0; i < 4; i++) {
+		if (fs->sb->hashSeed[i]) {
+			memcpy(buf, fs->sb->hashSeed, sizeof(buf));
+			break;
+		}
+	}
+
+	switch (algo) {
+	case HASH_UNSIGNED_LEGACY:
+		sign = 0;
+		/* Fall through */
+	case HASH_SIGNED_LEGACY:
+		*hash = ext2_htree_legacy(name, len, sign);
+		break;
+
+	case HASH_UNSIGNED_MD4:
+		sign = 0;
+		/* Fall through */
+	case HASH_SIGNED_MD4:
+		for (l = len; l > 0; l -= 32, name += 32) {
+			ext2_htree_str2buf(name, l, in, 8, sign);
+			ext2_htree_md4(buf, in);
+		}
+		*hash = buf[1];
+		break;
+
+	case HASH_UNSIGNED_TEA:
+		sign = 0;
+		/* Fall through */
+	case HASH_SIGNED_TEA:
+		for (l = len; l > 0; l -= 16, name += 16) {
+			ext2_htree_str2buf(name, l, in, 4, sign);
+			ext2_htree_tea(buf, in);
+		}
+		*hash = buf[0];
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	/* Lowest bit marks hash collisions continued in the next block, the highest hash value is reserved */
+	*hash &= ~1U;
+
+	if (*hash == 0xfffffffe)
+		*hash = 0xfffffffc;
+
+	return EOK;
+}
+
+
+/* Checks index node entries count and limit */
+static int ext2_htree_check(ext2_t *fs, ext2_htree_path_t *node)
+{
+	ext2_htree_cnt_t *cnt = ext2_htree_cnt(node);
+
+	if ((cnt->limit != (fs->blocksz - ((char *)node->entries - node->data)) / sizeof(ext2_htree_entry_t)) || !cnt->count || (cnt->count > cnt->limit))
+		return -EINVAL;
+
+	return EOK;
+}
+
+
+/* Finds last index node entry with hash not greater than given hash */
+static ext2_htree_entry_t *ext2_htree_entry(ext2_htree_path_t *node, uint32_t hash)
+{
+	int l = 1, r = ext2_htree_cnt(node)->count - 1, m;
+
+	while (l <= r) {
+		m = (l + r) / 2;
+
+		if (node->entries[m].hash > hash)
+			r = m - 1;
+		else
+			l = m + 1;
+	}
+
+	return node->entries + l - 1;
+}
+
+
+/* Searches directory block for given name, returns entry offset */
+static int ext2_htree_search(ext2_t *fs, const char *buff, const char *name, uint8_t len)
+{
+	ext2_dirent_t *entry;
+	uint32_t offs;
+
+	for (offs = 0; offs < fs->blocksz; offs += entry->size) {
+		entry = (ext2_dirent_t *)(buff + offs);
+
+		if (!entry->size)
+			break;
+
+		if (entry->ino && (entry->len == len) && !strncmp(entry->name, name, len))
+			return offs;
+	}
+
+	return -ENOENT;
+}
+
+
+/* Finds path to the leaf block for given name (path nodes buffers have to be set), returns lowest index node level (requires object to be locked) */
+static int _ext2_htree_lookup(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t len, ext2_htree_path_t *path, uint8_t *algo, uint32_t *hash)
+{
+	ext2_dirent_t *entry = (ext2_dirent_t *)path->data;
+	ext2_htree_info_t *info;
+	int i, err;
+
+	path->block = 0;
+
+	if ((err = ext2_block_init(fs, dir, 0, path->data)) < 0)
+		return err;
+
+	/* Index root is stored after "." and ".." entries */
+	if ((entry->size != DIRENT_SIZE(1)) || (((ext2_dirent_t *)(path->data + entry->size))->size != fs->blocksz - DIRENT_SIZE(1)))
+		return -EINVAL;
+
+	info = (ext2_htree_info_t *)(path->data + DIRENT_SIZE(1) + DIRENT_SIZE(2));
+
+	if (info->reserved || (info->infosz != sizeof(ext2_htree_info_t)) || (info->levels >= HTREE_LEVELS))
+		return -EINVAL;
+
+	*algo = info->hashAlgo;
+
+	if ((*algo <= HASH_SIGNED_TEA) && (fs->sb->flags & MISC_UNSIGNED_HASH))
+		*algo += HASH_UNSIGNED_LEGACY;
+
+	if ((err = ext2_htree_hash(fs, *algo, name, len, hash)) < 0)
+		return err;
+
+	path->entries = (ext2_htree_entry_t *)((char *)info + info->infosz);
+
+	for (i = 0;; i++) {
+		if ((err = ext2_htree_check(fs, path + i)) < 0)
+			return err;
+
+		path[i].at = ext2_htree_entry(path + i, *hash);
+
+		if (i == info->levels)
+			break;
+
+		path[i + 1].block = path[i].at->block;
+		path[i + 1].entries = (ext2_htree_entry_t *)(path[i + 1].data + sizeof(ext2_dirent_t));
+
+		if ((err = ext2_block_init(fs, dir, path[i + 1].block, path[i + 1].data)) < 0)
+			return err;
+	}
+
+	return i;
+}
+
+
+/* Moves path to the next leaf block if it may contain entries with given hash, returns 1 if path has been moved (requires object to be locked) */
+static int _ext2_htree_next(ext2_t *fs, ext2_obj_t *dir, uint32_t hash, ext2_htree_path_t *path, int level)
+{
+	int i, err;
+
+	for (i = level; ++path[i].at >= path[i].entries + ext2_htree_cnt(path + i)->count; i--) {
+		if (!i)
+			return 0;
+	}
+
+	if ((path[i].at->hash & ~1U) != hash)
+		return 0;
+
+	for (; i < level; i++) {
+		path[i + 1].block = path[i].at->block;
+
+		if ((err = ext2_block_init(fs, dir, path[i + 1].block, path[i + 1].data)) < 0)
+			return err;
+
+		if ((err = ext2_htree_check(fs, path + i + 1)) < 0)
+			return err;
+
+		path[i + 1].at = path[i + 1].entries;
+	}
+
+	return 1;
+}
+
+
+int _ext2_htree_find(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t len, char *buff, uint32_t *offs)
+{
+	ext2_htree_path_t path[HTREE_LEVELS];
+	uint32_t hash, block;
+	uint8_t algo;
+	int i, level, ret;
+	char *data;
+
+	if ((data = (char *)malloc(HTREE_LEVELS * fs->blocksz)) == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < HTREE_LEVELS; i++)
+		path[i].data = data + i * fs->blocksz;
+
+	do {
+		if ((ret = level = _ext2_htree_lookup(fs, dir, name, len, path, &algo, &hash)) < 0)
+			break;
+
+		/* Entries with colliding hashes may continue in the next blocks */
+		do {
+			block = path[level].at->block;
+
+			if ((ret = ext2_block_init(fs, dir, block, buff)) < 0)
+				break;
+
+			if ((ret = ext2_htree_search(fs, buff, name, len)) >= 0) {
+				*offs = ret;
+				ret = block * fs->blocksz;
+				break;
+			}
+		} while ((ret = _ext2_htree_next(fs, dir, hash, path, level)) > 0);
+
+		if (!ret)
+			ret = -ENOENT;
+	} while (0);
+
+	free(data);
+
+	return ret;
+}
+
+
+/* Appends new block to the directory (requires object to be locked) */
+static int _ext2_htree_append(ext2_t *fs, ext2_obj_t *dir, const char *data, uint32_t *block)
+{
+	int err;
+
+	*block = dir->inode->size / fs->blocksz;
+
+	if ((err = ext2_block_syncone(fs, dir, *block, data)) < 0)
+		return err;
+
+	dir->inode->size += fs->blocksz;
+	dir->flags |= OFLAG_DIRTY;
+
+	return EOK;
+}
+
+
+/* Inserts index entry after the selected entry */
+static void ext2_htree_insert(ext2_htree_path_t *node, uint32_t hash, uint32_t block)
+{
+	ext2_htree_cnt_t *cnt = ext2_htree_cnt(node);
+	ext2_htree_entry_t *entry = node->at + 1;
+
+	memmove(entry + 1, entry, (node->entries + cnt->count - entry) * sizeof(ext2_htree_entry_t));
+	entry->hash = hash;
+	entry->block = block;
+	cnt->count++;
+}
+
+
+/* Makes room for a new entry in the lowest index node (requires object to be locked) */
+static int _ext2_htree_room(ext2_t *fs, ext2_obj_t *dir, ext2_htree_path_t *path, int *level, char *buff)
+{
+	ext2_htree_path_t *root = path, *node = path + *level;
+	ext2_htree_cnt_t *cnt = ext2_htree_cnt(node), *ncnt;
+	ext2_htree_entry_t *entries;
+	uint32_t block, hash, split, offs;
+	int err;
+
+	if (cnt->count < cnt->limit)
+		return EOK;
+
+	/* Initialize new index node */
+	memset(buff, 0, sizeof(ext2_dirent_t));
+	((ext2_dirent_t *)buff)->size = fs->blocksz;
+	entries = (ext2_htree_entry_t *)(buff + sizeof(ext2_dirent_t));
+	ncnt = (ext2_htree_cnt_t *)entries;
+
+	/* Root node is full => move its entries to a new index node */
+	if (!*level) {
+		memcpy(entries, root->entries, cnt->count * sizeof(ext2_htree_entry_t));
+		ncnt->limit = (fs->blocksz - sizeof(ext2_dirent_t)) / sizeof(ext2_htree_entry_t);
+		ncnt->count = cnt->count;
+
+		if ((err = _ext2_htree_append(fs, dir, buff, &block)) < 0)
+			return err;
+
+		cnt->count = 1;
+		root->entries->block = block;
+		((ext2_htree_info_t *)root->entries - 1)->levels++;
+
+		if ((err = ext2_block_syncone(fs, dir, root->block, root->data)) < 0)
+			return err;
+
+		node = path + ++(*level);
+		node->block = block;
+		memcpy(node->data, buff, fs->blocksz);
+		node->entries = (ext2_htree_entry_t *)(node->data + sizeof(ext2_dirent_t));
+		node->at = node->entries + (root->at - root->entries);
+		root->at = root->entries;
+
+		return EOK;
+	}
+
+	/* Split index node, root node has to have room for the new node */
+	if (ext2_htree_cnt(root)->count >= ext2_htree_cnt(root)->limit)
+		return -ENOSPC;
+
+	split = cnt->count / 2;
+	hash = node->entries[split].hash;
+	memcpy(entries, node->entries + split, (cnt->count - split) * sizeof(ext2_htree_entry_t));
+	ncnt->limit = cnt->limit;
+	ncnt->count = cnt->count - split;
+	cnt->count = split;
+
+	if ((err = _ext2_htree_append(fs, dir, buff, &block)) < 0)
+		return err;
+
+	if ((err = ext2_block_syncone(fs, dir, node->block, node->data)) < 0)
+		return err;
+
+	ext2_htree_insert(root, hash, block);
+
+	if ((err = ext2_block_syncone(fs, dir, root->block, root->data)) < 0)
+		return err;
+
+	/* Selected entry has been moved to the new node */
+	if ((offs = node->at - node->entries) >= split) {
+		node->block = block;
+		memcpy(node->data, buff, fs->blocksz);
+		node->at = node->entries + offs - split;
+		root->at++;
+	}
+
+	return EOK;
+}
+
+
+/* Compares leaf block entries hashes */
+static int ext2_htree_cmp(const void *v1, const void *v2)
+{
+	const ext2_htree_map_t *m1 = (const ext2_htree_map_t *)v1, *m2 = (const ext2_htree_map_t *)v2;
+
+	if (m1->hash != m2->hash)
+		return (m1->hash < m2->hash) ? -1 : 1;
+
+	return (int)m1->offs - (int)m2->offs;
+}
+
+
+/* Packs directory block entries (extends last entry to the end of the block) */
+static void ext2_htree_pack(ext2_t *fs, char *buff)
+{
+	ext2_dirent_t *entry, *prev = NULL;
+	uint32_t offs, noffs, size;
+
+	for (offs = 0, noffs = 0; offs < fs->blocksz; offs += size) {
+		entry = (ext2_dirent_t *)(buff + offs);
+
+		if (!(size = entry->size))
+			break;
+
+		if (!entry->ino)
+			continue;
+
+		prev = (ext2_dirent_t *)memmove(buff + noffs, entry, DIRENT_SIZE(entry->len));
+		prev->size = DIRENT_SIZE(prev->len);
+		noffs += prev->size;
+	}
+
+	if (prev == NULL) {
+		prev = (ext2_dirent_t *)buff;
+		memset(prev, 0, sizeof(ext2_dirent_t));
+	}
+
+	prev->size += fs->blocksz - noffs;
+}
+
+
+/* Splits full leaf block moving entries with higher hashes to a new block, returns the new block lowest hash */
+static int ext2_htree_split(ext2_t *fs, uint8_t algo, char *leaf, char *nleaf, uint32_t *res)
+{
+	ext2_dirent_t *entry, *nentry = NULL;
+	ext2_htree_map_t *map;
+	uint32_t offs, noffs, size, i, n = 0, split;
+	int err;
+
+	if ((map = (ext2_htree_map_t *)malloc(fs->blocksz / DIRENT_SIZE(1) * sizeof(ext2_htree_map_t))) == NULL)
+		return -ENOMEM;
+
+	for (offs = 0; offs < fs->blocksz; offs += entry->size) {
+		entry = (ext2_dirent_t *)(leaf + offs);
+
+		if (!entry->size) {
+			free(map);
+			return -EINVAL;
+		}
+
+		if (!entry->ino)
+			continue;
+
+		if ((err = ext2_htree_hash(fs, algo, entry->name, entry->len, &map[n].hash)) < 0) {
+			free(map);
+			return err;
+		}
+
+		map[n].offs = offs;
+		map[n++].size = DIRENT_SIZE(entry->len);
+	}
+
+	if (n < 2) {
+		free(map);
+		return -ENOSPC;
+	}
+
+	qsort(map, n, sizeof(ext2_htree_map_t), ext2_htree_cmp);
+
+	/* Split entries in half size-wise */
+	for (split = n, size = 0; (split > 1) && (size + map[split - 1].size / 2 <= fs->blocksz / 2); size += map[--split].size);
+
+	if (split == n)
+		split--;
+
+	/* Entries with the same hash as the last entry left in the block continue in the new block */
+	*res = map[split].hash + (map[split].hash == map[split - 1].hash);
+
+	for (i = split, noffs = 0; i < n; i++) {
+		entry = (ext2_dirent_t *)(leaf + map[i].offs);
+		nentry = (ext2_dirent_t *)memcpy(nleaf + noffs, entry, map[i].size);
+		nentry->size = map[i].size;
+		noffs += map[i].size;
+		entry->ino = 0;
+	}
+	nentry->size += fs->blocksz - noffs;
+
+	ext2_htree_pack(fs, leaf);
+	free(map);
+
+	return EOK;
+}
+
+
+int _ext2_htree_add(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t len, uint16_t mode, uint32_t ino)
+{
+	ext2_htree_path_t path[HTREE_LEVELS];
+	uint32_t hash, nhash, block, nblock;
+	char *data, *leaf, *nleaf;
+	uint8_t algo;
+	int i, level, err;
+
+	/* Index nodes, leaf blocks and new index node buffers */
+	if ((data = (char *)malloc((HTREE_LEVELS + 3) * fs->blocksz)) == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < HTREE_LEVELS; i++)
+		path[i].data = data + i * fs->blocksz;
+
+	leaf = data + HTREE_LEVELS * fs->blocksz;
+	nleaf = leaf + fs->blocksz;
+
+	do {
+		if ((err = level = _ext2_htree_lookup(fs, dir, name, len, path, &algo, &hash)) < 0)
+			break;
+
+		block = path[level].at->block;
+
+		if ((err = ext2_block_init(fs, dir, block, leaf)) < 0)
+			break;
+
+		if ((err = ext2_dir_insert(fs, leaf, name, len, mode, ino)) != -ENOSPC) {
+			if (!err)
+				err = ext2_block_syncone(fs, dir, block, leaf);
+			break;
+		}
+
+		/* Leaf block is full => split it */
+		if ((err = _ext2_htree_room(fs, dir, path, &level, nleaf + fs->blocksz)) < 0)
+			break;
+
+		if ((err = ext2_htree_split(fs, algo, leaf, nleaf, &nhash)) < 0)
+			break;
+
+		if ((err = ext2_dir_insert(fs, (hash >= nhash) ? nleaf : leaf, name, len, mode, ino)) < 0)
+			break;
+
+		if ((err = _ext2_htree_append(fs, dir, nleaf, &nblock)) < 0)
+			break;
+
+		if ((err = ext2_block_syncone(fs, dir, block, leaf)) < 0)
+			break;
+
+		ext2_htree_insert(path + level, nhash, nblock);
+		err = ext2_block_syncone(fs, dir, path[level].block, path[level].data);
+	} while (0);
+
+	if (!err) {
+		dir->inode->mtime = dir->inode->atime = time(NULL);
+		dir->flags |= OFLAG_DIRTY;
+	}
+
+	free(data);
+
+	return err;
+}
+
+
+int _ext2_htree_init(ext2_t *fs, ext2_obj_t *dir)
+{
+	ext2_dirent_t *entry, *dot, *dotdot;
+	ext2_htree_entry_t *entries;
+	ext2_htree_info_t *info;
+	ext2_htree_cnt_t *cnt;
+	uint32_t offs, block;
+	char *root, *leaf;
+	int err;
+
+	if ((dir->inode->size != fs->blocksz) || (fs->sb->hashAlgo > HASH_SIGNED_TEA))
+		return -EINVAL;
+
+	if ((root = (char *)malloc(2 * fs->blocksz)) == NULL)
+		return -ENOMEM;
+
+	leaf = root + fs->blocksz;
+
+	do {
+		if ((err = ext2_block_init(fs, dir, 0, root)) < 0)
+			break;
+
+		dot = (ext2_dirent_t *)root;
+		dotdot = (ext2_dirent_t *)(root + dot->size);
+
+		if ((dot->size < DIRENT_SIZE(1)) || (dot->size + DIRENT_SIZE(2) > fs->blocksz) || (dot->len != 1) || strncmp(dot->name, ".", 1) ||
+			(dotdot->len != 2) || strncmp(dotdot->name, "..", 2)) {
+			err = -EINVAL;
+			break;
+		}
+
+		/* Move remaining entries to the first leaf block */
+		memcpy(leaf, root, fs->blocksz);
+		entry = (ext2_dirent_t *)leaf;
+		entry->ino = 0;
+		entry = (ext2_dirent_t *)(leaf + dot->size);
+		entry->ino = 0;
+		ext2_htree_pack(fs, leaf);
+
+		/* Initialize index root */
+		offs = dot->size;
+		dot->size = DIRENT_SIZE(1);
+		dotdot = (ext2_dirent_t *)memmove(root + dot->size, root + offs, DIRENT_SIZE(2));
+		dotdot->size = fs->blocksz - dot->size;
+		memset(root + DIRENT_SIZE(1) + DIRENT_SIZE(2), 0, fs->blocksz - DIRENT_SIZE(1) - DIRENT_SIZE(2));
+
+		info = (ext2_htree_info_t *)(root + DIRENT_SIZE(1) + DIRENT_SIZE(2));
+		info->hashAlgo = fs->sb->hashAlgo;
+		info->infosz = sizeof(ext2_htree_info_t);
+
+		entries = (ext2_htree_entry_t *)(info + 1);
+		cnt = (ext2_htree_cnt_t *)entries;
+		cnt->limit = (fs->blocksz - ((char *)entries - root)) / sizeof(ext2_htree_entry_t);
+		cnt->count = 1;
+
+		if ((err = _ext2_htree_append(fs, dir, leaf, &block)) < 0)
+			break;
+
+		entries->block = block;
+
+		if ((err = ext2_block_syncone(fs, dir, 0, root)) < 0)
+			break;
+
+		dir->inode->flags |= IFLAG_INDEX;
+		dir->flags |= OFLAG_DIRTY;
+	} while (0);
+
+	free(root);
+
+	return err;
+}
@@ -0,0 +1,64 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Hashed directory index (HTree)
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _HTREE_H_
+#define _HTREE_H_
+
+#include <stdint.h>
+
+#include "ext2.h"
+
+
+/* Directory index definitions */
+#define HTREE_LEVELS 2          /* Max index depth (root node + one level of index nodes) */
+
+
+typedef struct {
+	uint32_t reserved;          /* Reserved (zero) */
+	uint8_t hashAlgo;           /* Hash algorithm */
+	uint8_t infosz;             /* Info structure size */
+	uint8_t levels;             /* Number of index nodes levels below the root */
+	uint8_t flags;              /* Unused flags */
+} __attribute__ ((packed)) ext2_htree_info_t;
+
+
+typedef struct {
+	uint16_t limit;             /* Max number of entries in the node */
+	uint16_t count;             /* Number of entries in the node */
+} __attribute__ ((packed)) ext2_htree_cnt_t;
+
+
+typedef struct {
+	uint32_t hash;              /* Lowest hash in the block (first node entry holds count and limit instead) */
+	uint32_t block;             /* Directory block */
+} __attribute__ ((packed)) ext2_htree_entry_t;
+
+
+/* Calculates directory entry name hash */
+extern int ext2_htree_hash(ext2_t *fs, uint8_t algo, const char *name, uint8_t len, uint32_t *hash);
+
+
+/* Finds directory entry using the index, returns entry block offset (requires object to be locked) */
+extern int _ext2_htree_find(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t len, char *buff, uint32_t *offs);
+
+
+/* Adds directory entry using the index (requires object to be locked) */
+extern int _ext2_htree_add(ext2_t *fs, ext2_obj_t *dir, const char *name, uint8_t len, uint16_t mode, uint32_t ino);
+
+
+/* Converts single block directory to indexed directory (requires object to be locked) */
+extern int _ext2_htree_init(ext2_t *fs, ext2_obj_t *dir);
+
+
+#endif
@@ -21,121 +21,126 @@
 #include <sys/stat.h>
 
 #include "block.h"
+#include "bmp.h"
+#include "cache.h"
 #include "inode.h"
 
 
-int ext2_inode_sync(ext2_t *fs, uint32_t ino, ext2_inode_t *inode)
+/* Calculates inode table block number and inode offset in the block */
+static inline uint32_t ext2_inode_bno(ext2_t *fs, uint32_t ino, uint32_t *offs)
 {
 	uint32_t group = (ino - 1) / fs->sb->groupInodes;
 	uint32_t inodes = fs->blocksz / fs->sb->inodesz;
-	uint32_t bno = fs->gdt[group].inodeTbl + ((ino - 1) % fs->sb->groupInodes) / inodes;
-	char *buff;
-	int err;
 
-	if (((fs->root != NULL) && (ino < (uint32_t)fs->root->id)) || (ino > fs->sb->inodes))
-		return -EINVAL;
+	*offs = ((ino - 1) % inodes) * fs->sb->inodesz;
 
-	if ((buff = (char *)malloc(fs->blocksz)) == NULL)
-		return -ENOMEM;
+	return fs->gdt[group].inodeTbl + ((ino - 1) % fs->sb->groupInodes) / inodes;
+}
 
-	if ((err = ext2_block_read(fs, bno, buff, 1)) < 0) {
-		free(buff);
-		return err;
-	}
 
-	memcpy(buff + ((ino - 1) % inodes) * fs->sb->inodesz, inode, fs->sb->inodesz);
+int ext2_inode_sync(ext2_t *fs, uint32_t ino, ext2_inode_t *inode)
+{
+	uint32_t bno, offs;
 
-	if ((err = ext2_block_write(fs, bno, buff, 1)) < 0) {
-		free(buff);
-		return err;
-	}
+	if (((fs->root != NULL) && (ino < (uint32_t)fs->root->id)) || (ino > fs->sb->inodes))
+		return -EINVAL;
 
-	free(buff);
+	/* Inode is updated in the cached inode table block, the block is written back once for all its dirty inodes */
+	bno = ext2_inode_bno(fs, ino, &offs);
 
-	return EOK;
+	return ext2_block_writepart(fs, bno, offs, inode, fs->sb->inodesz);
 }
 
 
-ext2_inode_t *ext2_inode_init(ext2_t *fs, uint32_t ino)
+int ext2_inode_init(ext2_t *fs, uint32_t ino, ext2_inode_t *inode)
 {
-	uint32_t group = (ino - 1) / fs->sb->groupInodes;
-	uint32_t inodes = fs->blocksz / fs->sb->inodesz;
-	uint32_t bno = fs->gdt[group].inodeTbl + ((ino - 1) % fs->sb->groupInodes) / inodes;
-	ext2_inode_t *inode;
-	char *buff;
+	uint32_t bno, offs;
 
 	if (((fs->root != NULL) && (ino < (uint32_t)fs->root->id)) || (ino > fs->sb->inodes))
-		return NULL;
+		return -EINVAL;
 
-	if ((buff = (char *)malloc(fs->blocksz)) == NULL)
-		return NULL;
+	bno = ext2_inode_bno(fs, ino, &offs);
 
-	if (ext2_block_read(fs, bno, buff, 1) < 0) {
-		free(buff);
-		return NULL;
-	}
+	return ext2_block_readpart(fs, bno, offs, inode, fs->sb->inodesz);
+}
 
-	if ((inode = (ext2_inode_t *)malloc(fs->sb->inodesz)) == NULL) {
-		free(buff);
-		return NULL;
-	}
 
-	memcpy(inode, buff + ((ino - 1) % inodes) * fs->sb->inodesz, fs->sb->inodesz);
-	free(buff);
+int ext2_inode_fastlink(ext2_t *fs, ext2_inode_t *inode)
+{
+	/* Fast symlinks have no data blocks (extended attributes block is the only one counted) and fit in the inode */
+	return S_ISLNK(inode->mode) && (inode->size < FASTLINK_MAX) && (inode->blocks == ((inode->fileACL) ? fs->blocksz / INODE_BLOCKSZ : 0));
+}
 
-	return inode;
+
+static int ext2_inode_cmp(const void *i1, const void *i2)
+{
+	uint32_t ino1 = *(const uint32_t *)i1, ino2 = *(const uint32_t *)i2;
+
+	return (ino1 > ino2) - (ino1 < ino2);
 }
 
 
-int ext2_inode_destroy(ext2_t *fs, uint32_t ino, uint16_t mode)
+/* Queues run of n inode table blocks for readahead if at least 1/STATAHEAD_DENSITY of its inodes are to be stat'ed */
+static inline void ext2_inode_prefetch(ext2_t *fs, uint32_t bno, uint32_t n, uint32_t inodes)
 {
-	uint32_t group = (ino - 1) / fs->sb->groupInodes;
-	void *bmp;
-	int err;
+	if (inodes * STATAHEAD_DENSITY >= n * (fs->blocksz / fs->sb->inodesz))
+		ext2_cache_readahead(fs, bno, n);
+}
 
-	if (((fs->root != NULL) && (ino < (uint32_t)fs->root->id)) || (ino > fs->sb->inodes))
-		return -EINVAL;
 
-	if ((bmp = malloc(fs->blocksz)) == NULL)
-		return -ENOMEM;
+void ext2_inode_readahead(ext2_t *fs, uint32_t *inos, uint32_t n)
+{
+	uint32_t i, bno, offs, start = 0, end = 0, inodes = 0;
 
-	if ((err = ext2_block_read(fs, fs->gdt[group].inodeBmp, bmp, 1)) < 0) {
-		free(bmp);
-		return err;
-	}
+	/* Hashed directories list entries out of inode order */
+	qsort(inos, n, sizeof(uint32_t), ext2_inode_cmp);
 
-	ext2_togglebit(bmp, (ino - 1) % fs->sb->groupInodes + 1);
+	/* Inodes of one directory are mostly allocated in the same group => merge their blocks into runs */
+	for (i = 0; i < n; i++) {
+		if (((fs->root != NULL) && (inos[i] < (uint32_t)fs->root->id)) || (inos[i] > fs->sb->inodes))
+			continue;
 
-	if ((err = ext2_block_write(fs, fs->gdt[group].inodeBmp, bmp, 1)) < 0) {
-		free(bmp);
-		return err;
-	}
+		bno = ext2_inode_bno(fs, inos[i], &offs);
 
-	if (S_ISDIR(mode))
-		fs->gdt[group].dirs--;
-	fs->gdt[group].freeInodes++;
+		if (end > start) {
+			if (bno < end) {
+				inodes++;
+				continue;
+			}
 
-	if ((err = ext2_gdt_syncone(fs, group)) < 0) {
-		ext2_togglebit(bmp, (ino - 1) % fs->sb->groupInodes + 1);
+			if (bno - end <= STATAHEAD_GAP) {
+				end = bno + 1;
+				inodes++;
+				continue;
+			}
 
-		if (!ext2_block_write(fs, fs->gdt[group].inodeBmp, bmp, 1)) {
-			if (S_ISDIR(mode))
-				fs->gdt[group].dirs++;
-			fs->gdt[group].freeInodes--;
-		}
-		else {
-			fs->sb->freeInodes++;
-			ext2_sb_sync(fs);
+			ext2_inode_prefetch(fs, start, end - start, inodes);
 		}
 
-		free(bmp);
-		return err;
+		start = bno;
+		end = bno + 1;
+		inodes = 1;
 	}
 
-	free(bmp);
-	fs->sb->freeInodes++;
+	if (end > start)
+		ext2_inode_prefetch(fs, start, end - start, inodes);
+}
+
 
-	return ext2_sb_sync(fs);
+int ext2_inode_destroy(ext2_t *fs, uint32_t ino, uint16_t mode)
+{
+	uint32_t group = (ino - 1) / fs->sb->groupInodes;
+	int ret;
+
+	if (((fs->root != NULL) && (ino < (uint32_t)fs->root->id)) || (ino > fs->sb->inodes))
+		return -EINVAL;
+
+	if ((ret = ext2_bmp_free(fs, BMP_INODE, group, (ino - 1) % fs->sb->groupInodes + 1, 1)) <= 0)
+		return ret;
+
+	ext2_gdt_update(fs, group, 0, 1, S_ISDIR(mode) ? -1 : 0);
+
+	return EOK;
 }
 
 
@@ -143,22 +148,26 @@ int ext2_inode_destroy(ext2_t *fs, uint32_t ino, uint16_t mode)
 static uint32_t ext2_inode_filegroup(ext2_t *fs, uint32_t pino)
 {
 	uint32_t pgroup = (pino - 1) / fs->sb->groupInodes;
-	uint32_t i, group = (pgroup + pino) % fs->groups;
+	uint32_t i, group = (pgroup + pino) % fs->groups, bfree, ifree;
+
+	ext2_gdt_free(fs, pgroup, &bfree, &ifree);
 
-	if (fs->gdt[pgroup].freeInodes && fs->gdt[pgroup].freeBlocks)
+	if (ifree && bfree)
 		return pgroup;
 
 	for (i = 1; i < fs->groups; i <<= 1) {
 		group = (group + i) % fs->groups;
+		ext2_gdt_free(fs, group, &bfree, &ifree);
 
-		if (fs->gdt[group].freeInodes && fs->gdt[group].freeBlocks)
+		if (ifree && bfree)
 			return group;
 	}
 
 	for (i = 0, group = pgroup; i < fs->groups; i++) {
 		group = (group + 1) % fs->groups;
+		ext2_gdt_free(fs, group, &bfree, &ifree);
 
-		if (fs->gdt[group].freeInodes)
+		if (ifree)
 			return group;
 	}
 
@@ -169,9 +178,12 @@ static uint32_t ext2_inode_filegroup(ext2_t *fs, uint32_t pino)
 /* Calculates new inode directory group */
 static uint32_t ext2_inode_dirgroup(ext2_t *fs, uint32_t pino)
 {
-	uint32_t ifree = fs->sb->freeInodes / fs->groups;
-	uint32_t bfree = fs->sb->freeBlocks / fs->groups;
-	uint32_t i, pgroup, group;
+	uint32_t i, pgroup, group, bfree, ifree, gbfree, gifree;
+
+	/* Groups with above average free inodes and blocks are preferred */
+	ext2_gdt_free(fs, fs->groups, &bfree, &ifree);
+	bfree /= fs->groups;
+	ifree /= fs->groups;
 
 	if ((fs->root != NULL) && (pino == (uint32_t)fs->root->id))
 		pgroup = rand() % fs->groups;
@@ -180,27 +192,25 @@ static uint32_t ext2_inode_dirgroup(ext2_t *fs, uint32_t pino)
 
 	for (i = 0; i < fs->groups; i++) {
 		group = (pgroup + i) % fs->groups;
+		ext2_gdt_free(fs, group, &gbfree, &gifree);
 
-		if (fs->gdt[group].freeInodes < ifree)
-			continue;
-
-		if (fs->gdt[group].freeBlocks < bfree)
-			continue;
-
-		return group;
+		if ((gifree >= ifree) && (gbfree >= bfree))
+			return group;
 	}
 
 	for (i = 0; i < fs->groups; i++) {
 		group = (pgroup + i) % fs->groups;
+		ext2_gdt_free(fs, group, &gbfree, &gifree);
 
-		if (fs->gdt[group].freeInodes >= ifree)
+		if (gifree >= ifree)
 			return group;
 	}
 
 	for (i = 0; i < fs->groups; i++) {
 		group = (pgroup + i) % fs->groups;
+		ext2_gdt_free(fs, group, &gbfree, &gifree);
 
-		if (fs->gdt[group].freeInodes)
+		if (gifree)
 			return group;
 	}
 
@@ -211,7 +221,6 @@ static uint32_t ext2_inode_dirgroup(ext2_t *fs, uint32_t pino)
 uint32_t ext2_inode_create(ext2_t *fs, uint32_t pino, uint16_t mode)
 {
 	uint32_t group, ino;
-	void *bmp;
 
 	if (S_ISDIR(mode))
 		group = ext2_inode_dirgroup(fs, pino);
@@ -221,52 +230,10 @@ uint32_t ext2_inode_create(ext2_t *fs, uint32_t pino, uint16_t mode)
 	if (group == fs->groups)
 		return 0;
 
-	if ((bmp = malloc(fs->blocksz)) == NULL)
-		return 0;
-
-	if (ext2_block_read(fs, fs->gdt[group].inodeBmp, bmp, 1) < 0) {
-		free(bmp);
-		return 0;
-	}
-
-	if (!(ino = ext2_findzerobit(bmp, fs->sb->groupInodes, 0))) {
-		free(bmp);
-		return 0;
-	}
-
-	ext2_togglebit(bmp, ino);
-
-	if (ext2_block_write(fs, fs->gdt[group].inodeBmp, bmp, 1) < 0) {
-		free(bmp);
-		return 0;
-	}
-
-	if (S_ISDIR(mode))
-		fs->gdt[group].dirs++;
-	fs->gdt[group].freeInodes--;
-
-	if (ext2_gdt_syncone(fs, group) < 0) {
-		ext2_togglebit(bmp, ino);
-
-		if (!ext2_block_write(fs, fs->gdt[group].inodeBmp, bmp, 1)) {
-			if (S_ISDIR(mode))
-				fs->gdt[group].dirs--;
-			fs->gdt[group].freeInodes++;
-		}
-		else {
-			fs->sb->freeInodes--;
-			ext2_sb_sync(fs);
-		}
-
-		free(bmp);
+	if (ext2_bmp_alloc(fs, BMP_INODE, group, 0, 1, 1, 1, &ino) <= 0)
 		return 0;
-	}
 
-	free(bmp);
-	fs->sb->freeInodes--;
-
-	if (ext2_sb_sync(fs) < 0)
-		return 0;
+	ext2_gdt_update(fs, group, 0, -1, S_ISDIR(mode) ? 1 : 0);
 
 	return group * fs->sb->groupInodes + ino;
 }
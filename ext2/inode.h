@@ -28,6 +28,14 @@
 #define TRIPPLE_INDIRECT_BLOCK (DOUBLE_INDIRECT_BLOCK + 1) /* Tripple indirect block */
 #define NBLOCKS (TRIPPLE_INDIRECT_BLOCK + 1)               /* Total number of blocks */
 #define INDIRECT_BLOCKS (NBLOCKS - DIRECT_BLOCKS)          /* Number of indirect blocks */
+#define INODE_BLOCKSZ 512                                  /* Inode blocks counter unit */
+#define FASTLINK_MAX (NBLOCKS * sizeof(uint32_t))          /* Max fast symlink target length (including terminating NUL) */
+
+
+/* Stat-ahead configuration */
+#define STATAHEAD_MAX     64 /* Max number of inodes collected for readahead at once */
+#define STATAHEAD_GAP     4  /* Max gap between inode table blocks read ahead in one run */
+#define STATAHEAD_DENSITY 4  /* Min part (1/STATAHEAD_DENSITY) of run inodes that need to be listed to read it ahead */
 
 
 /* Inode flags */
@@ -120,8 +128,16 @@ typedef struct {
 extern int ext2_inode_sync(ext2_t *fs, uint32_t ino, ext2_inode_t *inode);
 
 
-/* Initializes inode */
-extern ext2_inode_t *ext2_inode_init(ext2_t *fs, uint32_t ino);
+/* Initializes inode (reads it into given buffer) */
+extern int ext2_inode_init(ext2_t *fs, uint32_t ino, ext2_inode_t *inode);
+
+
+/* Returns 1 if inode is a fast symlink (target is stored in the inode blocks array) */
+extern int ext2_inode_fastlink(ext2_t *fs, ext2_inode_t *inode);
+
+
+/* Queues inode table blocks holding given inodes for readahead (sorts inodes numbers) */
+extern void ext2_inode_readahead(ext2_t *fs, uint32_t *inos, uint32_t n);
 
 
 /* Destroys inode */
@@ -0,0 +1,848 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Metadata journal
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/threads.h>
+
+#include "block.h"
+#include "cache.h"
+#include "gdt.h"
+#include "journal.h"
+#include "obj.h"
+#include "sb.h"
+#include "stats.h"
+
+
+/* Revoked block record */
+typedef struct {
+	uint32_t bno;                 /* Block number */
+	uint32_t tid;                 /* Last transaction revoking the block */
+} ext2_jrevoke_t;
+
+
+/* Reads big-endian 16-bit journal field */
+static inline uint16_t ext2_journal_get16(const char *field)
+{
+	const uint8_t *b = (const uint8_t *)field;
+
+	return (uint16_t)((b[0] << 8) | b[1]);
+}
+
+
+/* Writes big-endian 16-bit journal field */
+static inline void ext2_journal_set16(char *field, uint16_t val)
+{
+	field[0] = (char)(val >> 8);
+	field[1] = (char)val;
+}
+
+
+/* Reads big-endian 32-bit journal field */
+static inline uint32_t ext2_journal_get32(const char *field)
+{
+	const uint8_t *b = (const uint8_t *)field;
+
+	return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+
+/* Writes big-endian 32-bit journal field */
+static inline void ext2_journal_set32(char *field, uint32_t val)
+{
+	field[0] = (char)(val >> 24);
+	field[1] = (char)(val >> 16);
+	field[2] = (char)(val >> 8);
+	field[3] = (char)val;
+}
+
+
+/* Initializes journal block header */
+static inline void ext2_journal_hdr(char *block, uint32_t type, uint32_t tid)
+{
+	ext2_journal_set32(block + JHDR_MAGIC, JOURNAL_MAGIC);
+	ext2_journal_set32(block + JHDR_TYPE, type);
+	ext2_journal_set32(block + JHDR_SEQUENCE, tid);
+}
+
+
+/* Returns log block n blocks after blk (the log wraps around at the end of the journal) */
+static inline uint32_t ext2_journal_next(ext2_journal_t *journal, uint32_t blk, uint32_t n)
+{
+	for (blk += n; blk >= journal->maxlen; blk -= journal->maxlen - journal->first);
+
+	return blk;
+}
+
+
+/* Compares transaction IDs (IDs wrap around) */
+static inline int32_t ext2_journal_tidcmp(uint32_t tid1, uint32_t tid2)
+{
+	return (int32_t)(tid1 - tid2);
+}
+
+
+/* Reads or writes journal blocks (given journal relative block number) */
+static int ext2_journal_io(ext2_t *fs, ext2_journal_t *journal, uint32_t blk, char *buff, uint32_t n, uint8_t write)
+{
+	uint32_t i, offs, k;
+	ssize_t size;
+	offs_t addr;
+
+	for (i = 0, offs = 0; n && (i < journal->nruns); offs += journal->map[i++].n) {
+		while (n && (blk < offs + journal->map[i].n)) {
+			if ((k = offs + journal->map[i].n - blk) > n)
+				k = n;
+
+			if (k > CACHE_MAXRUN)
+				k = CACHE_MAXRUN;
+
+			size = k * fs->blocksz;
+			addr = (offs_t)(journal->map[i].start + blk - offs) * fs->blocksz;
+			ext2_stats_dev(fs, LIBEXT2_IO_JOURNAL, k, write);
+
+			if (((write) ? fs->write(fs->oid.id, addr, buff, size) : fs->read(fs->oid.id, addr, buff, size)) != size)
+				return -EIO;
+
+			buff += size;
+			blk += k;
+			n -= k;
+		}
+	}
+
+	return (n) ? -EINVAL : EOK;
+}
+
+
+/* Releases journal */
+static void ext2_journal_release(ext2_journal_t *journal)
+{
+	free(journal->buff);
+	free(journal->jsb);
+	free(journal->map);
+	free(journal);
+}
+
+
+/* Maps journal inode blocks */
+static int ext2_journal_map(ext2_t *fs, ext2_journal_t *journal)
+{
+	ext2_bmprun_t *map, *run;
+	ext2_obj_t *obj;
+	uint32_t i, blocks, bno, size = 0;
+	int err = EOK;
+
+	if ((obj = ext2_obj_get(fs, fs->sb->journalInode)) == NULL)
+		return -EIO;
+
+	mutexLock(obj->lock);
+
+	blocks = obj->inode->size / fs->blocksz;
+
+	for (i = 0; i < blocks; i++) {
+		if ((err = ext2_block_get(fs, obj, i, &bno)) < 0)
+			break;
+
+		/* Journal can't have holes */
+		if (!bno) {
+			err = -EINVAL;
+			break;
+		}
+
+		run = (journal->nruns) ? journal->map + journal->nruns - 1 : NULL;
+		if ((run != NULL) && (run->start + run->n == bno)) {
+			run->n++;
+			continue;
+		}
+
+		if (journal->nruns == size) {
+			size = (size) ? 2 * size : 4;
+
+			if ((map = (ext2_bmprun_t *)realloc(journal->map, size * sizeof(ext2_bmprun_t))) == NULL) {
+				err = -ENOMEM;
+				break;
+			}
+
+			journal->map = map;
+		}
+
+		run = journal->map + journal->nruns++;
+		run->start = bno;
+		run->n = 1;
+	}
+
+	mutexUnlock(obj->lock);
+	ext2_obj_put(fs, obj);
+
+	if (err < 0)
+		return err;
+
+	return (blocks) ? EOK : -EINVAL;
+}
+
+
+/* Loads journal superblock (res = NULL => filesystem has no journal) */
+static int ext2_journal_load(ext2_t *fs, ext2_journal_t **res)
+{
+	ext2_journal_t *journal;
+	uint32_t i, type, avail, blocks;
+	int err;
+
+	*res = NULL;
+
+	if (!(fs->sb->featureCompat & COMPAT_HAS_JOURNAL))
+		return EOK;
+
+	/* External journal devices aren't supported */
+	if ((fs->sb->featureIncompat & INCOMPAT_JOURNAL_DEV) || !fs->sb->journalInode)
+		return -ENOTSUP;
+
+	if ((journal = (ext2_journal_t *)calloc(1, sizeof(ext2_journal_t))) == NULL)
+		return -ENOMEM;
+
+	if (((journal->jsb = (char *)malloc(fs->blocksz)) == NULL) || ((journal->buff = (char *)malloc(fs->blocksz)) == NULL)) {
+		ext2_journal_release(journal);
+		return -ENOMEM;
+	}
+
+	if (((err = ext2_journal_map(fs, journal)) < 0) || ((err = ext2_journal_io(fs, journal, 0, journal->jsb, 1, 0)) < 0)) {
+		ext2_journal_release(journal);
+		return err;
+	}
+
+	for (i = 0, blocks = 0; i < journal->nruns; i++)
+		blocks += journal->map[i].n;
+
+	type = ext2_journal_get32(journal->jsb + JHDR_TYPE);
+	journal->maxlen = ext2_journal_get32(journal->jsb + JSB_MAXLEN);
+	journal->first = ext2_journal_get32(journal->jsb + JSB_FIRST);
+	journal->tid = ext2_journal_get32(journal->jsb + JSB_SEQUENCE);
+
+	if ((ext2_journal_get32(journal->jsb + JHDR_MAGIC) != JOURNAL_MAGIC) || ((type != JBLOCK_SBV1) && (type != JBLOCK_SBV2)) ||
+		(ext2_journal_get32(journal->jsb + JSB_BLOCKSZ) != fs->blocksz) || (journal->maxlen > blocks) || !journal->first || (journal->first + 2 >= journal->maxlen)) {
+		ext2_journal_release(journal);
+		return -EINVAL;
+	}
+
+	/* Version 1 journal superblock has no features */
+	if (type == JBLOCK_SBV1)
+		memset(journal->jsb + JSB_FCOMPAT, 0, JSB_UUID - JSB_FCOMPAT);
+
+	journal->tagsz = (ext2_journal_get32(journal->jsb + JSB_FINCOMPAT) & JINCOMPAT_64BIT) ? JTAG_SIZE64 : JTAG_SIZE;
+	/* First tag in a descriptor block is followed by UUID */
+	journal->tags = (fs->blocksz - JHDR_SIZE - 16) / journal->tagsz;
+
+	/* Transaction is logged at the beginning of the log (descriptor blocks, logged blocks and a commit block) */
+	avail = journal->maxlen - journal->first - 1;
+	journal->tmax = avail / (journal->tags + 1) * journal->tags;
+	if (avail % (journal->tags + 1) > 1)
+		journal->tmax += avail % (journal->tags + 1) - 1;
+
+	/* The other half is left for handles in progress and blocks updated by the commit itself (inodes, bitmaps, GDT) */
+	journal->tlimit = journal->tmax / 2;
+
+	*res = journal;
+
+	return EOK;
+}
+
+
+/* Returns offset of the descriptor block tag following the tag at offs (offs = 0 => first tag, returns 0 if there are no more tags) */
+static inline uint32_t ext2_journal_tag(ext2_t *fs, ext2_journal_t *journal, const char *block, uint32_t offs)
+{
+	uint16_t flags;
+
+	if (!offs) {
+		offs = JHDR_SIZE;
+	}
+	else {
+		flags = ext2_journal_get16(block + offs + JTAG_FLAGS);
+		if (flags & JTAG_LASTTAG)
+			return 0;
+
+		offs += journal->tagsz;
+		if (!(flags & JTAG_SAMEUUID))
+			offs += 16;
+	}
+
+	return (offs + journal->tagsz <= fs->blocksz) ? offs : 0;
+}
+
+
+static int ext2_journal_revokecmp(const void *r1, const void *r2)
+{
+	const ext2_jrevoke_t *rev1 = (const ext2_jrevoke_t *)r1;
+	const ext2_jrevoke_t *rev2 = (const ext2_jrevoke_t *)r2;
+
+	if (rev1->bno > rev2->bno)
+		return 1;
+	else if (rev1->bno < rev2->bno)
+		return -1;
+
+	return 0;
+}
+
+
+/* Checks if block was revoked by given or later transaction */
+static int ext2_journal_revoked(const ext2_jrevoke_t *revs, uint32_t n, uint32_t bno, uint32_t tid)
+{
+	ext2_jrevoke_t key = { bno, tid }, *rev;
+
+	if (!n)
+		return 0;
+
+	if ((rev = (ext2_jrevoke_t *)bsearch(&key, revs, n, sizeof(ext2_jrevoke_t), ext2_journal_revokecmp)) == NULL)
+		return 0;
+
+	return (ext2_journal_tidcmp(rev->tid, tid) >= 0);
+}
+
+
+/* Collects revoke block records */
+static int ext2_journal_revoke(ext2_t *fs, ext2_journal_t *journal, uint32_t tid, ext2_jrevoke_t **revs, uint32_t *n, uint32_t *size)
+{
+	uint32_t offs, end, recsz = (journal->tagsz == JTAG_SIZE64) ? 8 : 4;
+	ext2_jrevoke_t *rev;
+
+	if ((end = ext2_journal_get32(journal->buff + JREVOKE_COUNT)) > fs->blocksz)
+		return -EINVAL;
+
+	for (offs = JREVOKE_SIZE; offs + recsz <= end; offs += recsz) {
+		if (*n == *size) {
+			*size = (*size) ? 2 * *size : 64;
+
+			if ((rev = (ext2_jrevoke_t *)realloc(*revs, *size * sizeof(ext2_jrevoke_t))) == NULL)
+				return -ENOMEM;
+
+			*revs = rev;
+		}
+
+		rev = *revs + (*n)++;
+		rev->bno = ext2_journal_get32(journal->buff + offs + recsz - 4);
+		rev->tid = tid;
+	}
+
+	return EOK;
+}
+
+
+/* Replays committed transactions, scans the log, collects revoked blocks and writes back logged blocks in three passes */
+static int ext2_journal_replay(ext2_t *fs, ext2_journal_t *journal)
+{
+	ext2_jrevoke_t *revs = NULL;
+	uint32_t nrevs = 0, revsz = 0;
+	uint32_t pass, blk, tid, end = 0, steps, offs, i, j, bno;
+	uint16_t flags;
+	char *data;
+	int err = EOK;
+
+	if ((data = (char *)malloc(fs->blocksz)) == NULL)
+		return -ENOMEM;
+
+	for (pass = 0; (pass < 3) && (err >= 0); pass++) {
+		blk = ext2_journal_get32(journal->jsb + JSB_START);
+		tid = journal->tid;
+
+		for (steps = 0; (steps < journal->maxlen) && (!pass || (tid != end)); ) {
+			if ((err = ext2_journal_io(fs, journal, blk, journal->buff, 1, 0)) < 0)
+				break;
+
+			if ((ext2_journal_get32(journal->buff + JHDR_MAGIC) != JOURNAL_MAGIC) || (ext2_journal_get32(journal->buff + JHDR_SEQUENCE) != tid))
+				break;
+
+			switch (ext2_journal_get32(journal->buff + JHDR_TYPE)) {
+			case JBLOCK_DESCRIPTOR:
+				for (i = 0, offs = 0; (offs = ext2_journal_tag(fs, journal, journal->buff, offs)); i++) {
+					if (pass < 2)
+						continue;
+
+					bno = ext2_journal_get32(journal->buff + offs + JTAG_BNO);
+					flags = ext2_journal_get16(journal->buff + offs + JTAG_FLAGS);
+
+					if (((journal->tagsz == JTAG_SIZE64) && ext2_journal_get32(journal->buff + offs + JTAG_BNOHI)) || (bno >= fs->sb->blocks)) {
+						err = -EINVAL;
+						break;
+					}
+
+					if (ext2_journal_revoked(revs, nrevs, bno, tid))
+						continue;
+
+					if ((err = ext2_journal_io(fs, journal, ext2_journal_next(journal, blk, i + 1), data, 1, 0)) < 0)
+						break;
+
+					if (flags & JTAG_ESCAPE)
+						ext2_journal_set32(data + JHDR_MAGIC, JOURNAL_MAGIC);
+
+					if ((err = ext2_block_write(fs, bno, data, 1)) < 0)
+						break;
+				}
+
+				blk = ext2_journal_next(journal, blk, i + 1);
+				steps += i + 1;
+				break;
+
+			case JBLOCK_COMMIT:
+				blk = ext2_journal_next(journal, blk, 1);
+				steps++;
+				tid++;
+				break;
+
+			case JBLOCK_REVOKE:
+				if ((pass == 1) && ((err = ext2_journal_revoke(fs, journal, tid, &revs, &nrevs, &revsz)) < 0))
+					break;
+
+				blk = ext2_journal_next(journal, blk, 1);
+				steps++;
+				break;
+
+			default:
+				/* Unknown block type ends the log */
+				steps = journal->maxlen;
+				break;
+			}
+
+			if (err < 0)
+				break;
+		}
+
+		/* Log ends with the first not committed transaction */
+		if (!pass)
+			end = tid;
+
+		/* Keep the last revoking transaction per block */
+		if ((pass == 1) && nrevs) {
+			qsort(revs, nrevs, sizeof(ext2_jrevoke_t), ext2_journal_revokecmp);
+
+			for (i = 0, j = 1; j < nrevs; j++) {
+				if (revs[j].bno != revs[i].bno)
+					revs[++i] = revs[j];
+				else if (ext2_journal_tidcmp(revs[j].tid, revs[i].tid) > 0)
+					revs[i].tid = revs[j].tid;
+			}
+			nrevs = i + 1;
+		}
+	}
+
+	free(revs);
+	free(data);
+
+	if ((err < 0) || ((err = ext2_cache_sync(fs)) < 0))
+		return err;
+
+	/* Mark the journal empty, next transaction IDs follow the replayed ones */
+	journal->tid = end + 1;
+	ext2_journal_set32(journal->jsb + JSB_SEQUENCE, journal->tid);
+	ext2_journal_set32(journal->jsb + JSB_START, 0);
+
+	return ext2_journal_io(fs, journal, 0, journal->jsb, 1, 1);
+}
+
+
+int ext2_journal_recover(ext2_t *fs)
+{
+	ext2_journal_t *journal;
+	uint32_t fincompat;
+	int err;
+
+	if ((err = ext2_journal_load(fs, &journal)) < 0)
+		return (fs->sb->featureIncompat & INCOMPAT_RECOVER) ? err : EOK;
+
+	if (journal == NULL)
+		return EOK;
+
+	if (ext2_journal_get32(journal->jsb + JSB_START)) {
+		fincompat = ext2_journal_get32(journal->jsb + JSB_FINCOMPAT);
+
+		/* Checksummed and fast commit logs aren't supported */
+		if (fincompat & ~(JINCOMPAT_REVOKE | JINCOMPAT_64BIT))
+			err = -ENOTSUP;
+		else
+			err = ext2_journal_replay(fs, journal);
+
+		/* Reload metadata updated by the replayed transactions */
+		if (err >= 0) {
+			ext2_stats_dev(fs, LIBEXT2_IO_SB, 1, 0);
+
+			if (fs->read(fs->oid.id, SB_OFFSET, (char *)fs->sb, sizeof(ext2_sb_t)) != sizeof(ext2_sb_t))
+				err = -EIO;
+		}
+
+		if (err >= 0) {
+			if (!fs->sb->inodesz)
+				fs->sb->inodesz = 128;
+
+			err = ext2_gdt_load(fs);
+		}
+	}
+
+	ext2_journal_release(journal);
+
+	if (err < 0)
+		return err;
+
+	/* Journal is empty */
+	fs->sb->featureIncompat &= ~INCOMPAT_RECOVER;
+
+	return EOK;
+}
+
+
+void ext2_journal_start(ext2_t *fs)
+{
+	ext2_journal_t *journal = fs->journal;
+
+	if (journal == NULL)
+		return;
+
+	/* Transactions are never split => commit the running one before it outgrows the log */
+	if (ext2_cache_mdirty(fs) >= journal->tlimit)
+		ext2_journal_commit(fs);
+
+	mutexLock(journal->lock);
+
+	while (journal->barrier)
+		condWait(journal->cond, journal->lock, 0);
+
+	journal->handles++;
+
+	mutexUnlock(journal->lock);
+}
+
+
+void ext2_journal_stop(ext2_t *fs)
+{
+	ext2_journal_t *journal = fs->journal;
+
+	if (journal == NULL)
+		return;
+
+	mutexLock(journal->lock);
+
+	if (!--journal->handles && journal->barrier)
+		condBroadcast(journal->cond);
+
+	mutexUnlock(journal->lock);
+}
+
+
+int ext2_journal_free(ext2_t *fs, ext2_bfree_t *batch)
+{
+	ext2_journal_t *journal = fs->journal;
+	ext2_bfree_t *frees = &journal->frees;
+	ext2_bmprun_t *runs;
+	uint32_t size;
+
+	if (!batch->n)
+		return EOK;
+
+	mutexLock(journal->lock);
+
+	if (!frees->n) {
+		/* Take over the batch runs */
+		free(frees->runs);
+		*frees = *batch;
+	}
+	else {
+		if (frees->n + batch->n > frees->size) {
+			for (size = frees->size; size < frees->n + batch->n; size *= 2);
+
+			/* Blocks can't be reused before the transaction is committed => leave them in the caller batch */
+			if ((runs = (ext2_bmprun_t *)realloc(frees->runs, size * sizeof(ext2_bmprun_t))) == NULL) {
+				mutexUnlock(journal->lock);
+				return -ENOMEM;
+			}
+
+			frees->runs = runs;
+			frees->size = size;
+		}
+
+		memcpy(frees->runs + frees->n, batch->runs, batch->n * sizeof(ext2_bmprun_t));
+		frees->n += batch->n;
+		free(batch->runs);
+	}
+
+	mutexUnlock(journal->lock);
+
+	batch->runs = NULL;
+	batch->n = 0;
+	batch->size = 0;
+
+	return EOK;
+}
+
+
+/* Writes transaction to the log (descriptor blocks, logged blocks and a commit block) */
+static int ext2_journal_log(ext2_t *fs, ext2_journal_t *journal, const uint32_t *bnos, char *data, uint32_t n)
+{
+	uint32_t i, j, k, offs, blk = journal->first;
+	uint16_t flags;
+	char *block;
+	int err;
+
+	/* Journal starts with the transaction */
+	ext2_journal_set32(journal->jsb + JSB_SEQUENCE, journal->tid);
+	ext2_journal_set32(journal->jsb + JSB_START, journal->first);
+
+	if ((err = ext2_journal_io(fs, journal, 0, journal->jsb, 1, 1)) < 0)
+		return err;
+
+	for (i = 0; i < n; i += k, blk += k + 1) {
+		if ((k = n - i) > journal->tags)
+			k = journal->tags;
+
+		memset(journal->buff, 0, fs->blocksz);
+		ext2_journal_hdr(journal->buff, JBLOCK_DESCRIPTOR, journal->tid);
+
+		for (j = 0, offs = JHDR_SIZE; j < k; j++) {
+			block = data + (i + j) * fs->blocksz;
+			flags = (j) ? JTAG_SAMEUUID : 0;
+
+			if (j == k - 1)
+				flags |= JTAG_LASTTAG;
+
+			/* Logged block mustn't look like a journal block */
+			if (ext2_journal_get32(block + JHDR_MAGIC) == JOURNAL_MAGIC) {
+				ext2_journal_set32(block + JHDR_MAGIC, 0);
+				flags |= JTAG_ESCAPE;
+			}
+
+			ext2_journal_set32(journal->buff + offs + JTAG_BNO, bnos[i + j]);
+			ext2_journal_set16(journal->buff + offs + JTAG_FLAGS, flags);
+			offs += journal->tagsz;
+
+			if (!j) {
+				memcpy(journal->buff + offs, journal->jsb + JSB_UUID, 16);
+				offs += 16;
+			}
+		}
+
+		if ((err = ext2_journal_io(fs, journal, blk, journal->buff, 1, 1)) >= 0)
+			err = ext2_journal_io(fs, journal, blk + 1, data + i * fs->blocksz, k, 1);
+
+		/* Restore escaped blocks for the checkpoint */
+		for (j = 0, offs = 0; (offs = ext2_journal_tag(fs, journal, journal->buff, offs)); j++) {
+			if (ext2_journal_get16(journal->buff + offs + JTAG_FLAGS) & JTAG_ESCAPE)
+				ext2_journal_set32(data + (i + j) * fs->blocksz + JHDR_MAGIC, JOURNAL_MAGIC);
+		}
+
+		if (err < 0)
+			return err;
+	}
+
+	memset(journal->buff, 0, fs->blocksz);
+	ext2_journal_hdr(journal->buff, JBLOCK_COMMIT, journal->tid);
+
+	return ext2_journal_io(fs, journal, blk, journal->buff, 1, 1);
+}
+
+
+/* Writes back logged blocks to their final locations */
+static int ext2_journal_checkpoint(ext2_t *fs, const uint32_t *bnos, const char *data, uint32_t n)
+{
+	uint32_t i, j;
+	ssize_t size;
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; (j < n) && (j - i < CACHE_MAXRUN) && (bnos[j] == bnos[j - 1] + 1); j++);
+
+		size = (j - i) * fs->blocksz;
+		ext2_stats_io(fs, bnos[i], j - i, 0, 1);
+
+		if (fs->write(fs->oid.id, (offs_t)bnos[i] * fs->blocksz, data + i * fs->blocksz, size) != size)
+			return -EIO;
+	}
+
+	return EOK;
+}
+
+
+/* Commits frozen blocks (transactions are never split) */
+static int ext2_journal_write(ext2_t *fs, ext2_journal_t *journal, const uint32_t *bnos, char *data, uint32_t n)
+{
+	int err;
+
+	/* Transaction outgrew the log despite the running transaction limit => write it in place (mounted filesystem is marked not clean, so it's checked after a crash) */
+	if (n > journal->tmax)
+		return ext2_journal_checkpoint(fs, bnos, data, n);
+
+	if (((err = ext2_journal_log(fs, journal, bnos, data, n)) < 0) || ((err = ext2_journal_checkpoint(fs, bnos, data, n)) < 0))
+		return err;
+
+	journal->tid++;
+
+	/* Checkpointed journal is empty, blocks freed by the transaction can be reused without revoke records */
+	ext2_journal_set32(journal->jsb + JSB_SEQUENCE, journal->tid);
+	ext2_journal_set32(journal->jsb + JSB_START, 0);
+
+	return ext2_journal_io(fs, journal, 0, journal->jsb, 1, 1);
+}
+
+
+int ext2_journal_commit(ext2_t *fs)
+{
+	ext2_journal_t *journal = fs->journal;
+	ext2_bfree_t frees;
+	uint32_t *bnos;
+	char *data;
+	int n, err;
+
+	mutexLock(journal->clock);
+
+	/* Close the running transaction, new handles wait until its metadata is frozen */
+	mutexLock(journal->lock);
+
+	journal->barrier = 1;
+	while (journal->handles)
+		condWait(journal->cond, journal->lock, 0);
+
+	frees = journal->frees;
+	journal->frees.runs = NULL;
+	journal->frees.n = 0;
+	journal->frees.size = 0;
+
+	mutexUnlock(journal->lock);
+
+	/* Committed bitmaps include blocks freed by the transaction */
+	do {
+		if ((fs->objs != NULL) && ((n = ext2_objs_commit(fs)) < 0))
+			break;
+
+		if ((n = ext2_block_markbatch(fs, &frees, 0)) < 0)
+			break;
+
+		if ((n = ext2_msync(fs)) < 0)
+			break;
+
+		n = ext2_cache_freeze(fs, &bnos, &data);
+	} while (0);
+
+	/* Freed blocks can't be reused until the transaction is checkpointed */
+	ext2_block_markbatch(fs, &frees, 1);
+
+	mutexLock(journal->lock);
+
+	journal->barrier = 0;
+	condBroadcast(journal->cond);
+
+	mutexUnlock(journal->lock);
+
+	if ((err = n) > 0) {
+		/* Ordered mode, file data is written back before metadata referencing it is committed */
+		if ((err = ext2_cache_sync(fs)) >= 0)
+			err = ext2_journal_write(fs, journal, bnos, data, n);
+
+		ext2_cache_thaw(fs, bnos, n, (err < 0));
+		free(bnos);
+		free(data);
+	}
+
+	if (err >= 0) {
+		err = ext2_block_destroybatch(fs, &frees);
+	}
+	/* Return freed blocks to the running transaction, leak them if it's not possible (they mustn't be reused) */
+	else if (ext2_journal_free(fs, &frees) < 0) {
+		free(frees.runs);
+	}
+
+	mutexUnlock(journal->clock);
+
+	return err;
+}
+
+
+int ext2_journal_destroy(ext2_t *fs)
+{
+	ext2_journal_t *journal = fs->journal;
+	int err;
+
+	if (journal == NULL)
+		return EOK;
+
+	/* Second commit writes back bitmaps updated by blocks freed in the first one */
+	if (((err = ext2_journal_commit(fs)) >= 0) && ((err = ext2_journal_commit(fs)) >= 0))
+		fs->sb->featureIncompat &= ~INCOMPAT_RECOVER;
+
+	fs->cache->journal = 0;
+	fs->journal = NULL;
+
+	resourceDestroy(journal->clock);
+	resourceDestroy(journal->cond);
+	resourceDestroy(journal->lock);
+	free(journal->frees.runs);
+	ext2_journal_release(journal);
+
+	return err;
+}
+
+
+int ext2_journal_init(ext2_t *fs)
+{
+	ext2_journal_t *journal;
+	int err;
+
+	/* Journalled metadata is kept in the cache until it's committed */
+	if (!fs->cache->max)
+		return EOK;
+
+	/* Filesystems with unsupported journals are mounted without journalling */
+	if ((ext2_journal_load(fs, &journal) < 0) || (journal == NULL))
+		return EOK;
+
+	/* Running transaction is kept in the cache until it's committed, it mustn't fill the cache up */
+	if (journal->tlimit > fs->cache->max / 2)
+		journal->tlimit = fs->cache->max / 2;
+
+	if ((ext2_journal_get32(journal->jsb + JSB_FINCOMPAT) & ~(JINCOMPAT_REVOKE | JINCOMPAT_64BIT)) ||
+		ext2_journal_get32(journal->jsb + JSB_FCOMPAT) || ext2_journal_get32(journal->jsb + JSB_FROCOMPAT)) {
+		ext2_journal_release(journal);
+		return EOK;
+	}
+
+	if ((err = mutexCreate(&journal->lock)) < 0) {
+		ext2_journal_release(journal);
+		return err;
+	}
+
+	if ((err = condCreate(&journal->cond)) < 0) {
+		resourceDestroy(journal->lock);
+		ext2_journal_release(journal);
+		return err;
+	}
+
+	if ((err = mutexCreate(&journal->clock)) < 0) {
+		resourceDestroy(journal->cond);
+		resourceDestroy(journal->lock);
+		ext2_journal_release(journal);
+		return err;
+	}
+
+	/* Mark the journal in use before the first transaction is logged */
+	fs->sb->featureIncompat |= INCOMPAT_RECOVER;
+
+	if ((err = ext2_sb_sync(fs)) < 0) {
+		fs->sb->featureIncompat &= ~INCOMPAT_RECOVER;
+		resourceDestroy(journal->clock);
+		resourceDestroy(journal->cond);
+		resourceDestroy(journal->lock);
+		ext2_journal_release(journal);
+		return err;
+	}
+
+	fs->journal = journal;
+	fs->cache->journal = 1;
+
+	return EOK;
+}
@@ -0,0 +1,162 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Metadata journal
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "block.h"
+#include "bmp.h"
+#include "ext2.h"
+
+
+/* Journal magic identifier */
+#define JOURNAL_MAGIC 0xC03B3998
+
+
+/* Journal block types */
+enum {
+	JBLOCK_DESCRIPTOR = 1, /* Descriptor block (tags of the following logged blocks) */
+	JBLOCK_COMMIT     = 2, /* Commit block (transaction is complete) */
+	JBLOCK_SBV1       = 3, /* Journal superblock version 1 */
+	JBLOCK_SBV2       = 4, /* Journal superblock version 2 */
+	JBLOCK_REVOKE     = 5  /* Revoke block (logged blocks that mustn't be replayed) */
+};
+
+
+/* Journal compatible features */
+enum {
+	JCOMPAT_CHECKSUM      = 0x01  /* Commit blocks have data checksums */
+};
+
+
+/* Journal incompatible features */
+enum {
+	JINCOMPAT_REVOKE      = 0x01, /* Journal has revoke blocks */
+	JINCOMPAT_64BIT       = 0x02, /* Tags have 64-bit block numbers */
+	JINCOMPAT_ASYNCCOMMIT = 0x04, /* Commit blocks are written without waiting for the logged blocks */
+	JINCOMPAT_CSUMV2      = 0x08, /* Metadata checksums version 2 */
+	JINCOMPAT_CSUMV3      = 0x10, /* Metadata checksums version 3 */
+	JINCOMPAT_FASTCOMMIT  = 0x20  /* Journal has fast commit blocks */
+};
+
+
+/* Descriptor tag flags */
+enum {
+	JTAG_ESCAPE    = 0x01, /* Logged block magic was cleared */
+	JTAG_SAMEUUID  = 0x02, /* Tag isn't followed by UUID (it's the same as in the previous tag) */
+	JTAG_DELETED   = 0x04, /* Block was deleted by this transaction */
+	JTAG_LASTTAG   = 0x08  /* Last tag in the descriptor block */
+};
+
+
+/* Journal block header (big-endian) field offsets */
+enum {
+	JHDR_MAGIC     = 0x00, /* Journal magic */
+	JHDR_TYPE      = 0x04, /* Block type */
+	JHDR_SEQUENCE  = 0x08, /* Transaction ID */
+	JHDR_SIZE      = 0x0C  /* Header size */
+};
+
+
+/* Journal superblock (big-endian) field offsets */
+enum {
+	JSB_BLOCKSZ    = 0x0C, /* Journal block size */
+	JSB_MAXLEN     = 0x10, /* Number of journal blocks */
+	JSB_FIRST      = 0x14, /* First log block */
+	JSB_SEQUENCE   = 0x18, /* First expected transaction ID */
+	JSB_START      = 0x1C, /* First log block of the journal (0 => journal is empty) */
+	JSB_ERRNO      = 0x20, /* Journal error number */
+	JSB_FCOMPAT    = 0x24, /* Compatible features */
+	JSB_FINCOMPAT  = 0x28, /* Incompatible features */
+	JSB_FROCOMPAT  = 0x2C, /* Read-only compatible features */
+	JSB_UUID       = 0x30  /* Journal UUID */
+};
+
+
+/* Revoke block field offsets */
+enum {
+	JREVOKE_COUNT  = 0x0C, /* Number of used bytes (including the header) */
+	JREVOKE_SIZE   = 0x10  /* Revoke block header size */
+};
+
+
+/* Descriptor tag field offsets */
+enum {
+	JTAG_BNO       = 0x00, /* Block number (low 32 bits) */
+	JTAG_CHECKSUM  = 0x04, /* Block checksum */
+	JTAG_FLAGS     = 0x06, /* Tag flags */
+	JTAG_BNOHI     = 0x08, /* Block number (high 32 bits, 64-bit journal only) */
+	JTAG_SIZE      = 0x08, /* Tag size */
+	JTAG_SIZE64    = 0x0C  /* 64-bit journal tag size */
+};
+
+
+struct _ext2_journal_t {
+	ext2_bmprun_t *map;      /* Journal blocks mapping (physical block runs) */
+	uint32_t nruns;          /* Number of mapping runs */
+	uint32_t maxlen;         /* Number of journal blocks */
+	uint32_t first;          /* First log block */
+	uint32_t tid;            /* Next transaction ID */
+	uint32_t tagsz;          /* Descriptor tag size */
+	uint32_t tags;           /* Max number of tags in a descriptor block */
+	uint32_t tmax;           /* Max number of logged blocks in one transaction */
+	uint32_t tlimit;         /* Running transaction size forcing its commit before new handles start */
+	char *jsb;               /* Journal superblock */
+	char *buff;              /* Descriptor and commit block buffer */
+
+	/* Running transaction */
+	uint32_t handles;        /* Number of running handles */
+	uint8_t barrier;         /* Commit is waiting for running handles (new handles wait for the commit) */
+	ext2_bfree_t frees;      /* Blocks freed in the running transaction */
+
+	/* Synchronization */
+	handle_t lock;           /* Running transaction mutex */
+	handle_t cond;           /* Handles and commit condition */
+	handle_t clock;          /* Commit mutex */
+};
+
+
+/* Starts a handle (filesystem operation atomically committed to the journal), commits full running transaction first (requires no locks to be held) */
+extern void ext2_journal_start(ext2_t *fs);
+
+
+/* Stops a handle */
+extern void ext2_journal_stop(ext2_t *fs);
+
+
+/* Queues blocks to be destroyed by the running transaction (blocks are reused after it's committed, batch is kept on failure) */
+extern int ext2_journal_free(ext2_t *fs, ext2_bfree_t *batch);
+
+
+/* Commits running transaction (dirty inodes, bitmaps, GDT and SuperBlock) and checkpoints it */
+extern int ext2_journal_commit(ext2_t *fs);
+
+
+/* Replays committed journal transactions (reloads SuperBlock and GDT) */
+extern int ext2_journal_recover(ext2_t *fs);
+
+
+/* Commits metadata and stops journalling (marks the journal empty) */
+extern int ext2_journal_destroy(ext2_t *fs);
+
+
+/* Starts journalling metadata (fs->journal = NULL => metadata isn't journalled) */
+extern int ext2_journal_init(ext2_t *fs);
+
+
+#endif
@@ -21,8 +21,87 @@
 #include <sys/stat.h>
 #include <sys/threads.h>
 
+#include "bmp.h"
+#include "cache.h"
+#include "dcache.h"
 #include "ext2.h"
+#include "journal.h"
 #include "libext2.h"
+#include "stats.h"
+
+
+/* Returns request latency statistics index (-1 => request latency isn't measured) */
+static int libext2_op(int type)
+{
+	switch (type) {
+	case mtCreate:
+		return LIBEXT2_OP_CREATE;
+
+	case mtDestroy:
+		return LIBEXT2_OP_DESTROY;
+
+	case mtLookup:
+		return LIBEXT2_OP_LOOKUP;
+
+	case mtOpen:
+		return LIBEXT2_OP_OPEN;
+
+	case mtClose:
+		return LIBEXT2_OP_CLOSE;
+
+	case mtRead:
+		return LIBEXT2_OP_READ;
+
+	case mtReaddir:
+		return LIBEXT2_OP_READDIR;
+
+	case mtWrite:
+		return LIBEXT2_OP_WRITE;
+
+	case mtTruncate:
+		return LIBEXT2_OP_TRUNCATE;
+
+	case mtGetAttr:
+		return LIBEXT2_OP_GETATTR;
+
+	case mtSetAttr:
+		return LIBEXT2_OP_SETATTR;
+
+	case mtLink:
+		return LIBEXT2_OP_LINK;
+
+	case mtUnlink:
+		return LIBEXT2_OP_UNLINK;
+
+	case mtSync:
+		return LIBEXT2_OP_SYNC;
+	}
+
+	return -1;
+}
+
+
+/* Processes device control requests */
+static int libext2_devctl(ext2_t *fs, msg_t *msg)
+{
+	libext2_i_devctl_t *idevctl = (libext2_i_devctl_t *)msg->i.raw;
+
+	switch (idevctl->type) {
+	case libext2_devctl_stat:
+		if ((msg->o.data == NULL) || (msg->o.size < sizeof(libext2_stat_t)))
+			return -EINVAL;
+
+		return libext2_stat(fs, (libext2_stat_t *)msg->o.data);
+
+	case libext2_devctl_reset:
+		return libext2_statreset(fs);
+
+	case libext2_devctl_compact:
+		return ext2_compact(fs, idevctl->id);
+	}
+
+	return -EINVAL;
+}
 
 
 int libext2_handler(void *fdata, msg_t *msg)
@@ -30,7 +109,22 @@ int libext2_handler(void *fdata, msg_t *msg)
 	ext2_t *fs = (ext2_t *)fdata;
 	ext2_obj_t *obj;
 	uint16_t mode;
+	time_t start;
+	size_t len;
 	oid_t dev;
+	int op;
+
+	gettime(&start, NULL);
+
+	/* Sync commits the journal transaction, it can't run inside a handle */
+	if (msg->type == mtSync) {
+		msg->o.io.err = ext2_sync(fs);
+		ext2_stats_op(fs, LIBEXT2_OP_SYNC, start);
+		return EOK;
+	}
+
+	/* Requests are journal handles, metadata is committed between them */
+	ext2_journal_start(fs);
 
 	switch (msg->type) {
 	case mtCreate:
@@ -101,6 +195,14 @@ int libext2_handler(void *fdata, msg_t *msg)
 			}
 		}
 
+		/* Symlink target follows its name */
+		if (S_ISLNK(mode)) {
+			len = strlen(msg->i.data) + 1;
+			msg->o.create.err = ext2_symlink(fs, msg->i.create.dir.id, msg->i.data, (uint8_t)(len - 1), (char *)msg->i.data + len,
+				(msg->i.size > len) ? strnlen((char *)msg->i.data + len, msg->i.size - len) : 0, mode, &msg->o.create.oid.id);
+			break;
+		}
+
 		msg->o.create.err = ext2_create(fs, msg->i.create.dir.id, msg->i.data, (uint8_t)strlen(msg->i.data), &msg->i.create.dev, mode, &msg->o.create.oid.id);
 		break;
 
@@ -138,7 +240,7 @@ int libext2_handler(void *fdata, msg_t *msg)
 		break;
 
 	case mtDevCtl:
-		msg->o.io.err = -EINVAL;
+		((libext2_o_devctl_t *)msg->o.raw)->err = libext2_devctl(fs, msg);
 		break;
 
 	case mtGetAttr:
@@ -158,6 +260,116 @@ int libext2_handler(void *fdata, msg_t *msg)
 		break;
 	}
 
+	ext2_journal_stop(fs);
+
+	if ((op = libext2_op(msg->type)) >= 0)
+		ext2_stats_op(fs, op, start);
+
+	return EOK;
+}
+
+
+/* Message handling threads pool */
+typedef struct {
+	ext2_t *fs;            /* Filesystem */
+	unsigned int nthreads; /* Number of running threads */
+	handle_t lock;         /* Access mutex */
+	handle_t cond;         /* Threads exit condition */
+} libext2_pool_t;
+
+
+/* Receives and handles filesystem messages until the port is closed */
+static void libext2_serveloop(ext2_t *fs)
+{
+	unsigned long rid;
+	msg_t msg;
+	int err;
+
+	for (;;) {
+		if ((err = msgRecv(fs->oid.port, &msg, &rid)) < 0) {
+			if (err == -EINTR)
+				continue;
+			break;
+		}
+
+		libext2_handler(fs, &msg);
+		msgRespond(fs->oid.port, &msg, rid);
+	}
+}
+
+
+/* Message handling thread */
+static void libext2_worker(void *arg)
+{
+	libext2_pool_t *pool = (libext2_pool_t *)arg;
+
+	libext2_serveloop(pool->fs);
+
+	mutexLock(pool->lock);
+
+	pool->nthreads--;
+	condSignal(pool->cond);
+
+	mutexUnlock(pool->lock);
+	endthread();
+}
+
+
+int libext2_serve(void *fdata, unsigned int nthreads)
+{
+	libext2_pool_t pool;
+	char *stacks;
+	unsigned int i;
+	int err;
+
+	if (nthreads <= 1) {
+		libext2_serveloop((ext2_t *)fdata);
+		return EOK;
+	}
+
+	if ((stacks = (char *)malloc((nthreads - 1) * LIBEXT2_STACKSZ)) == NULL)
+		return -ENOMEM;
+
+	if ((err = mutexCreate(&pool.lock)) < 0) {
+		free(stacks);
+		return err;
+	}
+
+	if ((err = condCreate(&pool.cond)) < 0) {
+		resourceDestroy(pool.lock);
+		free(stacks);
+		return err;
+	}
+
+	pool.fs = (ext2_t *)fdata;
+	pool.nthreads = 0;
+
+	/* Requests on different objects are handled in parallel, objects and allocator structures have their own locks */
+	for (i = 0; i < nthreads - 1; i++) {
+		mutexLock(pool.lock);
+
+		if (beginthread(libext2_worker, 4, stacks + i * LIBEXT2_STACKSZ, LIBEXT2_STACKSZ, &pool) < 0) {
+			mutexUnlock(pool.lock);
+			break;
+		}
+		pool.nthreads++;
+
+		mutexUnlock(pool.lock);
+	}
+
+	libext2_serveloop(pool.fs);
+
+	mutexLock(pool.lock);
+
+	while (pool.nthreads)
+		condWait(pool.cond, pool.lock, 0);
+
+	mutexUnlock(pool.lock);
+
+	resourceDestroy(pool.cond);
+	resourceDestroy(pool.lock);
+	free(stacks);
+
 	return EOK;
 }
 
@@ -165,17 +377,113 @@ int libext2_handler(void *fdata, msg_t *msg)
 int libext2_unmount(void *fdata)
 {
 	ext2_t *fs = (ext2_t *)fdata;
+	int err = EOK, ret;
+
+	ext2_cache_stop(fs);
+
+	if ((ret = ext2_objs_destroy(fs)) < 0)
+		err = ret;
+
+	if ((ret = ext2_journal_destroy(fs)) < 0)
+		err = ret;
 
-	ext2_objs_destroy(fs);
-	ext2_gdt_destroy(fs);
-	ext2_sb_destroy(fs);
+	ext2_dcache_destroy(fs);
+
+	if ((ret = ext2_bmps_destroy(fs)) < 0)
+		err = ret;
+
+	if ((ret = ext2_gdt_destroy(fs)) < 0)
+		err = ret;
+
+	if ((ret = ext2_cache_destroy(fs)) < 0)
+		err = ret;
+
+	/* Mark filesystem as clean only if all metadata has been written back (next mount recounts free blocks otherwise) */
+	if (!err)
+		fs->sb->state |= STATE_VALID;
+
+	if ((ret = ext2_sb_destroy(fs)) < 0)
+		err = ret;
+
+	ext2_stats_destroy(fs);
 	free(fs);
 
+	return err;
+}
+
+
+int libext2_stat(void *fdata, libext2_stat_t *stat)
+{
+	ext2_t *fs = (ext2_t *)fdata;
+
+	mutexLock(fs->cache->lock);
+
+	stat->hits = fs->cache->hits;
+	stat->misses = fs->cache->misses;
+	stat->wbacks = fs->cache->wbacks;
+	stat->rablocks = fs->cache->rablocks;
+
+	mutexUnlock(fs->cache->lock);
+
+	mutexLock(fs->dcache->lock);
+
+	stat->dhits = fs->dcache->hits;
+	stat->dmisses = fs->dcache->misses;
+
+	mutexUnlock(fs->dcache->lock);
+
+	mutexLock(fs->objs->lock);
+
+	stat->ohits = fs->objs->hits;
+	stat->omisses = fs->objs->misses;
+	stat->oevicts = fs->objs->evicts;
+	stat->owbacks = fs->objs->wbacks;
+	stat->osize = fs->objs->size;
+
+	mutexUnlock(fs->objs->lock);
+
+	ext2_stats_get(fs, stat);
+
 	return EOK;
 }
 
 
-int libext2_mount(oid_t *oid, unsigned int sectorsz, dev_read read, dev_write write, void **fdata)
+int libext2_statreset(void *fdata)
+{
+	ext2_t *fs = (ext2_t *)fdata;
+
+	mutexLock(fs->cache->lock);
+
+	fs->cache->hits = 0;
+	fs->cache->misses = 0;
+	fs->cache->wbacks = 0;
+	fs->cache->rablocks = 0;
+
+	mutexUnlock(fs->cache->lock);
+
+	mutexLock(fs->dcache->lock);
+
+	fs->dcache->hits = 0;
+	fs->dcache->misses = 0;
+
+	mutexUnlock(fs->dcache->lock);
+
+	mutexLock(fs->objs->lock);
+
+	fs->objs->hits = 0;
+	fs->objs->misses = 0;
+	fs->objs->evicts = 0;
+	fs->objs->wbacks = 0;
+
+	mutexUnlock(fs->objs->lock);
+
+	ext2_stats_reset(fs);
+
+	return EOK;
+}
+
+
+int libext2_mountopts(oid_t *oid, unsigned int sectorsz, dev_read read, dev_write write, const libext2_opts_t *opts, void **fdata)
 {
 	ext2_t *fs;
 	int err;
@@ -186,33 +494,104 @@ int libext2_mount(oid_t *oid, unsigned int sectorsz, dev_read read, dev_write wr
 	fs->sectorsz = sectorsz;
 	fs->read = read;
 	fs->write = write;
+	fs->root = NULL;
+	fs->journal = NULL;
+	fs->gdt = NULL;
+	fs->groups = 0;
 	memcpy(&fs->oid, oid, sizeof(oid_t));
 
+	if ((err = ext2_stats_init(fs)) < 0) {
+		free(fs);
+		return err;
+	}
+
 	if ((err = ext2_sb_init(fs)) < 0) {
+		ext2_stats_destroy(fs);
+		free(fs);
+		return err;
+	}
+
+	if ((err = ext2_cache_init(fs, (opts != NULL) ? opts->cachesz : CACHE_SIZE)) < 0) {
+		ext2_sb_destroy(fs);
+		ext2_stats_destroy(fs);
 		free(fs);
 		return err;
 	}
 
 	if ((err = ext2_gdt_init(fs)) < 0) {
+		ext2_cache_destroy(fs);
 		ext2_sb_destroy(fs);
+		ext2_stats_destroy(fs);
 		free(fs);
 		return err;
 	}
 
-	if ((err = ext2_objs_init(fs)) < 0) {
+	if ((err = ext2_objs_init(fs, (opts != NULL) ? opts->objsz : OBJS_SIZE)) < 0) {
 		ext2_gdt_destroy(fs);
 		ext2_sb_destroy(fs);
+		ext2_cache_destroy(fs);
+		ext2_stats_destroy(fs);
+		free(fs);
+		return err;
+	}
+
+	/* Journal is replayed before bitmaps are loaded and free counters are checked */
+	if ((err = ext2_journal_recover(fs)) < 0) {
+		ext2_objs_destroy(fs);
+		ext2_gdt_destroy(fs);
+		ext2_sb_destroy(fs);
+		ext2_cache_destroy(fs);
+		ext2_stats_destroy(fs);
+		free(fs);
+		return err;
+	}
+
+	if ((err = ext2_bmps_init(fs)) < 0) {
+		ext2_objs_destroy(fs);
+		ext2_gdt_destroy(fs);
+		ext2_sb_destroy(fs);
+		ext2_cache_destroy(fs);
+		ext2_stats_destroy(fs);
+		free(fs);
+		return err;
+	}
+
+	if ((err = ext2_dcache_init(fs)) < 0) {
+		ext2_objs_destroy(fs);
+		ext2_bmps_destroy(fs);
+		ext2_gdt_destroy(fs);
+		ext2_sb_destroy(fs);
+		ext2_cache_destroy(fs);
+		ext2_stats_destroy(fs);
 		free(fs);
 		return err;
 	}
 
 	if ((fs->root = ext2_obj_get(fs, ROOT_INO)) == NULL) {
 		ext2_objs_destroy(fs);
+		ext2_dcache_destroy(fs);
+		ext2_bmps_destroy(fs);
 		ext2_gdt_destroy(fs);
 		ext2_sb_destroy(fs);
+		ext2_cache_destroy(fs);
+		ext2_stats_destroy(fs);
 		free(fs);
 		return -ENOENT;
 	}
 
+	/* Metadata commit is deferred, mark filesystem as not clean while it's mounted */
+	fs->sb->state &= ~STATE_VALID;
+
+	if (((err = ext2_sb_sync(fs)) < 0) || ((err = ext2_journal_init(fs)) < 0) || ((err = ext2_cache_start(fs)) < 0)) {
+		libext2_unmount(fs);
+		return err;
+	}
+
 	return ROOT_INO;
 }
+
+
+int libext2_mount(oid_t *oid, unsigned int sectorsz, dev_read read, dev_write write, void **fdata)
+{
+	return libext2_mountopts(oid, sectorsz, read, write, NULL, fdata);
+}
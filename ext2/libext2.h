@@ -16,6 +16,7 @@
 #ifndef _LIBEXT2_H_
 #define _LIBEXT2_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <sys/msg.h>
@@ -27,12 +28,110 @@
 #define LIBEXT2_HANDLER libext2_handler
 #define LIBEXT2_UNMOUNT libext2_unmount
 #define LIBEXT2_MOUNT   libext2_mount
+#define LIBEXT2_STACKSZ 8192 /* Message handling thread stack size */
+
+
+/* Mount options */
+typedef struct {
+	size_t cachesz; /* Block cache size in bytes (0 disables the cache) */
+	size_t objsz;   /* Object cache size in bytes (0 => default size) */
+} libext2_opts_t;
+
+
+/* Device I/O block kinds */
+enum {
+	LIBEXT2_IO_SB = 0,   /* SuperBlock */
+	LIBEXT2_IO_GDT,      /* Group Descriptors Table */
+	LIBEXT2_IO_BMP,      /* Block and inode bitmaps */
+	LIBEXT2_IO_ITABLE,   /* Inode tables */
+	LIBEXT2_IO_IND,      /* Indirect blocks, extent tree nodes, directory and symlink blocks */
+	LIBEXT2_IO_DATA,     /* Regular file data */
+	LIBEXT2_IO_JOURNAL,  /* Journal */
+	LIBEXT2_IO_KINDS     /* Number of block kinds */
+};
+
+
+/* Requests with latency statistics */
+enum {
+	LIBEXT2_OP_CREATE = 0,
+	LIBEXT2_OP_DESTROY,
+	LIBEXT2_OP_LOOKUP,
+	LIBEXT2_OP_OPEN,
+	LIBEXT2_OP_CLOSE,
+	LIBEXT2_OP_READ,
+	LIBEXT2_OP_READDIR,
+	LIBEXT2_OP_WRITE,
+	LIBEXT2_OP_TRUNCATE,
+	LIBEXT2_OP_GETATTR,
+	LIBEXT2_OP_SETATTR,
+	LIBEXT2_OP_LINK,
+	LIBEXT2_OP_UNLINK,
+	LIBEXT2_OP_SYNC,
+	LIBEXT2_OPS          /* Number of requests with latency statistics */
+};
+
+
+/* Device control requests (msg.i.raw => libext2_i_devctl_t, msg.o.raw => libext2_o_devctl_t) */
+enum {
+	libext2_devctl_stat = 0, /* Retrieves statistics into msg.o.data (libext2_stat_t) */
+	libext2_devctl_reset,    /* Resets statistics */
+	libext2_devctl_compact   /* Compacts directory (reclaims space of removed entries) */
+};
+
+
+typedef struct {
+	int type;                /* Device control request type */
+	id_t id;                 /* Directory ID (compact request) */
+} libext2_i_devctl_t;
+
+
+typedef struct {
+	int err;                 /* Device control request error */
+} libext2_o_devctl_t;
+
+
+/* Latency histogram buckets (bucket 0 => under 1 us, bucket n => [2^(n - 1), 2^n) us, the last bucket => above) */
+#define LIBEXT2_LATBUCKETS 24
+
+
+/* Request latency statistics */
+typedef struct {
+	uint64_t count;                    /* Number of requests */
+	uint64_t time;                     /* Total time in microseconds */
+	uint64_t max;                      /* Max latency in microseconds */
+	uint32_t hist[LIBEXT2_LATBUCKETS]; /* Latency histogram */
+} libext2_lat_t;
+
+
+/* Filesystem statistics */
+typedef struct {
+	uint64_t hits;     /* Block cache hits */
+	uint64_t misses;   /* Block cache misses */
+	uint64_t wbacks;   /* Blocks written back from the cache */
+	uint64_t rablocks; /* Blocks read ahead into the cache */
+	uint64_t dhits;    /* Directory entry cache hits */
+	uint64_t dmisses;  /* Directory entry cache misses */
+	uint64_t ohits;    /* Object cache hits */
+	uint64_t omisses;  /* Object cache misses */
+	uint64_t oevicts;  /* Objects evicted from the cache */
+	uint64_t owbacks;  /* Objects written back by the flusher thread */
+	size_t osize;      /* Object cache memory in use */
+
+	/* Device I/O and requests latencies */
+	uint64_t reads[LIBEXT2_IO_KINDS];  /* Device blocks read by kind */
+	uint64_t writes[LIBEXT2_IO_KINDS]; /* Device blocks written by kind */
+	libext2_lat_t lat[LIBEXT2_OPS];    /* Requests latencies by request */
+} libext2_stat_t;
 
 
 /* Processes filesystem messages */
 extern int libext2_handler(void *fdata, msg_t *msg);
 
 
+/* Serves filesystem port with a pool of nthreads message handling threads (including the calling one), returns after the port is closed */
+extern int libext2_serve(void *fdata, unsigned int nthreads);
+
+
 /* Unmounts filesystem */
 extern int libext2_unmount(void *fdata);
 
@@ -41,4 +140,16 @@ extern int libext2_unmount(void *fdata);
 extern int libext2_mount(oid_t *dev, unsigned int sectorsz, ssize_t (*read)(id_t, offs_t, char *, size_t), ssize_t (*write)(id_t, offs_t, const char *, size_t), void **fdata);
 
 
+/* Mounts filesystem with given options (NULL => default options) */
+extern int libext2_mountopts(oid_t *dev, unsigned int sectorsz, ssize_t (*read)(id_t, offs_t, char *, size_t), ssize_t (*write)(id_t, offs_t, const char *, size_t), const libext2_opts_t *opts, void **fdata);
+
+
+/* Retrieves filesystem statistics */
+extern int libext2_stat(void *fdata, libext2_stat_t *stat);
+
+
+/* Resets filesystem statistics */
+extern int libext2_statreset(void *fdata);
+
+
 #endif
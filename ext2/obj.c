@@ -24,150 +24,380 @@
 #include <sys/threads.h>
 
 #include "block.h"
+#include "dcache.h"
+#include "extent.h"
+#include "cache.h"
 #include "file.h"
 #include "obj.h"
 
 
-/* Releases object resources and removes it from objects in use */
+/* Returns object memory size (object is allocated together with its inode buffer) */
+static inline size_t ext2_objs_objsz(ext2_t *fs)
+{
+	return sizeof(ext2_obj_t) + fs->sb->inodesz;
+}
+
+
+/* Returns object to the pool (requires objects to be locked) */
+static void _ext2_objs_free(ext2_t *fs, ext2_obj_t *obj)
+{
+	obj->next = fs->objs->pool;
+	fs->objs->pool = obj;
+}
+
+
+/* Returns indirect block buffer to the pool (requires objects to be locked) */
+static void _ext2_objs_indfree(ext2_t *fs, void *data)
+{
+	if (data != NULL) {
+		*(void **)data = fs->objs->ipool;
+		fs->objs->ipool = data;
+	}
+}
+
+
+/* Releases pooled memory until new allocation fits in the budget (requires objects to be locked) */
+static void _ext2_objs_trim(ext2_t *fs, size_t size)
+{
+	ext2_objs_t *objs = fs->objs;
+	ext2_obj_t *obj;
+	void *data;
+
+	while (objs->size + size > objs->max) {
+		if ((data = objs->ipool) != NULL) {
+			objs->ipool = *(void **)data;
+			objs->size -= fs->blocksz;
+			free(data);
+		}
+		else if ((obj = objs->pool) != NULL) {
+			objs->pool = obj->next;
+			objs->size -= ext2_objs_objsz(fs);
+			free(obj);
+		}
+		else {
+			break;
+		}
+	}
+}
+
+
+/* Checks if unused object can be evicted without I/O */
+static inline int ext2_obj_clean(ext2_obj_t *obj)
+{
+	return !(obj->flags & OFLAG_DIRTY) && !obj->dalloc.n && !obj->prealloc.n;
+}
+
+
+/* Releases resources of object removed from objects in use */
 static int _ext2_obj_remove(ext2_t *fs, ext2_obj_t *obj)
 {
 	int err;
 
-	if ((err = resourceDestroy(obj->lock)) < 0)
+	if ((err = ext2_block_discard(fs, obj)) < 0)
 		return err;
 
-	free(obj->inode);
-	free(obj->ind[0].data);
-	free(obj->ind[1].data);
-	free(obj->ind[2].data);
+	if ((err = resourceDestroy(obj->lock)) < 0)
+		return err;
 
-	lib_rbRemove(&fs->objs->used, &obj->node);
-	fs->objs->count--;
+	ext2_block_ddrop(fs, obj, 0);
+	free(obj->dalloc.bufs);
+	free(obj->map.runs);
+	free(obj->fmap.gaps);
+	_ext2_objs_indfree(fs, obj->ind[0].data);
+	_ext2_objs_indfree(fs, obj->ind[1].data);
+	_ext2_objs_indfree(fs, obj->ind[2].data);
 
 	return EOK;
 }
 
 
-/* Destroys object */
+/* Releases object blocks and marks its inode deleted (requires object to be locked) */
 static int _ext2_obj_destroy(ext2_t *fs, ext2_obj_t *obj)
 {
 	int err;
 
-	if ((err = ext2_inode_destroy(fs, (uint32_t)obj->id, obj->inode->mode)) < 0)
-		return err;
+	/* Release object blocks (fast symlinks keep data in the inode) */
+	if (!ext2_inode_fastlink(fs, obj->inode)) {
+		if ((err = _ext2_file_truncate(fs, obj, 0)) < 0)
+			return err;
+	}
 
-	if ((err = _ext2_obj_remove(fs, obj)) < 0)
-		return err;
+	obj->inode->dtime = time(NULL);
+
+	return ext2_inode_sync(fs, (uint32_t)obj->id, obj->inode);
+}
 
-	free(obj);
 
-	return EOK;
+/* Frees inode of object removed from objects in use (its inode number can be reused afterwards) */
+static int ext2_obj_free(ext2_t *fs, ext2_obj_t *obj)
+{
+	/* Drop cached entries of the removed directory */
+	if (S_ISDIR(obj->inode->mode))
+		ext2_dcache_purge(fs, (uint32_t)obj->id);
+
+	return ext2_inode_destroy(fs, (uint32_t)obj->id, obj->inode->mode);
+}
+
+
+/* Destroys object marked as destroyed and releases its reference, blocks release may need objects lock (requires objects to be unlocked) */
+static int ext2_obj_kill(ext2_t *fs, ext2_obj_t *obj)
+{
+	int err;
+
+	mutexLock(obj->lock);
+
+	err = _ext2_obj_destroy(fs, obj);
+
+	mutexUnlock(obj->lock);
+
+	/* Remove object from objects in use before its inode number is freed */
+	mutexLock(fs->objs->lock);
+
+	lib_rbRemove(&fs->objs->used, &obj->node);
+	fs->objs->count--;
+
+	mutexUnlock(fs->objs->lock);
+
+	if (err >= 0)
+		err = ext2_obj_free(fs, obj);
+
+	ext2_obj_put(fs, obj);
+
+	return err;
+}
+
+
+/* Writes back unused object, allocates its buffered blocks and releases blocks reserved for its growth */
+static int ext2_obj_writeback(ext2_t *fs, ext2_obj_t *obj)
+{
+	int ret;
+
+	mutexLock(obj->lock);
+
+	if (((ret = ext2_block_dflush(fs, obj)) >= 0) && ((ret = ext2_block_discard(fs, obj)) >= 0))
+		ret = _ext2_obj_sync(fs, obj);
+
+	mutexUnlock(obj->lock);
+
+	return ret;
+}
+
+
+/* Acquires object reference (requires objects to be locked) */
+static void _ext2_obj_ref(ext2_t *fs, ext2_obj_t *obj)
+{
+	if (!obj->refs++ && !(S_ISCHR(obj->inode->mode) || S_ISBLK(obj->inode->mode)))
+		LIST_REMOVE(&fs->objs->lru, obj);
 }
 
 
-/* Removes object from LRU cache */
-static int _ext2_obj_removelru(ext2_t *fs)
+/* Releases object reference, unused unlinked object is destroyed with objects unlocked (requires objects to be locked) */
+static void _ext2_obj_put(ext2_t *fs, ext2_obj_t *obj)
 {
+	if (--obj->refs)
+		return;
+
+	/* Destroyed object has already been removed from objects in use */
+	if (obj->destroyed) {
+		_ext2_obj_remove(fs, obj);
+		_ext2_objs_free(fs, obj);
+	}
+	else if (!(S_ISCHR(obj->inode->mode) || S_ISBLK(obj->inode->mode))) {
+		if (obj->inode->links) {
+			LIST_ADD(&fs->objs->lru, obj);
+			return;
+		}
+
+		obj->destroyed = 1;
+		obj->refs++;
+		mutexUnlock(fs->objs->lock);
+
+		ext2_obj_kill(fs, obj);
+
+		mutexLock(fs->objs->lock);
+	}
+}
+
+
+/* Evicts least recently used clean object, dirty objects are written back by the flusher thread (requires objects to be locked, they may be unlocked) */
+static int _ext2_objs_evict(ext2_t *fs)
+{
+	ext2_objs_t *objs = fs->objs;
 	ext2_obj_t *obj;
 	int err;
 
-	if ((obj = fs->objs->lru) == NULL)
+	if ((obj = objs->lru) == NULL)
 		return -ENOENT;
 
-	if ((err = ext2_obj_sync(fs, obj)) < 0)
-		return err;
+	/* Clean objects are evicted without I/O */
+	do {
+		if (ext2_obj_clean(obj))
+			break;
+	} while ((obj = obj->next) != objs->lru);
+
+	if (!ext2_obj_clean(obj)) {
+		ext2_cache_wakeup(fs);
+
+		/* Write back the least recently used object only if the flusher thread can't keep up */
+		if (objs->size < 2 * objs->max)
+			return -EBUSY;
+
+		/* Object locks are taken before objects lock, hold object reference and write it back with objects unlocked */
+		obj = objs->lru;
+		_ext2_obj_ref(fs, obj);
+		mutexUnlock(objs->lock);
+
+		err = ext2_obj_writeback(fs, obj);
+
+		mutexLock(objs->lock);
+
+		/* Object might have been used meanwhile */
+		if ((err < 0) || (obj->refs > 1) || !obj->inode->links || !ext2_obj_clean(obj)) {
+			_ext2_obj_put(fs, obj);
+			return (err < 0) ? err : -EBUSY;
+		}
+
+		obj->refs--;
+		LIST_ADD(&objs->lru, obj);
+	}
 
 	if ((err = _ext2_obj_remove(fs, obj)) < 0)
 		return err;
 
-	LIST_REMOVE(&fs->objs->lru, obj);
-	free(obj);
+	lib_rbRemove(&objs->used, &obj->node);
+	objs->count--;
+	LIST_REMOVE(&objs->lru, obj);
+	_ext2_objs_free(fs, obj);
+	objs->evicts++;
 
 	return EOK;
 }
 
 
-/* Creates new object */
-static int _ext2_obj_create(ext2_t *fs, uint32_t pino, ext2_inode_t *inode, uint16_t mode, ext2_obj_t** res)
+/* Allocates object with its inode buffer (requires objects to be locked, they may be unlocked) */
+static int _ext2_obj_alloc(ext2_t *fs, uint32_t ino, ext2_obj_t **res)
 {
+	ext2_objs_t *objs = fs->objs;
+	size_t size = ext2_objs_objsz(fs);
 	ext2_obj_t *obj;
-	uint32_t ino;
 	int err;
 
-	if (inode == NULL) {
-		if (!(ino = ext2_inode_create(fs, pino, mode)))
-			return -ENOSPC;
+	/* Reuse evicted object memory */
+	if ((objs->pool == NULL) && (objs->size + size > objs->max))
+		_ext2_objs_evict(fs);
 
-		if ((inode = (ext2_inode_t *)malloc(fs->sb->inodesz)) == NULL) {
-			ext2_inode_destroy(fs, ino, mode);
+	if ((obj = objs->pool) != NULL) {
+		objs->pool = obj->next;
+	}
+	else {
+		_ext2_objs_trim(fs, size);
+
+		if ((obj = (ext2_obj_t *)malloc(size)) == NULL)
 			return -ENOMEM;
-		}
 
-		memset(inode, 0, fs->sb->inodesz);
-		inode->ctime = inode->mtime = inode->atime = time(NULL);
-		inode->mode = mode;
+		objs->size += size;
 	}
-	else {
-		ino = pino;
+
+	memset(obj, 0, size);
+
+	if ((err = mutexCreate(&obj->lock)) < 0) {
+		_ext2_objs_free(fs, obj);
+		return err;
 	}
 
-	do {
-		if ((fs->objs->count >= MAX_OBJECTS) && ((err = _ext2_obj_removelru(fs)) < 0))
-			break;
+	obj->id = ino;
+	obj->refs = 1;
+	obj->inode = (ext2_inode_t *)(obj + 1);
+	*res = obj;
 
-		if ((*res = obj = (ext2_obj_t *)malloc(sizeof(ext2_obj_t))) == NULL) {
-			err = -ENOMEM;
-			break;
-		}
+	return EOK;
+}
 
-		memset(obj, 0, sizeof(ext2_obj_t));
 
-		if ((err = mutexCreate(&obj->lock)) < 0) {
-			free(obj);
-			*res = NULL;
-			break;
-		}
+/* Creates new object */
+static int _ext2_obj_create(ext2_t *fs, uint32_t pino, uint16_t mode, ext2_obj_t **res)
+{
+	ext2_obj_t *obj;
+	uint32_t ino;
+	int err;
 
-		obj->id = ino;
-		obj->refs = 1;
-		obj->flags = OFLAG_DIRTY;
-		obj->inode = inode;
-		obj->prev = NULL;
-		obj->next = NULL;
+	if (!(ino = ext2_inode_create(fs, pino, mode)))
+		return -ENOSPC;
 
-		lib_rbInsert(&fs->objs->used, &obj->node);
-		fs->objs->count++;
+	if ((err = _ext2_obj_alloc(fs, ino, &obj)) < 0) {
+		ext2_inode_destroy(fs, ino, mode);
+		return err;
+	}
 
-		return EOK;
-	} while (0);
+	obj->flags = OFLAG_DIRTY;
+	obj->inode->ctime = obj->inode->mtime = obj->inode->atime = time(NULL);
+	obj->inode->mode = mode;
 
-	free(inode);
-	ext2_inode_destroy(fs, ino, mode);
+	/* Map new files and directories with extents */
+	if ((fs->sb->featureIncompat & INCOMPAT_EXTENTS) && (S_ISREG(mode) || S_ISDIR(mode)))
+		ext2_extent_init(obj->inode);
 
-	return err;
+	lib_rbInsert(&fs->objs->used, &obj->node);
+	fs->objs->count++;
+	*res = obj;
+
+	return EOK;
+}
+
+
+/* Finds object in use (requires objects to be locked) */
+static ext2_obj_t *_ext2_obj_find(ext2_t *fs, id_t id)
+{
+	ext2_obj_t tmp;
+
+	tmp.id = id;
+
+	return lib_treeof(ext2_obj_t, node, lib_rbFind(&fs->objs->used, &tmp.node));
 }
 
 
 ext2_obj_t *ext2_obj_get(ext2_t *fs, id_t id)
 {
-	ext2_obj_t *obj, tmp;
-	ext2_inode_t *inode;
+	ext2_obj_t *obj, *nobj;
 
 	mutexLock(fs->objs->lock);
 
 	do {
-		tmp.id = id;
-		if ((obj = lib_treeof(ext2_obj_t, node, lib_rbFind(&fs->objs->used, &tmp.node))) != NULL) {
-			if (!obj->refs++ && !(S_ISCHR(obj->inode->mode) || S_ISBLK(obj->inode->mode)))
-				LIST_REMOVE(&fs->objs->lru, obj);
-			break;
+		if ((obj = _ext2_obj_find(fs, id)) == NULL) {
+			fs->objs->misses++;
+
+			if (_ext2_obj_alloc(fs, (uint32_t)id, &nobj) < 0)
+				break;
+
+			/* Objects are unlocked while an object is evicted, the object might have been loaded meanwhile */
+			if ((obj = _ext2_obj_find(fs, id)) == NULL) {
+				/* Deleted inode can't be used (e.g. through a stale ID) */
+				if ((ext2_inode_init(fs, (uint32_t)id, nobj->inode) < 0) || (!nobj->inode->links && nobj->inode->dtime)) {
+					resourceDestroy(nobj->lock);
+					_ext2_objs_free(fs, nobj);
+					break;
+				}
+
+				lib_rbInsert(&fs->objs->used, &nobj->node);
+				fs->objs->count++;
+				obj = nobj;
+				break;
+			}
+
+			resourceDestroy(nobj->lock);
+			_ext2_objs_free(fs, nobj);
+		}
+		else {
+			fs->objs->hits++;
 		}
 
-		if ((inode = ext2_inode_init(fs, (uint32_t)id)) == NULL)
+		/* Destroyed object can't be referenced */
+		if (obj->destroyed) {
+			obj = NULL;
 			break;
+		}
 
-		if (_ext2_obj_create(fs, (uint32_t)id, inode, inode->mode, &obj) < 0)
-			break;
+		_ext2_obj_ref(fs, obj);
 	} while (0);
 
 	mutexUnlock(fs->objs->lock);
@@ -180,12 +410,7 @@ void ext2_obj_put(ext2_t *fs, ext2_obj_t *obj)
 {
 	mutexLock(fs->objs->lock);
 
-	if (!(--obj->refs) && !(S_ISCHR(obj->inode->mode) || S_ISBLK(obj->inode->mode))) {
-		if (!obj->inode->links)
-			_ext2_obj_destroy(fs, obj);
-		else
-			LIST_ADD(&fs->objs->lru, obj);
-	}
+	_ext2_obj_put(fs, obj);
 
 	mutexUnlock(fs->objs->lock);
 }
@@ -203,13 +428,13 @@ int _ext2_obj_sync(ext2_t *fs, ext2_obj_t *obj)
 	}
 
 	if (!(S_ISCHR(obj->inode->mode) || S_ISBLK(obj->inode->mode)) && !(obj->flags & OFLAG_MOUNT)) {
-		if ((obj->ind[0].data != NULL) && (err = ext2_block_write(fs, obj->ind[0].bno, obj->ind[0].data, 1)) < 0)
+		if ((obj->ind[0].data != NULL) && obj->ind[0].bno && (err = ext2_block_write(fs, obj->ind[0].bno, obj->ind[0].data, 1)) < 0)
 			return err;
 
-		if ((obj->ind[1].data != NULL) && (err = ext2_block_write(fs, obj->ind[1].bno, obj->ind[1].data, 1)) < 0)
+		if ((obj->ind[1].data != NULL) && obj->ind[1].bno && (err = ext2_block_write(fs, obj->ind[1].bno, obj->ind[1].data, 1)) < 0)
 			return err;
 
-		if ((obj->ind[2].data != NULL) && (err = ext2_block_write(fs, obj->ind[2].bno, obj->ind[2].data, 1)) < 0)
+		if ((obj->ind[2].data != NULL) && obj->ind[2].bno && (err = ext2_block_write(fs, obj->ind[2].bno, obj->ind[2].data, 1)) < 0)
 			return err;
 	}
 
@@ -231,6 +456,22 @@ int ext2_obj_sync(ext2_t *fs, ext2_obj_t *obj)
 }
 
 
+/* Allocates object buffered blocks and synchronizes it */
+static int ext2_obj_flush(ext2_t *fs, ext2_obj_t *obj)
+{
+	int ret;
+
+	mutexLock(obj->lock);
+
+	if ((ret = ext2_block_dflush(fs, obj)) >= 0)
+		ret = _ext2_obj_sync(fs, obj);
+
+	mutexUnlock(obj->lock);
+
+	return ret;
+}
+
+
 int ext2_obj_truncate(ext2_t *fs, ext2_obj_t *obj, size_t size)
 {
 	int err;
@@ -252,12 +493,32 @@ int ext2_obj_truncate(ext2_t *fs, ext2_obj_t *obj, size_t size)
 
 
 int ext2_obj_destroy(ext2_t *fs, ext2_obj_t *obj)
+{
+	mutexLock(fs->objs->lock);
+
+	/* Object is already being destroyed */
+	if (obj->destroyed) {
+		_ext2_obj_put(fs, obj);
+		mutexUnlock(fs->objs->lock);
+
+		return EOK;
+	}
+
+	obj->destroyed = 1;
+
+	mutexUnlock(fs->objs->lock);
+
+	return ext2_obj_kill(fs, obj);
+}
+
+
+int ext2_obj_create(ext2_t *fs, uint32_t pino, uint16_t mode, ext2_obj_t **res)
 {
 	int ret;
 
 	mutexLock(fs->objs->lock);
 
-	ret = _ext2_obj_destroy(fs, obj);
+	ret = _ext2_obj_create(fs, pino, mode, res);
 
 	mutexUnlock(fs->objs->lock);
 
@@ -265,35 +526,206 @@ int ext2_obj_destroy(ext2_t *fs, ext2_obj_t *obj)
 }
 
 
-int ext2_obj_create(ext2_t *fs, uint32_t pino, ext2_inode_t *inode, uint16_t mode, ext2_obj_t **res)
+void *ext2_objs_indalloc(ext2_t *fs)
 {
-	int ret;
+	ext2_objs_t *objs = fs->objs;
+	void *data;
+
+	mutexLock(objs->lock);
+
+	/* Reuse evicted object indirect block buffers */
+	if ((objs->ipool == NULL) && (objs->size + fs->blocksz > objs->max))
+		_ext2_objs_evict(fs);
+
+	if ((data = objs->ipool) != NULL) {
+		objs->ipool = *(void **)data;
+	}
+	else {
+		_ext2_objs_trim(fs, fs->blocksz);
+
+		if ((data = malloc(fs->blocksz)) != NULL)
+			objs->size += fs->blocksz;
+	}
+
+	mutexUnlock(objs->lock);
+
+	return data;
+}
+
+
+void ext2_objs_writeback(ext2_t *fs)
+{
+	ext2_objs_t *objs = fs->objs;
+	ext2_obj_t *obj;
+	uint32_t n = 0;
+	int err;
+
+	mutexLock(objs->lock);
+
+	/* Write back each unused object at most once (objects may be used again meanwhile) */
+	if ((obj = objs->lru) != NULL) {
+		do {
+			n++;
+		} while ((obj = obj->next) != objs->lru);
+	}
+
+	/* Object locks are taken before objects lock, hold unused object reference and write it back with objects unlocked */
+	for (; n && ((obj = objs->lru) != NULL); n--) {
+		do {
+			if (!ext2_obj_clean(obj))
+				break;
+		} while ((obj = obj->next) != objs->lru);
+
+		if (ext2_obj_clean(obj))
+			break;
+
+		_ext2_obj_ref(fs, obj);
+		mutexUnlock(objs->lock);
+
+		err = ext2_obj_writeback(fs, obj);
+
+		mutexLock(objs->lock);
+		_ext2_obj_put(fs, obj);
+
+		if (err < 0)
+			break;
+
+		objs->wbacks++;
+	}
+
+	mutexUnlock(objs->lock);
+}
+
+
+/* Writes back dirty object inode for the journal commit (blocks preallocated for file growth are only reserved in memory, they're kept) */
+static int ext2_obj_commit(ext2_t *fs, ext2_obj_t *obj)
+{
+	int ret = EOK;
+
+	mutexLock(obj->lock);
+
+	if (obj->flags & OFLAG_DIRTY)
+		ret = _ext2_obj_sync(fs, obj);
+
+	mutexUnlock(obj->lock);
+
+	return ret;
+}
+
+
+/* Synchronizes all objects (commit != 0 => only dirty inodes are written back for the journal commit) */
+static int ext2_objs_syncall(ext2_t *fs, uint8_t commit)
+{
+	ext2_obj_t *obj, *next;
+	int err = EOK, ret;
 
 	mutexLock(fs->objs->lock);
 
-	ret = _ext2_obj_create(fs, pino, inode, mode, res);
+	if ((obj = lib_treeof(ext2_obj_t, node, lib_rbMinimum(fs->objs->used.root))) != NULL)
+		_ext2_obj_ref(fs, obj);
+
+	/* Object locks are taken before objects lock, hold object reference and sync it with objects unlocked */
+	while (obj != NULL) {
+		mutexUnlock(fs->objs->lock);
+
+		if ((ret = (commit) ? ext2_obj_commit(fs, obj) : ext2_obj_flush(fs, obj)) < 0)
+			err = ret;
+
+		mutexLock(fs->objs->lock);
+
+		if ((next = lib_treeof(ext2_obj_t, node, lib_rbNext(&obj->node))) != NULL)
+			_ext2_obj_ref(fs, next);
+
+		_ext2_obj_put(fs, obj);
+		obj = next;
+	}
 
 	mutexUnlock(fs->objs->lock);
 
-	return ret;
+	return err;
+}
+
+
+int ext2_objs_sync(ext2_t *fs)
+{
+	return ext2_objs_syncall(fs, 0);
+}
+
+
+int ext2_objs_commit(ext2_t *fs)
+{
+	return ext2_objs_syncall(fs, 1);
 }
 
 
-void ext2_objs_destroy(ext2_t *fs)
+/* Releases object, writes it back or destroys it if it's unlinked (requires objects to be locked, nobody else uses them on unmount) */
+static int _ext2_obj_release(ext2_t *fs, ext2_obj_t *obj)
+{
+	int err;
+
+	/* Object locks are taken before objects lock, blocks release may need objects lock */
+	mutexUnlock(fs->objs->lock);
+
+	if (!obj->inode->links) {
+		mutexLock(obj->lock);
+		err = _ext2_obj_destroy(fs, obj);
+		mutexUnlock(obj->lock);
+
+		if (err >= 0)
+			err = ext2_obj_free(fs, obj);
+	}
+	else {
+		err = ext2_obj_sync(fs, obj);
+	}
+
+	mutexLock(fs->objs->lock);
+
+	lib_rbRemove(&fs->objs->used, &obj->node);
+	fs->objs->count--;
+	_ext2_obj_remove(fs, obj);
+	_ext2_objs_free(fs, obj);
+
+	return err;
+}
+
+
+int ext2_objs_destroy(ext2_t *fs)
 {
 	rbnode_t *node, *next;
+	ext2_obj_t *obj;
+	int err, ret;
+
+	/* Allocate buffered blocks first, blocks allocation may need objects lock */
+	err = ext2_objs_sync(fs);
 
 	mutexLock(fs->objs->lock);
 
 	for (node = lib_rbMinimum(fs->objs->used.root); node; node = next) {
 		next = lib_rbNext(node);
-		_ext2_obj_destroy(fs, lib_treeof(ext2_obj_t, node, node));
+		obj = lib_treeof(ext2_obj_t, node, node);
+
+		/* Root object is used for inode numbers validation, release it last */
+		if ((obj != fs->root) && ((ret = _ext2_obj_release(fs, obj)) < 0))
+			err = ret;
 	}
 
+	if (fs->root != NULL) {
+		if ((ret = _ext2_obj_release(fs, fs->root)) < 0)
+			err = ret;
+		fs->root = NULL;
+	}
+
+	/* Release pooled memory */
+	fs->objs->max = 0;
+	_ext2_objs_trim(fs, 0);
+
 	mutexUnlock(fs->objs->lock);
 
 	resourceDestroy(fs->objs->lock);
 	free(fs->objs);
+	fs->objs = NULL;
+
+	return err;
 }
 
 
@@ -311,7 +743,7 @@ static int ext2_obj_cmp(rbnode_t *node1, rbnode_t *node2)
 }
 
 
-int ext2_objs_init(ext2_t *fs)
+int ext2_objs_init(ext2_t *fs, size_t size)
 {
 	ext2_objs_t *objs;
 	int err;
@@ -328,6 +760,19 @@ int ext2_objs_init(ext2_t *fs)
 	objs->lru = NULL;
 	lib_rbInit(&objs->used, ext2_obj_cmp, NULL);
 
+	objs->size = 0;
+	objs->max = (size) ? size : OBJS_SIZE;
+	objs->pool = NULL;
+	objs->ipool = NULL;
+
+	if (objs->max < OBJS_MINOBJS * ext2_objs_objsz(fs))
+		objs->max = OBJS_MINOBJS * ext2_objs_objsz(fs);
+
+	objs->hits = 0;
+	objs->misses = 0;
+	objs->evicts = 0;
+	objs->wbacks = 0;
+
 	fs->objs = objs;
 
 	return EOK;
@@ -25,6 +25,11 @@
 #include "inode.h"
 
 
+/* Object cache configuration */
+#define OBJS_SIZE    (256 * 1024) /* Default object cache size in bytes */
+#define OBJS_MINOBJS 16           /* Min number of cached objects */
+
+
 /* Object flags */
 enum {
 	OFLAG_DIRTY      = 0x01,
@@ -33,6 +38,22 @@ enum {
 };
 
 
+/* Cached block mapping (run of physically contiguous blocks) */
+typedef struct {
+	uint32_t block;          /* First logical block */
+	uint32_t bno;            /* First physical block */
+	uint32_t n;              /* Number of blocks */
+	uint32_t used;           /* Last use stamp */
+} ext2_bmap_t;
+
+
+/* Block buffered with delayed allocation */
+typedef struct {
+	uint32_t block;          /* Logical block */
+	char *data;              /* Block data */
+} ext2_dblock_t;
+
+
 struct _ext2_obj_t {
 	id_t id;                 /* Object ID, same as underlying inode number */
 	rbnode_t node;           /* RBTree node */
@@ -46,7 +67,34 @@ struct _ext2_obj_t {
 		oid_t mnt;           /* Mounted filesystem */
 		oid_t dev;           /* Device */
 	};
+	struct {
+		uint32_t bno;        /* First preallocated block */
+		uint32_t n;          /* Number of preallocated blocks */
+	} prealloc;              /* Blocks reserved for file growth */
+	struct {
+		uint32_t block;      /* Next sequentially accessed block */
+		uint32_t end;        /* First block after read ahead blocks */
+		uint32_t n;          /* Readahead window size in blocks (0 => random access) */
+	} ra;                    /* Sequential readahead state */
+	uint32_t sa;             /* Directory offset up to which listed entries inodes are read ahead (stat-ahead) */
+	struct {
+		ext2_bmap_t *runs;   /* Cached mappings sorted by logical block */
+		uint32_t n;          /* Number of cached mappings */
+		uint32_t size;       /* Mappings array size (grows up to BMAP_SIZE) */
+		uint32_t stamp;      /* Mappings use counter */
+	} map;                   /* Block mappings cache */
+	struct {
+		ext2_dblock_t *bufs; /* Buffered blocks sorted by logical block */
+		uint32_t n;          /* Number of buffered blocks */
+		uint32_t size;       /* Buffered blocks array size */
+	} dalloc;                /* Blocks with delayed allocation (allocated on write back) */
+	struct {
+		uint16_t *gaps;      /* Largest free space for a new entry in each directory block */
+		uint32_t n;          /* Number of mapped directory blocks */
+		uint32_t size;       /* Gaps array size */
+	} fmap;                  /* Free space map of a linear directory (built on the first entry insertion) */
 	uint32_t refs;           /* Reference counter */
+	uint8_t destroyed;       /* Object is being destroyed, it can't be referenced (protected by objects lock) */
 	uint8_t flags;           /* Object flags */
 	ext2_inode_t *inode;     /* Underlying inode */
 	ext2_obj_t *prev, *next; /* Double linked list */
@@ -61,6 +109,18 @@ struct _ext2_objs_t {
 	uint32_t count;          /* Number of objects in use */
 	ext2_obj_t *lru;         /* Least Recently Used objects cache */
 
+	/* Memory budget */
+	size_t size;             /* Allocated memory (including pooled allocations) */
+	size_t max;              /* Max allocated memory */
+	ext2_obj_t *pool;        /* Pooled objects (with inode buffers) */
+	void *ipool;             /* Pooled indirect block buffers */
+
+	/* Statistics */
+	uint64_t hits;           /* Number of object cache hits */
+	uint64_t misses;         /* Number of object cache misses */
+	uint64_t evicts;         /* Number of evicted objects */
+	uint64_t wbacks;         /* Number of objects written back by the flusher thread */
+
 	/* Synchronization */
 	handle_t lock;           /* Access mutex */
 };
@@ -86,20 +146,36 @@ extern int ext2_obj_sync(ext2_t *fs, ext2_obj_t *obj);
 extern int ext2_obj_truncate(ext2_t *fs, ext2_obj_t *obj, size_t size);
 
 
-/* Destroys object */
+/* Destroys object, releases the object reference */
 extern int ext2_obj_destroy(ext2_t *fs, ext2_obj_t *obj);
 
 
 /* Creates new object */
-extern int ext2_obj_create(ext2_t *fs, uint32_t pino, ext2_inode_t *inode, uint16_t mode, ext2_obj_t **res);
+extern int ext2_obj_create(ext2_t *fs, uint32_t pino, uint16_t mode, ext2_obj_t **res);
+
+
+/* Allocates indirect block buffer */
+extern void *ext2_objs_indalloc(ext2_t *fs);
+
+
+/* Writes back dirty unused objects, so they can be evicted without I/O */
+extern void ext2_objs_writeback(ext2_t *fs);
+
+
+/* Synchronizes filesystem objects, allocates their buffered blocks */
+extern int ext2_objs_sync(ext2_t *fs);
+
+
+/* Writes back dirty objects inodes for the journal commit (buffered blocks stay unallocated) */
+extern int ext2_objs_commit(ext2_t *fs);
 
 
-/* Destroys filesystem objects */
-extern void ext2_objs_destroy(ext2_t *fs);
+/* Destroys filesystem objects (returns write back error) */
+extern int ext2_objs_destroy(ext2_t *fs);
 
 
-/* Initializes filesystem objects */
-extern int ext2_objs_init(ext2_t *fs);
+/* Initializes filesystem objects (size given in bytes, 0 => default size) */
+extern int ext2_objs_init(ext2_t *fs, size_t size);
 
 
 #endif
@@ -16,11 +16,19 @@
 #include <errno.h>
 #include <stdlib.h>
 
+#include "block.h"
 #include "sb.h"
+#include "stats.h"
 
 
 int ext2_sb_sync(ext2_t *fs)
 {
+	/* Journalled SuperBlock is written through the cache and committed with other metadata */
+	if (fs->journal != NULL)
+		return ext2_block_writepart(fs, SB_OFFSET / fs->blocksz, SB_OFFSET % fs->blocksz, fs->sb, sizeof(ext2_sb_t));
+
+	ext2_stats_dev(fs, LIBEXT2_IO_SB, 1, 1);
+
 	if (fs->write(fs->oid.id, SB_OFFSET, (char *)fs->sb, sizeof(ext2_sb_t)) != sizeof(ext2_sb_t))
 		return -EIO;
 
@@ -28,10 +36,13 @@ int ext2_sb_sync(ext2_t *fs)
 }
 
 
-void ext2_sb_destroy(ext2_t *fs)
+int ext2_sb_destroy(ext2_t *fs)
 {
-	ext2_sb_sync(fs);
+	int err = ext2_sb_sync(fs);
+
 	free(fs->sb);
+
+	return err;
 }
 
 
@@ -40,6 +51,8 @@ int ext2_sb_init(ext2_t *fs)
 	if ((fs->sb = (ext2_sb_t *)malloc(sizeof(ext2_sb_t))) == NULL)
 		return -ENOMEM;
 
+	ext2_stats_dev(fs, LIBEXT2_IO_SB, 1, 0);
+
 	if (fs->read(fs->oid.id, SB_OFFSET, (char *)fs->sb, sizeof(ext2_sb_t)) != sizeof(ext2_sb_t)) {
 		free(fs->sb);
 		return -EIO;
@@ -0,0 +1,165 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Device I/O and requests latency statistics
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/threads.h>
+
+#include "stats.h"
+
+
+/* Returns kind of a block from the filesystem layout */
+static uint8_t ext2_stats_kind(ext2_t *fs, uint32_t bno, uint8_t data)
+{
+	uint32_t group, flex, n, itblocks;
+	ext2_gd_t *gd;
+
+	if (bno == SB_OFFSET / fs->blocksz)
+		return LIBEXT2_IO_SB;
+
+	/* GDT follows the SuperBlock */
+	if ((bno > fs->sb->fstBlock) && (bno - fs->sb->fstBlock <= (fs->groups * sizeof(ext2_gd_t) + fs->blocksz - 1) / fs->blocksz))
+		return LIBEXT2_IO_GDT;
+
+	if ((fs->gdt == NULL) || (bno < fs->sb->fstBlock) || ((group = (bno - fs->sb->fstBlock) / fs->sb->groupBlocks) >= fs->groups))
+		return (data) ? LIBEXT2_IO_DATA : LIBEXT2_IO_IND;
+
+	/* Bitmaps and inode tables of a flexible group are stored contiguously starting in its first group */
+	flex = (fs->sb->featureIncompat & INCOMPAT_FLEX_BG) ? 1 << fs->sb->logFlexGroups : 1;
+	group = group / flex * flex;
+	n = (fs->groups - group < flex) ? fs->groups - group : flex;
+	itblocks = (fs->sb->groupInodes * fs->sb->inodesz + fs->blocksz - 1) / fs->blocksz;
+	gd = fs->gdt + group;
+
+	if ((bno - gd->blockBmp < n) || (bno - gd->inodeBmp < n))
+		return LIBEXT2_IO_BMP;
+
+	if (bno - gd->inodeTbl < n * itblocks)
+		return LIBEXT2_IO_ITABLE;
+
+	return (data) ? LIBEXT2_IO_DATA : LIBEXT2_IO_IND;
+}
+
+
+void ext2_stats_dev(ext2_t *fs, uint8_t kind, uint32_t n, uint8_t write)
+{
+	ext2_stats_t *stats = fs->stats;
+
+	mutexLock(stats->lock);
+
+	if (write)
+		stats->writes[kind] += n;
+	else
+		stats->reads[kind] += n;
+
+	mutexUnlock(stats->lock);
+}
+
+
+void ext2_stats_io(ext2_t *fs, uint32_t bno, uint32_t n, uint8_t data, uint8_t write)
+{
+	ext2_stats_t *stats = fs->stats;
+	uint64_t *counters = (write) ? stats->writes : stats->reads;
+	uint32_t i;
+
+	mutexLock(stats->lock);
+
+	for (i = 0; i < n; i++)
+		counters[ext2_stats_kind(fs, bno + i, data)]++;
+
+	mutexUnlock(stats->lock);
+}
+
+
+void ext2_stats_op(ext2_t *fs, uint8_t op, time_t start)
+{
+	ext2_stats_t *stats = fs->stats;
+	libext2_lat_t *lat = stats->lat + op;
+	time_t now;
+	uint64_t t;
+	uint8_t i;
+
+	gettime(&now, NULL);
+	t = (now > start) ? now - start : 0;
+
+	/* Find log2 bucket */
+	for (i = 0; (i < LIBEXT2_LATBUCKETS - 1) && (t >> i); i++);
+
+	mutexLock(stats->lock);
+
+	lat->count++;
+	lat->time += t;
+	lat->hist[i]++;
+
+	if (t > lat->max)
+		lat->max = t;
+
+	mutexUnlock(stats->lock);
+}
+
+
+void ext2_stats_get(ext2_t *fs, libext2_stat_t *stat)
+{
+	ext2_stats_t *stats = fs->stats;
+
+	mutexLock(stats->lock);
+
+	memcpy(stat->reads, stats->reads, sizeof(stats->reads));
+	memcpy(stat->writes, stats->writes, sizeof(stats->writes));
+	memcpy(stat->lat, stats->lat, sizeof(stats->lat));
+
+	mutexUnlock(stats->lock);
+}
+
+
+void ext2_stats_reset(ext2_t *fs)
+{
+	ext2_stats_t *stats = fs->stats;
+
+	mutexLock(stats->lock);
+
+	memset(stats->reads, 0, sizeof(stats->reads));
+	memset(stats->writes, 0, sizeof(stats->writes));
+	memset(stats->lat, 0, sizeof(stats->lat));
+
+	mutexUnlock(stats->lock);
+}
+
+
+void ext2_stats_destroy(ext2_t *fs)
+{
+	resourceDestroy(fs->stats->lock);
+	free(fs->stats);
+}
+
+
+int ext2_stats_init(ext2_t *fs)
+{
+	ext2_stats_t *stats;
+	int err;
+
+	if ((stats = (ext2_stats_t *)calloc(1, sizeof(ext2_stats_t))) == NULL)
+		return -ENOMEM;
+
+	if ((err = mutexCreate(&stats->lock)) < 0) {
+		free(stats);
+		return err;
+	}
+
+	fs->stats = stats;
+
+	return EOK;
+}
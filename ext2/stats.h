@@ -0,0 +1,65 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Device I/O and requests latency statistics
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+#include "ext2.h"
+#include "libext2.h"
+
+
+struct _ext2_stats_t {
+	uint64_t reads[LIBEXT2_IO_KINDS];  /* Device blocks read by kind */
+	uint64_t writes[LIBEXT2_IO_KINDS]; /* Device blocks written by kind */
+	libext2_lat_t lat[LIBEXT2_OPS];    /* Requests latencies */
+
+	/* Synchronization */
+	handle_t lock;                     /* Access mutex */
+};
+
+
+/* Accounts device I/O of n blocks of one kind */
+extern void ext2_stats_dev(ext2_t *fs, uint8_t kind, uint32_t n, uint8_t write);
+
+
+/* Accounts device I/O of n blocks starting at bno, blocks kinds are derived from the filesystem layout (data != 0 => blocks outside metadata areas hold regular file data) */
+extern void ext2_stats_io(ext2_t *fs, uint32_t bno, uint32_t n, uint8_t data, uint8_t write);
+
+
+/* Accounts request latency (start is the request start time in microseconds) */
+extern void ext2_stats_op(ext2_t *fs, uint8_t op, time_t start);
+
+
+/* Copies statistics */
+extern void ext2_stats_get(ext2_t *fs, libext2_stat_t *stat);
+
+
+/* Resets statistics */
+extern void ext2_stats_reset(ext2_t *fs);
+
+
+/* Destroys statistics */
+extern void ext2_stats_destroy(ext2_t *fs);
+
+
+/* Initializes statistics */
+extern int ext2_stats_init(ext2_t *fs);
+
+
+#endif
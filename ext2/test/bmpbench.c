@@ -0,0 +1,159 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem
+ *
+ * Bitmap operations microbenchmark
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#include "../ext2.h"
+
+
+/* Benchmark configuration */
+#define BENCH_BITS   32768 /* Bitmap size in bits (4 KiB block) */
+#define BENCH_ROUNDS 1000  /* Number of rounds per measurement */
+
+
+struct {
+	uint64_t bmp[BENCH_BITS / 64];
+	uint32_t ref[BENCH_BITS / 32];
+	uint32_t seed;
+	volatile uint32_t sink;
+} bench_common;
+
+
+/* Reference bit at a time search (skips fully used 32-bit words) */
+static uint32_t bench_reffindzero(const uint32_t *bmp, uint32_t size, uint32_t offs)
+{
+	for (; offs <= size; offs++) {
+		if (!((offs - 1) % 32) && (bmp[(offs - 1) / 32] == ~0U)) {
+			offs += 31;
+			continue;
+		}
+
+		if (!(bmp[(offs - 1) / 32] & (1U << ((offs - 1) % 32))))
+			return offs;
+	}
+
+	return 0;
+}
+
+
+/* Reference bit at a time free run search */
+static uint32_t bench_reffindrun(const uint32_t *bmp, uint32_t size, uint32_t offs, uint32_t n, uint32_t *len)
+{
+	uint32_t l, best = 0;
+
+	for (*len = 0; (offs = bench_reffindzero(bmp, size, offs)); offs += l) {
+		for (l = 0; (l < n) && (offs + l <= size) && !(bmp[(offs + l - 1) / 32] & (1U << ((offs + l - 1) % 32))); l++);
+
+		if (l > *len) {
+			*len = l;
+			best = offs;
+
+			if (l >= n)
+				break;
+		}
+	}
+
+	return best;
+}
+
+
+static uint32_t bench_rand(void)
+{
+	bench_common.seed = bench_common.seed * 1103515245 + 12345;
+
+	return (bench_common.seed >> 16) & 0x7fff;
+}
+
+
+/* Prepares bitmap: 0 => empty, 1 => full (last bit free), 2 => fragmented (short free runs between used runs) */
+static void bench_prepare(int type)
+{
+	uint32_t offs, len;
+
+	memset(bench_common.bmp, (type) ? 0xff : 0, sizeof(bench_common.bmp));
+
+	if (type == 1) {
+		ext2_setbits(bench_common.bmp, BENCH_BITS, 1, 0);
+	}
+	else if (type == 2) {
+		bench_common.seed = 1;
+
+		for (offs = 1 + bench_rand() % 64; offs <= BENCH_BITS; offs += len + 1 + bench_rand() % 64) {
+			if ((len = 1 + bench_rand() % 16) > BENCH_BITS - offs + 1)
+				len = BENCH_BITS - offs + 1;
+
+			ext2_setbits(bench_common.bmp, offs, len, 0);
+		}
+	}
+
+	/* Reference search uses 32-bit words */
+	memcpy(bench_common.ref, bench_common.bmp, sizeof(bench_common.ref));
+}
+
+
+/* Measures search of n free bits run, returns average time in nanoseconds */
+static uint32_t bench_run(int ref, uint32_t n, uint32_t *res, uint32_t *len)
+{
+	time_t start, end;
+	int i;
+
+	gettime(&start, NULL);
+
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		if (ref)
+			*res = (n == 1) ? bench_reffindzero(bench_common.ref, BENCH_BITS, 1) : bench_reffindrun(bench_common.ref, BENCH_BITS, 1, n, len);
+		else
+			*res = (n == 1) ? ext2_findzerobit(bench_common.bmp, BENCH_BITS, 1) : ext2_findzerorun(bench_common.bmp, BENCH_BITS, 1, n, len);
+
+		bench_common.sink += *res;
+	}
+
+	gettime(&end, NULL);
+
+	return (uint32_t)((end - start) * 1000 / BENCH_ROUNDS);
+}
+
+
+int main(int argc, char *argv[])
+{
+	static const char *names[] = { "empty", "full", "fragmented" };
+	static const uint32_t runs[] = { 1, 8, 256, BENCH_BITS };
+	uint32_t i, res[2], len[2] = { 0, 0 }, t[2];
+	int type, err = 0;
+
+	printf("ext2-bmpbench: %u bits bitmap, average of %u rounds\n", BENCH_BITS, BENCH_ROUNDS);
+	printf("%-12s %8s %12s %12s %8s\n", "bitmap", "run", "bits [ns]", "words [ns]", "speedup");
+
+	for (type = 0; type < 3; type++) {
+		bench_prepare(type);
+
+		for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++) {
+			t[0] = bench_run(1, runs[i], &res[0], &len[0]);
+			t[1] = bench_run(0, runs[i], &res[1], &len[1]);
+
+			if ((res[0] != res[1]) || (len[0] != len[1])) {
+				printf("ext2-bmpbench: %s bitmap, %u bits run mismatch (%u/%u, %u/%u)\n", names[type], runs[i], res[0], len[0], res[1], len[1]);
+				err = 1;
+			}
+
+			printf("%-12s %8u %12u %12u %6u.%ux\n", names[type], runs[i], t[0], t[1], (t[1]) ? t[0] / t[1] : 0, (t[1]) ? 10 * t[0] / t[1] % 10 : 0);
+		}
+	}
+
+	return err;
+}
@@ -0,0 +1,1605 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem host benchmark
+ *
+ * Scripted workloads over a file-backed filesystem image
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/msg.h>
+
+#include "dir.h"
+#include "journal.h"
+#include "libext2.h"
+
+
+/* Benchmark configuration (sizes are multiplied by the scale) */
+#define BENCH_SECTORSZ  512               /* Image sector size */
+#define BENCH_CHUNKSZ   (64 * 1024)       /* Sequential I/O request size */
+#define BENCH_SEQSZ     (16 * 1024 * 1024) /* Sequential I/O file size */
+#define BENCH_RANDSZ    4096              /* Random I/O request size */
+#define BENCH_RANDOPS   4096              /* Number of random I/O requests */
+#define BENCH_RANDWR    30                /* Percent of random I/O writes */
+#define BENCH_FILES     1000              /* Number of created and unlinked files */
+#define BENCH_ENTRIES   2000              /* Number of looked up directory entries */
+#define BENCH_DIRBUFSZ  4096              /* Directory listing request buffer size */
+#define BENCH_LINKS     1000              /* Number of resolved symbolic links (every 4th has a long target) */
+#define BENCH_SPOOL     64                /* Number of live entries in churned directory */
+#define BENCH_SPARSE    32                /* Every BENCH_SPARSE entry survives before directory compaction */
+#define BENCH_REPLAY    64                /* Number of files created in the transaction replayed after a crash */
+#define BENCH_REPLAYSZ  6000              /* Size of files created in the replayed transaction */
+#define BENCH_DENSESZ   (8 * 1024 * 1024) /* Truncated dense file size */
+#define BENCH_SPARSESZ  (256 * 1024 * 1024) /* Truncated sparse file size (1 block every BENCH_SPARSEGAP) */
+#define BENCH_SPARSEGAP (1024 * 1024)     /* Sparse file blocks gap */
+#define BENCH_OPEN      24                /* Number of files written at once (their data exceeds the delayed allocation budget) */
+#define BENCH_OPENSZ    (512 * 1024)      /* Size of files written at once */
+#define BENCH_OPENIOSZ  (160 * 1024)      /* Max unaligned I/O request size of files written at once */
+#define BENCH_OPENOPS   2000              /* Number of I/O requests of files written at once */
+#define BENCH_THREADS   8                 /* Number of threads issuing requests concurrently */
+#define BENCH_TFILES    4                 /* Number of files written by each thread */
+#define BENCH_TFILESZ   (256 * 1024)      /* Size of files written by each thread and of the file read by all threads */
+#define BENCH_TOPS      1000              /* Number of requests issued by each thread */
+#define BENCH_TTMPSZ    6000              /* Size of temporary files created and unlinked by threads */
+
+
+/* Simulated power loss states */
+enum {
+	BENCH_CRASHOFF = 0,      /* Device writes are written */
+	BENCH_CRASHARM = 1,      /* Device writes following the next journal commit block written by the arming thread are dropped */
+	BENCH_CRASHED  = 2       /* Device writes are dropped */
+};
+
+
+typedef struct {
+	const char *name;        /* Workload name */
+	int (*run)(void);        /* Workload routine */
+} bench_workload_t;
+
+
+typedef struct {
+	uint32_t idx;            /* Thread index */
+	uint32_t seed;           /* Pseudo-random generator seed */
+	id_t dir;                /* Directory of temporary files */
+	id_t shared;             /* File read by all threads */
+	id_t ids[BENCH_TFILES];  /* Files written by the thread */
+	char *files;             /* Expected contents of files written by the thread */
+	char *buff;              /* I/O buffer */
+} bench_thread_t;
+
+
+typedef struct {
+	uint64_t time;           /* Monotonic time in nanoseconds */
+	uint64_t reads;          /* Device reads */
+	uint64_t writes;         /* Device writes */
+	uint64_t rbytes;         /* Device bytes read */
+	uint64_t wbytes;         /* Device bytes written */
+	libext2_stat_t stat;     /* Filesystem statistics */
+} bench_snapshot_t;
+
+
+struct {
+	/* Filesystem image */
+	int fd;                  /* Image file descriptor */
+	void *fs;                /* Mounted filesystem */
+	id_t root;               /* Root directory ID */
+	libext2_opts_t opts;     /* Mount options */
+	const libext2_opts_t *popts;
+	uint32_t scale;          /* Workloads size multiplier */
+	uint32_t seed;           /* Pseudo-random generator seed */
+	uint8_t verbose;         /* Report device I/O by block kind */
+	char *buff;              /* I/O buffer */
+	int crash;               /* Simulated power loss state (updated by the flusher thread too) */
+	pthread_t armer;         /* Thread armed the simulated power loss (flusher commits in progress aren't interrupted) */
+
+	/* Device I/O counters (updated by the flusher thread too) */
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t rbytes;
+	uint64_t wbytes;
+
+	/* Running measurement */
+	const char *name;        /* Measured workload phase name */
+	bench_snapshot_t start;  /* Counters at measurement start */
+	uint64_t *lat;           /* Operations latencies */
+	uint32_t nops;           /* Number of measured operations */
+	uint32_t maxops;         /* Latencies array size */
+	uint64_t bytes;          /* Bytes transferred by measured operations */
+	uint64_t ostart;         /* Running operation start time */
+	int errors;              /* Number of failed checks (updated by workload threads too) */
+} bench_common;
+
+
+static ssize_t bench_read(id_t id, offs_t offs, char *buff, size_t len)
+{
+	__atomic_fetch_add(&bench_common.reads, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&bench_common.rbytes, len, __ATOMIC_RELAXED);
+
+	return pread(bench_common.fd, buff, len, offs);
+}
+
+
+/* Checks if written blocks end with a journal commit block */
+static int bench_jcommit(const char *buff, size_t len)
+{
+	static const unsigned char hdr[8] = {
+		JOURNAL_MAGIC >> 24, (JOURNAL_MAGIC >> 16) & 0xff, (JOURNAL_MAGIC >> 8) & 0xff, JOURNAL_MAGIC & 0xff, 0, 0, 0, JBLOCK_COMMIT
+	};
+
+	return (len >= 1024) && !memcmp(buff, hdr, sizeof(hdr));
+}
+
+
+static ssize_t bench_write(id_t id, offs_t offs, const char *buff, size_t len)
+{
+	int crash = __atomic_load_n(&bench_common.crash, __ATOMIC_RELAXED);
+
+	/* Writes lost in a simulated power loss are reported as written */
+	if (crash == BENCH_CRASHED)
+		return len;
+
+	__atomic_fetch_add(&bench_common.writes, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&bench_common.wbytes, len, __ATOMIC_RELAXED);
+
+	if ((crash == BENCH_CRASHARM) && pthread_equal(pthread_self(), bench_common.armer) && bench_jcommit(buff, len))
+		__atomic_store_n(&bench_common.crash, BENCH_CRASHED, __ATOMIC_RELAXED);
+
+	return pwrite(bench_common.fd, buff, len, offs);
+}
+
+
+static uint64_t bench_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static uint32_t bench_randr(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+
+	return *seed >> 1;
+}
+
+
+static uint32_t bench_rand(void)
+{
+	return bench_randr(&bench_common.seed);
+}
+
+
+static void bench_fail(const char *what, const char *name, int err)
+{
+	fprintf(stderr, "ext2-hostbench: %s %s failed (%d)\n", what, name, err);
+	__atomic_fetch_add(&bench_common.errors, 1, __ATOMIC_RELAXED);
+}
+
+
+/* Fills buffer with data identifying file offset and write generation */
+static void bench_fill(char *buff, size_t len, offs_t offs, uint32_t gen)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buff[i] = (char)(((offs + i) >> 8) * 31 + (offs + i) * 7 + gen);
+}
+
+
+static int bench_verify(const char *buff, size_t len, offs_t offs, uint32_t gen)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (buff[i] != (char)(((offs + i) >> 8) * 31 + (offs + i) * 7 + gen))
+			return -EIO;
+	}
+
+	return EOK;
+}
+
+
+/* Filesystem requests */
+static int bench_create(id_t dir, const char *name, int type, id_t *id)
+{
+	msg_t msg = { 0 };
+
+	msg.type = mtCreate;
+	msg.i.create.dir.id = dir;
+	msg.i.create.type = type;
+	msg.i.create.mode = (type == otDir) ? 0755 : 0644;
+	msg.i.data = (void *)name;
+	msg.i.size = strlen(name) + 1;
+	libext2_handler(bench_common.fs, &msg);
+	*id = msg.o.create.oid.id;
+
+	return msg.o.create.err;
+}
+
+
+static int bench_symlink(id_t dir, const char *name, const char *target, id_t *id)
+{
+	msg_t msg = { 0 };
+	char buff[256];
+	size_t len = strlen(name) + 1;
+
+	/* Target follows the link name */
+	memcpy(buff, name, len);
+	strcpy(buff + len, target);
+
+	msg.type = mtCreate;
+	msg.i.create.dir.id = dir;
+	msg.i.create.type = otSymlink;
+	msg.i.create.mode = 0777;
+	msg.i.data = buff;
+	msg.i.size = len + strlen(target) + 1;
+	libext2_handler(bench_common.fs, &msg);
+	*id = msg.o.create.oid.id;
+
+	return msg.o.create.err;
+}
+
+
+static int bench_lookup(id_t dir, const char *name, id_t *id)
+{
+	msg_t msg = { 0 };
+
+	msg.type = mtLookup;
+	msg.i.lookup.dir.id = dir;
+	msg.i.data = (void *)name;
+	msg.i.size = strlen(name) + 1;
+	libext2_handler(bench_common.fs, &msg);
+	*id = msg.o.lookup.fil.id;
+
+	return msg.o.lookup.err;
+}
+
+
+static int bench_readdir(id_t dir, offs_t offs, char *buff, size_t len)
+{
+	msg_t msg = { 0 };
+
+	msg.type = mtReaddir;
+	msg.i.readdir.dir.id = dir;
+	msg.i.readdir.offs = offs;
+	msg.o.data = buff;
+	msg.o.size = len;
+	libext2_handler(bench_common.fs, &msg);
+
+	return msg.o.io.err;
+}
+
+
+static int bench_unlink(id_t dir, const char *name)
+{
+	msg_t msg = { 0 };
+
+	msg.type = mtUnlink;
+	msg.i.ln.dir.id = dir;
+	msg.i.data = (void *)name;
+	msg.i.size = strlen(name) + 1;
+	libext2_handler(bench_common.fs, &msg);
+
+	return msg.o.io.err;
+}
+
+
+static int bench_openclose(int type, id_t id)
+{
+	msg_t msg = { 0 };
+
+	msg.type = type;
+	msg.i.openclose.oid.id = id;
+	libext2_handler(bench_common.fs, &msg);
+
+	return msg.o.io.err;
+}
+
+
+static int bench_io(int type, id_t id, offs_t offs, char *buff, size_t len)
+{
+	msg_t msg = { 0 };
+
+	msg.type = type;
+	msg.i.io.oid.id = id;
+	msg.i.io.offs = offs;
+
+	if (type == mtWrite) {
+		msg.i.data = buff;
+		msg.i.size = len;
+	}
+	else {
+		msg.o.data = buff;
+		msg.o.size = len;
+	}
+	libext2_handler(bench_common.fs, &msg);
+
+	return msg.o.io.err;
+}
+
+
+static int bench_truncate(id_t id, size_t size)
+{
+	msg_t msg = { 0 };
+
+	msg.type = mtTruncate;
+	msg.i.io.oid.id = id;
+	msg.i.io.len = size;
+	libext2_handler(bench_common.fs, &msg);
+
+	return msg.o.io.err;
+}
+
+
+static int bench_getattr(id_t id, int type)
+{
+	msg_t msg = { 0 };
+
+	msg.type = mtGetAttr;
+	msg.i.attr.oid.id = id;
+	msg.i.attr.type = type;
+	libext2_handler(bench_common.fs, &msg);
+
+	return msg.o.attr.val;
+}
+
+
+static void bench_setattr(id_t id, int type, int val)
+{
+	msg_t msg = { 0 };
+
+	msg.type = mtSetAttr;
+	msg.i.attr.oid.id = id;
+	msg.i.attr.type = type;
+	msg.i.attr.val = val;
+	libext2_handler(bench_common.fs, &msg);
+}
+
+
+static int bench_sync(void)
+{
+	msg_t msg = { 0 };
+
+	msg.type = mtSync;
+	msg.i.io.oid.id = bench_common.root;
+	libext2_handler(bench_common.fs, &msg);
+
+	return msg.o.io.err;
+}
+
+
+static int bench_devctl(int type, id_t id, libext2_stat_t *stat)
+{
+	msg_t msg = { 0 };
+
+	msg.type = mtDevCtl;
+	((libext2_i_devctl_t *)msg.i.raw)->type = type;
+	((libext2_i_devctl_t *)msg.i.raw)->id = id;
+	msg.o.data = stat;
+	msg.o.size = (stat != NULL) ? sizeof(*stat) : 0;
+	libext2_handler(bench_common.fs, &msg);
+
+	return ((libext2_o_devctl_t *)msg.o.raw)->err;
+}
+
+
+static int bench_mount(void)
+{
+	oid_t oid = { 0, 0 };
+	int err;
+
+	if ((err = libext2_mountopts(&oid, BENCH_SECTORSZ, bench_read, bench_write, bench_common.popts, &bench_common.fs)) < 0) {
+		bench_common.fs = NULL;
+		bench_fail("mount", "image", err);
+		return err;
+	}
+	bench_common.root = err;
+
+	return EOK;
+}
+
+
+/* Remounts filesystem (measured workloads start with cold caches) */
+static int bench_remount(void)
+{
+	int err;
+
+	if ((bench_common.fs != NULL) && ((err = libext2_unmount(bench_common.fs)) < 0))
+		bench_fail("unmount", "remount", err);
+
+	return bench_mount();
+}
+
+
+/* Creates file and fills it with generation 0 data */
+static int bench_mkfile(id_t dir, const char *name, size_t size, id_t *id)
+{
+	size_t offs, len;
+	int err;
+
+	if ((err = bench_create(dir, name, otFile, id)) < 0) {
+		bench_fail("create", name, err);
+		return err;
+	}
+
+	for (offs = 0; offs < size; offs += len) {
+		len = (size - offs < BENCH_CHUNKSZ) ? size - offs : BENCH_CHUNKSZ;
+		bench_fill(bench_common.buff, len, offs, 0);
+
+		if ((err = bench_io(mtWrite, *id, offs, bench_common.buff, len)) != (int)len) {
+			bench_fail("write", name, err);
+			return (err < 0) ? err : -EIO;
+		}
+	}
+
+	return EOK;
+}
+
+
+static void bench_snapshot(bench_snapshot_t *s)
+{
+	s->reads = __atomic_load_n(&bench_common.reads, __ATOMIC_RELAXED);
+	s->writes = __atomic_load_n(&bench_common.writes, __ATOMIC_RELAXED);
+	s->rbytes = __atomic_load_n(&bench_common.rbytes, __ATOMIC_RELAXED);
+	s->wbytes = __atomic_load_n(&bench_common.wbytes, __ATOMIC_RELAXED);
+	bench_devctl(libext2_devctl_stat, 0, &s->stat);
+	s->time = bench_time();
+}
+
+
+/* Starts measurement of up to maxops operations */
+static int bench_begin(const char *name, uint32_t maxops)
+{
+	if ((bench_common.lat = (uint64_t *)malloc(maxops * sizeof(uint64_t))) == NULL)
+		return -ENOMEM;
+
+	bench_common.name = name;
+	bench_common.maxops = maxops;
+	bench_common.nops = 0;
+	bench_common.bytes = 0;
+	bench_snapshot(&bench_common.start);
+
+	return EOK;
+}
+
+
+static inline void bench_opstart(void)
+{
+	bench_common.ostart = bench_time();
+}
+
+
+static inline void bench_opend(size_t bytes)
+{
+	if (bench_common.nops < bench_common.maxops)
+		bench_common.lat[bench_common.nops++] = bench_time() - bench_common.ostart;
+	bench_common.bytes += bytes;
+}
+
+
+/* Records operation started at given time by a workload thread */
+static void bench_oprecord(uint64_t start, size_t bytes)
+{
+	uint32_t i = __atomic_fetch_add(&bench_common.nops, 1, __ATOMIC_RELAXED);
+
+	if (i < bench_common.maxops)
+		bench_common.lat[i] = bench_time() - start;
+	__atomic_fetch_add(&bench_common.bytes, bytes, __ATOMIC_RELAXED);
+}
+
+
+static int bench_latcmp(const void *a, const void *b)
+{
+	uint64_t l1 = *(const uint64_t *)a, l2 = *(const uint64_t *)b;
+
+	return (l1 > l2) - (l1 < l2);
+}
+
+
+/* Returns latency percentile in microseconds */
+static double bench_percentile(uint32_t p)
+{
+	if (!bench_common.nops)
+		return 0;
+
+	return bench_common.lat[(uint64_t)(bench_common.nops - 1) * p / 100] / 1000.0;
+}
+
+
+/* Ends measurement, writes back dirty data and reports results */
+static void bench_end(void)
+{
+	static const char *kinds[] = { "sb", "gdt", "bmp", "itable", "ind", "data", "journal" };
+	bench_snapshot_t end;
+	unsigned int i;
+	double secs, ops = (bench_common.nops) ? bench_common.nops : 1;
+	uint64_t hits, misses;
+	int err;
+
+	/* Writing back is a part of the workload */
+	if ((err = bench_sync()) < 0)
+		bench_fail("sync", bench_common.name, err);
+	bench_snapshot(&end);
+
+	secs = (end.time - bench_common.start.time) / 1e9;
+	hits = end.stat.hits - bench_common.start.stat.hits;
+	misses = end.stat.misses - bench_common.start.stat.misses;
+	qsort(bench_common.lat, bench_common.nops, sizeof(uint64_t), bench_latcmp);
+
+	printf("%-10s %7u %9.1f %8.2f %9.0f %8.1f %8.1f %8.1f %9.1f %7.2f %7.2f %8.2f %8.2f %6.1f\n",
+		bench_common.name, bench_common.nops, secs * 1000, bench_common.bytes / secs / (1024 * 1024), bench_common.nops / secs,
+		bench_percentile(50), bench_percentile(90), bench_percentile(99), bench_percentile(100),
+		(end.reads - bench_common.start.reads) / ops, (end.writes - bench_common.start.writes) / ops,
+		(end.rbytes - bench_common.start.rbytes) / ops / 1024, (end.wbytes - bench_common.start.wbytes) / ops / 1024,
+		(hits + misses) ? 100.0 * hits / (hits + misses) : 0);
+
+	/* Device blocks read/written by kind */
+	if (bench_common.verbose) {
+		printf("%-10s", "");
+
+		for (i = 0; i < LIBEXT2_IO_KINDS; i++)
+			printf(" %s %llu/%llu", kinds[i], (unsigned long long)(end.stat.reads[i] - bench_common.start.stat.reads[i]), (unsigned long long)(end.stat.writes[i] - bench_common.start.stat.writes[i]));
+		printf("\n");
+	}
+
+	free(bench_common.lat);
+	bench_common.lat = NULL;
+}
+
+
+/* Sequential writes of a new file */
+static int bench_seqwrite(void)
+{
+	size_t size = (size_t)BENCH_SEQSZ * bench_common.scale, offs;
+	id_t id;
+	int err;
+
+	if ((err = bench_create(bench_common.root, "seqwrite", otFile, &id)) < 0) {
+		bench_fail("create", "seqwrite", err);
+		return err;
+	}
+	bench_openclose(mtOpen, id);
+
+	if ((err = bench_begin("seqwrite", size / BENCH_CHUNKSZ)) < 0)
+		return err;
+
+	for (offs = 0; offs < size; offs += BENCH_CHUNKSZ) {
+		bench_fill(bench_common.buff, BENCH_CHUNKSZ, offs, 0);
+		bench_opstart();
+
+		if ((err = bench_io(mtWrite, id, offs, bench_common.buff, BENCH_CHUNKSZ)) != BENCH_CHUNKSZ) {
+			bench_fail("write", "seqwrite", err);
+			break;
+		}
+		bench_opend(BENCH_CHUNKSZ);
+	}
+	bench_end();
+
+	bench_openclose(mtClose, id);
+
+	return bench_unlink(bench_common.root, "seqwrite");
+}
+
+
+/* Sequential reads of an existing file */
+static int bench_seqread(void)
+{
+	size_t size = (size_t)BENCH_SEQSZ * bench_common.scale, offs;
+	id_t id;
+	int err;
+
+	if (((err = bench_mkfile(bench_common.root, "seqread", size, &id)) < 0) || ((err = bench_remount()) < 0))
+		return err;
+	bench_openclose(mtOpen, id);
+
+	if ((err = bench_begin("seqread", size / BENCH_CHUNKSZ)) < 0)
+		return err;
+
+	for (offs = 0; offs < size; offs += BENCH_CHUNKSZ) {
+		bench_opstart();
+
+		if ((err = bench_io(mtRead, id, offs, bench_common.buff, BENCH_CHUNKSZ)) != BENCH_CHUNKSZ) {
+			bench_fail("read", "seqread", err);
+			break;
+		}
+		bench_opend(BENCH_CHUNKSZ);
+
+		if (bench_verify(bench_common.buff, BENCH_CHUNKSZ, offs, 0) < 0) {
+			bench_fail("verify", "seqread", -EIO);
+			break;
+		}
+	}
+	bench_end();
+
+	bench_openclose(mtClose, id);
+
+	return bench_unlink(bench_common.root, "seqread");
+}
+
+
+/* Random aligned reads and writes of an existing file */
+static int bench_randrw(void)
+{
+	size_t size = (size_t)BENCH_SEQSZ * bench_common.scale;
+	uint32_t i, n = BENCH_RANDOPS * bench_common.scale, chunk;
+	uint8_t *gens;
+	offs_t offs;
+	id_t id;
+	int err;
+
+	if ((gens = (uint8_t *)calloc(size / BENCH_RANDSZ, sizeof(uint8_t))) == NULL)
+		return -ENOMEM;
+
+	if (((err = bench_mkfile(bench_common.root, "randrw", size, &id)) < 0) || ((err = bench_remount()) < 0) || ((err = bench_begin("randrw", n)) < 0)) {
+		free(gens);
+		return err;
+	}
+	bench_openclose(mtOpen, id);
+	bench_common.seed = 1;
+
+	for (i = 0; i < n; i++) {
+		chunk = bench_rand() % (size / BENCH_RANDSZ);
+		offs = (offs_t)chunk * BENCH_RANDSZ;
+
+		if (bench_rand() % 100 < BENCH_RANDWR) {
+			bench_fill(bench_common.buff, BENCH_RANDSZ, offs, ++gens[chunk]);
+			bench_opstart();
+
+			if ((err = bench_io(mtWrite, id, offs, bench_common.buff, BENCH_RANDSZ)) != BENCH_RANDSZ) {
+				bench_fail("write", "randrw", err);
+				break;
+			}
+			bench_opend(BENCH_RANDSZ);
+		}
+		else {
+			bench_opstart();
+
+			if ((err = bench_io(mtRead, id, offs, bench_common.buff, BENCH_RANDSZ)) != BENCH_RANDSZ) {
+				bench_fail("read", "randrw", err);
+				break;
+			}
+			bench_opend(BENCH_RANDSZ);
+
+			if (bench_verify(bench_common.buff, BENCH_RANDSZ, offs, gens[chunk]) < 0) {
+				bench_fail("verify", "randrw", -EIO);
+				break;
+			}
+		}
+	}
+	bench_end();
+
+	bench_openclose(mtClose, id);
+	free(gens);
+
+	return bench_unlink(bench_common.root, "randrw");
+}
+
+
+/* Creates and unlinks files in a new directory */
+static int bench_createunlink(void)
+{
+	uint32_t i, n = BENCH_FILES * bench_common.scale;
+	char name[32];
+	id_t dir, id;
+	int err;
+
+	if ((err = bench_create(bench_common.root, "createunlink", otDir, &dir)) < 0) {
+		bench_fail("create", "createunlink", err);
+		return err;
+	}
+
+	if ((err = bench_begin("create", n)) < 0)
+		return err;
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "file%u", i);
+		bench_opstart();
+
+		if ((err = bench_create(dir, name, otFile, &id)) < 0) {
+			bench_fail("create", name, err);
+			break;
+		}
+		bench_opend(0);
+	}
+	bench_end();
+
+	if ((err = bench_begin("unlink", n)) < 0)
+		return err;
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "file%u", i);
+		bench_opstart();
+
+		if ((err = bench_unlink(dir, name)) < 0) {
+			bench_fail("unlink", name, err);
+			break;
+		}
+		bench_opend(0);
+	}
+	bench_end();
+
+	return bench_unlink(bench_common.root, "createunlink");
+}
+
+
+/* Looks up entries of a large directory in random order */
+static int bench_lookups(void)
+{
+	uint32_t i, j, n = BENCH_ENTRIES * bench_common.scale;
+	id_t dir, *ids, id;
+	char name[32];
+	int err;
+
+	if ((ids = (id_t *)malloc(n * sizeof(id_t))) == NULL)
+		return -ENOMEM;
+
+	if ((err = bench_create(bench_common.root, "lookup", otDir, &dir)) < 0) {
+		bench_fail("create", "lookup", err);
+		free(ids);
+		return err;
+	}
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "entry%u", i);
+
+		if ((err = bench_create(dir, name, otFile, &ids[i])) < 0) {
+			bench_fail("create", name, err);
+			free(ids);
+			return err;
+		}
+	}
+
+	if (((err = bench_remount()) < 0) || ((err = bench_begin("lookup", n)) < 0)) {
+		free(ids);
+		return err;
+	}
+	bench_common.seed = 1;
+
+	for (i = 0; i < n; i++) {
+		j = bench_rand() % n;
+		sprintf(name, "entry%u", j);
+		bench_opstart();
+
+		if ((err = bench_lookup(dir, name, &id)) < 0) {
+			bench_fail("lookup", name, err);
+			break;
+		}
+		bench_opend(0);
+
+		if (id != ids[j])
+			bench_fail("verify", name, -EIO);
+	}
+	bench_end();
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "entry%u", i);
+		bench_unlink(dir, name);
+	}
+	free(ids);
+
+	return bench_unlink(bench_common.root, "lookup");
+}
+
+
+/* Lists a large directory and stats its entries in directory order (ls -l) */
+static int bench_listing(void)
+{
+	uint32_t i, n = BENCH_ENTRIES * bench_common.scale, found = 0;
+	char name[32], *buff = bench_common.buff;
+	struct dirent *d;
+	offs_t offs = 0;
+	int err, len;
+	id_t dir, id;
+
+	if ((err = bench_create(bench_common.root, "listing", otDir, &dir)) < 0) {
+		bench_fail("create", "listing", err);
+		return err;
+	}
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "entry%u", i);
+
+		if ((err = bench_create(dir, name, otFile, &id)) < 0) {
+			bench_fail("create", name, err);
+			return err;
+		}
+	}
+
+	if (((err = bench_remount()) < 0) || ((err = bench_begin("listing", n)) < 0))
+		return err;
+
+	while ((len = bench_readdir(dir, offs, buff, BENCH_DIRBUFSZ)) > 0) {
+		for (i = 0; i < (uint32_t)len; i = (i + sizeof(struct dirent) + d->d_namlen + 1 + DIRENT_ALIGN - 1) & ~(DIRENT_ALIGN - 1)) {
+			d = (struct dirent *)(buff + i);
+			offs += d->d_reclen;
+
+			if (!d->d_ino || !strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+				continue;
+
+			bench_opstart();
+
+			if ((err = bench_lookup(dir, d->d_name, &id)) < 0) {
+				bench_fail("lookup", d->d_name, err);
+				continue;
+			}
+			bench_getattr(id, atMode);
+			bench_opend(0);
+
+			if (id != d->d_ino)
+				bench_fail("verify", d->d_name, -EIO);
+			found++;
+		}
+	}
+	bench_end();
+
+	if ((len < 0) && (len != -ENOENT))
+		bench_fail("readdir", "listing", len);
+
+	if (found != n)
+		bench_fail("verify", "listing", -ENOENT);
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "entry%u", i);
+		bench_unlink(dir, name);
+	}
+
+	return bench_unlink(bench_common.root, "listing");
+}
+
+
+/* Returns symbolic link target (short targets fit in the inode, long ones don't) */
+static void bench_target(char *target, uint32_t i)
+{
+	if (i % 4)
+		sprintf(target, "/usr/lib/libentry%u.so", i);
+	else
+		sprintf(target, "../../../../usr/local/share/bench/a/rather/long/path/to/the/link/target/entry%u", i);
+}
+
+
+/* Resolves symbolic links in creation order */
+static int bench_symlinks(void)
+{
+	uint32_t i, n = BENCH_LINKS * bench_common.scale;
+	char name[32], target[128], *buff = bench_common.buff;
+	id_t dir, id;
+	int err;
+
+	if ((err = bench_create(bench_common.root, "symlink", otDir, &dir)) < 0) {
+		bench_fail("create", "symlink", err);
+		return err;
+	}
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "link%u", i);
+		bench_target(target, i);
+
+		if ((err = bench_symlink(dir, name, target, &id)) < 0) {
+			bench_fail("symlink", name, err);
+			return err;
+		}
+	}
+
+	if (((err = bench_remount()) < 0) || ((err = bench_begin("symlink", n)) < 0))
+		return err;
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "link%u", i);
+		bench_target(target, i);
+		bench_opstart();
+
+		if ((err = bench_lookup(dir, name, &id)) < 0) {
+			bench_fail("lookup", name, err);
+			continue;
+		}
+
+		if ((err = bench_io(mtRead, id, 0, buff, sizeof(target))) < 0) {
+			bench_fail("read", name, err);
+			continue;
+		}
+		bench_opend(err);
+
+		if ((err != (int)strlen(target)) || memcmp(buff, target, err))
+			bench_fail("verify", name, -EIO);
+	}
+	bench_end();
+
+	/* Fast symlink grown past the inode keeps its target followed by zeros */
+	bench_target(target, 0);
+	memset(buff, 0xff, sizeof(target));
+
+	if ((err = bench_lookup(dir, "link0", &id)) < 0) {
+		bench_fail("lookup", "link0", err);
+	}
+	else {
+		bench_setattr(id, atSize, sizeof(target));
+
+		if ((err = bench_io(mtRead, id, 0, buff, sizeof(target))) != sizeof(target))
+			bench_fail("grow", "link0", (err < 0) ? err : -EIO);
+		else if (memcmp(buff, target, strlen(target) + 1) || buff[sizeof(target) - 1])
+			bench_fail("grow", "link0", -EIO);
+	}
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "link%u", i);
+		bench_unlink(dir, name);
+	}
+
+	return bench_unlink(bench_common.root, "symlink");
+}
+
+
+/* Returns number of listed directory entries (excluding "." and "..") */
+static int bench_count(id_t dir)
+{
+	char *buff = bench_common.buff;
+	struct dirent *d;
+	offs_t offs = 0, prev;
+	int len, i, n = 0;
+
+	while ((len = bench_readdir(dir, offs, buff, BENCH_DIRBUFSZ)) > 0) {
+		for (i = 0, prev = offs; i < len; i = (i + sizeof(struct dirent) + d->d_namlen + 1 + DIRENT_ALIGN - 1) & ~(DIRENT_ALIGN - 1)) {
+			d = (struct dirent *)(buff + i);
+			offs += d->d_reclen;
+
+			if (d->d_ino && strcmp(d->d_name, ".") && strcmp(d->d_name, ".."))
+				n++;
+		}
+
+		/* Listing has to advance */
+		if (offs <= prev)
+			return -EIO;
+	}
+
+	return ((len < 0) && (len != -ENOENT)) ? len : n;
+}
+
+
+/* Creates new entries while removing the oldest ones (spool directory), then compacts a sparse directory */
+static int bench_churn(void)
+{
+	uint32_t i, n = BENCH_FILES * bench_common.scale;
+	int err, size;
+	char name[240];
+	id_t dir, id;
+
+	if ((err = bench_create(bench_common.root, "churn", otDir, &dir)) < 0) {
+		bench_fail("create", "churn", err);
+		return err;
+	}
+
+	if ((err = bench_begin("churn", n)) < 0)
+		return err;
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "spool%u", i);
+		bench_opstart();
+
+		if ((err = bench_create(dir, name, otFile, &id)) < 0) {
+			bench_fail("create", name, err);
+			break;
+		}
+
+		if (i >= BENCH_SPOOL) {
+			sprintf(name, "spool%u", i - BENCH_SPOOL);
+
+			if ((err = bench_unlink(dir, name)) < 0) {
+				bench_fail("unlink", name, err);
+				break;
+			}
+		}
+		bench_opend(0);
+	}
+	bench_end();
+
+	/* Space of removed entries is reused => directory doesn't grow */
+	if (bench_getattr(dir, atSize) > BENCH_SPOOL * 128)
+		bench_fail("size", "churn", -EFBIG);
+
+	for (i = (n > BENCH_SPOOL) ? n - BENCH_SPOOL : 0; i < n; i++) {
+		sprintf(name, "spool%u", i);
+		bench_unlink(dir, name);
+	}
+
+	/* Listing skips long runs of emptied directory blocks */
+	memset(name, 'h', sizeof(name) - 12);
+
+	for (i = 0; i < n; i++) {
+		sprintf(name + sizeof(name) - 12, "%u", i);
+
+		if ((err = bench_create(dir, name, otFile, &id)) < 0) {
+			bench_fail("create", name, err);
+			return err;
+		}
+	}
+
+	for (i = 0; i + 1 < n; i++) {
+		sprintf(name + sizeof(name) - 12, "%u", i);
+		bench_unlink(dir, name);
+	}
+
+	if ((err = bench_count(dir)) != 1)
+		bench_fail("readdir", "churn", (err < 0) ? err : -EIO);
+
+	sprintf(name + sizeof(name) - 12, "%u", i);
+	bench_unlink(dir, name);
+
+	/* Compaction reclaims blocks of sparse directory */
+	for (i = 0; i < n; i++) {
+		sprintf(name, "sparse%u", i);
+
+		if ((err = bench_create(dir, name, otFile, &id)) < 0) {
+			bench_fail("create", name, err);
+			return err;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "sparse%u", i);
+
+		if ((i % BENCH_SPARSE) && ((err = bench_unlink(dir, name)) < 0))
+			bench_fail("unlink", name, err);
+	}
+
+	size = bench_getattr(dir, atSize);
+
+	if ((err = bench_devctl(libext2_devctl_compact, dir, NULL)) < 0)
+		bench_fail("compact", "churn", err);
+
+	if ((n > 2 * BENCH_SPARSE) && (bench_getattr(dir, atSize) >= size))
+		bench_fail("size", "compact", -EFBIG);
+
+	for (i = 0; i < n; i += BENCH_SPARSE) {
+		sprintf(name, "sparse%u", i);
+
+		if ((err = bench_lookup(dir, name, &id)) < 0)
+			bench_fail("lookup", name, err);
+
+		bench_unlink(dir, name);
+	}
+
+	return bench_unlink(bench_common.root, "churn");
+}
+
+
+/* Loses power right after a journal transaction is committed (before it's checkpointed), replays it on the next mount */
+static int bench_replay(void)
+{
+	uint32_t i, n = BENCH_REPLAY * bench_common.scale;
+	char name[32], *buff = bench_common.buff;
+	id_t dir, id;
+	int err;
+
+	if ((err = bench_create(bench_common.root, "replay", otDir, &dir)) < 0) {
+		bench_fail("create", "replay", err);
+		return err;
+	}
+
+	/* Commit the directory first, so the replayed transaction is made of the files only */
+	bench_sync();
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "replay%u", i);
+
+		if ((err = bench_mkfile(dir, name, BENCH_REPLAYSZ, &id)) < 0)
+			return err;
+	}
+
+	/* Power is lost right after the commit block, before the transaction is checkpointed */
+	bench_common.armer = pthread_self();
+	__atomic_store_n(&bench_common.crash, BENCH_CRASHARM, __ATOMIC_RELAXED);
+
+	if ((err = bench_sync()) < 0)
+		bench_fail("sync", "replay", err);
+
+	/* Filesystems without a journal write metadata in place, they must survive the power loss after sync too */
+	__atomic_store_n(&bench_common.crash, BENCH_CRASHED, __ATOMIC_RELAXED);
+	libext2_unmount(bench_common.fs);
+	bench_common.fs = NULL;
+	__atomic_store_n(&bench_common.crash, BENCH_CRASHOFF, __ATOMIC_RELAXED);
+
+	/* Mount replays the journal */
+	if ((err = bench_mount()) < 0)
+		return err;
+
+	if ((err = bench_lookup(bench_common.root, "replay", &dir)) < 0) {
+		bench_fail("lookup", "replay", err);
+		return err;
+	}
+
+	if ((err = bench_begin("replay", n)) < 0)
+		return err;
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "replay%u", i);
+		bench_opstart();
+
+		if ((err = bench_lookup(dir, name, &id)) < 0) {
+			bench_fail("lookup", name, err);
+			continue;
+		}
+
+		if ((err = bench_io(mtRead, id, 0, buff, BENCH_REPLAYSZ)) != BENCH_REPLAYSZ) {
+			bench_fail("read", name, (err < 0) ? err : -EIO);
+			continue;
+		}
+		bench_opend(err);
+
+		if (bench_verify(buff, BENCH_REPLAYSZ, 0, 0) < 0)
+			bench_fail("verify", name, -EIO);
+	}
+	bench_end();
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "replay%u", i);
+		bench_unlink(dir, name);
+	}
+
+	return bench_unlink(bench_common.root, "replay");
+}
+
+
+/* Truncates dense file in halves and sparse file spanning indirect blocks at once */
+static int bench_truncates(void)
+{
+	size_t dense = (size_t)BENCH_DENSESZ * bench_common.scale, sparse = (size_t)BENCH_SPARSESZ * bench_common.scale, size, offs;
+	id_t did, sid;
+	int err;
+
+	if ((err = bench_mkfile(bench_common.root, "dense", dense, &did)) < 0)
+		return err;
+
+	if ((err = bench_create(bench_common.root, "sparse", otFile, &sid)) < 0) {
+		bench_fail("create", "sparse", err);
+		return err;
+	}
+
+	for (offs = 0; offs < sparse; offs += BENCH_SPARSEGAP) {
+		bench_fill(bench_common.buff, BENCH_RANDSZ, offs, 0);
+
+		if ((err = bench_io(mtWrite, sid, offs, bench_common.buff, BENCH_RANDSZ)) != BENCH_RANDSZ) {
+			bench_fail("write", "sparse", err);
+			return (err < 0) ? err : -EIO;
+		}
+	}
+
+	if (((err = bench_remount()) < 0) || ((err = bench_begin("truncate", 64)) < 0))
+		return err;
+
+	for (size = dense / 2;; size /= 2) {
+		bench_opstart();
+
+		if ((err = bench_truncate(did, size)) < 0) {
+			bench_fail("truncate", "dense", err);
+			break;
+		}
+		bench_opend(0);
+
+		if (bench_getattr(did, atSize) != (int)size)
+			bench_fail("size", "dense", -EIO);
+
+		if (!size)
+			break;
+	}
+
+	bench_opstart();
+
+	if ((err = bench_truncate(sid, 0)) < 0)
+		bench_fail("truncate", "sparse", err);
+	bench_opend(0);
+
+	if (bench_getattr(sid, atSize) != 0)
+		bench_fail("size", "sparse", -EIO);
+	bench_end();
+
+	bench_unlink(bench_common.root, "dense");
+
+	return bench_unlink(bench_common.root, "sparse");
+}
+
+
+/* Unaligned random reads and writes of many open files, verified against their copies in memory */
+static int bench_openfiles(void)
+{
+	uint32_t i, j, n = BENCH_OPENOPS * bench_common.scale;
+	char name[32], *buff, *files;
+	size_t offs, len;
+	id_t ids[BENCH_OPEN];
+	int err = EOK;
+
+	if ((files = (char *)calloc(BENCH_OPEN + 1, BENCH_OPENSZ)) == NULL)
+		return -ENOMEM;
+	buff = files + BENCH_OPEN * BENCH_OPENSZ;
+
+	for (i = 0; i < BENCH_OPEN; i++) {
+		sprintf(name, "open%u", i);
+
+		if ((err = bench_create(bench_common.root, name, otFile, &ids[i])) < 0) {
+			bench_fail("create", name, err);
+			free(files);
+			return err;
+		}
+		bench_openclose(mtOpen, ids[i]);
+	}
+
+	if ((err = bench_begin("openfiles", n)) < 0) {
+		free(files);
+		return err;
+	}
+	bench_common.seed = 1;
+
+	for (j = 0; j < n; j++) {
+		i = bench_rand() % BENCH_OPEN;
+		len = bench_rand() % BENCH_OPENIOSZ + 1;
+		offs = bench_rand() % (BENCH_OPENSZ - len + 1);
+		sprintf(name, "open%u", i);
+
+		if (bench_rand() % 100 < 50) {
+			bench_fill(files + i * BENCH_OPENSZ + offs, len, offs, j);
+			bench_opstart();
+
+			if ((err = bench_io(mtWrite, ids[i], offs, files + i * BENCH_OPENSZ + offs, len)) != (int)len) {
+				bench_fail("write", name, err);
+				break;
+			}
+			bench_opend(len);
+		}
+		else {
+			bench_opstart();
+
+			/* Not written file tail isn't read */
+			if ((err = bench_io(mtRead, ids[i], offs, buff, len)) < 0) {
+				bench_fail("read", name, err);
+				break;
+			}
+			bench_opend(err);
+
+			if (memcmp(buff, files + i * BENCH_OPENSZ + offs, err)) {
+				bench_fail("verify", name, -EIO);
+				break;
+			}
+		}
+	}
+	bench_end();
+
+	for (i = 0; i < BENCH_OPEN; i++)
+		bench_openclose(mtClose, ids[i]);
+
+	/* Written back data survives remount */
+	if ((err = bench_remount()) == EOK) {
+		for (i = 0; i < BENCH_OPEN; i++) {
+			sprintf(name, "open%u", i);
+
+			if ((err = bench_lookup(bench_common.root, name, &ids[i])) < 0) {
+				bench_fail("lookup", name, err);
+				continue;
+			}
+
+			if ((err = bench_io(mtRead, ids[i], 0, buff, BENCH_OPENSZ)) < 0)
+				bench_fail("read", name, err);
+			else if (memcmp(buff, files + i * BENCH_OPENSZ, err))
+				bench_fail("verify", name, -EIO);
+		}
+	}
+	free(files);
+
+	for (i = 0; i < BENCH_OPEN; i++) {
+		sprintf(name, "open%u", i);
+
+		if ((err = bench_unlink(bench_common.root, name)) < 0)
+			bench_fail("unlink", name, err);
+	}
+
+	return err;
+}
+
+
+/* Issues unaligned reads and writes of thread files, reads of the shared file and creates temporary files */
+static void *bench_thread(void *arg)
+{
+	bench_thread_t *t = (bench_thread_t *)arg;
+	uint32_t i, j, op;
+	char name[32], *data;
+	size_t offs, len;
+	uint64_t start;
+	id_t id;
+	int err;
+
+	for (i = 0; i < BENCH_TOPS * bench_common.scale; i++) {
+		op = bench_randr(&t->seed) % 100;
+		j = bench_randr(&t->seed) % BENCH_TFILES;
+		len = bench_randr(&t->seed) % BENCH_OPENIOSZ + 1;
+		offs = bench_randr(&t->seed) % (BENCH_TFILESZ - len + 1);
+		data = t->files + j * BENCH_TFILESZ;
+		sprintf(name, "thread%u.%u", t->idx, j);
+		start = bench_time();
+
+		if (op < 40) {
+			bench_fill(data + offs, len, offs, t->idx + i);
+
+			if ((err = bench_io(mtWrite, t->ids[j], offs, data + offs, len)) != (int)len) {
+				bench_fail("write", name, err);
+				break;
+			}
+		}
+		else if (op < 70) {
+			if ((err = bench_io(mtRead, t->ids[j], offs, t->buff, len)) < 0) {
+				bench_fail("read", name, err);
+				break;
+			}
+
+			if (memcmp(t->buff, data + offs, err)) {
+				bench_fail("verify", name, -EIO);
+				break;
+			}
+			len = err;
+		}
+		else if (op < 90) {
+			if ((err = bench_io(mtRead, t->shared, offs, t->buff, len)) != (int)len) {
+				bench_fail("read", "threads", err);
+				break;
+			}
+
+			if (bench_verify(t->buff, len, offs, 0) < 0) {
+				bench_fail("verify", "threads", -EIO);
+				break;
+			}
+		}
+		/* Temporary file is created, verified and unlinked */
+		else {
+			sprintf(name, "tmp%u.%u", t->idx, i);
+			len = BENCH_TTMPSZ;
+			bench_fill(t->buff, len, 0, i);
+
+			if ((err = bench_create(t->dir, name, otFile, &id)) < 0) {
+				bench_fail("create", name, err);
+				break;
+			}
+
+			if ((err = bench_io(mtWrite, id, 0, t->buff, len)) != (int)len) {
+				bench_fail("write", name, err);
+				break;
+			}
+
+			if (((err = bench_io(mtRead, id, 0, t->buff, len)) != (int)len) || (bench_verify(t->buff, len, 0, i) < 0)) {
+				bench_fail("verify", name, (err < 0) ? err : -EIO);
+				break;
+			}
+
+			if ((err = bench_unlink(t->dir, name)) < 0) {
+				bench_fail("unlink", name, err);
+				break;
+			}
+
+			/* Commits run concurrently with requests */
+			if (op == 99)
+				bench_sync();
+		}
+		bench_oprecord(start, len);
+	}
+
+	return NULL;
+}
+
+
+/* Multiple threads issue requests concurrently to files written at once (their data exceeds the delayed allocation budget) */
+static int bench_threads(void)
+{
+	bench_thread_t threads[BENCH_THREADS];
+	pthread_t tids[BENCH_THREADS];
+	uint32_t i, j, n;
+	char name[32], *files;
+	id_t dir, shared;
+	int err;
+
+	if ((files = (char *)calloc(BENCH_THREADS * BENCH_TFILES + BENCH_THREADS, BENCH_TFILESZ)) == NULL)
+		return -ENOMEM;
+
+	if (((err = bench_mkfile(bench_common.root, "shared", BENCH_TFILESZ, &shared)) < 0) || ((err = bench_create(bench_common.root, "threads", otDir, &dir)) < 0)) {
+		free(files);
+		return err;
+	}
+
+	for (i = 0, n = 0; i < BENCH_THREADS; i++) {
+		threads[i].idx = i;
+		threads[i].seed = i + 1;
+		threads[i].dir = dir;
+		threads[i].shared = shared;
+		threads[i].files = files + i * BENCH_TFILES * BENCH_TFILESZ;
+		threads[i].buff = files + (BENCH_THREADS * BENCH_TFILES + i) * BENCH_TFILESZ;
+
+		for (j = 0; j < BENCH_TFILES; j++, n++) {
+			sprintf(name, "thread%u.%u", i, j);
+
+			if ((err = bench_create(bench_common.root, name, otFile, &threads[i].ids[j])) < 0) {
+				bench_fail("create", name, err);
+				break;
+			}
+			bench_openclose(mtOpen, threads[i].ids[j]);
+		}
+
+		if (err < 0)
+			break;
+	}
+
+	if ((err >= 0) && ((err = bench_begin("threads", BENCH_THREADS * BENCH_TOPS * bench_common.scale)) >= 0)) {
+		for (i = 0; i < BENCH_THREADS; i++) {
+			if ((err = pthread_create(&tids[i], NULL, bench_thread, &threads[i])) != 0) {
+				bench_fail("start", "thread", -err);
+				break;
+			}
+		}
+
+		while (i--)
+			pthread_join(tids[i], NULL);
+		bench_end();
+	}
+
+	for (i = 0; i < n; i++)
+		bench_openclose(mtClose, threads[i / BENCH_TFILES].ids[i % BENCH_TFILES]);
+
+	/* Written back data survives remount */
+	if ((err >= 0) && ((err = bench_remount()) >= 0)) {
+		for (i = 0; i < n; i++) {
+			sprintf(name, "thread%u.%u", i / BENCH_TFILES, i % BENCH_TFILES);
+
+			if ((err = bench_lookup(bench_common.root, name, &threads[0].ids[0])) < 0) {
+				bench_fail("lookup", name, err);
+				continue;
+			}
+
+			if ((err = bench_io(mtRead, threads[0].ids[0], 0, threads[0].buff, BENCH_TFILESZ)) < 0)
+				bench_fail("read", name, err);
+			else if (memcmp(threads[0].buff, files + i * BENCH_TFILESZ, err))
+				bench_fail("verify", name, -EIO);
+		}
+
+		if ((err = bench_count(dir)) != 0)
+			bench_fail("readdir", "threads", (err < 0) ? err : -EIO);
+	}
+	free(files);
+
+	for (i = 0; i < n; i++) {
+		sprintf(name, "thread%u.%u", i / BENCH_TFILES, i % BENCH_TFILES);
+		bench_unlink(bench_common.root, name);
+	}
+	bench_unlink(bench_common.root, "shared");
+
+	return bench_unlink(bench_common.root, "threads");
+}
+
+
+static const bench_workload_t bench_workloads[] = {
+	{ "seqwrite", bench_seqwrite },
+	{ "seqread", bench_seqread },
+	{ "randrw", bench_randrw },
+	{ "createunlink", bench_createunlink },
+	{ "lookup", bench_lookups },
+	{ "listing", bench_listing },
+	{ "symlink", bench_symlinks },
+	{ "churn", bench_churn },
+	{ "replay", bench_replay },
+	{ "truncate", bench_truncates },
+	{ "openfiles", bench_openfiles },
+	{ "threads", bench_threads }
+};
+
+
+static void bench_usage(const char *progname)
+{
+	unsigned int i;
+
+	printf("usage: %s [-c cachesz] [-o objsz] [-s scale] [-v] [-w workload[,workload...]] image\n", progname);
+	printf("\t-c cachesz  block cache size in bytes (0 disables the cache)\n");
+	printf("\t-o objsz    object cache size in bytes\n");
+	printf("\t-s scale    workloads size multiplier (default 1)\n");
+	printf("\t-v          report device blocks read/written by block kind\n");
+	printf("\t-w          workloads to run (default all):");
+
+	for (i = 0; i < sizeof(bench_workloads) / sizeof(bench_workloads[0]); i++)
+		printf(" %s", bench_workloads[i].name);
+	printf("\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *workloads = NULL;
+	unsigned int i;
+	int c, err;
+
+	bench_common.scale = 1;
+
+	while ((c = getopt(argc, argv, "c:o:s:vw:h")) != -1) {
+		switch (c) {
+		case 'c':
+			bench_common.opts.cachesz = strtoul(optarg, NULL, 0);
+			bench_common.popts = &bench_common.opts;
+			break;
+
+		case 'o':
+			bench_common.opts.objsz = strtoul(optarg, NULL, 0);
+			bench_common.popts = &bench_common.opts;
+			break;
+
+		case 's':
+			if (!(bench_common.scale = strtoul(optarg, NULL, 0)))
+				bench_common.scale = 1;
+			break;
+
+		case 'v':
+			bench_common.verbose = 1;
+			break;
+
+		case 'w':
+			workloads = optarg;
+			break;
+
+		default:
+			bench_usage(argv[0]);
+			return (c == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc - 1) {
+		bench_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if ((bench_common.fd = open(argv[optind], O_RDWR)) < 0) {
+		fprintf(stderr, "ext2-hostbench: failed to open %s\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	if ((bench_common.buff = (char *)malloc(BENCH_CHUNKSZ)) == NULL) {
+		close(bench_common.fd);
+		return EXIT_FAILURE;
+	}
+
+	if (bench_mount() < 0) {
+		free(bench_common.buff);
+		close(bench_common.fd);
+		return EXIT_FAILURE;
+	}
+
+	printf("ext2-hostbench: %s, scale %u, latencies in microseconds, device I/O per operation\n", argv[optind], bench_common.scale);
+	printf("%-10s %7s %9s %8s %9s %8s %8s %8s %9s %7s %7s %8s %8s %6s\n",
+		"workload", "ops", "time[ms]", "MB/s", "ops/s", "p50", "p90", "p99", "max", "rd/op", "wr/op", "rdKB/op", "wrKB/op", "hit%");
+
+	for (i = 0; i < sizeof(bench_workloads) / sizeof(bench_workloads[0]); i++) {
+		if ((workloads != NULL) && (strstr(workloads, bench_workloads[i].name) == NULL))
+			continue;
+
+		if ((err = bench_workloads[i].run()) < 0)
+			bench_fail("workload", bench_workloads[i].name, err);
+
+		/* Start next workload with cold caches */
+		if (bench_remount() < 0)
+			break;
+	}
+
+	if ((bench_common.fs != NULL) && ((err = libext2_unmount(bench_common.fs)) < 0))
+		bench_fail("unmount", argv[optind], err);
+	free(bench_common.buff);
+	close(bench_common.fd);
+
+	return (bench_common.errors) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
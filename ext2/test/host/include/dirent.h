@@ -0,0 +1,34 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem host benchmark
+ *
+ * Phoenix-RTOS directory entry (host stub)
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _HOST_DIRENT_H_
+#define _HOST_DIRENT_H_
+
+#include <sys/types.h>
+
+
+/* Directory entry types */
+enum { dtDir = 0, dtFile, dtDev, dtSymlink, dtUnknown };
+
+
+struct dirent {
+	ino_t d_ino;
+	unsigned short d_reclen;
+	unsigned short d_namlen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+
+#endif
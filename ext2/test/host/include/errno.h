@@ -0,0 +1,24 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem host benchmark
+ *
+ * Phoenix-RTOS error codes (host stub)
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _HOST_ERRNO_H_
+#define _HOST_ERRNO_H_
+
+#include_next <errno.h>
+
+
+#define EOK 0
+
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem host benchmark
+ *
+ * Phoenix-RTOS file object types and attributes (host stub)
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _HOST_SYS_FILE_H_
+#define _HOST_SYS_FILE_H_
+
+
+/* Object types */
+enum { otDir = 0, otFile, otDev, otSymlink, otUnknown };
+
+
+/* Object attributes */
+enum { atMode = 0, atUid, atGid, atSize, atType, atPort, atPollStatus, atEventMask, atCTime, atMTime, atATime, atLinks, atDev };
+
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem host benchmark
+ *
+ * Phoenix-RTOS messages (host stub)
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _HOST_SYS_MSG_H_
+#define _HOST_SYS_MSG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+
+/* Message types */
+enum { mtOpen = 0, mtClose, mtRead, mtWrite, mtTruncate, mtDevCtl, mtCreate, mtDestroy, mtSetAttr, mtGetAttr,
+	mtLookup, mtLink, mtUnlink, mtReaddir, mtCount, mtMount, mtUmount, mtSync };
+
+
+typedef struct {
+	int type;
+	unsigned int pid;
+	unsigned int priority;
+
+	struct {
+		union {
+			struct { oid_t oid; } openclose;
+			struct { oid_t oid; offs_t offs; size_t len; unsigned int mode; } io;
+			struct { oid_t dir; int type; int mode; oid_t dev; } create;
+			struct { oid_t oid; } destroy;
+			struct { oid_t oid; int type; int val; } attr;
+			struct { oid_t dir; } lookup;
+			struct { oid_t dir; oid_t oid; } ln;
+			struct { oid_t dir; offs_t offs; } readdir;
+			unsigned char raw[64];
+		};
+
+		size_t size;
+		void *data;
+	} i;
+
+	struct {
+		union {
+			struct { int err; } io;
+			struct { int val; } attr;
+			struct { oid_t oid; int err; } create;
+			struct { oid_t fil; oid_t dev; int err; } lookup;
+			unsigned char raw[64];
+		};
+
+		size_t size;
+		void *data;
+	} o;
+} msg_t;
+
+
+/* Receives a message (host port has no senders, always fails) */
+extern int msgRecv(uint32_t port, msg_t *msg, unsigned long *rid);
+
+
+/* Responds to a message */
+extern int msgRespond(uint32_t port, msg_t *msg, unsigned long rid);
+
+
+#endif
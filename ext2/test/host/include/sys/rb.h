@@ -0,0 +1,73 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem host benchmark
+ *
+ * Phoenix-RTOS red-black trees (host stub)
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _HOST_SYS_RB_H_
+#define _HOST_SYS_RB_H_
+
+#include <stddef.h>
+
+
+typedef struct _rbnode_t {
+	struct _rbnode_t *left;
+	struct _rbnode_t *right;
+	struct _rbnode_t *parent;
+	int color;
+} rbnode_t;
+
+
+typedef int (*rbcomp_t)(rbnode_t *, rbnode_t *);
+
+
+typedef void (*rbaugment_t)(rbnode_t *);
+
+
+typedef struct {
+	rbnode_t *root;
+	rbcomp_t compare;
+	rbaugment_t augment;
+} rbtree_t;
+
+
+#define lib_treeof(type, node_field, node) ({ \
+	long _off = (long)&(((type *)0)->node_field); \
+	rbnode_t *_tmpnode = (node); \
+	(type *)((_tmpnode == NULL) ? NULL : ((void *)_tmpnode - _off)); \
+})
+
+
+extern void lib_rbInit(rbtree_t *tree, rbcomp_t compare, rbaugment_t augment);
+
+
+extern int lib_rbInsert(rbtree_t *tree, rbnode_t *node);
+
+
+extern void lib_rbRemove(rbtree_t *tree, rbnode_t *node);
+
+
+extern rbnode_t *lib_rbFind(rbtree_t *tree, rbnode_t *node);
+
+
+extern rbnode_t *lib_rbMinimum(rbnode_t *node);
+
+
+extern rbnode_t *lib_rbMaximum(rbnode_t *node);
+
+
+extern rbnode_t *lib_rbNext(rbnode_t *node);
+
+
+extern rbnode_t *lib_rbPrev(rbnode_t *node);
+
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem host benchmark
+ *
+ * Phoenix-RTOS threads (host stub)
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _HOST_SYS_THREADS_H_
+#define _HOST_SYS_THREADS_H_
+
+#include <time.h>
+
+#include <sys/types.h>
+
+
+extern int mutexCreate(handle_t *h);
+
+
+extern int mutexLock(handle_t h);
+
+
+extern int mutexTry(handle_t h);
+
+
+extern int mutexUnlock(handle_t h);
+
+
+extern int condCreate(handle_t *h);
+
+
+/* Waits on condition (timeout in microseconds, 0 => no timeout) */
+extern int condWait(handle_t h, handle_t m, time_t timeout);
+
+
+extern int condSignal(handle_t h);
+
+
+extern int condBroadcast(handle_t h);
+
+
+extern int resourceDestroy(handle_t h);
+
+
+extern int beginthread(void (*start)(void *), unsigned int priority, void *stack, unsigned int stacksz, void *arg);
+
+
+extern void endthread(void);
+
+
+/* Returns monotonic time in microseconds */
+extern int gettime(time_t *raw, time_t *offs);
+
+
+#endif
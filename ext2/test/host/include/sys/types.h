@@ -0,0 +1,33 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem host benchmark
+ *
+ * Phoenix-RTOS system types (host stub)
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _HOST_SYS_TYPES_H_
+#define _HOST_SYS_TYPES_H_
+
+#include_next <sys/types.h>
+
+#include <stdint.h>
+
+
+typedef int64_t offs_t;
+typedef unsigned int handle_t;
+
+
+typedef struct _oid_t {
+	uint32_t port;
+	id_t id;
+} oid_t;
+
+
+#endif
@@ -0,0 +1,502 @@
+/*
+ * Phoenix-RTOS
+ *
+ * EXT2 filesystem host benchmark
+ *
+ * Phoenix-RTOS primitives (host stub)
+ *
+ * Copyright 2020 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <sys/msg.h>
+#include <sys/rb.h>
+#include <sys/threads.h>
+
+
+/* Misc definitions */
+#define MAX_RESOURCES 65536 /* Max number of synchronization resources */
+
+
+/* Red-black tree node colors */
+enum { RB_RED = 0, RB_BLACK };
+
+
+typedef struct {
+	uint8_t type;            /* Resource type (0 => mutex, 1 => condition) */
+	union {
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+	};
+} stub_resource_t;
+
+
+typedef struct {
+	void (*start)(void *);   /* Thread routine */
+	void *arg;               /* Thread routine argument */
+} stub_thread_t;
+
+
+struct {
+	stub_resource_t *resources[MAX_RESOURCES];
+	pthread_mutex_t lock;
+} stub_common = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static int stub_create(uint8_t type, handle_t *h)
+{
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	stub_resource_t *r;
+	unsigned int i;
+
+	if ((r = (stub_resource_t *)malloc(sizeof(stub_resource_t))) == NULL)
+		return -ENOMEM;
+
+	r->type = type;
+
+	if (!type) {
+		/* Catch unlocking not owned mutexes */
+		pthread_mutexattr_init(&mattr);
+		pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_ERRORCHECK);
+		pthread_mutex_init(&r->mutex, &mattr);
+		pthread_mutexattr_destroy(&mattr);
+	}
+	else {
+		/* Condition timeouts are relative to the monotonic clock */
+		pthread_condattr_init(&cattr);
+		pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+		pthread_cond_init(&r->cond, &cattr);
+		pthread_condattr_destroy(&cattr);
+	}
+
+	pthread_mutex_lock(&stub_common.lock);
+
+	for (i = 1; i < MAX_RESOURCES; i++) {
+		if (stub_common.resources[i] == NULL) {
+			stub_common.resources[i] = r;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&stub_common.lock);
+
+	if (i == MAX_RESOURCES) {
+		if (!type)
+			pthread_mutex_destroy(&r->mutex);
+		else
+			pthread_cond_destroy(&r->cond);
+		free(r);
+		return -ENOMEM;
+	}
+
+	*h = i;
+
+	return EOK;
+}
+
+
+int mutexCreate(handle_t *h)
+{
+	return stub_create(0, h);
+}
+
+
+int mutexLock(handle_t h)
+{
+	if (pthread_mutex_lock(&stub_common.resources[h]->mutex))
+		abort();
+
+	return EOK;
+}
+
+
+int mutexTry(handle_t h)
+{
+	return (pthread_mutex_trylock(&stub_common.resources[h]->mutex)) ? -EBUSY : EOK;
+}
+
+
+int mutexUnlock(handle_t h)
+{
+	if (pthread_mutex_unlock(&stub_common.resources[h]->mutex))
+		abort();
+
+	return EOK;
+}
+
+
+int condCreate(handle_t *h)
+{
+	return stub_create(1, h);
+}
+
+
+int condWait(handle_t h, handle_t m, time_t timeout)
+{
+	struct timespec ts;
+
+	if (!timeout)
+		return -pthread_cond_wait(&stub_common.resources[h]->cond, &stub_common.resources[m]->mutex);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout / 1000000;
+	ts.tv_nsec += (timeout % 1000000) * 1000;
+
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	return (pthread_cond_timedwait(&stub_common.resources[h]->cond, &stub_common.resources[m]->mutex, &ts)) ? -ETIME : EOK;
+}
+
+
+int condSignal(handle_t h)
+{
+	return -pthread_cond_signal(&stub_common.resources[h]->cond);
+}
+
+
+int condBroadcast(handle_t h)
+{
+	return -pthread_cond_broadcast(&stub_common.resources[h]->cond);
+}
+
+
+int resourceDestroy(handle_t h)
+{
+	stub_resource_t *r;
+
+	pthread_mutex_lock(&stub_common.lock);
+
+	r = stub_common.resources[h];
+	stub_common.resources[h] = NULL;
+
+	pthread_mutex_unlock(&stub_common.lock);
+
+	if (!r->type)
+		pthread_mutex_destroy(&r->mutex);
+	else
+		pthread_cond_destroy(&r->cond);
+	free(r);
+
+	return EOK;
+}
+
+
+static void *stub_thread(void *arg)
+{
+	stub_thread_t t = *(stub_thread_t *)arg;
+
+	free(arg);
+	t.start(t.arg);
+
+	return NULL;
+}
+
+
+int beginthread(void (*start)(void *), unsigned int priority, void *stack, unsigned int stacksz, void *arg)
+{
+	stub_thread_t *t;
+	pthread_t tid;
+
+	/* Host threads use their own stacks */
+	if ((t = (stub_thread_t *)malloc(sizeof(stub_thread_t))) == NULL)
+		return -ENOMEM;
+
+	t->start = start;
+	t->arg = arg;
+
+	if (pthread_create(&tid, NULL, stub_thread, t)) {
+		free(t);
+		return -ENOMEM;
+	}
+	pthread_detach(tid);
+
+	return EOK;
+}
+
+
+void endthread(void)
+{
+	pthread_exit(NULL);
+}
+
+
+int gettime(time_t *raw, time_t *offs)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (raw != NULL)
+		*raw = (time_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+	if (offs != NULL)
+		*offs = 0;
+
+	return EOK;
+}
+
+
+int msgRecv(uint32_t port, msg_t *msg, unsigned long *rid)
+{
+	/* Requests are passed directly to the handler, port has no senders */
+	return -EINVAL;
+}
+
+
+int msgRespond(uint32_t port, msg_t *msg, unsigned long rid)
+{
+	return EOK;
+}
+
+
+/* Red-black tree (augment callback isn't supported) */
+static int rb_color(rbnode_t *node)
+{
+	return (node == NULL) ? RB_BLACK : node->color;
+}
+
+
+static void rb_rotate(rbtree_t *tree, rbnode_t *node, int left)
+{
+	rbnode_t *child = (left) ? node->right : node->left;
+
+	if (left) {
+		if ((node->right = child->left) != NULL)
+			child->left->parent = node;
+		child->left = node;
+	}
+	else {
+		if ((node->left = child->right) != NULL)
+			child->right->parent = node;
+		child->right = node;
+	}
+
+	if ((child->parent = node->parent) == NULL)
+		tree->root = child;
+	else if (node == node->parent->left)
+		node->parent->left = child;
+	else
+		node->parent->right = child;
+	node->parent = child;
+}
+
+
+static void rb_replace(rbtree_t *tree, rbnode_t *node, rbnode_t *child)
+{
+	if (node->parent == NULL)
+		tree->root = child;
+	else if (node == node->parent->left)
+		node->parent->left = child;
+	else
+		node->parent->right = child;
+
+	if (child != NULL)
+		child->parent = node->parent;
+}
+
+
+void lib_rbInit(rbtree_t *tree, rbcomp_t compare, rbaugment_t augment)
+{
+	tree->root = NULL;
+	tree->compare = compare;
+	tree->augment = augment;
+}
+
+
+int lib_rbInsert(rbtree_t *tree, rbnode_t *node)
+{
+	rbnode_t **link = &tree->root, *parent = NULL, *uncle;
+	int c, left;
+
+	while (*link != NULL) {
+		parent = *link;
+
+		if (!(c = tree->compare(node, parent)))
+			return -EEXIST;
+
+		link = (c < 0) ? &parent->left : &parent->right;
+	}
+
+	node->left = node->right = NULL;
+	node->parent = parent;
+	node->color = RB_RED;
+	*link = node;
+
+	while (((parent = node->parent) != NULL) && (parent->color == RB_RED)) {
+		left = (parent == parent->parent->left);
+		uncle = (left) ? parent->parent->right : parent->parent->left;
+
+		if (rb_color(uncle) == RB_RED) {
+			parent->color = uncle->color = RB_BLACK;
+			parent->parent->color = RB_RED;
+			node = parent->parent;
+			continue;
+		}
+
+		if (node == ((left) ? parent->right : parent->left)) {
+			rb_rotate(tree, parent, left);
+			node = parent;
+			parent = node->parent;
+		}
+
+		parent->color = RB_BLACK;
+		parent->parent->color = RB_RED;
+		rb_rotate(tree, parent->parent, !left);
+	}
+	tree->root->color = RB_BLACK;
+
+	return EOK;
+}
+
+
+void lib_rbRemove(rbtree_t *tree, rbnode_t *node)
+{
+	rbnode_t *child, *parent, *sibling, *next;
+	int color = node->color, left;
+
+	if (node->left == NULL) {
+		child = node->right;
+		parent = node->parent;
+		rb_replace(tree, node, child);
+	}
+	else if (node->right == NULL) {
+		child = node->left;
+		parent = node->parent;
+		rb_replace(tree, node, child);
+	}
+	else {
+		/* Replace node with its successor */
+		next = lib_rbMinimum(node->right);
+		color = next->color;
+		child = next->right;
+
+		if (next->parent == node) {
+			parent = next;
+		}
+		else {
+			parent = next->parent;
+			rb_replace(tree, next, child);
+			next->right = node->right;
+			next->right->parent = next;
+		}
+
+		rb_replace(tree, node, next);
+		next->left = node->left;
+		next->left->parent = next;
+		next->color = node->color;
+	}
+
+	if (color != RB_BLACK)
+		return;
+
+	while ((child != tree->root) && (rb_color(child) == RB_BLACK)) {
+		left = (child == parent->left);
+		sibling = (left) ? parent->right : parent->left;
+
+		if (sibling->color == RB_RED) {
+			sibling->color = RB_BLACK;
+			parent->color = RB_RED;
+			rb_rotate(tree, parent, left);
+			sibling = (left) ? parent->right : parent->left;
+		}
+
+		if ((rb_color(sibling->left) == RB_BLACK) && (rb_color(sibling->right) == RB_BLACK)) {
+			sibling->color = RB_RED;
+			child = parent;
+			parent = child->parent;
+			continue;
+		}
+
+		if (rb_color((left) ? sibling->right : sibling->left) == RB_BLACK) {
+			((left) ? sibling->left : sibling->right)->color = RB_BLACK;
+			sibling->color = RB_RED;
+			rb_rotate(tree, sibling, !left);
+			sibling = (left) ? parent->right : parent->left;
+		}
+
+		sibling->color = parent->color;
+		parent->color = RB_BLACK;
+		((left) ? sibling->right : sibling->left)->color = RB_BLACK;
+		rb_rotate(tree, parent, left);
+		child = tree->root;
+	}
+
+	if (child != NULL)
+		child->color = RB_BLACK;
+}
+
+
+rbnode_t *lib_rbFind(rbtree_t *tree, rbnode_t *node)
+{
+	rbnode_t *it = tree->root;
+	int c;
+
+	while (it != NULL) {
+		if (!(c = tree->compare(node, it)))
+			return it;
+
+		it = (c < 0) ? it->left : it->right;
+	}
+
+	return NULL;
+}
+
+
+rbnode_t *lib_rbMinimum(rbnode_t *node)
+{
+	if (node == NULL)
+		return NULL;
+
+	while (node->left != NULL)
+		node = node->left;
+
+	return node;
+}
+
+
+rbnode_t *lib_rbMaximum(rbnode_t *node)
+{
+	if (node == NULL)
+		return NULL;
+
+	while (node->right != NULL)
+		node = node->right;
+
+	return node;
+}
+
+
+rbnode_t *lib_rbNext(rbnode_t *node)
+{
+	if (node->right != NULL)
+		return lib_rbMinimum(node->right);
+
+	while ((node->parent != NULL) && (node == node->parent->right))
+		node = node->parent;
+
+	return node->parent;
+}
+
+
+rbnode_t *lib_rbPrev(rbnode_t *node)
+{
+	if (node->left != NULL)
+		return lib_rbMaximum(node->left);
+
+	while ((node->parent != NULL) && (node == node->parent->left))
+		node = node->parent;
+
+	return node->parent;
+}